@@ -41,6 +41,7 @@ typedef enum _mips_error{
     mips_ErrorInvalidHandle=0x1002,
     mips_ErrorFileReadError=0x1003,
     mips_ErrorFileWriteError=0x1004,
+    mips_ErrorOutOfMemory=0x1005,	//!< The simulator could not allocate what it needed
     ///@}
 
     //! Error or exception from the simulated processor or program.
@@ -51,6 +52,7 @@ typedef enum _mips_error{
     mips_ExceptionAccessViolation=0x2003,
     mips_ExceptionInvalidInstruction=0x2004,
     mips_ExceptionArithmeticOverflow=0x2005,
+    mips_ExceptionWatchpoint=0x2006,	//!< An access touched a watched range, see mips_mem_add_watchpoint
     ///@}
 
     /*! This is an extension point for implementations. Codes
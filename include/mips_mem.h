@@ -99,6 +99,19 @@ mips_error mips_mem_write(
 );
 
 
+/*! Perform an instruction fetch from the memory
+
+    This behaves exactly like mips_mem_read, except that the memory
+    may refuse it (with mips_ExceptionAccessViolation) if the
+    location is not executable.
+*/
+mips_error mips_mem_fetch(
+    mips_mem_h mem,		//!< Handle to target memory
+    uint32_t address,	//!< Byte address to start transaction at
+    uint32_t length,	//!< Number of bytes to transfer
+    uint8_t *dataOut	//!< Receives the target bytes
+);
+
 /*! Release all resources associated with memory. The caller doesn't
     really know what is being released (it could be memory, it could
     be file handles), and shouldn't care. Calling mips_mem_free on an
@@ -142,6 +155,240 @@ mips_mem_h mips_mem_create_ram(
     uint32_t blockSize	//!< Granularity of transactions supported by RAM
 );
 
+/*! Initialise a new RAM whose storage can be mapped by other processes.
+
+    This behaves exactly like mips_mem_create_ram, but the bytes live in
+    an anonymous shared memory file (a Linux memfd) rather than on the
+    heap. The file has a fixed size, and its contents are the guest
+    memory in guest (big endian) byte order, so a monitor can map it
+    read-only and look at live guest buffers without copies and
+    without stopping the simulation:
+
+        int fd=mips_mem_get_fd(mem);
+        // ...hand fd to the monitor over a Unix socket, or let it
+        // open /proc/<pid>/fd/<fd>...
+        const uint8_t *view=mmap(0, cbMem, PROT_READ, MAP_SHARED, fd, 0);
+
+    Returns an empty handle if shared memory is not supported on this
+    platform, or could not be created.
+*/
+mips_mem_h mips_mem_create_shared_ram(
+    uint32_t cbMem,	//!< Total number of bytes of ram
+    uint32_t blockSize,	//!< Granularity of transactions supported by RAM
+    const char *name	//!< Name shown in /proc/<pid>/fd, for debugging
+);
+
+/*! Returns the number of bytes mips_mem_init_ram needs for a RAM of the
+    given size: the bookkeeping, the page table and the data itself.
+*/
+size_t mips_mem_ram_footprint(
+    uint32_t cbMem	//!< Total number of bytes of ram
+);
+
+/*! Initialise a new RAM inside storage supplied by the caller.
+
+    This behaves exactly like mips_mem_create_ram, but makes no allocations:
+    everything the RAM needs is laid out in 'storage', which must be at
+    least mips_mem_ram_footprint(cbMem) bytes and aligned to 64 bytes, and
+    the data starts on a cache line boundary within it. The contents of the
+    RAM are whatever was in the storage. It is for allocators that keep
+    many RAMs in one block and recycle them.
+
+    mips_mem_free on such a RAM releases anything it allocated later (such
+    as watchpoints) but not the storage, which stays the caller's to reuse
+    or free. Returns an empty handle if the storage is null or misaligned.
+*/
+mips_mem_h mips_mem_init_ram(
+    void *storage,      //!< Where to build the RAM
+    uint32_t cbMem,     //!< Total number of bytes of ram
+    uint32_t blockSize  //!< Granularity of transactions supported by RAM
+);
+
+/*! Returns the file descriptor backing a RAM from mips_mem_create_shared_ram,
+    or -1 for any other memory. The descriptor remains owned by the memory,
+    and is closed by mips_mem_free.
+*/
+int mips_mem_get_fd(mips_mem_h mem);
+
+/*! Atomically replace a word of RAM if it holds an expected value.
+
+    The four bytes at the word-aligned 'address' are compared with
+    'expected' and, if they match, replaced with 'desired', as one
+    sequentially consistent operation. On a mismatch nothing is written,
+    and 'expected' receives the bytes actually in memory. Both values are
+    in guest (big endian) byte order, exactly as mips_mem_read returns
+    them. The page must allow both reading and writing.
+
+    Several CPUs may share one RAM from separate threads. Every
+    mips_mem_read or mips_mem_write of 1, 2 or 4 bytes at an address
+    aligned to its length is single-copy atomic, but has no ordering
+    with respect to other addresses; this call is the only one that
+    orders them, and is what LL/SC and SYNC are built on.
+*/
+mips_error mips_mem_compare_swap(
+    mips_mem_h mem,         //!< Handle to a RAM
+    uint32_t address,       //!< Word aligned byte address
+    uint8_t *expected,      //!< 4 bytes to compare with; receives the old value on failure
+    const uint8_t *desired, //!< 4 bytes to store on success
+    int *swapped            //!< If not null, receives 1 if the store happened, else 0
+);
+
+/*! Size in bytes of a RAM page, the granularity of \ref mips_mem_set_permissions. */
+#define MIPS_MEM_PAGE_SIZE 4096
+
+/*! Access permission bits for a page of RAM. */
+typedef enum _mips_mem_perm{
+    mips_mem_PermRead=1,    //!< Allow mips_mem_read
+    mips_mem_PermWrite=2,   //!< Allow mips_mem_write
+    mips_mem_PermExecute=4, //!< Allow mips_mem_fetch
+    mips_mem_PermAll=7
+}mips_mem_perm;
+
+/*! Change the permissions of every RAM page overlapping the given range.
+
+    New RAM starts with every page set to mips_mem_PermAll. Any
+    transaction touching a page without the needed permission fails
+    with mips_ExceptionAccessViolation, and transfers nothing. The
+    check happens in the same page lookup as the access itself,
+    so it costs nothing extra for permitted accesses.
+*/
+mips_error mips_mem_set_permissions(
+    mips_mem_h mem,     //!< Handle to a RAM
+    uint32_t address,   //!< Start of the range (need not be page aligned)
+    uint32_t length,    //!< Number of bytes in the range
+    unsigned perms      //!< Combination of mips_mem_perm bits
+);
+
+/*! Read the permissions of every RAM page.
+
+    perms[i] is set to the mips_mem_perm bits of page i (the bytes from
+    i*MIPS_MEM_PAGE_SIZE). 'count' is the size of the perms array,
+    which must have room for every page of the RAM.
+*/
+mips_error mips_mem_get_permissions(
+    mips_mem_h mem,     //!< Handle to a RAM
+    uint8_t *perms,     //!< Receives one byte per page
+    uint32_t count      //!< Number of bytes in perms
+);
+
+/*! Find which RAM pages have been written, and mark them all clean.
+
+    dirty[i] is set to 1 if page i (the bytes from
+    i*MIPS_MEM_PAGE_SIZE) was changed by mips_mem_write or
+    mips_mem_compare_swap since the last call, or since the RAM was
+    created, and to 0 otherwise. 'count' is the size of the dirty
+    array, which must have room for every page of the RAM.
+
+    The flag lives in the same page table as the permissions, so
+    tracking costs writes one extra store to a byte they already read.
+*/
+mips_error mips_mem_take_dirty_pages(
+    mips_mem_h mem,     //!< Handle to a RAM
+    uint8_t *dirty,     //!< Receives one byte per page
+    uint32_t count      //!< Number of bytes in dirty
+);
+
+/*! Kinds of access a watchpoint can trigger on. */
+typedef enum _mips_mem_watch{
+    mips_mem_WatchRead=1,   //!< Trigger on mips_mem_read
+    mips_mem_WatchWrite=2,  //!< Trigger on mips_mem_write
+    mips_mem_WatchAccess=3  //!< Trigger on either
+}mips_mem_watch;
+
+/*! Watch a range of RAM for reads and/or writes.
+
+    Any transaction overlapping the range with a matching kind fails
+    with mips_ExceptionWatchpoint before anything is transferred, so a
+    CPU stops with the watched instruction not yet executed, and
+    mips_mem_get_watch_hit says what was touched. To continue past it,
+    remove the watchpoint, step once, and add it again.
+
+    Pages holding a watchpoint are flagged in the same page table as
+    the permissions, and only accesses to those pages are compared with
+    the watched ranges. Memory with no watchpoints runs at full speed.
+*/
+mips_error mips_mem_add_watchpoint(
+    mips_mem_h mem,     //!< Handle to a RAM
+    uint32_t address,   //!< First byte to watch
+    uint32_t length,    //!< Number of bytes to watch
+    unsigned kind       //!< Combination of mips_mem_watch bits
+);
+
+/*! Remove a watchpoint previously added with exactly the same range. */
+mips_error mips_mem_remove_watchpoint(
+    mips_mem_h mem,     //!< Handle to a RAM
+    uint32_t address,   //!< First byte of the watched range
+    uint32_t length     //!< Number of bytes in the watched range
+);
+
+/*! Retrieve one of the watchpoints on a RAM.
+
+    Watchpoints are numbered from 0, in no particular order, and the
+    numbers change when one is removed. Returns mips_ErrorInvalidArgument
+    if 'index' is not less than the number of watchpoints.
+*/
+mips_error mips_mem_get_watchpoint(
+    mips_mem_h mem,     //!< Handle to a RAM
+    unsigned index,     //!< Which watchpoint
+    uint32_t *address,  //!< Receives its first byte
+    uint32_t *length,   //!< Receives its number of bytes
+    unsigned *kind      //!< Receives its mips_mem_watch bits
+);
+
+/*! Retrieve the transaction that most recently hit a watchpoint.
+
+    Returns mips_ErrorInvalidArgument if no watchpoint has been hit.
+*/
+mips_error mips_mem_get_watch_hit(
+    mips_mem_h mem,     //!< Handle to a RAM
+    uint32_t *address,  //!< Receives the start of the transaction
+    uint32_t *length,   //!< Receives the length of the transaction
+    unsigned *kind      //!< Receives mips_mem_WatchRead or mips_mem_WatchWrite
+);
+
+/*! Check that a write would succeed, without making it.
+
+    Fails exactly as mips_mem_write would with the same arguments, for
+    alignment, range, permissions or a write watchpoint, but transfers
+    nothing and marks no page dirty. A watchpoint hit is recorded for
+    mips_mem_get_watch_hit, as the write it stands for has failed. It
+    lets a CPU that holds its stores back until later fault on the
+    instruction that made them.
+*/
+mips_error mips_mem_probe_write(
+    mips_mem_h mem,     //!< Handle to a RAM
+    uint32_t address,   //!< Byte address the write would start at
+    uint32_t length     //!< Number of bytes it would write
+);
+
+/*! Read RAM from outside the simulated program, as a debugger would.
+
+    This behaves like mips_mem_read, but ignores the block size, page
+    permissions and watchpoints, so tools that look at the guest's
+    memory (profilers, or a CPU merging part of a word it has held
+    back) neither fault nor look like an access by the program.
+*/
+mips_error mips_mem_peek(
+    mips_mem_h mem,     //!< Handle to a RAM
+    uint32_t address,   //!< Byte address to start at
+    uint32_t length,    //!< Number of bytes to read
+    uint8_t *dataOut    //!< Receives the bytes
+);
+
+/*! Write RAM from outside the simulated program, as a debugger would.
+
+    The counterpart of mips_mem_peek: it behaves like mips_mem_write,
+    marking the pages written dirty, but ignores the block size, page
+    permissions and watchpoints, so a tool can set up memory the
+    program itself may not write.
+*/
+mips_error mips_mem_poke(
+    mips_mem_h mem,         //!< Handle to a RAM
+    uint32_t address,       //!< Byte address to start at
+    uint32_t length,        //!< Number of bytes to write
+    const uint8_t *dataIn   //!< The bytes to write
+);
+
 /*!
     @}
     @}
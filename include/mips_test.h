@@ -116,13 +116,27 @@ void mips_test_begin_suite();
     \retval A unique identifier identifying the test
     
     You may have some tests which are not associated with any
-    instruction, in which case use the string "<internal>". These
+    instruction, in which case use the string "<internal>", or
+    better, mips_test_begin_internal_test. These
     can be useful to establish certain invariants, like "if I set
     register 3 to a value, then if I read register 3 it should still
     be the same value".
 */
 int mips_test_begin_test(const char *instruction);
 
+/*! Used before starting an individual test of something other than
+    an instruction, such as a device or a tool.
+    \param name String identifying what the test is testing, for
+    example "mmu" or "watchpoint".
+
+    \retval A unique identifier identifying the test, to pass to
+    mips_test_end_test as usual.
+
+    Such tests are reported by name, after the table of instructions,
+    and are not counted as instructions tested.
+*/
+int mips_test_begin_internal_test(const char *name);
+
 /*! Used to indicate whether an individual test passed or failed.
 
     \param testId The unique identifier returned from mips_test_begin_test.
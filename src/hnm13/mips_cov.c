@@ -0,0 +1,89 @@
+/**
+ * MIPS-I Coverage merger and reporter
+ * (C) Hamish Milne 2014
+ *
+ * Usage: mips_cov [-o merged.cov] [-e program.elf] run.cov...
+ *
+ * Merges coverage maps (see mips_cpu_coverage.h) from many runs, which
+ * must all be of the same range of addresses, writing the result to
+ * 'merged.cov' if given. With an ELF file, reports how much of its code
+ * the runs covered, function by function, naming functions from the
+ * file's symbols.
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_coverage.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int main(int argc, char** argv)
+{
+	mips_coverage_h merged = NULL, cov;
+	mips_profiler_h symbols = NULL;
+	const char *output = NULL, *elf = NULL;
+	mips_error error;
+	int opt, i;
+	while((opt = getopt(argc, argv, "o:e:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'o':
+			output = optarg;
+			break;
+		case 'e':
+			elf = optarg;
+			break;
+		default:
+			optind = argc + 1;
+		}
+	}
+	if(optind >= argc)
+	{
+		fprintf(stderr, "Usage: %s [-o merged.cov] [-e program.elf] run.cov...\n", argv[0]);
+		return 1;
+	}
+	for(i = optind; i < argc; i++)
+	{
+		cov = mips_coverage_load(argv[i]);
+		if(cov == NULL)
+		{
+			fprintf(stderr, "Could not read coverage map %s\n", argv[i]);
+			return 1;
+		}
+		if(merged == NULL)
+			merged = cov;
+		else if(mips_coverage_merge(merged, cov))
+		{
+			fprintf(stderr, "%s covers a different range to %s\n", argv[i], argv[optind]);
+			return 1;
+		}
+		if(cov != merged)
+			mips_coverage_free(cov);
+	}
+	if(output != NULL && mips_coverage_save(merged, output))
+	{
+		fprintf(stderr, "Could not write %s\n", output);
+		return 1;
+	}
+	if(elf != NULL)
+	{
+		/** The period is unused: the profiler only names addresses */
+		symbols = mips_profiler_create(1);
+		if(mips_profiler_load_elf(symbols, elf))
+		{
+			mips_profiler_free(symbols);
+			symbols = NULL;
+		}
+		error = mips_coverage_report(merged, elf, symbols, stdout, NULL);
+		if(error)
+		{
+			fprintf(stderr, "Could not read the code of %s\n", elf);
+			return 1;
+		}
+		mips_profiler_free(symbols);
+	}
+	mips_coverage_free(merged);
+	return 0;
+}
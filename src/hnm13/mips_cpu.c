@@ -4,36 +4,27 @@
  *
  * Implements all MIPS-I instructions
  *
+ * The simulator is reentrant: everything a CPU touches while running,
+ * including its debug formatting buffer, lives in its own
+ * struct mips_cpu_impl, and the only globals are constant tables.
+ * Separate mips_cpu_h/mips_mem_h pairs may be stepped on separate
+ * threads at the same time without any locking.
+ * CPUs may also share one RAM across threads, using LL/SC and SYNC
+ * to coordinate (see mips_cpu_smp.h).
+ *
  * ISO C90 compatible
  **/
 
-#include "mips_cpu.h"
-#include "mips_util.h"
+#include "mips_cpu_state.h"
+#include "mips_cpu_btrace.h"
+#include "mips_cpu_memprof.h"
 #include <stdio.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <string.h>
 
-/** The number of simulated register **/
-#define NUM_REGS 32
-/** The size of temp_buf **/
-#define BUF_SIZE 256
-
 #define BLANK {0},{0},{0},{0}
 
-/** Two words next to each other, the high and low parts */
-typedef struct
-{
-	uint32_t lo, hi;
-} s_hi_lo;
-
-/** A double word register, accessible in full or in parts */
-typedef union
-{
-	uint64_t full;
-	s_hi_lo parts;
-} long_reg;
-
 /** Data for an R-type instruction */
 typedef struct
 {
@@ -81,31 +72,6 @@ typedef struct
 	bool shift;
 } lw_data;
 
-/** CPU state structure */
-struct mips_cpu_impl
-{
-	/** Pointer to memory object */
-	mips_mem_h mem;
-	/** Debug level */
-	unsigned debug;
-	/** Output for debug messages */
-	FILE* output;
-	/** Debug handler method */
-	debug_handle debug_handle;
-	/** Exception handler locations */
-	uint32_t exception[16];
-	/** Program counter */
-	uint32_t pc, pcN;
-	/** The $HI and $LO registers */
-	long_reg hi_lo;
-	/** Coprocessor settings */
-	coprocessor coprocessor[4];
-	/** General purpose registers */
-	uint32_t reg[NUM_REGS];
-	/** Flags for when the register is undefined */
-	bool undefined[NUM_REGS];
-};
-
 /** Parses an R-type operand list from an instruction */
 rtype get_rtype(uint32_t instr)
 {
@@ -163,14 +129,18 @@ void reverse_data(uint8_t* data, unsigned length)
 	}
 }
 
-/** A temporary buffer for processing debug output */
-static char temp_buf[BUF_SIZE];
-
 /** Outputs the given string to the debug handler */
 void debug(mips_cpu_h state, const char* buf, size_t bufsize)
 {
 	debug_handle dh = state->debug_handle;
-	if(dh == NULL)
+	trace_record rec;
+	if(state->host.trace != NULL)
+	{
+		rec.kind = trace_text;
+		rec.length = bufsize;
+		trace_push(state->host.trace, &rec, buf);
+	}
+	else if(dh == NULL)
 	{
 		FILE* file = state->output;
 		if(file == NULL)
@@ -183,12 +153,31 @@ void debug(mips_cpu_h state, const char* buf, size_t bufsize)
 	}
 }
 
+/** Outputs a debug message of one of the trace_kind forms,
+ *  as a binary record when the trace is asynchronous */
+void debug_event(mips_cpu_h state, unsigned kind, unsigned index, uint32_t value, const char* name)
+{
+	trace_record rec;
+	rec.kind = kind;
+	rec.index = index;
+	rec.length = 0;
+	rec.value = value;
+	rec.name = name;
+	if(state->host.trace != NULL)
+		trace_push(state->host.trace, &rec, NULL);
+	else
+		debug(state, state->temp_buf, trace_format(state->temp_buf, &rec));
+}
+
 /** Sets a register, ensuring that $0 == 0 and outputting debug information */
 void set_reg(mips_cpu_h state, unsigned index, uint32_t value)
 {
 	state->reg[index] = index ? value : 0;
+	state->undefined &= ~(1u << index);
 	if(state->debug > 1)
-		debug(state, temp_buf, sprintf(temp_buf, "$%d = %d (0x%x)\n", index, (int32_t)value, value));
+		debug_event(state, trace_reg, index, value, NULL);
+	if(state->host.btrace != NULL)
+		btrace_reg(state->host.btrace, index, value);
 }
 
 void advance_pc(mips_cpu_h state)
@@ -201,8 +190,12 @@ void advance_pc(mips_cpu_h state)
  *  using the pcN field */
 void set_branch_delay(mips_cpu_h state, uint32_t value)
 {
+	if(state->host.plugin_mask & plugin_kind_branch)
+		plugin_branch(state, value, true);
 	if(state->debug > 2)
-		debug(state, temp_buf, sprintf(temp_buf, "$pcN = 0x%x\n", value));
+		debug_event(state, trace_pcN, 0, value, NULL);
+	if(state->host.btrace != NULL)
+		btrace_branch(state->host.btrace, value);
 	state->pc = state->pcN;
 	state->pcN = value;
 }
@@ -220,6 +213,8 @@ mips_error jump(mips_cpu_h state, uint32_t instruction)
 	jtype operands = get_jtype(instruction);
 	link(state, operands.opcode, 1);
 	set_branch_delay(state, ((state->pc + 4) & 0xF0000000) | (operands.imm << 2));
+	if(state->host.callgraph != NULL && (operands.opcode & 1))
+		callgraph_call(state, state->pcN, state->reg[31]);
 	return mips_Success;
 }
 
@@ -256,16 +251,28 @@ mips_error branch_zero(mips_cpu_h state, uint32_t instruction)
 	}
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf, fmt, operands.s, value));
+		debug(state, state->temp_buf, sprintf(state->temp_buf, fmt, operands.s, value));
 	}
 	/** Use the first bit of the 'd' field
 	 *  to determine if we need to link
 	 *  The link happens regardless of whether the condition is true */
 	link(state, operands.d, 0x20);
+	if(state->host.coverage != NULL)
+		coverage_edge(state, result);
 	if(result)
+	{
+		state->host.stats.branches_taken++;
 		set_branch_delay(state, state->pc + 4 + ((int16_t)operands.imm << 2));
+		if(state->host.callgraph != NULL && (operands.d & 0x20))
+			callgraph_call(state, state->pcN, state->reg[31]);
+	}
 	else
+	{
+		state->host.stats.branches_not_taken++;
+		if(state->host.plugin_mask & plugin_kind_branch)
+			plugin_branch(state, state->pc + 4 + ((int16_t)operands.imm << 2), false);
 		advance_pc(state);
+	}
 	return mips_Success;
 }
 
@@ -282,15 +289,25 @@ mips_error branch_var(mips_cpu_h state, uint32_t instruction)
 		result = !result;
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"Test: $%d %c= $%d - %s\n", operands.s,
 				(operands.opcode & 1) ? '!' : '=',
 				operands.d, result ? "TRUE" : "FALSE"));
 	}
+	if(state->host.coverage != NULL)
+		coverage_edge(state, result);
 	if(result)
+	{
+		state->host.stats.branches_taken++;
 		set_branch_delay(state, state->pc + 4 + ((int16_t)operands.imm << 2));
+	}
 	else
+	{
+		state->host.stats.branches_not_taken++;
+		if(state->host.plugin_mask & plugin_kind_branch)
+			plugin_branch(state, state->pc + 4 + ((int16_t)operands.imm << 2), false);
 		advance_pc(state);
+	}
 	return mips_Success;
 }
 
@@ -303,7 +320,7 @@ mips_error addi(mips_cpu_h state, uint32_t instruction)
 	int32_t y = (int16_t)operands.imm;
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$%d = $%d + %d\n", operands.d, operands.s,
 				(int16_t)operands.imm));
 	}
@@ -330,7 +347,7 @@ mips_error slti(mips_cpu_h state, uint32_t instruction)
 		result = (int32_t)value < (int16_t)operands.imm;
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"Test ($%d) %d < %d - %s\n", operands.s, value,
 				(int16_t)operands.imm, result ? "TRUE" : "FALSE"));
 	}
@@ -366,7 +383,7 @@ mips_error bitwise_imm(mips_cpu_h state, uint32_t instruction)
 	}
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$%d = $%d %c 0x%x\n", operands.d,
 				operands.s, c, operands.imm));
 	}
@@ -382,7 +399,7 @@ mips_error lui(mips_cpu_h state, uint32_t instruction)
 	set_reg(state, operands.d, operands.imm << 16);
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$%d = 0x%x\n", operands.d,
 				operands.imm << 16));
 	}
@@ -390,28 +407,46 @@ mips_error lui(mips_cpu_h state, uint32_t instruction)
 	return mips_Success;
 }
 
-/** Common function for most memory operations */
-mips_error mem_base(mips_cpu_h state, itype operands, bool load, int length, uint8_t* word, int offset, int align)
+/** Counts a load or store of 1, 2 or 4 bytes, at a physical address */
+static void count_access(mips_cpu_h state, bool load, int length, uint32_t addr)
+{
+	uint64_t* counts = load ? state->host.stats.loads : state->host.stats.stores;
+	counts[length == 4 ? 2 : length - 1]++;
+	if(state->host.memprof != NULL)
+		memprof_access(state, mips_MemprofData, addr);
+	if(state->host.plugin_mask & plugin_kind_memory)
+		plugin_memory(state, addr, length, !load);
+}
+
+/** Checks a store could be made now, so a buffered one faults on the
+ *  instruction that made it rather than when the buffer is committed */
+static mips_error probe_store(mips_cpu_h state, uint32_t addr, int length)
+{
+	uint32_t new_addr;
+	mips_error error = mips_mem_probe_write(state->mem, addr, length);
+	if(error == mips_ExceptionInvalidAlignment)
+	{
+		new_addr = addr & ~3u;
+		error = mips_mem_probe_write(state->mem, new_addr,
+			((addr + length + 3) & ~3u) - new_addr);
+	}
+	return error;
+}
+
+/** Makes a load or store at a physical address, within one page */
+static mips_error mem_physical(mips_cpu_h state, bool load, uint32_t addr, int length, uint8_t* word)
 {
 	mips_error error;
-	uint32_t addr, new_addr, new_len, data_offset;
+	uint32_t new_addr, new_len, data_offset;
 	uint64_t data;
-	uint8_t* ptr;
-	if(state->mem == NULL)
-		return mips_ErrorInvalidHandle;
-	addr = state->reg[operands.s] + (int16_t)operands.imm + offset;
-	if((addr % align) || (length % align))
-		return mips_ExceptionInvalidAlignment;
-	if(state->debug > 2)
+	uint8_t *ptr, *start = word;
+	int count = length;
+	if(!load && state->stores != NULL)
 	{
-		if(load)
-			debug(state, temp_buf, sprintf(temp_buf,
-				"$%d = mem[0x%x : 0x%x]\n",
-				operands.d, addr, addr + length - 1));
-		else
-			debug(state, temp_buf, sprintf(temp_buf,
-				"mem[0x%x : 0x%x] = $%d\n",
-				addr, addr + length - 1, operands.d));
+		error = probe_store(state, addr, length);
+		if(error)
+			return error;
+		return store_buffer_store(state->stores, addr, length, word);
 	}
 	if(load)
 		error = mips_mem_read(state->mem, addr, length, word);
@@ -427,7 +462,12 @@ mips_error mem_base(mips_cpu_h state, itype operands, bool load, int length, uin
 		if(new_len > 8)
 			return error;
 		ptr = (uint8_t*)&data;
-		error = mips_mem_read(state->mem, new_addr, new_len, ptr);
+		/** A store reads the bytes around it back without it being
+		 *  a read by the program */
+		if(load)
+			error = mips_mem_read(state->mem, new_addr, new_len, ptr);
+		else
+			error = mips_mem_peek(state->mem, new_addr, new_len, ptr);
 		if(error)
 			return error;
 		ptr += data_offset;
@@ -441,6 +481,64 @@ mips_error mem_base(mips_cpu_h state, itype operands, bool load, int length, uin
 			error = mips_mem_write(state->mem, new_addr, new_len, (uint8_t*)&data);
 		}
 	}
+	if(!error && load && state->stores != NULL)
+		store_buffer_load(state->stores, addr, count, start);
+	return error;
+}
+
+/** Common function for most memory operations */
+mips_error mem_base(mips_cpu_h state, itype operands, bool load, int length, uint8_t* word, int offset, int align)
+{
+	mips_error error;
+	uint32_t addr, next;
+	int split = length;
+	cop_translate translate = state->coprocessor[0].translate;
+	if(state->mem == NULL)
+		return mips_ErrorInvalidHandle;
+	addr = state->reg[operands.s] + (int16_t)operands.imm + offset;
+	if((addr % align) || (length % align))
+		return mips_ExceptionInvalidAlignment;
+	if(state->debug > 2)
+	{
+		if(load)
+			debug(state, state->temp_buf, sprintf(state->temp_buf,
+				"$%d = mem[0x%x : 0x%x]\n",
+				operands.d, addr, addr + length - 1));
+		else
+			debug(state, state->temp_buf, sprintf(state->temp_buf,
+				"mem[0x%x : 0x%x] = $%d\n",
+				addr, addr + length - 1, operands.d));
+	}
+	if(state->host.btrace != NULL)
+		btrace_mem(state->host.btrace, load, operands.d, addr, length);
+	/** The unaligned LWL/LWR/SWL/SWR accesses can run onto the next
+	 *  virtual page, which may be mapped anywhere, so each page's part
+	 *  is translated, and both translations are made before either
+	 *  part is, so a fault leaves memory as it was */
+	if(translate != NULL)
+	{
+		if((int)(MIPS_MEM_PAGE_SIZE - addr % MIPS_MEM_PAGE_SIZE) < length)
+			split = MIPS_MEM_PAGE_SIZE - addr % MIPS_MEM_PAGE_SIZE;
+		if(split < length)
+		{
+			error = translate(state, addr + split, load ? mem_load : mem_store, &next);
+			if(error)
+				return error;
+		}
+		error = translate(state, addr, load ? mem_load : mem_store, &addr);
+		if(error)
+			return error;
+	}
+	if(split < length && !load)
+		error = probe_store(state, next, length - split);
+	else
+		error = mips_Success;
+	if(!error)
+		error = mem_physical(state, load, addr, split, word);
+	if(!error && split < length)
+		error = mem_physical(state, load, next, length - split, word + split);
+	if(!error)
+		count_access(state, load, length, addr);
 	return error;
 }
 
@@ -453,7 +551,7 @@ mips_error copz(mips_cpu_h state, uint32_t instruction)
 		return mips_ErrorNotImplemented;
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"    0x%x", instruction & 0x3FFFFFF));
 	}
 	error = cop(state, instruction);
@@ -474,7 +572,7 @@ mips_error lwcz(mips_cpu_h state, uint32_t instruction)
 	operands = get_itype(instruction);
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf, "CP%d: ",
+		debug(state, state->temp_buf, sprintf(state->temp_buf, "CP%d: ",
 				(instruction >> 26) & 3));
 	}
 	error = mem_base(state, operands, true, 4, (uint8_t*)&data, 0, 4);
@@ -501,7 +599,7 @@ mips_error swcz(mips_cpu_h state, uint32_t instruction)
 		return error;
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf, "CP%d: ",
+		debug(state, state->temp_buf, sprintf(state->temp_buf, "CP%d: ",
 				(instruction >> 26) & 3));
 	}
 	error = mem_base(state, operands, true, 4, (uint8_t*)&data, 0, 4);
@@ -553,6 +651,86 @@ mips_error lw(mips_cpu_h state, uint32_t instruction)
 	return mips_Success;
 }
 
+/** Load linked
+ *  A load word which also remembers the word, for a following SC */
+mips_error ll(mips_cpu_h state, uint32_t instruction)
+{
+	itype operands = get_itype(instruction);
+	uint32_t word;
+	mips_error error = mem_base(state, operands, true, 4, (uint8_t*)&word, 0, 4);
+	if(error)
+		return error;
+	state->ll_bit = true;
+	state->ll_addr = state->reg[operands.s] + (int16_t)operands.imm;
+	state->ll_value = word;
+	reverse_word(&word);
+	set_reg(state, operands.d, word);
+	advance_pc(state);
+	return mips_Success;
+}
+
+/** Store conditional
+ *  Stores only if the word still holds what the last LL read from it,
+ *  checked and stored as one atomic operation on the shared memory.
+ *  A CPU with buffered stores waits for them to be committed first:
+ *  mips_cpu_step parks it before the SC is run */
+mips_error sc(mips_cpu_h state, uint32_t instruction)
+{
+	itype operands = get_itype(instruction);
+	uint32_t addr, word = state->reg[operands.d];
+	cop_translate translate = state->coprocessor[0].translate;
+	mips_error error;
+	int swapped = 0;
+	addr = state->reg[operands.s] + (int16_t)operands.imm;
+	if(addr % 4)
+		return mips_ExceptionInvalidAlignment;
+	if(state->ll_bit && addr == state->ll_addr)
+	{
+		if(translate != NULL)
+		{
+			error = translate(state, addr, mem_store, &addr);
+			if(error)
+				return error;
+		}
+		reverse_word(&word);
+		error = mips_mem_compare_swap(state->mem, addr,
+			(uint8_t*)&state->ll_value, (uint8_t*)&word, &swapped);
+		if(error)
+			return error;
+	}
+	if(state->debug > 2)
+	{
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
+				"mem[0x%x] = $%d - %s\n", addr, operands.d,
+				swapped ? "STORED" : "FAILED"));
+	}
+	if(swapped && state->host.btrace != NULL)
+		btrace_mem(state->host.btrace, false, operands.d, addr, 4);
+	if(swapped)
+		count_access(state, false, 4, addr);
+	state->ll_bit = false;
+	set_reg(state, operands.d, (uint32_t)swapped);
+	advance_pc(state);
+	return mips_Success;
+}
+
+/** Read hardware register (MIPS32r2)
+ *  Only register 0, the CPU number, is provided */
+mips_error rdhwr(mips_cpu_h state, uint32_t instruction)
+{
+	rtype operands = get_rtype(instruction);
+	if(operands.f != 0x3B || operands.d != 0)
+		return mips_ExceptionInvalidInstruction;
+	set_reg(state, operands.s2, state->cpu_id);
+	if(state->debug > 2)
+	{
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
+				"$%d = CPU %d\n", operands.s2, state->cpu_id));
+	}
+	advance_pc(state);
+	return mips_Success;
+}
+
 /** Load word left */
 mips_error lwl(mips_cpu_h state, uint32_t instruction)
 {
@@ -676,7 +854,7 @@ mips_error shift_base(mips_cpu_h state, rtype operands, uint32_t shift)
 	s_str = (operands.f & 1) ? "signed" : "unsigned";
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$%d = $%d %c%c %d (%s)\n", operands.d, operands.s2,
 				c, c, shift, s_str));
 	}
@@ -707,6 +885,13 @@ mips_error jr(mips_cpu_h state, rtype operands)
 	if(val & 0x3)
 		return mips_ExceptionInvalidAlignment;
 	set_branch_delay(state, val);
+	if(state->host.callgraph != NULL)
+	{
+		if(operands.f & 1)
+			callgraph_call(state, val, state->pc + 4);
+		else if(operands.s1 == 31)
+			callgraph_return(state, val);
+	}
 	return mips_Success;
 }
 
@@ -722,13 +907,24 @@ mips_error breakpoint(mips_cpu_h state, rtype operands)
 	return mips_ExceptionBreak;
 }
 
+/** Synchronise
+ *  A full fence: every load and store before it is visible
+ *  to the other CPUs before any after it */
+mips_error sync(mips_cpu_h state, rtype operands)
+{
+	(void)operands;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	advance_pc(state);
+	return mips_Success;
+}
+
 /** Move from HI */
 mips_error mfhi(mips_cpu_h state, rtype operands)
 {
-	state->reg[operands.d] = state->hi_lo.parts.hi;
+	set_reg(state, operands.d, state->hi_lo.parts.hi);
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$%d = $HI\n", operands.d));
 	}
 	advance_pc(state);
@@ -739,9 +935,10 @@ mips_error mfhi(mips_cpu_h state, rtype operands)
 mips_error mthi(mips_cpu_h state, rtype operands)
 {
 	state->hi_lo.parts.hi = state->reg[operands.s1];
+	state->undefined_hi_lo &= ~UNDEFINED_HI;
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$HI = $%d\n", operands.s1));
 	}
 	advance_pc(state);
@@ -751,10 +948,10 @@ mips_error mthi(mips_cpu_h state, rtype operands)
 /** Move from LO */
 mips_error mflo(mips_cpu_h state, rtype operands)
 {
-	state->reg[operands.d] = state->hi_lo.parts.lo;
+	set_reg(state, operands.d, state->hi_lo.parts.lo);
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$%d = $LO\n", operands.d));
 	}
 	advance_pc(state);
@@ -765,9 +962,10 @@ mips_error mflo(mips_cpu_h state, rtype operands)
 mips_error mtlo(mips_cpu_h state, rtype operands)
 {
 	state->hi_lo.parts.lo = state->reg[operands.s1];
+	state->undefined_hi_lo &= ~UNDEFINED_LO;
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$LO = $%d\n", operands.s1));
 	}
 	advance_pc(state);
@@ -783,7 +981,7 @@ mips_error add_sub(mips_cpu_h state, rtype operands)
 	int32_t x, y;
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$%d = $%d %c $%d\n", operands.d, operands.s1,
 				(operands.f & 2) ? '-' : '+', operands.s2));
 	}
@@ -812,9 +1010,10 @@ mips_error mult(mips_cpu_h state, rtype operands)
 		state->hi_lo.full = (uint64_t)v1 * (uint64_t)v2;
 	else
 		state->hi_lo.full = (int64_t)(int32_t)v1 * (int64_t)(int32_t)v2;
+	state->undefined_hi_lo = 0;
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$HI, $LO = $%d * $%d\n",
 				operands.s1, operands.s2));
 	}
@@ -839,9 +1038,11 @@ mips_error _div(mips_cpu_h state, rtype operands)
 		state->hi_lo.parts.lo = zero ? 0 : (uint32_t)((int32_t)v1 / (int32_t)v2);
 		state->hi_lo.parts.hi = zero ? 0 : (uint32_t)((int32_t)v1 % (int32_t)v2);
 	}
+	/** The architecture leaves the result of dividing by zero undefined */
+	state->undefined_hi_lo = v2 == 0 ? UNDEFINED_HI | UNDEFINED_LO : 0;
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"$LO = $%d / $%d\n$HI = $%d %% $%d\n",
 				operands.s1, operands.s2, operands.s1, operands.s2));
 	}
@@ -894,7 +1095,7 @@ mips_error slt(mips_cpu_h state, rtype operands)
 	set_reg(state, operands.d, (uint32_t)result);
 	if(state->debug > 2)
 	{
-		debug(state, temp_buf, sprintf(temp_buf,
+		debug(state, state->temp_buf, sprintf(state->temp_buf,
 				"Test $%d < $%d - %s (%s)\n", operands.s1, operands.s2,
 				result ? "TRUE" : "FALSE", operands.f&1 ? "signed" : "unsigned"));
 	}
@@ -903,7 +1104,7 @@ mips_error slt(mips_cpu_h state, rtype operands)
 }
 
 /** Map of R-type 'function' fields to function pointers */
-static rtype_op_info rtype_ops[64] =
+static const rtype_op_info rtype_ops[64] =
 {
 	/** 0000 */
 	{ &shift, "SLL" },
@@ -924,7 +1125,7 @@ static rtype_op_info rtype_ops[64] =
 	{ &syscall, "SYSCALL" },
 	{ &breakpoint, "BREAK" },
 	{ NULL },
-	{ NULL },
+	{ &sync, "SYNC" },
 	/** 0100 */
 	{ &mfhi, "MFHI" },
 	{ &mthi, "MTHI" },
@@ -975,14 +1176,14 @@ mips_error do_rtype_op(mips_cpu_h state, uint32_t instruction)
 		const char* name = rtop.name;
 		if(name == NULL)
 			name = "Invalid instruction";
-		debug(state, temp_buf, sprintf(temp_buf, "%s\n", name));
+		debug_event(state, trace_op, 0, 0, name);
 	}
 	return rtop.op(state, operands);
 }
 
 /** The map of opcodes (6 bits) to operation function pointers
  *  A value of NULL here will throw a mips_ErrorInvalidInstruction */
-static op_info operations[64] =
+static const op_info operations[64] =
 {
 	/** 0000 */
 	{ &do_rtype_op, "R-type:" },
@@ -1014,7 +1215,10 @@ static op_info operations[64] =
 	/** 0110 */
 	BLANK,
 	/** 0111 */
-	BLANK,
+	{ NULL },
+	{ NULL },
+	{ NULL },
+	{ &rdhwr, "RDHWR" },
 	/** 1000 */
 	{ &lb, "LB" },
 	{ &lh, "LH" },
@@ -1036,14 +1240,14 @@ static op_info operations[64] =
 	{ &swr, "SWR" },
 	{ NULL },
 	/** 1100 */
-	{ &lwcz, "LWC0" },
+	{ &ll, "LL" },
 	{ &lwcz, "LWC1" },
 	{ &lwcz, "LWC2" },
 	{ &lwcz, "LWC3" },
 	/** 1101 */
 	BLANK,
 	/** 1110 */
-	{ &swcz, "SWC0" },
+	{ &sc, "SC" },
 	{ &swcz, "SWC1" },
 	{ &swcz, "SWC2" },
 	{ &swcz, "SWC3" },
@@ -1053,13 +1257,23 @@ static op_info operations[64] =
 
 static const struct mips_cpu_impl cpu_empty = {0};
 
+/** Sets up a CPU state in existing storage */
+void mips_cpu_init(mips_cpu_h state, mips_mem_h mem)
+{
+	*state = cpu_empty;
+	state->mem = mem;
+	state->pcN = 4;
+	state->undefined = ~1u;
+	state->undefined_hi_lo = UNDEFINED_HI | UNDEFINED_LO;
+	mmu_init(&state->mmu);
+}
+
 /** Creates a CPU state */
 mips_cpu_h mips_cpu_create(mips_mem_h mem)
 {
 	mips_cpu_h ret = malloc(sizeof(struct mips_cpu_impl));
-	*ret = cpu_empty;
-	ret->mem = mem;
-	ret->pcN = 4;
+	if(ret != NULL)
+		mips_cpu_init(ret, mem);
 	return ret;
 }
 
@@ -1069,16 +1283,57 @@ mips_error mips_cpu_reset(mips_cpu_h state)
 	mips_mem_h mem;
 	unsigned l_debug;
 	debug_handle dh;
+	FILE* output;
+	cpu_attachments host;
+	coprocessor cp[4];
+	unsigned id;
 	if(state == NULL)
 		return mips_ErrorInvalidHandle;
 	mem = state->mem;
+	id = state->cpu_id;
 	l_debug = state->debug;
 	dh = state->debug_handle;
+	output = state->output;
+	host = state->host;
+	/** Coprocessors are attached hardware, so they survive a reset */
+	memcpy(cp, state->coprocessor, sizeof(cp));
 	*state = cpu_empty;
 	state->mem = mem;
 	state->debug = l_debug;
 	state->debug_handle = dh;
+	state->output = output;
+	state->host = host;
+	memcpy(state->coprocessor, cp, sizeof(cp));
+	state->cpu_id = id;
 	state->pcN = 4;
+	state->undefined = ~1u;
+	state->undefined_hi_lo = UNDEFINED_HI | UNDEFINED_LO;
+	mmu_init(&state->mmu);
+	if(state->host.callgraph != NULL)
+		callgraph_restart(state);
+	return mips_Success;
+}
+
+/** Copies the architectural state of one CPU into another
+ *  The destination keeps its own memory, debug settings, attachments
+ *  and store buffer */
+mips_error mips_cpu_copy_state(mips_cpu_h dst, const struct mips_cpu_impl* src)
+{
+	struct mips_cpu_impl keep;
+	if(dst == NULL || src == NULL)
+		return mips_ErrorInvalidHandle;
+	if(dst == src)
+		return mips_Success;
+	keep = *dst;
+	*dst = *src;
+	dst->mem = keep.mem;
+	dst->debug = keep.debug;
+	dst->output = keep.output;
+	dst->debug_handle = keep.debug_handle;
+	dst->host = keep.host;
+	dst->stores = keep.stores;
+	if(dst->host.callgraph != NULL)
+		callgraph_restart(dst);
 	return mips_Success;
 }
 
@@ -1122,6 +1377,8 @@ mips_error mips_cpu_set_pc(
 		return mips_ErrorInvalidHandle;
 	state->pc = pc;
 	state->pcN = pc + 4;
+	if(state->host.callgraph != NULL)
+		callgraph_restart(state);
 	return mips_Success;
 }
 
@@ -1136,52 +1393,209 @@ mips_error mips_cpu_get_pc(mips_cpu_h state, uint32_t *pc)
 	return mips_Success;
 }
 
+/** Returns the name mips_cpu_step gives an instruction */
+const char* mips_cpu_instruction_name(uint32_t instruction)
+{
+	const char* name;
+	if(instruction >> 26)
+	{
+		name = operations[instruction >> 26].name;
+		return name != NULL ? name : "Unknown instruction";
+	}
+	name = rtype_ops[instruction & 0x3F].name;
+	return name != NULL ? name : "Invalid instruction";
+}
+
+/** The general purpose registers an instruction reads, as a mask */
+static uint32_t registers_read(uint32_t instruction)
+{
+	unsigned opcode = instruction >> 26, function = instruction & 0x3F;
+	uint32_t rs = 1u << ((instruction >> 21) & 0x1F);
+	uint32_t rt = 1u << ((instruction >> 16) & 0x1F);
+	switch(opcode)
+	{
+	case 0:
+		if(function < 4) /** SLL, SRL, SRA */
+			return rt;
+		if(function < 8) /** SLLV, SRLV, SRAV */
+			return rs | rt;
+		if(function < 10) /** JR, JALR */
+			return rs;
+		if(function < 16) /** SYSCALL, BREAK, SYNC */
+			return 0;
+		if(function < 20) /** MFHI, MTHI, MFLO, MTLO */
+			return (function & 1) ? rs : 0;
+		return rs | rt;
+	case 2: /** J, JAL, LUI, RDHWR */
+	case 3:
+	case 15:
+	case 31:
+		return 0;
+	case 4: /** BEQ, BNE, and LWL and LWR, which merge into rt */
+	case 5:
+	case 34:
+	case 38:
+		return rs | rt;
+	case 16: /** MTCz and CTCz */
+	case 17:
+	case 18:
+	case 19:
+		return ((instruction >> 21) & 0x1D) == 4 ? rt : 0;
+	default:
+		/** Stores and SWCz read rt as well as the base */
+		return (opcode & 0x28) == 0x28 ? rs | rt : rs;
+	}
+}
+
+/** Reports the undefined registers an instruction is about to read */
+static void check_undefined(mips_cpu_h state, uint32_t instruction)
+{
+	uint32_t read = registers_read(instruction) & state->undefined;
+	unsigned i, hi_lo = 0;
+	if((instruction >> 26) == 0 && (instruction & 0x3D) == 0x10)
+		hi_lo = (instruction & 2) ? UNDEFINED_LO : UNDEFINED_HI;
+	for(i = 1; i < NUM_REGS; i++)
+		if((read >> i) & 1)
+			debug_event(state, trace_undefined, i, state->pc, NULL);
+	if(hi_lo & state->undefined_hi_lo)
+		debug_event(state, trace_undefined, hi_lo == UNDEFINED_HI ? 32 : 33, state->pc, NULL);
+}
+
 /** Logs the given exception */
 mips_error debug_exception(mips_cpu_h state, mips_error error)
 {
 	if(error && state->debug)
-		debug(state, temp_buf, sprintf(temp_buf,
-				"Exception: %s\n",  mips_error_string(error)));
+		debug_event(state, trace_exception, 0, error, NULL);
+	if(error && state->host.btrace != NULL)
+		btrace_exception(state->host.btrace, error);
+	if(error)
+		state->host.stats.errors[(error >> 12) & 3][error & 0xF]++;
+	if(error && (state->host.plugin_mask & plugin_kind_exception))
+		plugin_exception(state, error);
 	return error;
 }
 
 /** Performs one step in the CPU */
 mips_error mips_cpu_step(mips_cpu_h state)
 {
-	uint32_t instruction;
-	mips_error memresult;
+	uint32_t instruction, address;
+	mips_error memresult, error;
 	unsigned opcode;
 	op_info opinfo;
+	cop_translate translate;
 	if(state == NULL || state->mem == NULL)
 		return mips_ErrorInvalidHandle;
 
-	if(state->debug > 2)
-		debug(state, temp_buf, sprintf(temp_buf, "PC: %d\n", state->pc));
+	memresult = mips_Success;
+	address = state->pc;
+	translate = state->coprocessor[0].translate;
 	if(state->pc % 4)
-		return debug_exception(state, mips_ExceptionInvalidAlignment);
-	memresult = mips_mem_read(
-		state->mem,
-		state->pc,
-		sizeof(instruction),
-		(uint8_t*)&instruction);
+		memresult = mips_ExceptionInvalidAlignment;
+	else if(translate != NULL)
+		memresult = translate(state, address, mem_fetch, &address);
+	if(memresult == mips_Success)
+		memresult = mips_mem_fetch(
+			state->mem,
+			address,
+			sizeof(instruction),
+			(uint8_t*)&instruction);
+	if(memresult == mips_Success)
+	{
+		reverse_word(&instruction);
+		opcode = instruction >> 26;
+		/** An SC can't run while this CPU's stores are held back. It is
+		 *  stepped again once they are committed, so is only traced,
+		 *  counted and reported to plugins then */
+		if(opcode == 0x38 /** SC */ && state->stores != NULL)
+			return mips_ExceptionSerialise;
+	}
+
+	if(state->debug > 2)
+		debug_event(state, trace_pc, 0, state->pc, NULL);
+	if(state->host.btrace != NULL)
+		btrace_step(state->host.btrace, state->pc, state->pcN);
 	if(memresult != mips_Success)
 		return debug_exception(state, memresult);
+	if(state->host.memprof != NULL)
+		memprof_access(state, mips_MemprofFetch, address);
+	if(state->host.coverage != NULL)
+	{
+		if(state->pc != state->host.coverage_next)
+			coverage_block(state);
+		state->host.coverage_next = state->pc + 4;
+	}
 
-	reverse_word(&instruction);
 	opcode = instruction >> 26;
 	opinfo = operations[opcode];
 	if(opinfo.op == NULL)
 		return debug_exception(state, mips_ExceptionInvalidInstruction);
 
+	if(state->host.plugin_mask & (plugin_kind_instruction | plugin_kind_block))
+		plugin_step(state, instruction);
+	if(state->debug && (state->undefined || state->undefined_hi_lo))
+		check_undefined(state, instruction);
+
 	if(state->debug > 1 && opcode > 0)
 	{
 		const char* name = opinfo.name;
 		if(name == NULL)
 			name = "Unknown instruction";
-		debug(state, temp_buf, sprintf(temp_buf, "%s\n", name));
+		debug_event(state, trace_op, 0, 0, name);
 	}
 
-	return debug_exception(state, opinfo.op(state, instruction));
+	if(state->host.latency != NULL && state->host.latency->period
+		&& --state->host.latency->countdown == 0)
+		error = latency_sample(state, opinfo.op, instruction);
+	else
+		error = opinfo.op(state, instruction);
+	if(!error)
+	{
+		state->host.stats.retired++;
+		state->host.stats.opcode[opcode]++;
+		if(opcode == 0)
+			state->host.stats.function[instruction & 0x3F]++;
+		if(state->host.profiler != NULL && --state->host.profile_countdown == 0)
+			profile_sample(state);
+		if(state->host.metrics != NULL && --state->host.metrics_countdown == 0)
+			metrics_publish(state);
+	}
+	return debug_exception(state, error);
+}
+
+/** Steps until the PC reaches stop_pc, an instruction fails,
+ *  or the budget runs out */
+mips_error mips_cpu_run(mips_cpu_h state,
+	uint32_t stop_pc,
+	uint64_t budget,
+	uint64_t* retired)
+{
+	mips_error error = mips_Success;
+	uint64_t count = 0;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	while(count < budget && state->pc != stop_pc)
+	{
+		error = mips_cpu_step(state);
+		if(error)
+			break;
+		count++;
+	}
+	if(state->host.metrics != NULL)
+		metrics_publish(state);
+	if(state->host.coverage != NULL)
+		coverage_flush(state);
+	if(retired != NULL)
+		*retired = count;
+	return error;
+}
+
+/** Sets the number this core reports to the guest */
+mips_error mips_cpu_set_id(mips_cpu_h state, unsigned id)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	state->cpu_id = id;
+	return mips_Success;
 }
 
 /** Sets the debug level:
@@ -1197,6 +1611,8 @@ mips_error mips_cpu_set_debug_level(mips_cpu_h state,
 		return mips_ErrorInvalidHandle;
 	state->debug = level;
 	state->output = dest;
+	/** Anything already traced still goes to the old output */
+	trace_set_output(state);
 	return mips_Success;
 }
 
@@ -1225,13 +1641,33 @@ mips_error mips_cpu_set_exception_handler(mips_cpu_h state,
 	return mips_Success;
 }
 
+/** Releases what a CPU holds, but not its storage */
+void mips_cpu_destroy(mips_cpu_h state)
+{
+	trace_stop(state);
+	mips_btrace_close(state);
+	free(state->host.latency);
+	state->host.latency = NULL;
+	callgraph_free(state->host.callgraph);
+	state->host.callgraph = NULL;
+	memprof_free(state->host.memprof);
+	state->host.memprof = NULL;
+	mips_cpu_set_metrics(state, NULL, 0, NULL);
+	mips_cpu_set_coverage(state, NULL);
+	plugin_free(state->host.plugins);
+	state->host.plugins = NULL;
+	state->host.plugin_mask = 0;
+	if(state->output != NULL)
+		fclose(state->output);
+	state->output = NULL;
+}
+
 /** Releases CPU resources */
 void mips_cpu_free(mips_cpu_h state)
 {
 	if(state != NULL)
 	{
-		if(state->output != NULL)
-			fclose(state->output);
+		mips_cpu_destroy(state);
 		free(state);
 	}
 }
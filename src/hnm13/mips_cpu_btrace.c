@@ -0,0 +1,410 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Binary execution traces, written to a memory-mapped file, and the
+ * decoder that turns them back into text
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_btrace.h"
+#include "mips_cpu_state.h"
+#include "mips_cpu_extend.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/** The size the file starts at, and the most a record can take */
+#define INITIAL_SIZE (1 << 20)
+#define MAX_RECORD 16
+
+/** Writer state */
+struct btrace
+{
+	int fd;
+	uint8_t* data;
+	size_t length, size;
+	unsigned flags;
+	/** Where the reader will think the current instruction is */
+	uint32_t pc, pcN;
+	/** Set if the current instruction branched, and where to */
+	bool branched;
+	uint32_t target;
+	bool started;
+	/** Instructions started since the last record */
+	uint64_t pending;
+	/** The last value of each register, and the last address */
+	uint32_t regs[32];
+	uint32_t address;
+};
+
+/** Doubles the file, if it hasn't room for another record
+ *  On failure, the trace stops growing and records are lost */
+static bool reserve(btrace* bt)
+{
+	uint8_t* data;
+	if(bt->length + MAX_RECORD <= bt->size)
+		return true;
+	if(bt->data == NULL || ftruncate(bt->fd, bt->size * 2))
+		return false;
+	munmap(bt->data, bt->size);
+	data = mmap(NULL, bt->size * 2, PROT_READ | PROT_WRITE, MAP_SHARED, bt->fd, 0);
+	bt->data = data == MAP_FAILED ? NULL : data;
+	bt->size *= 2;
+	return bt->data != NULL;
+}
+
+/** Writes an unsigned varint */
+static void put_varint(btrace* bt, uint64_t value)
+{
+	while(value >= 0x80)
+	{
+		bt->data[bt->length++] = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	bt->data[bt->length++] = (uint8_t)value;
+}
+
+/** Writes a signed difference, zigzag encoded */
+static void put_delta(btrace* bt, uint32_t value, uint32_t from)
+{
+	int32_t d = (int32_t)(value - from);
+	put_varint(bt, ((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+}
+
+/** Starts a record, returning false if there is no room for it */
+static bool put_tag(btrace* bt, unsigned kind)
+{
+	if(!reserve(bt))
+		return false;
+	if(bt->pending < 31)
+		bt->data[bt->length++] = (kind << 5) | (uint8_t)bt->pending;
+	else
+	{
+		bt->data[bt->length++] = (kind << 5) | 31;
+		put_varint(bt, bt->pending - 31);
+	}
+	bt->pending = 0;
+	return true;
+}
+
+/** Records the start of an instruction */
+void btrace_step(btrace* bt, uint32_t pc, uint32_t pcN)
+{
+	if(bt->started)
+	{
+		bt->pc = bt->pcN;
+		bt->pcN = bt->branched ? bt->target : bt->pc + 4;
+	}
+	bt->started = true;
+	bt->branched = false;
+	if((pc != bt->pc || pcN != bt->pcN) && put_tag(bt, mips_btrace_Pc))
+	{
+		put_delta(bt, pc, bt->pc);
+		put_delta(bt, pcN, pc + 4);
+		bt->pc = pc;
+		bt->pcN = pcN;
+	}
+	bt->pending++;
+}
+
+/** Records a register write */
+void btrace_reg(btrace* bt, unsigned index, uint32_t value)
+{
+	if(!(bt->flags & MIPS_BTRACE_REGS) || !put_tag(bt, mips_btrace_Reg))
+		return;
+	bt->data[bt->length++] = index;
+	put_delta(bt, value, bt->regs[index]);
+	bt->regs[index] = value;
+}
+
+/** Records a branch being taken */
+void btrace_branch(btrace* bt, uint32_t target)
+{
+	if(!(bt->flags & MIPS_BTRACE_BRANCHES) || !put_tag(bt, mips_btrace_Branch))
+		return;
+	put_delta(bt, target, bt->pc);
+	bt->branched = true;
+	bt->target = target;
+}
+
+/** Records a load or store */
+void btrace_mem(btrace* bt, bool load, unsigned reg, uint32_t address, unsigned length)
+{
+	if(!(bt->flags & MIPS_BTRACE_MEMORY)
+		|| !put_tag(bt, load ? mips_btrace_Load : mips_btrace_Store))
+		return;
+	bt->data[bt->length++] = reg | ((length == 4 ? 2 : length - 1) << 5);
+	put_delta(bt, address, bt->address);
+	bt->address = address;
+}
+
+/** Records an exception */
+void btrace_exception(btrace* bt, mips_error error)
+{
+	if(put_tag(bt, mips_btrace_Exception))
+		put_varint(bt, error);
+}
+
+/** Starts a trace */
+mips_error mips_btrace_open(mips_cpu_h state, const char* path, unsigned flags)
+{
+	btrace* bt;
+	mips_btrace_header* header;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(path == NULL)
+		return mips_ErrorInvalidArgument;
+	mips_btrace_close(state);
+	bt = calloc(1, sizeof(btrace));
+	if(bt == NULL)
+		return mips_ErrorOutOfMemory;
+	bt->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(bt->fd < 0)
+	{
+		free(bt);
+		return mips_ErrorFileWriteError;
+	}
+	bt->size = INITIAL_SIZE;
+	if(ftruncate(bt->fd, bt->size)
+		|| (bt->data = mmap(NULL, bt->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, bt->fd, 0)) == MAP_FAILED)
+	{
+		close(bt->fd);
+		free(bt);
+		return mips_ErrorFileWriteError;
+	}
+	bt->flags = flags;
+	bt->pc = state->pc;
+	bt->pcN = state->pcN;
+	memcpy(bt->regs, state->reg, sizeof(bt->regs));
+	header = (mips_btrace_header*)bt->data;
+	memcpy(header->magic, MIPS_BTRACE_MAGIC, sizeof(header->magic));
+	header->flags = flags;
+	header->pc = bt->pc;
+	header->pcN = bt->pcN;
+	memcpy(header->regs, bt->regs, sizeof(header->regs));
+	bt->length = sizeof(mips_btrace_header);
+	state->host.btrace = bt;
+	return mips_Success;
+}
+
+/** Finishes a trace */
+mips_error mips_btrace_close(mips_cpu_h state)
+{
+	btrace* bt;
+	mips_error error = mips_Success;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	bt = state->host.btrace;
+	if(bt == NULL)
+		return mips_Success;
+	if(bt->pending)
+		put_tag(bt, mips_btrace_Step);
+	if(bt->data == NULL)
+		error = mips_ErrorFileWriteError;
+	else
+		munmap(bt->data, bt->size);
+	if(ftruncate(bt->fd, bt->length) || close(bt->fd))
+		error = mips_ErrorFileWriteError;
+	state->host.btrace = NULL;
+	free(bt);
+	return error;
+}
+
+/** Decoder state, following the CPU the way the writer did */
+typedef struct
+{
+	const uint8_t* data;
+	size_t length, pos;
+	uint32_t pc, pcN, target;
+	bool branched, started, override;
+	uint32_t regs[32], address;
+	/** Instructions started so far */
+	uint64_t index;
+	/** Whether the current instruction passes the filter */
+	bool show;
+	const mips_btrace_filter* filter;
+	FILE* dest;
+} decoder;
+
+/** Reads an unsigned varint, returning false if the trace ends first */
+static bool get_varint(decoder* d, uint64_t* value)
+{
+	unsigned shift = 0;
+	uint8_t byte;
+	*value = 0;
+	do
+	{
+		if(d->pos >= d->length || shift > 63)
+			return false;
+		byte = d->data[d->pos++];
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		shift += 7;
+	} while(byte & 0x80);
+	return true;
+}
+
+/** Reads a zigzag encoded difference, and applies it to 'from' */
+static bool get_delta(decoder* d, uint32_t from, uint32_t* value)
+{
+	uint64_t z;
+	if(!get_varint(d, &z))
+		return false;
+	*value = from + (((uint32_t)z >> 1) ^ -((uint32_t)z & 1));
+	return true;
+}
+
+/** Moves the PC on from the last instruction */
+static void advance(decoder* d)
+{
+	d->pc = d->pcN;
+	d->pcN = d->branched ? d->target : d->pc + 4;
+	d->branched = false;
+}
+
+/** Starts the next instruction */
+static void start(decoder* d)
+{
+	const mips_btrace_filter* f = d->filter;
+	const uint8_t* p;
+	if(d->started && !d->override)
+		advance(d);
+	d->branched = false;
+	d->override = false;
+	d->started = true;
+	d->show = d->index >= f->first && d->index - f->first < f->count
+		&& d->pc >= f->low && d->pc <= f->high;
+	d->index++;
+	if(!d->show)
+		return;
+	if(f->level > 2)
+		fprintf(d->dest, "PC: %d\n", d->pc);
+	if(f->level > 1 && f->image != NULL && d->pc % 4 == 0
+		&& d->pc < f->image_length && f->image_length - d->pc >= 4)
+	{
+		p = f->image + d->pc;
+		fprintf(d->dest, "%s\n", mips_cpu_instruction_name(
+			((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]));
+	}
+}
+
+/** Decodes one record, returning false if it is cut short or invalid */
+static bool decode(decoder* d)
+{
+	const mips_btrace_filter* f = d->filter;
+	uint64_t skip, value;
+	uint32_t pc, length;
+	uint8_t tag, byte;
+	unsigned kind, reg;
+	if(d->pos >= d->length)
+		return false;
+	tag = d->data[d->pos++];
+	kind = tag >> 5;
+	skip = tag & 31;
+	if(skip == 31)
+	{
+		if(!get_varint(d, &value))
+			return false;
+		skip += value;
+	}
+	while(skip-- > 0)
+		start(d);
+	switch(kind)
+	{
+	case mips_btrace_Step:
+		return true;
+	case mips_btrace_Reg:
+		if(d->pos >= d->length)
+			return false;
+		reg = d->data[d->pos++] & 31;
+		if(!get_delta(d, d->regs[reg], &d->regs[reg]))
+			return false;
+		if(d->show && f->level > 1 && (f->reg < 0 || (unsigned)f->reg == reg))
+			fprintf(d->dest, "$%d = %d (0x%x)\n", reg, (int32_t)d->regs[reg], d->regs[reg]);
+		return true;
+	case mips_btrace_Branch:
+		if(!get_delta(d, d->pc, &d->target))
+			return false;
+		d->branched = true;
+		if(d->show && f->level > 2)
+			fprintf(d->dest, "$pcN = 0x%x\n", d->target);
+		return true;
+	case mips_btrace_Load:
+	case mips_btrace_Store:
+		if(d->pos >= d->length)
+			return false;
+		byte = d->data[d->pos++];
+		if(!get_delta(d, d->address, &d->address))
+			return false;
+		length = 1 << ((byte >> 5) & 3);
+		if(d->show && f->level > 2 && kind == mips_btrace_Load)
+			fprintf(d->dest, "$%d = mem[0x%x : 0x%x]\n", byte & 31, d->address, d->address + length - 1);
+		else if(d->show && f->level > 2)
+			fprintf(d->dest, "mem[0x%x : 0x%x] = $%d\n", d->address, d->address + length - 1, byte & 31);
+		return true;
+	case mips_btrace_Exception:
+		if(!get_varint(d, &value))
+			return false;
+		if(d->show && f->level > 0)
+			fprintf(d->dest, "Exception: %s\n", mips_error_string((mips_error)value));
+		return true;
+	case mips_btrace_Pc:
+		if(d->started)
+			advance(d);
+		if(!get_delta(d, d->pc, &pc) || !get_delta(d, pc + 4, &d->pcN))
+			return false;
+		d->pc = pc;
+		d->override = true;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/** Sets a filter that passes everything */
+void mips_btrace_filter_init(mips_btrace_filter* filter)
+{
+	memset(filter, 0, sizeof(mips_btrace_filter));
+	filter->level = 3;
+	filter->high = 0xFFFFFFFF;
+	filter->count = (uint64_t)-1;
+	filter->reg = -1;
+}
+
+/** Decodes a trace */
+mips_error mips_btrace_decode(const uint8_t* data,
+	size_t length,
+	const mips_btrace_filter* filter,
+	FILE* dest,
+	uint64_t* instructions,
+	uint32_t* regs)
+{
+	decoder d;
+	const mips_btrace_header* header = (const mips_btrace_header*)data;
+	mips_error error = mips_Success;
+	if(data == NULL || filter == NULL || dest == NULL)
+		return mips_ErrorInvalidArgument;
+	if(length < sizeof(mips_btrace_header)
+		|| memcmp(header->magic, MIPS_BTRACE_MAGIC, sizeof(header->magic)))
+		return mips_ErrorInvalidArgument;
+	memset(&d, 0, sizeof(d));
+	d.data = data;
+	d.length = length;
+	d.filter = filter;
+	d.dest = dest;
+	d.pc = header->pc;
+	d.pcN = header->pcN;
+	memcpy(d.regs, header->regs, sizeof(d.regs));
+	d.pos = sizeof(mips_btrace_header);
+	while(!error && d.pos < d.length)
+		if(!decode(&d))
+			error = mips_ErrorFileReadError;
+	if(instructions != NULL)
+		*instructions = d.index;
+	if(regs != NULL)
+		memcpy(regs, d.regs, sizeof(d.regs));
+	return error;
+}
@@ -0,0 +1,113 @@
+#ifndef mips_cpu_btrace_header
+#define mips_cpu_btrace_header
+
+#include "mips_cpu.h"
+
+/** Compact binary execution traces
+ *
+ *  A binary trace records what a CPU did, instruction by instruction,
+ *  into a memory-mapped file: where each instruction was, the branches
+ *  it took, the registers it wrote and the memory it touched. The
+ *  mips_trace_decode tool turns it back into the text mips_cpu_step
+ *  writes at debug level 3, less the operand details of each
+ *  instruction, which follow from the instruction and the registers.
+ *
+ *  The file is a mips_btrace_header followed by records. Each record
+ *  starts with a tag byte: a kind (mips_btrace_kind) in the top 3
+ *  bits, and in the bottom 5 the number of instructions started since
+ *  the record before (31 means a varint with the count less 31
+ *  follows). Instructions are only recorded this way, so a straight
+ *  run costs one byte per 31 instructions. Values are encoded as
+ *  unsigned LEB128 varints, and signed ones zigzag encoded first. The
+ *  reader keeps the PC the same way the CPU does, advancing by 4 or to
+ *  a branch target; a PC record is only written when it would be
+ *  wrong, such as after an exception handler or mips_cpu_set_pc.
+ *  Register values and memory addresses are written as the difference
+ *  from the last value of that register or the last address. */
+
+/** The first 8 bytes of a binary trace */
+#define MIPS_BTRACE_MAGIC "MIPSBTR1"
+
+/** What a trace should record. Instructions, their PCs and
+ *  exceptions are always recorded */
+#define MIPS_BTRACE_REGS 1
+#define MIPS_BTRACE_BRANCHES 2
+#define MIPS_BTRACE_MEMORY 4
+#define MIPS_BTRACE_ALL 7
+
+/** The start of a trace, in host byte order */
+typedef struct
+{
+	char magic[8];
+	/** The MIPS_BTRACE_* flags it was recorded with */
+	uint32_t flags;
+	/** The CPU when the trace started */
+	uint32_t pc, pcN;
+	uint32_t regs[32];
+} mips_btrace_header;
+
+/** Record kinds, and what follows the tag */
+typedef enum
+{
+	/** Nothing: just a count of instructions */
+	mips_btrace_Step,
+	/** A register byte, then the signed change in its value */
+	mips_btrace_Reg,
+	/** The signed distance of the target from the branch */
+	mips_btrace_Branch,
+	/** A byte of the register (bits 0-4) and log2 of the length
+	 *  (bits 5-6), then the signed change in the address */
+	mips_btrace_Load,
+	mips_btrace_Store,
+	/** The mips_error */
+	mips_btrace_Exception,
+	/** The signed changes in the PC, and in pcN less PC + 4, for the
+	 *  next instruction */
+	mips_btrace_Pc
+} mips_btrace_kind;
+
+/** Starts writing a binary trace of the CPU to a new file at 'path',
+ *  recording what 'flags' asks for. Replaces any trace already being
+ *  written, which is closed first */
+mips_error mips_btrace_open(mips_cpu_h state, const char* path, unsigned flags);
+
+/** Finishes the trace and closes the file */
+mips_error mips_btrace_close(mips_cpu_h state);
+
+/** What mips_btrace_decode writes */
+typedef struct
+{
+	/** The debug level to write at: 1 for exceptions, 2 adds
+	 *  instruction names and register writes, and 3 PCs, branches and
+	 *  memory accesses */
+	unsigned level;
+	/** Only instructions at PCs from low to high, inclusive */
+	uint32_t low, high;
+	/** Only 'count' instructions, from number 'first' (counting from 0) */
+	uint64_t first, count;
+	/** Only writes of this register, or of all of them if -1 */
+	int reg;
+	/** The program, loaded at address 0, to name instructions from;
+	 *  NULL to leave them out */
+	const uint8_t* image;
+	uint32_t image_length;
+} mips_btrace_filter;
+
+/** Sets a filter that passes everything, at debug level 3 */
+void mips_btrace_filter_init(mips_btrace_filter* filter);
+
+/** Writes a binary trace held in memory to 'dest', as the text
+ *  mips_cpu_step would have written, for what passes 'filter'. The
+ *  number of instructions read, and the registers after the last of
+ *  them, are written to 'instructions' and 'regs' if given, even if
+ *  the trace is cut short.
+ *  Returns mips_ErrorInvalidArgument if 'data' is not a binary trace,
+ *  and mips_ErrorFileReadError if it is cut short */
+mips_error mips_btrace_decode(const uint8_t* data,
+	size_t length,
+	const mips_btrace_filter* filter,
+	FILE* dest,
+	uint64_t* instructions,
+	uint32_t* regs);
+
+#endif // mips_cpu_btrace_header
@@ -0,0 +1,542 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Exact call graph profiling with a shadow call stack
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_callgraph.h"
+#include "mips_cpu_state.h"
+#include <limits.h>
+#include <string.h>
+
+/** The most frames on the shadow stack */
+#define CALLGRAPH_MAX_DEPTH 1024
+
+/** Marks an empty hash table slot */
+#define EMPTY_KEY UINT64_MAX
+
+/** Marks the root frame, which has no edge */
+#define NO_EDGE UINT_MAX
+
+/** A function, and how many of its frames are open */
+typedef struct
+{
+	uint32_t address;
+	unsigned active;
+	mips_callgraph_entry entry;
+} cg_function;
+
+/** Calls from one function to another */
+typedef struct
+{
+	unsigned caller, callee, active;
+	uint64_t calls, inclusive;
+} cg_edge;
+
+/** A call that has not yet returned */
+typedef struct
+{
+	unsigned function, edge;
+	uint32_t return_address;
+	/** Calls made from this frame that didn't push one of their own */
+	unsigned nested;
+	/** The clock when the call was made, and the instructions retired
+	 *  in the frames it has called */
+	uint64_t entry, children;
+} cg_frame;
+
+/** Call graph state */
+struct callgraph
+{
+	bool enabled;
+	/** Added to the retired count, so the clock goes on when the
+	 *  CPU's counters are reset */
+	uint64_t bias;
+	cg_frame stack[CALLGRAPH_MAX_DEPTH];
+	unsigned depth;
+	cg_function* functions;
+	unsigned num_functions, max_functions;
+	cg_edge* edges;
+	unsigned num_edges, max_edges;
+	/** Finds functions by address, and edges by caller and callee,
+	 *  as indices into the arrays above */
+	uint64_t* keys;
+	unsigned* values;
+	unsigned table_size, table_used;
+};
+
+/** The number of instructions the CPU has retired */
+static uint64_t now(mips_cpu_h state)
+{
+	return state->host.stats.retired + state->host.callgraph->bias;
+}
+
+/** Mixes the bits of a key */
+static unsigned hash_key(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xFF51AFD7ED558CCDull;
+	key ^= key >> 33;
+	return (unsigned)key;
+}
+
+/** Adds a key to the table, which must have room */
+static void table_put(callgraph* cg, uint64_t key, unsigned value)
+{
+	unsigned i = hash_key(key) & (cg->table_size - 1);
+	while(cg->keys[i] != EMPTY_KEY)
+		i = (i + 1) & (cg->table_size - 1);
+	cg->keys[i] = key;
+	cg->values[i] = value;
+	cg->table_used++;
+}
+
+/** Finds a key in the table, returning UINT_MAX if it isn't there */
+static unsigned table_get(const callgraph* cg, uint64_t key)
+{
+	unsigned i = hash_key(key) & (cg->table_size - 1);
+	if(cg->table_size == 0)
+		return UINT_MAX;
+	while(cg->keys[i] != EMPTY_KEY)
+	{
+		if(cg->keys[i] == key)
+			return cg->values[i];
+		i = (i + 1) & (cg->table_size - 1);
+	}
+	return UINT_MAX;
+}
+
+/** Makes sure there is room in the table for one more key */
+static bool table_reserve(callgraph* cg)
+{
+	uint64_t* keys = cg->keys;
+	unsigned* values = cg->values;
+	unsigned size = cg->table_size, i;
+	if((cg->table_used + 1) * 2 <= cg->table_size)
+		return true;
+	cg->table_size = size ? size * 2 : 256;
+	cg->keys = malloc(cg->table_size * sizeof(uint64_t));
+	cg->values = malloc(cg->table_size * sizeof(unsigned));
+	if(cg->keys == NULL || cg->values == NULL)
+	{
+		free(cg->keys);
+		free(cg->values);
+		cg->keys = keys;
+		cg->values = values;
+		cg->table_size = size;
+		return false;
+	}
+	memset(cg->keys, 0xFF, cg->table_size * sizeof(uint64_t));
+	cg->table_used = 0;
+	for(i = 0; i < size; i++)
+		if(keys[i] != EMPTY_KEY)
+			table_put(cg, keys[i], values[i]);
+	free(keys);
+	free(values);
+	return true;
+}
+
+/** Grows an array to hold one more element */
+static bool array_reserve(void** array, unsigned count, unsigned* max, size_t size)
+{
+	void* ret;
+	if(count < *max)
+		return true;
+	ret = realloc(*array, (*max ? *max * 2 : 64) * size);
+	if(ret == NULL)
+		return false;
+	*array = ret;
+	*max = *max ? *max * 2 : 64;
+	return true;
+}
+
+/** Returns the index of the function at 'address', adding it if need
+ *  be, or UINT_MAX if there's no memory */
+static unsigned get_function(callgraph* cg, uint32_t address)
+{
+	unsigned ret = table_get(cg, address);
+	if(ret != UINT_MAX)
+		return ret;
+	if(!table_reserve(cg) || !array_reserve((void**)&cg->functions,
+		cg->num_functions, &cg->max_functions, sizeof(cg_function)))
+		return UINT_MAX;
+	ret = cg->num_functions++;
+	memset(&cg->functions[ret], 0, sizeof(cg_function));
+	cg->functions[ret].address = address;
+	table_put(cg, address, ret);
+	return ret;
+}
+
+/** Returns the index of the edge between two functions, adding it if
+ *  need be, or UINT_MAX if there's no memory */
+static unsigned get_edge(callgraph* cg, unsigned caller, unsigned callee)
+{
+	/** Function keys are addresses, so never have the top half set */
+	uint64_t key = ((uint64_t)(caller + 1) << 32) | callee;
+	unsigned ret = table_get(cg, key);
+	if(ret != UINT_MAX)
+		return ret;
+	if(!table_reserve(cg) || !array_reserve((void**)&cg->edges,
+		cg->num_edges, &cg->max_edges, sizeof(cg_edge)))
+		return UINT_MAX;
+	ret = cg->num_edges++;
+	memset(&cg->edges[ret], 0, sizeof(cg_edge));
+	cg->edges[ret].caller = caller;
+	cg->edges[ret].callee = callee;
+	table_put(cg, key, ret);
+	return ret;
+}
+
+/** Pushes a frame, which there must be room for */
+static void push(callgraph* cg, unsigned function, unsigned edge, uint32_t return_address, uint64_t clock)
+{
+	cg_frame* frame = &cg->stack[cg->depth++];
+	frame->function = function;
+	frame->edge = edge;
+	frame->return_address = return_address;
+	frame->nested = 0;
+	frame->entry = clock;
+	frame->children = 0;
+	cg->functions[function].entry.calls++;
+	cg->functions[function].active++;
+	if(edge != NO_EDGE)
+	{
+		cg->edges[edge].calls++;
+		cg->edges[edge].active++;
+	}
+}
+
+/** Pops the top frame, adding up its counts */
+static void pop(callgraph* cg, uint64_t clock)
+{
+	cg_frame* frame = &cg->stack[--cg->depth];
+	cg_function* f = &cg->functions[frame->function];
+	uint64_t inclusive = clock - frame->entry;
+	f->entry.self += inclusive - frame->children;
+	/** Only the outermost frame of a function counts inclusively */
+	if(--f->active == 0)
+		f->entry.inclusive += inclusive;
+	if(frame->edge != NO_EDGE && --cg->edges[frame->edge].active == 0)
+		cg->edges[frame->edge].inclusive += inclusive;
+	if(cg->depth > 0)
+		cg->stack[cg->depth - 1].children += inclusive;
+}
+
+/** Makes the function at the PC the root, closing any open frames */
+static void restart(mips_cpu_h state)
+{
+	callgraph* cg = state->host.callgraph;
+	uint64_t clock = now(state);
+	unsigned root;
+	while(cg->depth > 0)
+		pop(cg, clock);
+	root = get_function(cg, state->pc);
+	if(root != UINT_MAX)
+		push(cg, root, NO_EDGE, 0, clock);
+}
+
+/** Records a call */
+void callgraph_call(mips_cpu_h state, uint32_t target, uint32_t return_address)
+{
+	callgraph* cg = state->host.callgraph;
+	cg_frame* top;
+	unsigned callee, edge;
+	if(!cg->enabled || cg->depth == 0)
+		return;
+	top = &cg->stack[cg->depth - 1];
+	if(cg->functions[top->function].address == target)
+	{
+		cg->functions[top->function].entry.recursive++;
+		top->nested++;
+		return;
+	}
+	callee = get_function(cg, target);
+	edge = callee == UINT_MAX ? UINT_MAX : get_edge(cg, top->function, callee);
+	if(edge == UINT_MAX || cg->depth == CALLGRAPH_MAX_DEPTH)
+	{
+		if(callee != UINT_MAX)
+			cg->functions[callee].entry.calls++;
+		top->nested++;
+		return;
+	}
+	push(cg, callee, edge, return_address, now(state));
+}
+
+/** Records a 'jr $ra' */
+void callgraph_return(mips_cpu_h state, uint32_t target)
+{
+	callgraph* cg = state->host.callgraph;
+	uint64_t clock;
+	unsigned i;
+	if(!cg->enabled || cg->depth == 0)
+		return;
+	if(cg->stack[cg->depth - 1].nested > 0)
+	{
+		cg->stack[cg->depth - 1].nested--;
+		return;
+	}
+	/** Returns that match no frame (the root's, or a jump through
+	 *  $ra that wasn't a return) are ignored */
+	for(i = cg->depth - 1; i > 0; i--)
+		if(cg->stack[i].return_address == target)
+			break;
+	if(i == 0)
+		return;
+	clock = now(state);
+	while(cg->depth > i)
+		pop(cg, clock);
+}
+
+/** Notes the PC being moved, other than by a jump */
+void callgraph_restart(mips_cpu_h state)
+{
+	if(state->host.callgraph->enabled)
+		restart(state);
+}
+
+/** Notes the retired count being set back to zero */
+void callgraph_rebase(mips_cpu_h state)
+{
+	state->host.callgraph->bias += state->host.stats.retired;
+}
+
+/** Frees call graph state */
+void callgraph_free(callgraph* cg)
+{
+	if(cg == NULL)
+		return;
+	free(cg->functions);
+	free(cg->edges);
+	free(cg->keys);
+	free(cg->values);
+	free(cg);
+}
+
+/** Starts or stops recording */
+mips_error mips_cpu_set_callgraph(mips_cpu_h state, bool enable)
+{
+	callgraph* cg;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	cg = state->host.callgraph;
+	if(cg == NULL && enable)
+	{
+		cg = calloc(1, sizeof(callgraph));
+		if(cg == NULL)
+			return mips_ErrorOutOfMemory;
+		state->host.callgraph = cg;
+	}
+	if(cg == NULL)
+		return mips_Success;
+	if(enable)
+		restart(state);
+	else
+	{
+		while(cg->depth > 0)
+			pop(cg, now(state));
+	}
+	cg->enabled = enable;
+	return mips_Success;
+}
+
+/** Clears what has been recorded */
+mips_error mips_cpu_reset_callgraph(mips_cpu_h state)
+{
+	callgraph* cg;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	cg = state->host.callgraph;
+	if(cg == NULL)
+		return mips_Success;
+	cg->depth = 0;
+	cg->num_functions = 0;
+	cg->num_edges = 0;
+	if(cg->keys != NULL)
+		memset(cg->keys, 0xFF, cg->table_size * sizeof(uint64_t));
+	cg->table_used = 0;
+	if(cg->enabled)
+		restart(state);
+	return mips_Success;
+}
+
+/** Copies the counts, closing the copy's open frames so they are
+ *  included. The copy has no hash table */
+static callgraph* settle(mips_cpu_h state)
+{
+	const callgraph* cg = state->host.callgraph;
+	callgraph* ret = malloc(sizeof(callgraph));
+	if(ret == NULL)
+		return NULL;
+	*ret = *cg;
+	ret->keys = NULL;
+	ret->values = NULL;
+	ret->functions = malloc((cg->num_functions + 1) * sizeof(cg_function));
+	ret->edges = malloc((cg->num_edges + 1) * sizeof(cg_edge));
+	if(ret->functions == NULL || ret->edges == NULL)
+	{
+		callgraph_free(ret);
+		return NULL;
+	}
+	memcpy(ret->functions, cg->functions, cg->num_functions * sizeof(cg_function));
+	memcpy(ret->edges, cg->edges, cg->num_edges * sizeof(cg_edge));
+	while(ret->depth > 0)
+		pop(ret, now(state));
+	return ret;
+}
+
+/** Gets one function's counts */
+mips_error mips_cpu_get_callgraph(mips_cpu_h state,
+	uint32_t address,
+	mips_callgraph_entry* entry)
+{
+	callgraph* cg;
+	unsigned i;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(entry == NULL)
+		return mips_ErrorInvalidArgument;
+	memset(entry, 0, sizeof(mips_callgraph_entry));
+	if(state->host.callgraph == NULL)
+		return mips_Success;
+	cg = settle(state);
+	if(cg == NULL)
+		return mips_ErrorOutOfMemory;
+	for(i = 0; i < cg->num_functions; i++)
+		if(cg->functions[i].address == address)
+			*entry = cg->functions[i].entry;
+	callgraph_free(cg);
+	return mips_Success;
+}
+
+/** Orders functions by inclusive count, largest first */
+static int compare_functions(const void* a, const void* b)
+{
+	uint64_t x = ((const cg_function*)a)->entry.inclusive;
+	uint64_t y = ((const cg_function*)b)->entry.inclusive;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/** Writes a function's name and report index */
+static void print_name(const callgraph* cg, const unsigned* order, unsigned function,
+	mips_profiler_h symbols, FILE* dest)
+{
+	const char* name = mips_profiler_symbol(symbols, cg->functions[function].address);
+	if(name != NULL)
+		fprintf(dest, "%s [%u]\n", name, order[function] + 1);
+	else
+		fprintf(dest, "0x%08x [%u]\n", cg->functions[function].address, order[function] + 1);
+}
+
+/** Formats a call count as gprof does: calls, then '+' and
+ *  recursive calls if there were any */
+static void format_calls(char* buf, const mips_callgraph_entry* entry)
+{
+	if(entry->recursive)
+		sprintf(buf, "%llu+%llu", (unsigned long long)entry->calls,
+			(unsigned long long)entry->recursive);
+	else
+		sprintf(buf, "%llu", (unsigned long long)entry->calls);
+}
+
+/** Writes the report */
+mips_error mips_cpu_print_callgraph(mips_cpu_h state,
+	mips_profiler_h symbols,
+	FILE* dest)
+{
+	callgraph* cg;
+	cg_function* sorted;
+	const cg_function* f;
+	const cg_edge* e;
+	unsigned* order;
+	unsigned i, j, index;
+	uint64_t total = 0;
+	char calls[48];
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(dest == NULL)
+		return mips_ErrorInvalidArgument;
+	if(state->host.callgraph == NULL)
+		return mips_Success;
+	cg = settle(state);
+	if(cg == NULL)
+		return mips_ErrorOutOfMemory;
+	sorted = malloc((cg->num_functions + 1) * sizeof(cg_function));
+	order = malloc((cg->num_functions + 1) * sizeof(unsigned));
+	if(sorted == NULL || order == NULL)
+	{
+		free(sorted);
+		free(order);
+		callgraph_free(cg);
+		return mips_ErrorOutOfMemory;
+	}
+	/** Sort a copy, then find where each function ended up; the
+	 *  'active' field, unused once settled, holds the original index */
+	for(i = 0; i < cg->num_functions; i++)
+	{
+		total += cg->functions[i].entry.self;
+		sorted[i] = cg->functions[i];
+		sorted[i].active = i;
+	}
+	qsort(sorted, cg->num_functions, sizeof(cg_function), &compare_functions);
+	for(i = 0; i < cg->num_functions; i++)
+		order[sorted[i].active] = i;
+	if(total == 0)
+		total = 1;
+
+	fprintf(dest, "Flat profile (instructions retired):\n\n");
+	fprintf(dest, "%7s %14s %14s %20s  %s\n", "%self", "self", "inclusive", "calls", "name");
+	for(i = 0; i < cg->num_functions; i++)
+	{
+		f = &sorted[i];
+		format_calls(calls, &f->entry);
+		fprintf(dest, "%6.2f%% %14llu %14llu %20s  ", 100.0 * f->entry.self / total,
+			(unsigned long long)f->entry.self, (unsigned long long)f->entry.inclusive, calls);
+		print_name(cg, order, f->active, symbols, dest);
+	}
+
+	fprintf(dest, "\nCall graph:\n\n");
+	fprintf(dest, "%-7s %7s %14s %14s %20s  %s\n", "index", "%incl", "self", "inclusive", "called", "name");
+	for(i = 0; i < cg->num_functions; i++)
+	{
+		f = &sorted[i];
+		index = f->active;
+		/** Callers, with the calls they made out of the total */
+		for(j = 0; j < cg->num_edges; j++)
+		{
+			e = &cg->edges[j];
+			if(e->callee != index || e->caller == index)
+				continue;
+			sprintf(calls, "%llu/%llu", (unsigned long long)e->calls,
+				(unsigned long long)f->entry.calls);
+			fprintf(dest, "%-7s %7s %14s %14llu %20s      ", "", "", "",
+				(unsigned long long)e->inclusive, calls);
+			print_name(cg, order, e->caller, symbols, dest);
+		}
+		sprintf(calls, "[%u]", i + 1);
+		fprintf(dest, "%-7s %6.1f%% %14llu %14llu ", calls, 100.0 * f->entry.inclusive / total,
+			(unsigned long long)f->entry.self, (unsigned long long)f->entry.inclusive);
+		format_calls(calls, &f->entry);
+		fprintf(dest, "%20s  ", calls);
+		print_name(cg, order, index, symbols, dest);
+		/** Callees, with the calls made here out of their total */
+		for(j = 0; j < cg->num_edges; j++)
+		{
+			e = &cg->edges[j];
+			if(e->caller != index || e->callee == index)
+				continue;
+			sprintf(calls, "%llu/%llu", (unsigned long long)e->calls,
+				(unsigned long long)cg->functions[e->callee].entry.calls);
+			fprintf(dest, "%-7s %7s %14s %14llu %20s      ", "", "", "",
+				(unsigned long long)e->inclusive, calls);
+			print_name(cg, order, e->callee, symbols, dest);
+		}
+		fprintf(dest, "-----------------------------------------------\n");
+	}
+	free(sorted);
+	free(order);
+	callgraph_free(cg);
+	return ferror(dest) ? mips_ErrorFileWriteError : mips_Success;
+}
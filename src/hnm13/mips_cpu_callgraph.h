@@ -0,0 +1,58 @@
+#ifndef mips_cpu_callgraph_header
+#define mips_cpu_callgraph_header
+
+#include "mips_cpu.h"
+#include "mips_cpu_profile.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+/** An exact call graph of guest code
+ *
+ *  While it is on, every call the CPU makes (JAL, JALR, BLTZAL and
+ *  BGEZAL, when taken) pushes a frame on a shadow stack, and a
+ *  'jr $ra' to the return address of a frame pops it, and everything
+ *  above it. Instructions retired in between are counted to the
+ *  function (named by its entry address) and to the call edge it was
+ *  entered by: 'self' counts only those retired in the function
+ *  itself, 'inclusive' those in everything it called as well.
+ *
+ *  A function calling itself doesn't push a frame; it is counted on
+ *  the frame it is already in, so recursion of any depth takes no
+ *  memory. Indirect recursion does push frames, up to a fixed depth,
+ *  but a function's inclusive count is only added once its last
+ *  frame is popped, so no instruction is counted twice. Beyond that
+ *  depth, calls are counted but their instructions are added to the
+ *  deepest frame.
+ *
+ *  The function the CPU is in when the graph is turned on is the root,
+ *  and so is the one it is in after mips_cpu_set_pc or mips_cpu_reset. */
+
+/** What is known about one function */
+typedef struct
+{
+	/** Calls from other functions, and from itself */
+	uint64_t calls, recursive;
+	/** Instructions retired in the function, and in it and its callees */
+	uint64_t self, inclusive;
+} mips_callgraph_entry;
+
+/** Starts recording calls, from the current PC, or stops. Stopping
+ *  keeps what has been recorded */
+mips_error mips_cpu_set_callgraph(mips_cpu_h state, bool enable);
+
+/** Clears what has been recorded */
+mips_error mips_cpu_reset_callgraph(mips_cpu_h state);
+
+/** Gets the counts for the function at 'address', including any of
+ *  its frames that are still open */
+mips_error mips_cpu_get_callgraph(mips_cpu_h state,
+	uint32_t address,
+	mips_callgraph_entry* entry);
+
+/** Writes a flat profile and a call graph in the style of gprof,
+ *  naming functions from a profiler's symbols if 'symbols' is set */
+mips_error mips_cpu_print_callgraph(mips_cpu_h state,
+	mips_profiler_h symbols,
+	FILE* dest);
+
+#endif // mips_cpu_callgraph_header
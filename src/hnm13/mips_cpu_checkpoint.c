@@ -0,0 +1,470 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Checkpointed recording, and parallel replay of the intervals
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_checkpoint.h"
+#include "mips_cpu_state.h"
+#include "mips_cpu_extend.h"
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+/** What a CPU needs to carry on from a checkpoint: the guest-visible
+ *  state, and the exception handlers and coprocessors it was set up
+ *  with, but not the host's translation cache, buffers or attachments */
+typedef struct
+{
+	uint32_t exception[16];
+	uint32_t pc, pcN;
+	long_reg hi_lo;
+	coprocessor coprocessor[4];
+	uint32_t reg[NUM_REGS];
+	uint32_t undefined;
+	unsigned undefined_hi_lo;
+	unsigned cpu_id;
+	bool ll_bit;
+	uint32_t ll_addr, ll_value;
+	/** The COP0 registers and the guest TLB */
+	uint32_t cop0[16];
+	tlb_entry tlb[TLB_SIZE];
+} cpu_context;
+
+/** The CPU at one point in the run, and the memory changed since the last */
+typedef struct
+{
+	cpu_context context;
+	/** Instructions retired before this point */
+	uint64_t retired;
+	/** The pages written since the previous checkpoint, and their contents */
+	uint32_t page_count;
+	uint32_t* pages;
+	uint8_t* data;
+} checkpoint;
+
+/** A watchpoint on the recorded CPU's RAM */
+typedef struct
+{
+	uint32_t address, length;
+	unsigned kind;
+} watchpoint;
+
+/** A recording: point i starts interval i, and the last point is the end */
+struct mips_recording_impl
+{
+	/** The size and block size of the recorded CPU's RAM */
+	uint32_t mem_size, block_size;
+	/** Memory as it was when the recording started */
+	uint8_t* initial;
+	/** The permissions of each page, and the watchpoints, which only the
+	 *  host can change, so are the same for the whole run */
+	uint8_t* perms;
+	watchpoint* watches;
+	unsigned watch_count;
+	checkpoint* points;
+	unsigned count;
+	/** The error the recorded run stopped with */
+	mips_error error;
+};
+
+/** State shared by the replay threads */
+typedef struct
+{
+	mips_recording_h rec;
+	mips_replay_step step;
+	/** stats_size bytes for each interval */
+	uint8_t* stats;
+	size_t stats_size;
+	/** The result of each interval */
+	mips_error* errors;
+	/** The next interval to replay */
+	unsigned next;
+	pthread_mutex_t lock;
+} replay;
+
+/** The number of pages in mem_size bytes */
+static uint32_t page_count(uint32_t mem_size)
+{
+	return (mem_size + MIPS_MEM_PAGE_SIZE - 1) / MIPS_MEM_PAGE_SIZE;
+}
+
+/** The number of bytes of RAM in the given page */
+static uint32_t page_length(uint32_t mem_size, uint32_t page)
+{
+	uint32_t left = mem_size - page * MIPS_MEM_PAGE_SIZE;
+	return left < MIPS_MEM_PAGE_SIZE ? left : MIPS_MEM_PAGE_SIZE;
+}
+
+/** Saves the permissions and watchpoints of the recorded RAM */
+static mips_error save_protection(mips_recording_h rec, mips_mem_h mem)
+{
+	watchpoint* watches;
+	watchpoint w;
+	mips_error error;
+	rec->perms = malloc(page_count(rec->mem_size));
+	if(rec->perms == NULL)
+		return mips_ErrorOutOfMemory;
+	error = mips_mem_get_permissions(mem, rec->perms, page_count(rec->mem_size));
+	while(!error && !mips_mem_get_watchpoint(mem, rec->watch_count,
+		&w.address, &w.length, &w.kind))
+	{
+		watches = realloc(rec->watches, (rec->watch_count + 1) * sizeof(watchpoint));
+		if(watches == NULL)
+			return mips_ErrorOutOfMemory;
+		rec->watches = watches;
+		rec->watches[rec->watch_count++] = w;
+	}
+	return error;
+}
+
+/** Gives a replay's RAM the recorded RAM's permissions and watchpoints */
+static mips_error load_protection(mips_recording_h rec, mips_mem_h mem)
+{
+	uint32_t i;
+	mips_error error = mips_Success;
+	for(i = 0; !error && i < page_count(rec->mem_size); i++)
+		if(rec->perms[i] != mips_mem_PermAll)
+			error = mips_mem_set_permissions(mem, i * MIPS_MEM_PAGE_SIZE,
+				page_length(rec->mem_size, i), rec->perms[i]);
+	for(i = 0; !error && i < rec->watch_count; i++)
+		error = mips_mem_add_watchpoint(mem, rec->watches[i].address,
+			rec->watches[i].length, rec->watches[i].kind);
+	return error;
+}
+
+/** Saves a CPU's context */
+static void save_context(cpu_context* c, const struct mips_cpu_impl* state)
+{
+	memcpy(c->exception, state->exception, sizeof(c->exception));
+	c->pc = state->pc;
+	c->pcN = state->pcN;
+	c->hi_lo = state->hi_lo;
+	memcpy(c->coprocessor, state->coprocessor, sizeof(c->coprocessor));
+	memcpy(c->reg, state->reg, sizeof(c->reg));
+	c->undefined = state->undefined;
+	c->undefined_hi_lo = state->undefined_hi_lo;
+	c->cpu_id = state->cpu_id;
+	c->ll_bit = state->ll_bit;
+	c->ll_addr = state->ll_addr;
+	c->ll_value = state->ll_value;
+	memcpy(c->cop0, state->mmu.reg, sizeof(c->cop0));
+	memcpy(c->tlb, state->mmu.tlb, sizeof(c->tlb));
+}
+
+/** Puts a CPU into a saved context, emptying its translation cache
+ *  since the TLB it was filled from has been replaced */
+static void load_context(mips_cpu_h state, const cpu_context* c)
+{
+	memcpy(state->exception, c->exception, sizeof(c->exception));
+	state->pc = c->pc;
+	state->pcN = c->pcN;
+	state->hi_lo = c->hi_lo;
+	memcpy(state->coprocessor, c->coprocessor, sizeof(c->coprocessor));
+	memcpy(state->reg, c->reg, sizeof(c->reg));
+	state->undefined = c->undefined;
+	state->undefined_hi_lo = c->undefined_hi_lo;
+	state->cpu_id = c->cpu_id;
+	state->ll_bit = c->ll_bit;
+	state->ll_addr = c->ll_addr;
+	state->ll_value = c->ll_value;
+	memcpy(state->mmu.reg, c->cop0, sizeof(c->cop0));
+	memcpy(state->mmu.tlb, c->tlb, sizeof(c->tlb));
+	memset(state->mmu.cache, 0, sizeof(state->mmu.cache));
+}
+
+/** Appends a checkpoint of the CPU, with the pages marked in 'dirty' */
+static mips_error add_point(mips_recording_h rec, mips_cpu_h state,
+	uint64_t retired, const uint8_t* dirty)
+{
+	checkpoint *points, *cp;
+	uint32_t i, pages = page_count(rec->mem_size);
+	mips_error error = mips_Success;
+	points = realloc(rec->points, (rec->count + 1) * sizeof(checkpoint));
+	if(points == NULL)
+		return mips_ErrorOutOfMemory;
+	rec->points = points;
+	cp = &points[rec->count];
+	memset(cp, 0, sizeof(checkpoint));
+	save_context(&cp->context, state);
+	cp->retired = retired;
+	for(i = 0; dirty != NULL && i < pages; i++)
+		cp->page_count += dirty[i];
+	if(cp->page_count)
+	{
+		cp->pages = malloc(cp->page_count * sizeof(uint32_t));
+		cp->data = malloc(cp->page_count * MIPS_MEM_PAGE_SIZE);
+		if(cp->pages == NULL || cp->data == NULL)
+		{
+			free(cp->pages);
+			free(cp->data);
+			return mips_ErrorOutOfMemory;
+		}
+		cp->page_count = 0;
+		for(i = 0; !error && i < pages; i++)
+		{
+			if(!dirty[i])
+				continue;
+			cp->pages[cp->page_count] = i;
+			error = mips_mem_peek(state->mem, i * MIPS_MEM_PAGE_SIZE,
+				page_length(rec->mem_size, i),
+				cp->data + cp->page_count * MIPS_MEM_PAGE_SIZE);
+			cp->page_count++;
+		}
+	}
+	rec->count++;
+	return error;
+}
+
+/** Records a run with checkpoints */
+mips_recording_h mips_record(mips_cpu_h state,
+	uint32_t mem_size,
+	uint32_t block_size,
+	uint32_t stop_pc,
+	uint64_t budget,
+	uint64_t interval,
+	mips_error* error)
+{
+	mips_recording_h rec;
+	uint8_t* dirty;
+	uint32_t pages = page_count(mem_size), pc;
+	uint64_t total = 0, length, count;
+	mips_error result = mips_Success;
+	if(state == NULL || state->mem == NULL || mem_size == 0 || block_size == 0 || interval == 0)
+		return NULL;
+	rec = calloc(1, sizeof(struct mips_recording_impl));
+	dirty = malloc(pages);
+	if(rec == NULL || dirty == NULL)
+	{
+		free(rec);
+		free(dirty);
+		return NULL;
+	}
+	rec->mem_size = mem_size;
+	rec->block_size = block_size;
+	rec->initial = malloc(mem_size);
+	if(rec->initial == NULL
+		|| mips_mem_peek(state->mem, 0, mem_size, rec->initial)
+		|| save_protection(rec, state->mem)
+		|| mips_mem_take_dirty_pages(state->mem, dirty, pages)
+		|| add_point(rec, state, 0, NULL))
+	{
+		free(dirty);
+		mips_recording_free(rec);
+		return NULL;
+	}
+
+	for(;;)
+	{
+		length = budget - total;
+		if(length > interval)
+			length = interval;
+		count = 0;
+		result = mips_cpu_run(state, stop_pc, length, &count);
+		total += count;
+		mips_cpu_get_pc(state, &pc);
+		if(result || pc == stop_pc || total >= budget)
+			break;
+		if(mips_mem_take_dirty_pages(state->mem, dirty, pages)
+			|| add_point(rec, state, total, dirty))
+		{
+			free(dirty);
+			mips_recording_free(rec);
+			return NULL;
+		}
+	}
+	free(dirty);
+	/** The end point needs no pages: nothing replays from it */
+	if(add_point(rec, state, total, NULL))
+	{
+		mips_recording_free(rec);
+		return NULL;
+	}
+	rec->error = result;
+	if(error != NULL)
+		*error = result;
+	return rec;
+}
+
+/** Returns the number of intervals in the recording */
+unsigned mips_recording_intervals(mips_recording_h rec)
+{
+	return rec != NULL ? rec->count - 1 : 0;
+}
+
+/** Returns the number of instructions the recorded run retired */
+uint64_t mips_recording_retired(mips_recording_h rec)
+{
+	return rec != NULL ? rec->points[rec->count - 1].retired : 0;
+}
+
+/** True if a CPU is at the point of the run a context was saved at */
+static bool same_state(const struct mips_cpu_impl* a, const cpu_context* b)
+{
+	return a->pc == b->pc && a->pcN == b->pcN
+		&& a->hi_lo.full == b->hi_lo.full
+		&& memcmp(a->reg + 1, b->reg + 1, sizeof(a->reg) - sizeof(a->reg[0])) == 0;
+}
+
+/** Replays one interval on the thread's own CPU and RAM
+ *  'at' is the checkpoint the RAM is known to match, or -1 */
+static mips_error replay_interval(replay* r, unsigned index,
+	mips_cpu_h state, int* at, void* stats)
+{
+	mips_recording_h rec = r->rec;
+	const checkpoint* cp;
+	uint64_t n, length;
+	mips_error error = mips_Success;
+	unsigned i, j;
+	bool last = index + 2 == rec->count;
+	if(*at < 0 || *at > (int)index)
+	{
+		error = mips_mem_poke(state->mem, 0, rec->mem_size, rec->initial);
+		*at = 0;
+	}
+	for(i = *at + 1; !error && i <= index; i++)
+	{
+		cp = &rec->points[i];
+		for(j = 0; !error && j < cp->page_count; j++)
+			error = mips_mem_poke(state->mem, cp->pages[j] * MIPS_MEM_PAGE_SIZE,
+				page_length(rec->mem_size, cp->pages[j]),
+				cp->data + j * MIPS_MEM_PAGE_SIZE);
+	}
+	*at = -1;
+	if(error)
+		return error;
+
+	load_context(state, &rec->points[index].context);
+	length = rec->points[index + 1].retired - rec->points[index].retired;
+	for(n = 0; !error && n < length; n++)
+	{
+		if(r->step != NULL)
+			r->step(stats, state);
+		error = mips_cpu_step(state);
+	}
+	/** The recorded run's last instruction failed, so this one should too */
+	if(!error && last && rec->error)
+	{
+		if(r->step != NULL)
+			r->step(stats, state);
+		error = mips_cpu_step(state);
+	}
+	if(error != (last ? rec->error : mips_Success)
+		|| !same_state(state, &rec->points[index + 1].context))
+		return mips_ErrorReplayDiverged;
+	/** Memory now matches the next checkpoint */
+	*at = index + 1;
+	return mips_Success;
+}
+
+/** Thread entry point: replays intervals until there are none left,
+ *  on RAM that takes and refuses the same transactions as the
+ *  recorded CPU's */
+static void* replay_worker(void* arg)
+{
+	replay* r = arg;
+	mips_mem_h mem = mips_mem_create_ram(r->rec->mem_size, r->rec->block_size);
+	mips_cpu_h state = mips_cpu_create(mem);
+	mips_error error = mips_ErrorOutOfMemory;
+	unsigned index;
+	int at = -1;
+	if(mem != NULL && state != NULL)
+		error = load_protection(r->rec, mem);
+	for(;;)
+	{
+		pthread_mutex_lock(&r->lock);
+		index = r->next++;
+		pthread_mutex_unlock(&r->lock);
+		if(index >= r->rec->count - 1)
+			break;
+		if(error)
+			r->errors[index] = error;
+		else
+			r->errors[index] = replay_interval(r, index, state, &at,
+				r->stats + index * r->stats_size);
+	}
+	mips_cpu_free(state);
+	mips_mem_free(mem);
+	return NULL;
+}
+
+/** Replays every interval in parallel, and merges the statistics */
+mips_error mips_replay(mips_recording_h rec,
+	unsigned threads,
+	mips_replay_step step,
+	mips_replay_merge merge,
+	void* total,
+	size_t stats_size)
+{
+	replay r;
+	pthread_t* handles;
+	unsigned i, started, intervals;
+	mips_error error = mips_Success;
+	long cores;
+	if(rec == NULL)
+		return mips_ErrorInvalidHandle;
+	intervals = rec->count - 1;
+	if(threads == 0)
+	{
+		cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? (unsigned)cores : 1;
+	}
+	if(threads > intervals)
+		threads = intervals ? intervals : 1;
+	r.rec = rec;
+	r.step = step;
+	r.stats_size = stats_size;
+	r.next = 0;
+	r.stats = calloc(intervals ? intervals : 1, stats_size ? stats_size : 1);
+	r.errors = calloc(intervals ? intervals : 1, sizeof(mips_error));
+	handles = malloc(threads * sizeof(pthread_t));
+	if(r.stats == NULL || r.errors == NULL || handles == NULL)
+	{
+		free(r.stats);
+		free(r.errors);
+		free(handles);
+		return mips_ErrorOutOfMemory;
+	}
+	pthread_mutex_init(&r.lock, NULL);
+	for(started = 0; started < threads; started++)
+		if(pthread_create(&handles[started], NULL, &replay_worker, &r))
+			break;
+	if(started == 0)
+		replay_worker(&r);
+	for(i = 0; i < started; i++)
+		pthread_join(handles[i], NULL);
+	pthread_mutex_destroy(&r.lock);
+
+	for(i = 0; i < intervals; i++)
+	{
+		if(!error)
+			error = r.errors[i];
+		if(merge != NULL)
+			merge(total, r.stats + i * stats_size);
+	}
+	free(r.stats);
+	free(r.errors);
+	free(handles);
+	return error;
+}
+
+/** Frees a recording */
+void mips_recording_free(mips_recording_h rec)
+{
+	unsigned i;
+	if(rec == NULL)
+		return;
+	for(i = 0; i < rec->count; i++)
+	{
+		free(rec->points[i].pages);
+		free(rec->points[i].data);
+	}
+	free(rec->points);
+	free(rec->initial);
+	free(rec->perms);
+	free(rec->watches);
+	free(rec);
+}
@@ -0,0 +1,67 @@
+#ifndef mips_cpu_checkpoint_header
+#define mips_cpu_checkpoint_header
+
+#include "mips_cpu.h"
+
+/** A fast run of a program, cut into intervals by checkpoints
+ *
+ *  Each checkpoint holds the guest-visible CPU state, and the RAM
+ *  pages written since the one before, so any interval can be set up
+ *  again from the starting memory and a handful of page copies. The
+ *  intervals can then be replayed independently, on as many threads
+ *  as there are, under whatever slow analysis is wanted. */
+struct mips_recording_impl;
+
+/** An opaque handle to a recording */
+typedef struct mips_recording_impl *mips_recording_h;
+
+/** Called before each instruction of a replay
+ *  stats : The interval's statistics, initially zeroed
+ *  state : The replaying CPU, at the instruction about to run */
+typedef void (*mips_replay_step)(void* stats, mips_cpu_h state);
+
+/** Adds the statistics of one interval into the running total
+ *  It is called for each interval in program order, on one thread */
+typedef void (*mips_replay_merge)(void* total, const void* stats);
+
+/** Runs the CPU from where it is, like mips_cpu_run, taking a
+ *  checkpoint every 'interval' instructions
+ *  mem_size : The size of the CPU's RAM, all of which is recorded
+ *  block_size : The RAM's block size, which replays use too, so they
+ *  fail on the same accesses
+ *  The RAM's page permissions and watchpoints are recorded and given
+ *  to the replays' RAM as well; the recorder itself reads memory
+ *  around them, so it neither faults nor hits a watchpoint
+ *  error : Receives the error the run stopped with, if given
+ *  Returns NULL if the recording could not be made */
+mips_recording_h mips_record(mips_cpu_h state,
+	uint32_t mem_size,
+	uint32_t block_size,
+	uint32_t stop_pc,
+	uint64_t budget,
+	uint64_t interval,
+	mips_error* error);
+
+/** Returns the number of intervals in the recording */
+unsigned mips_recording_intervals(mips_recording_h rec);
+
+/** Returns the number of instructions the recorded run retired */
+uint64_t mips_recording_retired(mips_recording_h rec);
+
+/** Replays every interval over 'threads' threads, calling 'step'
+ *  before each instruction, then merges the per-interval statistics
+ *  (each of stats_size bytes) into 'total' in program order.
+ *  Returns mips_ErrorReplayDiverged (mips_util.h) if any interval did
+ *  not end in the state the recording did. Passing threads == 0 uses
+ *  one thread per online host core */
+mips_error mips_replay(mips_recording_h rec,
+	unsigned threads,
+	mips_replay_step step,
+	mips_replay_merge merge,
+	void* total,
+	size_t stats_size);
+
+/** Frees a recording */
+void mips_recording_free(mips_recording_h rec);
+
+#endif // mips_cpu_checkpoint_header
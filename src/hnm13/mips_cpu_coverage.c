@@ -0,0 +1,337 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Guest instruction and branch edge coverage
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_coverage.h"
+#include "mips_cpu_state.h"
+#include "mips_cpu_elf.h"
+#include <string.h>
+
+/** The first 8 bytes of a saved map */
+#define COVERAGE_MAGIC "MIPSCOV1"
+
+/** The size of a saved map's header: the magic, start and end */
+#define COVERAGE_HEADER 16
+
+/** A coverage map */
+struct mips_coverage_impl
+{
+	uint32_t start, end;
+	/** The number of instruction words covered */
+	uint32_t words;
+	/** A bit for each word, then two (taken, not taken) for each */
+	uint8_t* pcs;
+	uint8_t* edges;
+};
+
+/** The number of bytes of bitmap for 'bits' bits */
+static size_t map_bytes(size_t bits)
+{
+	return (bits + 7) / 8;
+}
+
+/** Sets 'count' bits from bit 'first', skipping the write for any
+ *  byte that already has them all */
+static void set_bits(uint8_t* map, uint32_t first, uint32_t count)
+{
+	uint32_t n;
+	uint8_t bits;
+	while(count > 0)
+	{
+		n = 8 - first % 8;
+		if(n > count)
+			n = count;
+		bits = (uint8_t)(((1u << n) - 1) << (first % 8));
+		if((__atomic_load_n(&map[first / 8], __ATOMIC_RELAXED) & bits) != bits)
+			__atomic_fetch_or(&map[first / 8], bits, __ATOMIC_RELAXED);
+		first += n;
+		count -= n;
+	}
+}
+
+/** Reads one bit */
+static bool get_bit(const uint8_t* map, uint32_t index)
+{
+	return (__atomic_load_n(&map[index / 8], __ATOMIC_RELAXED) >> (index % 8)) & 1;
+}
+
+/** Marks the words in [from, to) as run */
+static void mark_run(mips_coverage_h cov, uint32_t from, uint32_t to)
+{
+	if(from < cov->start)
+		from = cov->start;
+	if(to > cov->end)
+		to = cov->end;
+	if(from < to)
+		set_bits(cov->pcs, (from - cov->start) / 4, (to - from + 3) / 4);
+}
+
+/** Writes the block just left, and starts one at the PC; called from
+ *  mips_cpu_step when the PC is not the one after the last */
+void coverage_block(mips_cpu_h state)
+{
+	mark_run(state->host.coverage, state->host.coverage_start, state->host.coverage_next);
+	state->host.coverage_start = state->pc;
+}
+
+/** Marks an edge of the conditional branch at the PC */
+void coverage_edge(mips_cpu_h state, bool taken)
+{
+	mips_coverage_h cov = state->host.coverage;
+	if(state->pc >= cov->start && state->pc < cov->end)
+		set_bits(cov->edges, (state->pc - cov->start) / 4 * 2 + (taken ? 0 : 1), 1);
+}
+
+/** Writes the block being run, which carries on from where it is */
+void coverage_flush(mips_cpu_h state)
+{
+	mark_run(state->host.coverage, state->host.coverage_start, state->host.coverage_next);
+	state->host.coverage_start = state->host.coverage_next;
+}
+
+/** Creates a map */
+mips_coverage_h mips_coverage_create(uint32_t start, uint32_t end)
+{
+	mips_coverage_h cov;
+	size_t pcs;
+	if(start >= end || (start % 4) || (end % 4))
+		return NULL;
+	cov = malloc(sizeof(struct mips_coverage_impl));
+	if(cov == NULL)
+		return NULL;
+	cov->start = start;
+	cov->end = end;
+	cov->words = (end - start) / 4;
+	pcs = map_bytes(cov->words);
+	cov->pcs = calloc(pcs + map_bytes((size_t)cov->words * 2), 1);
+	if(cov->pcs == NULL)
+	{
+		free(cov);
+		return NULL;
+	}
+	cov->edges = cov->pcs + pcs;
+	return cov;
+}
+
+/** Attaches or detaches a CPU */
+mips_error mips_cpu_set_coverage(mips_cpu_h state, mips_coverage_h cov)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(state->host.coverage != NULL)
+		coverage_flush(state);
+	state->host.coverage = cov;
+	state->host.coverage_start = state->host.coverage_next = state->pc;
+	return mips_Success;
+}
+
+/** Returns whether an instruction has run */
+bool mips_coverage_pc(mips_coverage_h cov, uint32_t pc)
+{
+	if(cov == NULL || pc < cov->start || pc >= cov->end)
+		return false;
+	return get_bit(cov->pcs, (pc - cov->start) / 4);
+}
+
+/** Returns the edges seen of a branch */
+unsigned mips_coverage_edges(mips_coverage_h cov, uint32_t pc)
+{
+	uint32_t index;
+	if(cov == NULL || pc < cov->start || pc >= cov->end)
+		return 0;
+	index = (pc - cov->start) / 4 * 2;
+	return (get_bit(cov->edges, index) ? MIPS_COVERAGE_TAKEN : 0)
+		| (get_bit(cov->edges, index + 1) ? MIPS_COVERAGE_NOT_TAKEN : 0);
+}
+
+/** Merges two maps */
+mips_error mips_coverage_merge(mips_coverage_h dst, mips_coverage_h src)
+{
+	size_t i, length;
+	uint8_t bits;
+	if(dst == NULL || src == NULL)
+		return mips_ErrorInvalidHandle;
+	if(dst->start != src->start || dst->end != src->end)
+		return mips_ErrorInvalidArgument;
+	/** The two bitmaps are next to each other */
+	length = map_bytes(dst->words) + map_bytes((size_t)dst->words * 2);
+	for(i = 0; i < length; i++)
+	{
+		bits = __atomic_load_n(&src->pcs[i], __ATOMIC_RELAXED);
+		if(bits)
+			__atomic_fetch_or(&dst->pcs[i], bits, __ATOMIC_RELAXED);
+	}
+	return mips_Success;
+}
+
+/** Writes a big endian word */
+static void put_word(uint8_t* p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+/** Saves a map */
+mips_error mips_coverage_save(mips_coverage_h cov, const char* path)
+{
+	uint8_t header[COVERAGE_HEADER];
+	size_t length;
+	FILE* f;
+	bool ok;
+	if(cov == NULL)
+		return mips_ErrorInvalidHandle;
+	if(path == NULL)
+		return mips_ErrorInvalidArgument;
+	f = fopen(path, "wb");
+	if(f == NULL)
+		return mips_ErrorFileWriteError;
+	memcpy(header, COVERAGE_MAGIC, 8);
+	put_word(header + 8, cov->start);
+	put_word(header + 12, cov->end);
+	length = map_bytes(cov->words) + map_bytes((size_t)cov->words * 2);
+	ok = fwrite(header, sizeof(header), 1, f) == 1 && fwrite(cov->pcs, length, 1, f) == 1;
+	if(fclose(f))
+		ok = false;
+	return ok ? mips_Success : mips_ErrorFileWriteError;
+}
+
+/** Loads a map */
+mips_coverage_h mips_coverage_load(const char* path)
+{
+	uint8_t header[COVERAGE_HEADER];
+	mips_coverage_h cov = NULL;
+	size_t length;
+	FILE* f;
+	if(path == NULL)
+		return NULL;
+	f = fopen(path, "rb");
+	if(f == NULL)
+		return NULL;
+	if(fread(header, sizeof(header), 1, f) == 1 && !memcmp(header, COVERAGE_MAGIC, 8))
+		cov = mips_coverage_create(elf_word(header + 8), elf_word(header + 12));
+	if(cov != NULL)
+	{
+		length = map_bytes(cov->words) + map_bytes((size_t)cov->words * 2);
+		if(fread(cov->pcs, length, 1, f) != 1)
+		{
+			mips_coverage_free(cov);
+			cov = NULL;
+		}
+	}
+	fclose(f);
+	return cov;
+}
+
+/** Whether an instruction is a conditional branch: BEQ, BNE, BLEZ,
+ *  BGTZ, or BLTZ, BGEZ and their linking forms */
+static bool is_branch(uint32_t instruction)
+{
+	unsigned opcode = instruction >> 26, rt = (instruction >> 16) & 0x1F;
+	if(opcode == 1)
+		return rt == 0 || rt == 1 || rt == 16 || rt == 17;
+	return opcode >= 4 && opcode <= 7;
+}
+
+/** Writes a line of the report */
+static void report_line(FILE* dest, const mips_coverage_summary* s, const char* name)
+{
+	fprintf(dest, "%6.2f%% %10llu %10llu %6.2f%% %8llu %8llu  %s\n",
+		s->instructions ? 100.0 * s->covered / s->instructions : 0.0,
+		(unsigned long long)s->covered, (unsigned long long)s->instructions,
+		s->edges ? 100.0 * s->edges_covered / s->edges : 0.0,
+		(unsigned long long)s->edges_covered, (unsigned long long)s->edges, name);
+}
+
+/** Adds up the coverage of one executable section */
+static void report_section(mips_coverage_h cov,
+	const uint8_t* code, uint32_t address, uint32_t size,
+	mips_profiler_h symbols, FILE* dest, mips_coverage_summary* total)
+{
+	mips_coverage_summary function;
+	const char *name, *last = NULL;
+	uint32_t i, pc;
+	unsigned edges, covered, branch, taken;
+	memset(&function, 0, sizeof(function));
+	for(i = 0; i + 4 <= size; i += 4)
+	{
+		pc = address + i;
+		name = mips_profiler_symbol(symbols, pc);
+		if(dest != NULL && name != last && function.instructions)
+		{
+			report_line(dest, &function, last != NULL ? last : "?");
+			memset(&function, 0, sizeof(function));
+		}
+		last = name;
+		covered = mips_coverage_pc(cov, pc);
+		branch = is_branch(elf_word(code + i)) ? 2 : 0;
+		edges = branch ? mips_coverage_edges(cov, pc) : 0;
+		taken = ((edges & MIPS_COVERAGE_TAKEN) != 0) + ((edges & MIPS_COVERAGE_NOT_TAKEN) != 0);
+		function.instructions++;
+		function.covered += covered;
+		function.edges += branch;
+		function.edges_covered += taken;
+		total->instructions++;
+		total->covered += covered;
+		total->edges += branch;
+		total->edges_covered += taken;
+	}
+	if(dest != NULL && function.instructions)
+		report_line(dest, &function, last != NULL ? last : "?");
+}
+
+/** Reports coverage of an ELF file's code */
+mips_error mips_coverage_report(mips_coverage_h cov,
+	const char* elf_path,
+	mips_profiler_h symbols,
+	FILE* dest,
+	mips_coverage_summary* summary)
+{
+	mips_coverage_summary total;
+	elf_file elf;
+	elf_section section;
+	const uint8_t* code;
+	unsigned i, found = 0;
+	mips_error error;
+	if(cov == NULL)
+		return mips_ErrorInvalidHandle;
+	memset(&total, 0, sizeof(total));
+	error = elf_open(&elf, elf_path);
+	if(!error && dest != NULL)
+		fprintf(dest, "%7s %10s %10s %7s %8s %8s  %s\n", "%instr", "covered", "instrs",
+			"%edges", "covered", "edges", "name");
+	for(i = 0; !error && i < elf.section_count; i++)
+	{
+		elf_section_header(&elf, i, &section);
+		if(section.type != ELF_SHT_PROGBITS || !(section.flags & ELF_SHF_EXECINSTR))
+			continue;
+		code = elf_contents(&elf, &section);
+		if(code == NULL)
+			error = mips_ErrorInvalidArgument;
+		else
+			report_section(cov, code, section.address, section.size, symbols, dest, &total);
+		found++;
+	}
+	if(!error && found == 0)
+		error = mips_ErrorInvalidArgument;
+	if(!error && dest != NULL)
+		report_line(dest, &total, "total");
+	elf_close(&elf);
+	if(!error && summary != NULL)
+		*summary = total;
+	return error;
+}
+
+/** Frees a map */
+void mips_coverage_free(mips_coverage_h cov)
+{
+	if(cov != NULL)
+		free(cov->pcs);
+	free(cov);
+}
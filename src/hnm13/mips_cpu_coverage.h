@@ -0,0 +1,79 @@
+#ifndef mips_cpu_coverage_header
+#define mips_cpu_coverage_header
+
+#include "mips_cpu.h"
+#include "mips_cpu_profile.h"
+#include <stdbool.h>
+
+/** Guest code coverage
+ *
+ *  A coverage map covers a range of guest addresses, with a bit for
+ *  each instruction word, set once it has run, and two for each, set
+ *  once it has been seen as a conditional branch that was taken or
+ *  not taken.
+ *
+ *  A CPU attached to a map marks the instructions it runs a basic
+ *  block at a time: it remembers where the straight-line run it is in
+ *  began, and sets the bits for the whole run when it jumps away, so
+ *  the map is only written once per block. Bits are set with atomic
+ *  operations, so several CPUs, on any threads, may share a map.
+ *
+ *  Maps may be saved, loaded back and merged, to find the coverage of
+ *  many runs, and reported against the code in an ELF file. */
+struct mips_coverage_impl;
+
+/** An opaque handle to a coverage map */
+typedef struct mips_coverage_impl *mips_coverage_h;
+
+/** Bits of mips_coverage_edges */
+#define MIPS_COVERAGE_TAKEN 1
+#define MIPS_COVERAGE_NOT_TAKEN 2
+
+/** Totals from mips_coverage_report */
+typedef struct
+{
+	/** Instruction words in the code, and how many have run */
+	uint64_t instructions, covered;
+	/** Conditional branch edges (two per branch), and how many were
+	 *  seen */
+	uint64_t edges, edges_covered;
+} mips_coverage_summary;
+
+/** Creates an empty map of the word aligned addresses [start, end) */
+mips_coverage_h mips_coverage_create(uint32_t start, uint32_t end);
+
+/** Attaches a CPU to a map, or detaches it if 'cov' is NULL. The block
+ *  being run is written to the map when the CPU is detached, and when
+ *  mips_cpu_run returns */
+mips_error mips_cpu_set_coverage(mips_cpu_h state, mips_coverage_h cov);
+
+/** Returns whether the instruction at 'pc' has run */
+bool mips_coverage_pc(mips_coverage_h cov, uint32_t pc);
+
+/** Returns the MIPS_COVERAGE_ bits of the branch at 'pc' */
+unsigned mips_coverage_edges(mips_coverage_h cov, uint32_t pc);
+
+/** Adds everything covered in 'src' to 'dst'; both must be of the
+ *  same range */
+mips_error mips_coverage_merge(mips_coverage_h dst, mips_coverage_h src);
+
+/** Writes a map to a file */
+mips_error mips_coverage_save(mips_coverage_h cov, const char* path);
+
+/** Reads a map written by mips_coverage_save, or returns NULL */
+mips_coverage_h mips_coverage_load(const char* path);
+
+/** Counts what the map covers of the executable sections of a 32-bit
+ *  big endian MIPS ELF file, into 'summary' if given. If 'dest' is
+ *  given, writes a line for each function named by 'symbols' (which
+ *  may be NULL), then the totals */
+mips_error mips_coverage_report(mips_coverage_h cov,
+	const char* elf_path,
+	mips_profiler_h symbols,
+	FILE* dest,
+	mips_coverage_summary* summary);
+
+/** Frees a map. CPUs must be detached from it first */
+void mips_coverage_free(mips_coverage_h cov);
+
+#endif // mips_cpu_coverage_header
@@ -0,0 +1,100 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Reading ELF files, for symbols and code
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_elf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Reads a big endian word */
+uint32_t elf_word(const uint8_t* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/** Reads a big endian half word */
+unsigned elf_half(const uint8_t* p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+/** Reads a whole ELF file */
+mips_error elf_open(elf_file* elf, const char* path)
+{
+	FILE* f;
+	long size;
+	mips_error error = mips_ErrorFileReadError;
+	memset(elf, 0, sizeof(elf_file));
+	if(path == NULL)
+		return mips_ErrorInvalidArgument;
+	f = fopen(path, "rb");
+	if(f == NULL)
+		return mips_ErrorFileReadError;
+	if(fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0)
+	{
+		elf->length = (size_t)size;
+		elf->data = malloc(elf->length);
+		if(elf->data == NULL)
+			error = mips_ErrorOutOfMemory;
+		else if(fread(elf->data, 1, elf->length, f) == elf->length)
+			error = mips_Success;
+	}
+	fclose(f);
+	/** 32 bit, big endian, with the section headers in the file */
+	if(!error)
+	{
+		if(elf->length < 52 || memcmp(elf->data, "\177ELF", 4)
+			|| elf->data[4] != 1 || elf->data[5] != 2)
+			error = mips_ErrorInvalidArgument;
+		else
+		{
+			elf->section_offset = elf_word(elf->data + 32);
+			elf->section_size = elf_half(elf->data + 46);
+			elf->section_count = elf_half(elf->data + 48);
+			if(elf->section_size < 40 || elf->section_offset > elf->length
+				|| (size_t)elf->section_count * elf->section_size
+					> elf->length - elf->section_offset)
+				error = mips_ErrorInvalidArgument;
+		}
+	}
+	if(error)
+		elf_close(elf);
+	return error;
+}
+
+/** Reads a section header */
+bool elf_section_header(const elf_file* elf, unsigned index, elf_section* section)
+{
+	const uint8_t* sh;
+	if(index >= elf->section_count)
+		return false;
+	sh = elf->data + elf->section_offset + index * elf->section_size;
+	section->type = elf_word(sh + 4);
+	section->flags = elf_word(sh + 8);
+	section->address = elf_word(sh + 12);
+	section->offset = elf_word(sh + 16);
+	section->size = elf_word(sh + 20);
+	section->link = elf_word(sh + 24);
+	return true;
+}
+
+/** Finds the contents of a section */
+const uint8_t* elf_contents(const elf_file* elf, const elf_section* section)
+{
+	if(section->offset > elf->length || section->size > elf->length - section->offset)
+		return NULL;
+	return elf->data + section->offset;
+}
+
+/** Frees an ELF file */
+void elf_close(elf_file* elf)
+{
+	free(elf->data);
+	memset(elf, 0, sizeof(elf_file));
+}
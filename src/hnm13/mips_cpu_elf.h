@@ -0,0 +1,58 @@
+#ifndef mips_cpu_elf_header
+#define mips_cpu_elf_header
+
+#include "mips_cpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Reading 32-bit big endian MIPS ELF files
+ *
+ *  The profiler takes symbols from ELF files, and coverage reports
+ *  take code from them; both read the whole file into memory with
+ *  elf_open, then walk its section headers. Offsets and sizes are
+ *  checked against the file before anything is read through them. */
+
+/** An ELF file read into memory */
+typedef struct
+{
+	uint8_t* data;
+	size_t length;
+	/** The section header table */
+	uint32_t section_offset;
+	unsigned section_size, section_count;
+} elf_file;
+
+/** The fields of a section header that are used */
+typedef struct
+{
+	uint32_t type, flags, address, offset, size, link;
+} elf_section;
+
+/** Section types and flags */
+#define ELF_SHT_PROGBITS 1
+#define ELF_SHT_SYMTAB 2
+#define ELF_SHT_DYNSYM 11
+#define ELF_SHF_EXECINSTR 4
+
+/** Reads big endian fields */
+uint32_t elf_word(const uint8_t* p);
+unsigned elf_half(const uint8_t* p);
+
+/** Reads a whole file, which must be a 32-bit big endian ELF file
+ *  with its section headers inside it. Returns mips_ErrorFileReadError
+ *  if it can't be read, and mips_ErrorInvalidArgument if it isn't
+ *  such a file */
+mips_error elf_open(elf_file* elf, const char* path);
+
+/** Reads the header of section 'index', returning false if there is
+ *  no such section */
+bool elf_section_header(const elf_file* elf, unsigned index, elf_section* section);
+
+/** Returns the contents of a section, or NULL if they are not all
+ *  inside the file */
+const uint8_t* elf_contents(const elf_file* elf, const elf_section* section);
+
+/** Frees the file's contents */
+void elf_close(elf_file* elf);
+
+#endif // mips_cpu_elf_header
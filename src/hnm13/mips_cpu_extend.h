@@ -15,4 +15,37 @@ mips_error mips_cpu_set_exception_handler(mips_cpu_h state,
 	mips_error exception,
 	uint32_t handler);
 
+/** Runs the CPU until the PC reaches stop_pc, an instruction fails,
+ *  or 'budget' instructions have retired. All state stays in the CPU,
+ *  so a later call carries on where this one stopped.
+ *  The number of instructions retired is written to 'retired' if given */
+mips_error mips_cpu_run(mips_cpu_h state,
+	uint32_t stop_pc,
+	uint64_t budget,
+	uint64_t* retired);
+
+/** Sets the CPU number the guest reads with RDHWR $0 (0 by default)
+ *  The number is kept across mips_cpu_reset */
+mips_error mips_cpu_set_id(mips_cpu_h state, unsigned id);
+
+/** Returns the name of an instruction, as debug level 2 prints it */
+const char* mips_cpu_instruction_name(uint32_t instruction);
+
+/** Sets up a CPU state in storage the caller owns, as mips_cpu_create
+ *  would, for allocators that keep many CPUs in one block */
+void mips_cpu_init(mips_cpu_h state, mips_mem_h mem);
+
+/** Releases what a CPU from mips_cpu_init holds (its trace files,
+ *  trace thread and histograms), leaving the storage to the caller */
+void mips_cpu_destroy(mips_cpu_h state);
+
+/** Copies registers, PC, HI/LO, coprocessors and MMU state from src
+ *  to dst, so dst carries on exactly where src is. dst keeps its own
+ *  memory, debug settings, store buffer and everything the host has
+ *  attached to it: traces, counters, profilers, plugins and coverage */
+mips_error mips_cpu_copy_state(mips_cpu_h dst, const struct mips_cpu_impl* src);
+
+/** Attaches an R3000-style MMU (TLB and segments) as coprocessor 0 */
+mips_error mips_cpu_enable_mmu(mips_cpu_h state);
+
 #endif // mips_cpu_extend_header
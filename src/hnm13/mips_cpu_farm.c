@@ -0,0 +1,223 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Batch job runner over a work-stealing thread pool
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_farm.h"
+#include "mips_cpu_extend.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** A worker's share of the batch: job indices [head, tail)
+ *  The owner takes from the head, thieves from the tail */
+typedef struct
+{
+	pthread_mutex_t lock;
+	unsigned head, tail;
+} job_queue;
+
+/** State shared by every worker in one mips_farm_run call */
+typedef struct
+{
+	const mips_farm_job* jobs;
+	mips_farm_result* results;
+	job_queue* queues;
+	unsigned threads;
+	uint32_t mem_size, pages;
+} farm;
+
+/** A page of zero bytes, to wipe RAM with between jobs */
+static const uint8_t zero_page[MIPS_MEM_PAGE_SIZE];
+
+/** Per-thread arguments */
+typedef struct
+{
+	farm* farm;
+	unsigned index;
+} worker_args;
+
+/** Returns the monotonic clock, in seconds */
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Takes the next job from our own queue, or steals one
+ *  Returns false when every queue is empty */
+static bool next_job(farm* f, unsigned self, unsigned* job)
+{
+	unsigned i, victim;
+	job_queue* q;
+	for(i = 0; i < f->threads; i++)
+	{
+		victim = (self + i) % f->threads;
+		q = &f->queues[victim];
+		pthread_mutex_lock(&q->lock);
+		if(q->head < q->tail)
+		{
+			*job = (victim == self) ? q->head++ : --q->tail;
+			pthread_mutex_unlock(&q->lock);
+			return true;
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+	return false;
+}
+
+/** Zeroes the pages of the worker's RAM marked in 'dirty', and marks
+ *  every page clean, so the flags then show what the job writes */
+static mips_error wipe(farm* f, mips_mem_h mem, uint8_t* dirty)
+{
+	uint32_t i, offset, length;
+	mips_error error = mips_Success;
+	for(i = 0; !error && i < f->pages; i++)
+	{
+		if(!dirty[i])
+			continue;
+		offset = i * MIPS_MEM_PAGE_SIZE;
+		length = f->mem_size - offset;
+		if(length > MIPS_MEM_PAGE_SIZE)
+			length = MIPS_MEM_PAGE_SIZE;
+		error = mips_mem_write(mem, offset, length, zero_page);
+	}
+	if(!error)
+		error = mips_mem_take_dirty_pages(mem, dirty, f->pages);
+	return error;
+}
+
+/** Loads and runs a single job on the worker's CPU and RAM
+ *  'dirty' marks the pages the last job wrote, and is updated to
+ *  those this one writes */
+static void run_job(farm* f, mips_cpu_h cpu, mips_mem_h mem, uint8_t* dirty, unsigned index)
+{
+	const mips_farm_job* job = &f->jobs[index];
+	mips_farm_result* result = &f->results[index];
+	double start = now();
+	unsigned i;
+	mips_error error;
+	mips_cpu_reset(cpu);
+	error = wipe(f, mem, dirty);
+	if(!error && job->image_length)
+		error = mips_mem_write(mem, job->image_address, job->image_length, job->image);
+	for(i = 0; !error && i < job->input_count; i++)
+		error = mips_mem_write(mem, job->inputs[i].address,
+			job->inputs[i].length, job->inputs[i].data);
+	for(i = 1; i < 32; i++)
+		mips_cpu_set_register(cpu, i, job->regs[i]);
+	mips_cpu_set_pc(cpu, job->entry);
+	result->retired = 0;
+	if(!error)
+		error = mips_cpu_run(cpu, job->exit, job->budget, &result->retired);
+	result->error = error;
+	for(i = 0; i < 32; i++)
+		mips_cpu_get_register(cpu, i, &result->regs[i]);
+	mips_cpu_get_pc(cpu, &result->pc);
+	if(mips_mem_take_dirty_pages(mem, dirty, f->pages))
+		memset(dirty, 1, f->pages);
+	result->wall_time = now() - start;
+}
+
+/** Thread entry point: runs jobs until none are left anywhere */
+static void* worker(void* arg)
+{
+	worker_args* args = arg;
+	farm* f = args->farm;
+	mips_mem_h mem = mips_mem_create_ram(f->mem_size, 1);
+	mips_cpu_h cpu = mips_cpu_create(mem);
+	uint8_t* dirty = malloc(f->pages);
+	unsigned job;
+	/** New RAM holds whatever malloc gave it */
+	if(dirty != NULL)
+		memset(dirty, 1, f->pages);
+	while(next_job(f, args->index, &job))
+	{
+		if(mem == NULL || cpu == NULL || dirty == NULL)
+		{
+			memset(&f->results[job], 0, sizeof(mips_farm_result));
+			f->results[job].error = mips_ErrorOutOfMemory;
+			continue;
+		}
+		run_job(f, cpu, mem, dirty, job);
+	}
+	free(dirty);
+	mips_cpu_free(cpu);
+	mips_mem_free(mem);
+	return NULL;
+}
+
+/** Runs a batch of jobs over a pool of worker threads */
+mips_error mips_farm_run(const mips_farm_job* jobs,
+	mips_farm_result* results,
+	unsigned count,
+	unsigned threads,
+	uint32_t mem_size)
+{
+	farm f;
+	pthread_t* handles;
+	worker_args* args;
+	unsigned i, started;
+	long cores;
+	if((jobs == NULL || results == NULL) && count > 0)
+		return mips_ErrorInvalidArgument;
+	if(mem_size == 0)
+		return mips_ErrorInvalidArgument;
+	if(threads == 0)
+	{
+		cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? (unsigned)cores : 1;
+	}
+	if(threads > count)
+		threads = count ? count : 1;
+
+	f.jobs = jobs;
+	f.results = results;
+	f.threads = threads;
+	f.mem_size = mem_size;
+	f.pages = (mem_size + MIPS_MEM_PAGE_SIZE - 1) / MIPS_MEM_PAGE_SIZE;
+	f.queues = malloc(threads * sizeof(job_queue));
+	handles = malloc(threads * sizeof(pthread_t));
+	args = malloc(threads * sizeof(worker_args));
+	if(f.queues == NULL || handles == NULL || args == NULL)
+	{
+		free(f.queues);
+		free(handles);
+		free(args);
+		return mips_ErrorOutOfMemory;
+	}
+
+	/** Deal the jobs out in contiguous runs */
+	for(i = 0; i < threads; i++)
+	{
+		pthread_mutex_init(&f.queues[i].lock, NULL);
+		f.queues[i].head = (unsigned)((uint64_t)count * i / threads);
+		f.queues[i].tail = (unsigned)((uint64_t)count * (i + 1) / threads);
+	}
+	for(started = 0; started < threads; started++)
+	{
+		args[started].farm = &f;
+		args[started].index = started;
+		if(pthread_create(&handles[started], NULL, &worker, &args[started]))
+			break;
+	}
+	/** If we couldn't start every thread, the others steal the work */
+	if(started == 0)
+		worker(&args[0]);
+	for(i = 0; i < started; i++)
+		pthread_join(handles[i], NULL);
+
+	for(i = 0; i < threads; i++)
+		pthread_mutex_destroy(&f.queues[i].lock);
+	free(f.queues);
+	free(handles);
+	free(args);
+	return mips_Success;
+}
@@ -0,0 +1,65 @@
+#ifndef mips_cpu_farm_header
+#define mips_cpu_farm_header
+
+#include "mips_cpu.h"
+
+/** A block of bytes copied into guest memory before a job starts */
+typedef struct
+{
+	uint32_t address;
+	const uint8_t* data;
+	uint32_t length;
+} mips_farm_input;
+
+/** Describes one independent guest run */
+typedef struct
+{
+	/** Program image, in guest byte order, and where to load it */
+	const uint8_t* image;
+	uint32_t image_length;
+	uint32_t image_address;
+	/** Optional extra data to load after the image */
+	const mips_farm_input* inputs;
+	unsigned input_count;
+	/** Initial register values ($0 is ignored) */
+	uint32_t regs[32];
+	/** Address of the first instruction */
+	uint32_t entry;
+	/** The job finishes successfully when the PC reaches this address */
+	uint32_t exit;
+	/** The most instructions the job may retire */
+	uint64_t budget;
+} mips_farm_job;
+
+/** What happened to one job */
+typedef struct
+{
+	/** Final register values and PC */
+	uint32_t regs[32];
+	uint32_t pc;
+	/** The error that stopped the job, or mips_Success if it reached
+	 *  its exit address or ran out of budget (pc != exit) */
+	mips_error error;
+	/** The number of instructions retired */
+	uint64_t retired;
+	/** Wall clock time spent on the job, in seconds */
+	double wall_time;
+} mips_farm_result;
+
+/** Runs a batch of jobs over a pool of worker threads
+ *
+ *  Each worker owns one CPU and one RAM of mem_size bytes, which it
+ *  resets and reuses for every job it runs, zeroing only the pages
+ *  the job before wrote. Jobs are dealt out evenly in advance; a
+ *  worker that empties its own queue steals from the back of
+ *  another's, so uneven jobs still keep every thread busy.
+ *
+ *  results must have room for 'count' entries, in the same order as
+ *  jobs. Passing threads == 0 uses one thread per online host core. */
+mips_error mips_farm_run(const mips_farm_job* jobs,
+	mips_farm_result* results,
+	unsigned count,
+	unsigned threads,
+	uint32_t mem_size);
+
+#endif // mips_cpu_farm_header
@@ -0,0 +1,185 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Sampled host latency histograms for instruction handlers
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_latency.h"
+#include "mips_cpu_state.h"
+#include "mips_cpu_extend.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+const char* const mips_latency_unit = "cycles";
+
+/** Reads the cycle counter */
+static uint64_t now()
+{
+	return __rdtsc();
+}
+#else
+#include <time.h>
+
+const char* const mips_latency_unit = "ns";
+
+/** Reads the monotonic clock */
+static uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+/** Picks the gap to the next sample: from 1 to 2 * period - 1, so
+ *  'period' on average */
+static uint32_t next_gap(latency_sampler* ls)
+{
+	/** xorshift32 */
+	ls->seed ^= ls->seed << 13;
+	ls->seed ^= ls->seed >> 17;
+	ls->seed ^= ls->seed << 5;
+	return 1 + ls->seed % (2 * ls->period - 1);
+}
+
+/** Runs an instruction's handler, timing it */
+mips_error latency_sample(mips_cpu_h state, op handler, uint32_t instruction)
+{
+	latency_sampler* ls = state->host.latency;
+	unsigned index = instruction >> 26 ? instruction >> 26 : 64 + (instruction & 0x3F);
+	unsigned bucket = 0;
+	uint64_t start, ticks;
+	mips_error error;
+	start = now();
+	error = handler(state, instruction);
+	ticks = now() - start;
+	if(ticks > 1)
+		bucket = 63 - __builtin_clzll(ticks);
+	if(bucket >= MIPS_LATENCY_BUCKETS)
+		bucket = MIPS_LATENCY_BUCKETS - 1;
+	ls->profile.counts[index][bucket]++;
+	ls->countdown = next_gap(ls);
+	return error;
+}
+
+/** Starts or stops sampling */
+mips_error mips_cpu_set_latency_sampling(mips_cpu_h state, unsigned period)
+{
+	latency_sampler* ls;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	ls = state->host.latency;
+	if(ls == NULL && period > 0)
+	{
+		ls = calloc(1, sizeof(latency_sampler));
+		if(ls == NULL)
+			return mips_ErrorOutOfMemory;
+		ls->seed = 0x9E3779B9;
+		state->host.latency = ls;
+	}
+	if(ls != NULL)
+	{
+		ls->period = period;
+		if(period > 0)
+			ls->countdown = next_gap(ls);
+	}
+	return mips_Success;
+}
+
+/** Copies the histograms */
+mips_error mips_cpu_get_latency(mips_cpu_h state, mips_latency_profile* profile)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(profile == NULL)
+		return mips_ErrorInvalidArgument;
+	if(state->host.latency != NULL)
+		*profile = state->host.latency->profile;
+	else
+		memset(profile, 0, sizeof(mips_latency_profile));
+	return mips_Success;
+}
+
+/** Empties the histograms */
+mips_error mips_cpu_reset_latency(mips_cpu_h state)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(state->host.latency != NULL)
+		memset(&state->host.latency->profile, 0, sizeof(mips_latency_profile));
+	return mips_Success;
+}
+
+/** Estimates a percentile of a histogram */
+double mips_latency_percentile(const uint64_t counts[MIPS_LATENCY_BUCKETS], double percentile)
+{
+	uint64_t total = 0, seen = 0;
+	double target, low, high;
+	unsigned i;
+	for(i = 0; i < MIPS_LATENCY_BUCKETS; i++)
+		total += counts[i];
+	if(total == 0)
+		return 0;
+	target = total * percentile / 100;
+	for(i = 0; i < MIPS_LATENCY_BUCKETS - 1; i++)
+	{
+		if(counts[i] && seen + counts[i] >= target)
+			break;
+		seen += counts[i];
+	}
+	low = i ? (double)((uint64_t)1 << i) : 0;
+	high = (double)((uint64_t)2 << i);
+	if(counts[i] == 0 || target <= seen)
+		return low;
+	return low + (high - low) * (target - seen) / counts[i];
+}
+
+/** One line of the report */
+typedef struct
+{
+	unsigned index;
+	uint64_t samples;
+} latency_entry;
+
+/** Orders report lines by samples, most first */
+static int compare_entries(const void* a, const void* b)
+{
+	uint64_t x = ((const latency_entry*)a)->samples, y = ((const latency_entry*)b)->samples;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/** Writes the report */
+void mips_print_latency(const mips_latency_profile* profile, FILE* dest)
+{
+	latency_entry entries[MIPS_LATENCY_OPS];
+	const uint64_t* counts;
+	unsigned i, j, n = 0;
+	for(i = 0; i < MIPS_LATENCY_OPS; i++)
+	{
+		entries[n].index = i;
+		entries[n].samples = 0;
+		for(j = 0; j < MIPS_LATENCY_BUCKETS; j++)
+			entries[n].samples += profile->counts[i][j];
+		if(entries[n].samples)
+			n++;
+	}
+	qsort(entries, n, sizeof(latency_entry), &compare_entries);
+	fprintf(dest, "%-12s %12s %10s %10s %10s  (%s)\n", "Instruction", "Samples",
+		"p50", "p90", "p99", mips_latency_unit);
+	for(i = 0; i < n; i++)
+	{
+		counts = profile->counts[entries[i].index];
+		fprintf(dest, "%-12s %12llu %10.0f %10.0f %10.0f\n",
+			mips_cpu_instruction_name(entries[i].index < 64
+				? entries[i].index << 26 : entries[i].index - 64),
+			(unsigned long long)entries[i].samples,
+			mips_latency_percentile(counts, 50),
+			mips_latency_percentile(counts, 90),
+			mips_latency_percentile(counts, 99));
+	}
+}
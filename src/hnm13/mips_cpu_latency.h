@@ -0,0 +1,53 @@
+#ifndef mips_cpu_latency_header
+#define mips_cpu_latency_header
+
+#include "mips_cpu.h"
+#include <stdio.h>
+
+/** Host time spent in each instruction handler
+ *
+ *  When sampling is on, the CPU times one instruction in every
+ *  'period' (on average; the gaps are randomised so loops can't line
+ *  up with them) from the call into its handler to the return, and
+ *  adds the time to a histogram for that instruction. The time is in
+ *  ticks of the cycle counter where there is one (rdtsc on x86), and
+ *  nanoseconds elsewhere. Nothing is done for instructions that are
+ *  not sampled beyond counting them down, so a period of 100 or so
+ *  costs a few percent. */
+
+/** The number of histogram buckets: bucket 0 holds times of 0 or 1
+ *  ticks, and bucket i times from 2^i to 2^(i+1) - 1 */
+#define MIPS_LATENCY_BUCKETS 40
+
+/** The number of instructions with a histogram: one per opcode, with
+ *  the R-type ones (opcode 0) counted at 64 + their function field */
+#define MIPS_LATENCY_OPS 128
+
+/** Latency histograms for every instruction */
+typedef struct
+{
+	uint64_t counts[MIPS_LATENCY_OPS][MIPS_LATENCY_BUCKETS];
+} mips_latency_profile;
+
+/** The unit of the times, "cycles" or "ns" */
+extern const char* const mips_latency_unit;
+
+/** Times one instruction in every 'period', or stops timing if
+ *  period is 0. Starting again keeps the histograms so far */
+mips_error mips_cpu_set_latency_sampling(mips_cpu_h state, unsigned period);
+
+/** Copies the histograms (all zero if sampling was never on) */
+mips_error mips_cpu_get_latency(mips_cpu_h state, mips_latency_profile* profile);
+
+/** Empties the histograms */
+mips_error mips_cpu_reset_latency(mips_cpu_h state);
+
+/** Estimates a percentile (0 to 100) of one histogram, interpolating
+ *  within the bucket it falls in. Returns 0 for an empty histogram */
+double mips_latency_percentile(const uint64_t counts[MIPS_LATENCY_BUCKETS], double percentile);
+
+/** Writes the sample count and the 50th, 90th and 99th percentiles
+ *  for each instruction sampled, the most sampled first */
+void mips_print_latency(const mips_latency_profile* profile, FILE* dest);
+
+#endif // mips_cpu_latency_header
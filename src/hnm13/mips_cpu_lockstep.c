@@ -0,0 +1,489 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Lockstep execution of many guest instances over a
+ * struct-of-arrays register file
+ *
+ * Every lane loop runs over all LOCKSTEP_MAX_LANES lanes with no
+ * early exits, and results are merged with a per-lane select mask,
+ * so at -O3 GCC and Clang compile the ALU instructions to as many
+ * lanes per vector operation as the target allows: 4 with the SSE2
+ * every x86-64 host has, 8 with -mavx2, 16 with -mavx512f. The
+ * makefile builds this file alone at -O3, for the baseline target
+ * unless LOCKSTEP_ARCH is set; nothing checks the host before calling
+ * in here, so only set it for hosts known to support it.
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_lockstep.h"
+#include "mips_util.h"
+#include <limits.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define NUM_LANES LOCKSTEP_MAX_LANES
+
+/** Evaluates 'expr' for every lane index i */
+#define LANES(expr) for(i = 0; i < NUM_LANES; i++) { expr; }
+
+/** Lockstep engine state */
+struct mips_lockstep_impl
+{
+	/** General purpose registers, reg[index][lane] */
+	uint32_t reg[32][NUM_LANES];
+	/** The $HI and $LO registers */
+	uint32_t hi[NUM_LANES], lo[NUM_LANES];
+	/** Program counter, and the one after it */
+	uint32_t pc[NUM_LANES], pcN[NUM_LANES];
+	/** Why each lane stopped, or mips_Success */
+	mips_error error[NUM_LANES];
+	/** Pointer to memory object */
+	mips_mem_h mem;
+	/** The number of lanes in use */
+	unsigned lanes;
+};
+
+/** Merges 'value' into 'dst' for the lanes selected by 'sel' */
+static void blend(uint32_t* dst, const uint32_t* value, const uint32_t* sel)
+{
+	unsigned i;
+	LANES(dst[i] = (value[i] & sel[i]) | (dst[i] & ~sel[i]))
+}
+
+/** Converts a per-lane flag array into a lane mask, limited to 'mask' */
+static uint32_t to_mask(const uint32_t* flags, uint32_t mask)
+{
+	unsigned i;
+	uint32_t ret = 0;
+	LANES(ret |= (flags[i] ? 1u : 0u) << i)
+	return ret & mask;
+}
+
+/** Reads 1, 2 or 4 bytes for a load, via the aligned word holding them
+ *  so that RAMs of any block size up to 4 will accept it */
+static mips_error load(mips_mem_h mem, uint32_t addr, unsigned length, uint32_t* value)
+{
+	uint8_t word[4];
+	unsigned offset = addr & 3, j;
+	mips_error error;
+	if(addr % length)
+		return mips_ExceptionInvalidAlignment;
+	error = mips_mem_read(mem, addr - offset, 4, word);
+	if(error)
+		return error;
+	*value = 0;
+	for(j = 0; j < length; j++)
+		*value = (*value << 8) | word[offset + j];
+	return mips_Success;
+}
+
+/** Executes one instruction for the lanes in 'mask', which share a PC */
+static void exec_group(mips_lockstep_h ls, uint32_t mask)
+{
+	uint32_t instruction, pc, imm, uimm, link = 0;
+	uint32_t tmp[NUM_LANES], sel[NUM_LANES], flag[NUM_LANES], target[NUM_LANES];
+	uint32_t hi[NUM_LANES], lo[NUM_LANES];
+	mips_error lane_error[NUM_LANES];
+	const uint32_t *a, *b;
+	unsigned i, opcode, rs, rt, rd, sh, dest = 0, length = 0;
+	bool branch = false, hilo = false, sign = false;
+	uint32_t fault = 0;
+	mips_error error;
+	int64_t product;
+
+	for(i = 0; !(mask & (1u << i)); i++)
+		;
+	pc = ls->pc[i];
+	error = mips_mem_fetch(ls->mem, pc, 4, (uint8_t*)&instruction);
+	if(error)
+	{
+		LANES(if(mask & (1u << i)) ls->error[i] = error)
+		return;
+	}
+	reverse_word(&instruction);
+	opcode = instruction >> 26;
+	rs = (instruction >> 21) & 0x1F;
+	rt = (instruction >> 16) & 0x1F;
+	rd = (instruction >> 11) & 0x1F;
+	sh = (instruction >> 6) & 0x1F;
+	imm = (uint32_t)(int16_t)(instruction & 0xFFFF);
+	uimm = instruction & 0xFFFF;
+	a = ls->reg[rs];
+	b = ls->reg[rt];
+	memset(flag, 0, sizeof(flag));
+	memset(target, 0, sizeof(target));
+	LANES(lane_error[i] = mips_Success)
+
+	switch(opcode)
+	{
+	case 0x00: /** R-type */
+		dest = rd;
+		switch(instruction & 0x3F)
+		{
+		case 0x00: LANES(tmp[i] = b[i] << sh) break; /** SLL */
+		case 0x02: LANES(tmp[i] = b[i] >> sh) break; /** SRL */
+		case 0x03: LANES(tmp[i] = (int32_t)b[i] >> sh) break; /** SRA */
+		case 0x04: LANES(tmp[i] = b[i] << (a[i] & 0x1F)) break; /** SLLV */
+		case 0x06: LANES(tmp[i] = b[i] >> (a[i] & 0x1F)) break; /** SRLV */
+		case 0x07: LANES(tmp[i] = (int32_t)b[i] >> (a[i] & 0x1F)) break; /** SRAV */
+		case 0x08: /** JR */
+		case 0x09: /** JALR */
+			dest = (instruction & 1) ? rd : 0;
+			LANES(tmp[i] = pc + 8)
+			LANES(flag[i] = 1)
+			LANES(target[i] = a[i])
+			for(i = 0; i < NUM_LANES; i++)
+				if(a[i] & 3)
+					lane_error[i] = mips_ExceptionInvalidAlignment;
+			branch = true;
+			break;
+		case 0x0C: /** SYSCALL */
+			dest = 0;
+			LANES(lane_error[i] = mips_ExceptionSystemCall)
+			break;
+		case 0x0D: /** BREAK */
+			dest = 0;
+			LANES(lane_error[i] = mips_ExceptionBreak)
+			break;
+		case 0x10: LANES(tmp[i] = ls->hi[i]) break; /** MFHI */
+		case 0x12: LANES(tmp[i] = ls->lo[i]) break; /** MFLO */
+		case 0x11: /** MTHI */
+			dest = 0;
+			hilo = true;
+			LANES(hi[i] = a[i])
+			LANES(lo[i] = ls->lo[i])
+			break;
+		case 0x13: /** MTLO */
+			dest = 0;
+			hilo = true;
+			LANES(hi[i] = ls->hi[i])
+			LANES(lo[i] = a[i])
+			break;
+		case 0x18: /** MULT */
+			dest = 0;
+			hilo = true;
+			for(i = 0; i < NUM_LANES; i++)
+			{
+				product = (int64_t)(int32_t)a[i] * (int64_t)(int32_t)b[i];
+				hi[i] = (uint32_t)((uint64_t)product >> 32);
+				lo[i] = (uint32_t)product;
+			}
+			break;
+		case 0x19: /** MULTU */
+			dest = 0;
+			hilo = true;
+			LANES(hi[i] = (uint32_t)(((uint64_t)a[i] * b[i]) >> 32))
+			LANES(lo[i] = a[i] * b[i])
+			break;
+		case 0x1A: /** DIV */
+			dest = 0;
+			hilo = true;
+			for(i = 0; i < NUM_LANES; i++)
+			{
+				if(b[i] == 0 || (a[i] == (uint32_t)INT_MIN && b[i] == 0xFFFFFFFF))
+				{
+					lo[i] = b[i] ? a[i] : 0;
+					hi[i] = 0;
+				}
+				else
+				{
+					lo[i] = (uint32_t)((int32_t)a[i] / (int32_t)b[i]);
+					hi[i] = (uint32_t)((int32_t)a[i] % (int32_t)b[i]);
+				}
+			}
+			break;
+		case 0x1B: /** DIVU */
+			dest = 0;
+			hilo = true;
+			LANES(lo[i] = b[i] ? a[i] / b[i] : 0)
+			LANES(hi[i] = b[i] ? a[i] % b[i] : 0)
+			break;
+		case 0x20: /** ADD */
+			LANES(tmp[i] = a[i] + b[i])
+			LANES(flag[i] = (~(a[i] ^ b[i]) & (a[i] ^ tmp[i])) >> 31)
+			for(i = 0; i < NUM_LANES; i++)
+				if(flag[i])
+					lane_error[i] = mips_ExceptionArithmeticOverflow;
+			break;
+		case 0x21: LANES(tmp[i] = a[i] + b[i]) break; /** ADDU */
+		case 0x22: /** SUB, checked as an ADD of -b like the scalar core */
+			LANES(target[i] = 0 - b[i])
+			LANES(tmp[i] = a[i] + target[i])
+			LANES(flag[i] = (~(a[i] ^ target[i]) & (a[i] ^ tmp[i])) >> 31)
+			for(i = 0; i < NUM_LANES; i++)
+				if(flag[i])
+					lane_error[i] = mips_ExceptionArithmeticOverflow;
+			break;
+		case 0x23: LANES(tmp[i] = a[i] - b[i]) break; /** SUBU */
+		case 0x24: LANES(tmp[i] = a[i] & b[i]) break; /** AND */
+		case 0x25: LANES(tmp[i] = a[i] | b[i]) break; /** OR */
+		case 0x26: LANES(tmp[i] = a[i] ^ b[i]) break; /** XOR */
+		case 0x27: LANES(tmp[i] = ~(a[i] | b[i])) break; /** NOR */
+		case 0x2A: LANES(tmp[i] = (int32_t)a[i] < (int32_t)b[i]) break; /** SLT */
+		case 0x2B: LANES(tmp[i] = a[i] < b[i]) break; /** SLTU */
+		default:
+			dest = 0;
+			LANES(lane_error[i] = mips_ExceptionInvalidInstruction)
+		}
+		break;
+	case 0x01: /** BLTZ, BGEZ, BLTZAL, BGEZAL */
+		if(rt & 1)
+			LANES(flag[i] = (int32_t)a[i] >= 0)
+		else
+			LANES(flag[i] = (int32_t)a[i] < 0)
+		LANES(target[i] = pc + 4 + (imm << 2))
+		if(rt & 0x10)
+		{
+			dest = 31;
+			LANES(tmp[i] = pc + 8)
+		}
+		branch = true;
+		break;
+	case 0x02: /** J */
+	case 0x03: /** JAL */
+		LANES(flag[i] = 1)
+		LANES(target[i] = ((pc + 4) & 0xF0000000) | ((instruction & 0x3FFFFFF) << 2))
+		if(opcode & 1)
+		{
+			dest = 31;
+			LANES(tmp[i] = pc + 8)
+		}
+		branch = true;
+		break;
+	case 0x04: /** BEQ */
+	case 0x05: /** BNE */
+		LANES(flag[i] = (a[i] == b[i]) ^ (opcode & 1))
+		LANES(target[i] = pc + 4 + (imm << 2))
+		branch = true;
+		break;
+	case 0x06: /** BLEZ */
+		LANES(flag[i] = (int32_t)a[i] <= 0)
+		LANES(target[i] = pc + 4 + (imm << 2))
+		branch = true;
+		break;
+	case 0x07: /** BGTZ */
+		LANES(flag[i] = (int32_t)a[i] > 0)
+		LANES(target[i] = pc + 4 + (imm << 2))
+		branch = true;
+		break;
+	case 0x08: /** ADDI */
+		dest = rt;
+		LANES(tmp[i] = a[i] + imm)
+		LANES(flag[i] = (~(a[i] ^ imm) & (a[i] ^ tmp[i])) >> 31)
+		for(i = 0; i < NUM_LANES; i++)
+			if(flag[i])
+				lane_error[i] = mips_ExceptionArithmeticOverflow;
+		break;
+	case 0x09: dest = rt; LANES(tmp[i] = a[i] + imm) break; /** ADDIU */
+	case 0x0A: dest = rt; LANES(tmp[i] = (int32_t)a[i] < (int32_t)imm) break; /** SLTI */
+	case 0x0B: dest = rt; LANES(tmp[i] = a[i] < imm) break; /** SLTIU */
+	case 0x0C: dest = rt; LANES(tmp[i] = a[i] & uimm) break; /** ANDI */
+	case 0x0D: dest = rt; LANES(tmp[i] = a[i] | uimm) break; /** ORI */
+	case 0x0E: dest = rt; LANES(tmp[i] = a[i] ^ uimm) break; /** XORI */
+	case 0x0F: dest = rt; LANES(tmp[i] = uimm << 16) break; /** LUI */
+	case 0x20: length = 1; sign = true; break; /** LB */
+	case 0x21: length = 2; sign = true; break; /** LH */
+	case 0x23: length = 4; break; /** LW */
+	case 0x24: length = 1; break; /** LBU */
+	case 0x25: length = 2; break; /** LHU */
+	case 0x22: /** LWL */
+	case 0x26: /** LWR */
+	case 0x28: case 0x29: case 0x2A: case 0x2B: case 0x2E: /** Stores */
+	case 0x10: case 0x11: case 0x12: case 0x13: /** COPz */
+	case 0x30: case 0x31: case 0x32: case 0x33: /** LWCz */
+	case 0x38: case 0x39: case 0x3A: case 0x3B: /** SWCz */
+		LANES(lane_error[i] = mips_ErrorNotImplemented)
+		break;
+	default:
+		LANES(lane_error[i] = mips_ExceptionInvalidInstruction)
+	}
+
+	/** Loads go through memory one lane at a time */
+	if(length)
+	{
+		dest = rt;
+		for(i = 0; i < NUM_LANES; i++)
+		{
+			if(!(mask & (1u << i)))
+				continue;
+			lane_error[i] = load(ls->mem, a[i] + imm, length, &tmp[i]);
+			if(sign && length == 1)
+				tmp[i] = (uint32_t)(int8_t)tmp[i];
+			else if(sign && length == 2)
+				tmp[i] = (uint32_t)(int16_t)tmp[i];
+		}
+	}
+
+	/** Lanes that faulted keep their old state */
+	for(i = 0; i < NUM_LANES; i++)
+	{
+		if((mask & (1u << i)) && lane_error[i])
+		{
+			fault |= 1u << i;
+			ls->error[i] = lane_error[i];
+		}
+	}
+	mask &= ~fault;
+	LANES(sel[i] = 0 - ((mask >> i) & 1))
+	if(dest)
+		blend(ls->reg[dest], tmp, sel);
+	if(hilo)
+	{
+		blend(ls->hi, hi, sel);
+		blend(ls->lo, lo, sel);
+	}
+	link = branch ? to_mask(flag, mask) : 0;
+	for(i = 0; i < NUM_LANES; i++)
+	{
+		if(!(mask & (1u << i)))
+			continue;
+		ls->pc[i] = ls->pcN[i];
+		ls->pcN[i] = (link & (1u << i)) ? target[i] : ls->pcN[i] + 4;
+	}
+}
+
+/** Executes one instruction for every lane in 'mask'
+ *  Lanes are grouped by PC, and each group is run as one vector */
+static void step_lanes(mips_lockstep_h ls, uint32_t mask)
+{
+	uint32_t group;
+	unsigned i, first;
+	while(mask)
+	{
+		for(first = 0; !(mask & (1u << first)); first++)
+			;
+		group = 0;
+		for(i = first; i < ls->lanes; i++)
+			if((mask & (1u << i)) && ls->pc[i] == ls->pc[first]
+				&& ls->pcN[i] == ls->pcN[first])
+				group |= 1u << i;
+		mask &= ~group;
+		exec_group(ls, group);
+	}
+}
+
+/** Returns the mask of lanes that have not stopped */
+static uint32_t running(mips_lockstep_h ls)
+{
+	unsigned i;
+	uint32_t mask = 0;
+	for(i = 0; i < ls->lanes; i++)
+		if(!ls->error[i])
+			mask |= 1u << i;
+	return mask;
+}
+
+/** Creates a lockstep engine */
+mips_lockstep_h mips_lockstep_create(mips_mem_h mem, unsigned lanes)
+{
+	mips_lockstep_h ret;
+	unsigned i;
+	if(lanes == 0 || lanes > NUM_LANES)
+		return NULL;
+	ret = calloc(1, sizeof(struct mips_lockstep_impl));
+	if(ret == NULL)
+		return NULL;
+	ret->mem = mem;
+	ret->lanes = lanes;
+	LANES(ret->pcN[i] = 4)
+	return ret;
+}
+
+/** Sets one register of one lane */
+mips_error mips_lockstep_set_register(mips_lockstep_h state,
+	unsigned lane,
+	unsigned index,
+	uint32_t value)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(lane >= state->lanes || index >= 32)
+		return mips_ErrorInvalidArgument;
+	state->reg[index][lane] = index ? value : 0;
+	return mips_Success;
+}
+
+/** Gets one register of one lane */
+mips_error mips_lockstep_get_register(mips_lockstep_h state,
+	unsigned lane,
+	unsigned index,
+	uint32_t* value)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(lane >= state->lanes || index >= 32 || value == NULL)
+		return mips_ErrorInvalidArgument;
+	*value = state->reg[index][lane];
+	return mips_Success;
+}
+
+/** Moves every lane to the given PC */
+mips_error mips_lockstep_set_pc(mips_lockstep_h state, uint32_t pc)
+{
+	unsigned i;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	LANES(state->pc[i] = pc)
+	LANES(state->pcN[i] = pc + 4)
+	LANES(state->error[i] = mips_Success)
+	return mips_Success;
+}
+
+/** Gets the PC of one lane */
+mips_error mips_lockstep_get_pc(mips_lockstep_h state, unsigned lane, uint32_t* pc)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(lane >= state->lanes || pc == NULL)
+		return mips_ErrorInvalidArgument;
+	*pc = state->pc[lane];
+	return mips_Success;
+}
+
+/** Gets the error that stopped a lane */
+mips_error mips_lockstep_get_error(mips_lockstep_h state, unsigned lane, mips_error* error)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(lane >= state->lanes || error == NULL)
+		return mips_ErrorInvalidArgument;
+	*error = state->error[lane];
+	return mips_Success;
+}
+
+/** Advances every running lane by one instruction */
+mips_error mips_lockstep_step(mips_lockstep_h state)
+{
+	if(state == NULL || state->mem == NULL)
+		return mips_ErrorInvalidHandle;
+	step_lanes(state, running(state));
+	return mips_Success;
+}
+
+/** Steps until every lane has stopped or reached stop_pc */
+mips_error mips_lockstep_run(mips_lockstep_h state, uint32_t stop_pc, uint64_t budget)
+{
+	uint32_t mask;
+	unsigned i;
+	if(state == NULL || state->mem == NULL)
+		return mips_ErrorInvalidHandle;
+	while(budget--)
+	{
+		mask = running(state);
+		for(i = 0; i < state->lanes; i++)
+			if(state->pc[i] == stop_pc)
+				mask &= ~(1u << i);
+		if(!mask)
+			break;
+		step_lanes(state, mask);
+	}
+	return mips_Success;
+}
+
+/** Frees the engine */
+void mips_lockstep_free(mips_lockstep_h state)
+{
+	free(state);
+}
@@ -0,0 +1,69 @@
+#ifndef mips_cpu_lockstep_header
+#define mips_cpu_lockstep_header
+
+#include "mips_cpu.h"
+
+/** The most guest instances one lockstep engine can hold */
+#define LOCKSTEP_MAX_LANES 32
+
+/** A group of guest CPUs ('lanes') sharing one memory and
+ *  executing the same instruction stream together
+ *
+ *  The register files are held as a struct of arrays, one array of
+ *  lanes per register, so an ALU instruction is a straight loop over
+ *  every lane that the compiler turns into SIMD code. Lanes only
+ *  split into separately fetched groups when a branch sends them to
+ *  different PCs, and join up again when their PCs meet.
+ *
+ *  The memory is shared, so lanes may load but not store. Stores,
+ *  LWL, LWR and coprocessor instructions stop the lane with
+ *  mips_ErrorNotImplemented. There are no exception handlers, so
+ *  SYSCALL and BREAK stop it with mips_ExceptionSystemCall and
+ *  mips_ExceptionBreak.
+ *
+ *  The lane loops are only vectorised at -O3, as wide as the target
+ *  allows; the makefile builds this engine with -O3 $(LOCKSTEP_ARCH),
+ *  which is empty, for any host, unless set to -mavx2 or wider (see
+ *  mips_cpu_lockstep.c).
+ */
+struct mips_lockstep_impl;
+
+/** An opaque handle to a lockstep engine */
+typedef struct mips_lockstep_impl *mips_lockstep_h;
+
+/** Creates an engine with 'lanes' CPUs, all registers zero, all at PC 0 */
+mips_lockstep_h mips_lockstep_create(mips_mem_h mem, unsigned lanes);
+
+/** Sets one register of one lane */
+mips_error mips_lockstep_set_register(mips_lockstep_h state,
+	unsigned lane,
+	unsigned index,
+	uint32_t value);
+
+/** Gets one register of one lane */
+mips_error mips_lockstep_get_register(mips_lockstep_h state,
+	unsigned lane,
+	unsigned index,
+	uint32_t* value);
+
+/** Moves every lane to the given PC, and restarts any stopped lanes */
+mips_error mips_lockstep_set_pc(mips_lockstep_h state, uint32_t pc);
+
+/** Gets the PC of one lane */
+mips_error mips_lockstep_get_pc(mips_lockstep_h state, unsigned lane, uint32_t* pc);
+
+/** Gets the error that stopped a lane, or mips_Success if it is still running */
+mips_error mips_lockstep_get_error(mips_lockstep_h state, unsigned lane, mips_error* error);
+
+/** Advances every running lane by one instruction
+ *  A failing instruction stops only the lanes it failed on */
+mips_error mips_lockstep_step(mips_lockstep_h state);
+
+/** Steps until every lane has stopped or reached stop_pc,
+ *  or 'budget' steps have been taken */
+mips_error mips_lockstep_run(mips_lockstep_h state, uint32_t stop_pc, uint64_t budget);
+
+/** Frees the engine. The memory is not owned by it */
+void mips_lockstep_free(mips_lockstep_h state);
+
+#endif // mips_cpu_lockstep_header
@@ -0,0 +1,376 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Sampled reuse distance and working set profiling
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_memprof.h"
+#include "mips_cpu_state.h"
+#include <string.h>
+
+/** The smallest Fenwick tree, in sampled accesses */
+#define MIN_TREE 4096
+
+/** A sampled line, in a stream's hash table */
+typedef struct
+{
+	/** The line number plus 1, or 0 for an empty slot */
+	uint32_t key;
+	/** When it was last accessed, as an index into the tree */
+	uint32_t time;
+	/** The last window it was touched in, plus 1 */
+	uint64_t window;
+} line_entry;
+
+/** One stream's state */
+typedef struct
+{
+	mips_reuse_histogram hist;
+	line_entry* lines;
+	uint32_t table_bits, num_lines;
+	/** A Fenwick tree over access times, with a 1 at each line's last
+	 *  access. 'time' is the next one to be used */
+	uint32_t* tree;
+	uint32_t tree_size, time;
+	/** The current window, and the sampled lines touched in it */
+	uint64_t window, window_lines;
+	/** Working set sizes of the windows so far, in bytes */
+	uint64_t* sets;
+	size_t num_sets, max_sets;
+} memprof_stream;
+
+/** Profiler state */
+struct memprof
+{
+	unsigned line_shift, sample_shift;
+	uint32_t sample_mask;
+	uint64_t window;
+	memprof_stream stream[2];
+};
+
+/** The murmur3 finaliser, to pick lines for the sample */
+static uint32_t hash32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x85EBCA6B;
+	x ^= x >> 13;
+	x *= 0xC2B2AE35;
+	x ^= x >> 16;
+	return x;
+}
+
+/** The table slot to start looking for a line at. Sampled lines all
+ *  share the low bits of hash32, so this uses another hash */
+static uint32_t slot(const memprof_stream* s, uint32_t line)
+{
+	return (line * 2654435761u) >> (32 - s->table_bits);
+}
+
+/** Adds 'delta' at a tree position (from 1) */
+static void tree_add(memprof_stream* s, uint32_t i, int32_t delta)
+{
+	for(; i <= s->tree_size; i += i & -i)
+		s->tree[i - 1] += delta;
+}
+
+/** Sums the tree from position 1 to i */
+static uint32_t tree_sum(const memprof_stream* s, uint32_t i)
+{
+	uint32_t ret = 0;
+	for(; i > 0; i -= i & -i)
+		ret += s->tree[i - 1];
+	return ret;
+}
+
+/** Orders line entries by last access */
+static int compare_times(const void* a, const void* b)
+{
+	uint32_t x = (*(const line_entry* const*)a)->time, y = (*(const line_entry* const*)b)->time;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/** Renumbers the lines' access times from 0, keeping their order,
+ *  into a tree with room for as many again */
+static bool compact(memprof_stream* s)
+{
+	uint32_t size = s->num_lines * 2 > MIN_TREE ? s->num_lines * 2 : MIN_TREE;
+	uint32_t i, j, n = 0;
+	line_entry** order = malloc((s->num_lines + 1) * sizeof(line_entry*));
+	uint32_t* tree = calloc(size, sizeof(uint32_t));
+	if(order == NULL || tree == NULL)
+	{
+		free(order);
+		free(tree);
+		return false;
+	}
+	for(i = 0; s->lines != NULL && i < (1u << s->table_bits); i++)
+		if(s->lines[i].key)
+			order[n++] = &s->lines[i];
+	qsort(order, n, sizeof(line_entry*), &compare_times);
+	for(i = 0; i < n; i++)
+	{
+		order[i]->time = i;
+		tree[i] = 1;
+	}
+	/** Build the tree in place, each node adding into its parent */
+	for(i = 1; i <= size; i++)
+	{
+		j = i + (i & -i);
+		if(j <= size)
+			tree[j - 1] += tree[i - 1];
+	}
+	free(order);
+	free(s->tree);
+	s->tree = tree;
+	s->tree_size = size;
+	s->time = n;
+	return true;
+}
+
+/** Doubles the hash table */
+static bool grow_table(memprof_stream* s)
+{
+	line_entry* old = s->lines;
+	uint32_t old_size = s->lines ? 1u << s->table_bits : 0, i, j;
+	line_entry* lines = calloc((size_t)2 << s->table_bits, sizeof(line_entry));
+	if(lines == NULL)
+		return false;
+	s->lines = lines;
+	s->table_bits++;
+	for(i = 0; i < old_size; i++)
+		if(old[i].key)
+		{
+			for(j = slot(s, old[i].key - 1); lines[j].key; j = (j + 1) & ((1u << s->table_bits) - 1))
+				;
+			lines[j] = old[i];
+		}
+	free(old);
+	return true;
+}
+
+/** Finishes the windows before 'window' */
+static void close_windows(struct memprof* mp, memprof_stream* s, uint64_t window)
+{
+	uint64_t* sets;
+	size_t max;
+	/** The retired count goes back if the CPU's counters are reset */
+	while(s->window < window)
+	{
+		if(s->num_sets == s->max_sets)
+		{
+			max = s->max_sets ? s->max_sets * 2 : 256;
+			sets = realloc(s->sets, max * sizeof(uint64_t));
+			if(sets == NULL)
+				break;
+			s->sets = sets;
+			s->max_sets = max;
+		}
+		s->sets[s->num_sets++] = s->window_lines << mp->sample_shift << mp->line_shift;
+		s->window_lines = 0;
+		s->window++;
+	}
+	s->window = window;
+	s->window_lines = 0;
+}
+
+/** Follows an access to a sampled line */
+static void sample(struct memprof* mp, memprof_stream* s, uint32_t line, uint64_t retired)
+{
+	uint64_t window = mp->window ? retired / mp->window : 0, distance;
+	uint32_t i, mask;
+	unsigned bucket;
+	line_entry* e;
+	if(window != s->window)
+		close_windows(mp, s, window);
+	if(s->time == s->tree_size && !compact(s))
+		return;
+	if((s->num_lines + 1) * 2 > (1u << s->table_bits) && !grow_table(s))
+		return;
+	mask = (1u << s->table_bits) - 1;
+	for(i = slot(s, line); s->lines[i].key && s->lines[i].key != line + 1; i = (i + 1) & mask)
+		;
+	e = &s->lines[i];
+	s->hist.sampled++;
+	if(e->key == 0)
+	{
+		e->key = line + 1;
+		s->num_lines++;
+		s->hist.cold += (uint64_t)1 << mp->sample_shift;
+	}
+	else
+	{
+		/** Every line with a mark after this one's was touched since;
+		 *  this line is counted in num_lines but not in the sum */
+		distance = (uint64_t)(s->num_lines - tree_sum(s, e->time + 1)) << mp->sample_shift;
+		bucket = distance ? 64 - __builtin_clzll(distance) : 0;
+		if(bucket >= MIPS_REUSE_BUCKETS)
+			bucket = MIPS_REUSE_BUCKETS - 1;
+		s->hist.reuse[bucket] += (uint64_t)1 << mp->sample_shift;
+		tree_add(s, e->time + 1, -1);
+	}
+	e->time = s->time++;
+	tree_add(s, e->time + 1, 1);
+	if(e->window != window + 1)
+	{
+		e->window = window + 1;
+		s->window_lines++;
+	}
+}
+
+/** Notes an access; called for fetches and data accesses */
+void memprof_access(mips_cpu_h state, unsigned stream, uint32_t address)
+{
+	struct memprof* mp = state->host.memprof;
+	memprof_stream* s = &mp->stream[stream];
+	uint32_t line = address >> mp->line_shift;
+	s->hist.accesses++;
+	if(!(hash32(line) & mp->sample_mask))
+		sample(mp, s, line, state->host.stats.retired);
+}
+
+/** Frees profiler state */
+void memprof_free(struct memprof* mp)
+{
+	unsigned i;
+	if(mp == NULL)
+		return;
+	for(i = 0; i < 2; i++)
+	{
+		free(mp->stream[i].lines);
+		free(mp->stream[i].tree);
+		free(mp->stream[i].sets);
+	}
+	free(mp);
+}
+
+/** Starts or stops profiling */
+mips_error mips_cpu_set_memprof(mips_cpu_h state, const mips_memprof_config* config)
+{
+	struct memprof* mp;
+	unsigned i;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	memprof_free(state->host.memprof);
+	state->host.memprof = NULL;
+	if(config == NULL)
+		return mips_Success;
+	if(config->line_size < 4 || (config->line_size & (config->line_size - 1))
+		|| config->sample_shift > 16)
+		return mips_ErrorInvalidArgument;
+	mp = calloc(1, sizeof(struct memprof));
+	if(mp == NULL)
+		return mips_ErrorOutOfMemory;
+	mp->line_shift = __builtin_ctz(config->line_size);
+	mp->sample_shift = config->sample_shift;
+	mp->sample_mask = (1u << config->sample_shift) - 1;
+	mp->window = config->window;
+	for(i = 0; i < 2; i++)
+		if(mp->window)
+			mp->stream[i].window = state->host.stats.retired / mp->window;
+	state->host.memprof = mp;
+	return mips_Success;
+}
+
+/** Copies a histogram */
+mips_error mips_cpu_get_reuse(mips_cpu_h state,
+	mips_memprof_stream stream,
+	mips_reuse_histogram* histogram)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(histogram == NULL || stream > mips_MemprofData)
+		return mips_ErrorInvalidArgument;
+	if(state->host.memprof != NULL)
+		*histogram = state->host.memprof->stream[stream].hist;
+	else
+		memset(histogram, 0, sizeof(mips_reuse_histogram));
+	return mips_Success;
+}
+
+/** Copies working set sizes */
+mips_error mips_cpu_get_working_set(mips_cpu_h state,
+	mips_memprof_stream stream,
+	uint64_t* sizes,
+	size_t max,
+	size_t* count)
+{
+	const memprof_stream* s;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(count == NULL || (sizes == NULL && max > 0) || stream > mips_MemprofData)
+		return mips_ErrorInvalidArgument;
+	*count = 0;
+	if(state->host.memprof == NULL)
+		return mips_Success;
+	s = &state->host.memprof->stream[stream];
+	*count = s->num_sets;
+	memcpy(sizes, s->sets, (max < s->num_sets ? max : s->num_sets) * sizeof(uint64_t));
+	return mips_Success;
+}
+
+/** Estimates a miss ratio */
+double mips_reuse_miss_ratio(const mips_reuse_histogram* histogram, uint64_t lines)
+{
+	double total = (double)histogram->cold, misses = (double)histogram->cold, low, high;
+	unsigned i;
+	for(i = 0; i < MIPS_REUSE_BUCKETS; i++)
+	{
+		total += histogram->reuse[i];
+		low = i ? (double)((uint64_t)1 << (i - 1)) : 0;
+		high = i ? (double)((uint64_t)1 << i) : 1;
+		if(lines <= low)
+			misses += histogram->reuse[i];
+		else if(lines < high)
+			misses += histogram->reuse[i] * (high - lines) / (high - low);
+	}
+	return total ? misses / total : 0;
+}
+
+/** Writes one stream's report */
+static void print_stream(const struct memprof* mp, const memprof_stream* s,
+	const char* name, FILE* dest)
+{
+	uint64_t size, min = UINT64_MAX, max = 0, sum = 0;
+	size_t i;
+	fprintf(dest, "%s: %llu accesses, %llu sampled (1 line in %u, %u byte lines)\n",
+		name, (unsigned long long)s->hist.accesses, (unsigned long long)s->hist.sampled,
+		1u << mp->sample_shift, 1u << mp->line_shift);
+	fprintf(dest, "%12s %12s\n", "Cache size", "Miss ratio");
+	for(size = (uint64_t)1 << mp->line_shift << 4; size <= ((uint64_t)1 << 24); size <<= 1)
+		fprintf(dest, "%12llu %11.3f%%\n", (unsigned long long)size,
+			100 * mips_reuse_miss_ratio(&s->hist, size >> mp->line_shift));
+	for(i = 0; i < s->num_sets; i++)
+	{
+		sum += s->sets[i];
+		if(s->sets[i] < min)
+			min = s->sets[i];
+		if(s->sets[i] > max)
+			max = s->sets[i];
+	}
+	if(s->num_sets)
+		fprintf(dest, "Working set over %llu windows of %llu instructions: "
+			"min %llu, mean %llu, max %llu bytes\n",
+			(unsigned long long)s->num_sets, (unsigned long long)mp->window,
+			(unsigned long long)min, (unsigned long long)(sum / s->num_sets),
+			(unsigned long long)max);
+}
+
+/** Writes the report */
+mips_error mips_cpu_print_memprof(mips_cpu_h state, FILE* dest)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(dest == NULL)
+		return mips_ErrorInvalidArgument;
+	if(state->host.memprof == NULL)
+		return mips_Success;
+	print_stream(state->host.memprof, &state->host.memprof->stream[mips_MemprofFetch],
+		"Instruction fetches", dest);
+	fputc('\n', dest);
+	print_stream(state->host.memprof, &state->host.memprof->stream[mips_MemprofData],
+		"Data accesses", dest);
+	return ferror(dest) ? mips_ErrorFileWriteError : mips_Success;
+}
@@ -0,0 +1,94 @@
+#ifndef mips_cpu_memprof_header
+#define mips_cpu_memprof_header
+
+#include "mips_cpu.h"
+#include <stdio.h>
+
+/** How the guest uses memory, for sizing caches and RAM
+ *
+ *  Instruction fetches and data accesses (loads and stores, after
+ *  address translation) are followed as two streams of cache line
+ *  addresses. For each, the profiler keeps:
+ *
+ *  - A reuse distance histogram: for every access, the number of
+ *    other lines touched since the last access to the same line. A
+ *    fully associative LRU cache of C lines misses exactly on the
+ *    accesses with a distance of C or more, and on first touches, so
+ *    the histogram gives the miss ratio of every cache size at once.
+ *  - The working set: the bytes of distinct lines touched in each
+ *    window of so many retired instructions.
+ *
+ *  Following every line exactly would cost memory in proportion to
+ *  the footprint, so lines are sampled by a hash of their address, as
+ *  SHARDS does: only lines whose hash falls in 1 of 2^sample_shift
+ *  are followed, and the distances and counts seen are scaled up by
+ *  2^sample_shift. The same line is always in or out of the sample, so
+ *  its reuses are seen whole. Distances among the sampled lines are
+ *  counted with a Fenwick tree over access times, so each sampled
+ *  access costs O(log n) in the number of sampled lines; the rest cost
+ *  one hash and a compare. A shift of 6 to 10 keeps the error to a few
+ *  percent on programs with more than a few thousand lines. */
+
+/** The two streams */
+typedef enum
+{
+	mips_MemprofFetch,
+	mips_MemprofData
+} mips_memprof_stream;
+
+/** Reuse distance histogram buckets: bucket 0 holds distances of 0,
+ *  and bucket i distances from 2^(i-1) to 2^i - 1 lines */
+#define MIPS_REUSE_BUCKETS 33
+
+/** Profiler settings */
+typedef struct
+{
+	/** Bytes in a cache line: a power of 2, at least 4 */
+	unsigned line_size;
+	/** Lines are followed at a rate of 1 in 2^sample_shift (0 to 16) */
+	unsigned sample_shift;
+	/** Instructions per working set window, or 0 for none */
+	uint64_t window;
+} mips_memprof_config;
+
+/** One stream's reuse distances. Everything but 'accesses' is scaled
+ *  up from the sample */
+typedef struct
+{
+	/** Every access in the stream */
+	uint64_t accesses;
+	/** First touches of a line */
+	uint64_t cold;
+	/** Reuses by distance, in lines */
+	uint64_t reuse[MIPS_REUSE_BUCKETS];
+	/** Accesses seen in the sample, before scaling */
+	uint64_t sampled;
+} mips_reuse_histogram;
+
+/** Starts profiling, clearing any previous profile, or stops and
+ *  frees it if 'config' is NULL */
+mips_error mips_cpu_set_memprof(mips_cpu_h state, const mips_memprof_config* config);
+
+/** Copies a stream's reuse distance histogram */
+mips_error mips_cpu_get_reuse(mips_cpu_h state,
+	mips_memprof_stream stream,
+	mips_reuse_histogram* histogram);
+
+/** Copies up to 'max' working set sizes, in bytes, of a stream's
+ *  complete windows, oldest first, and sets 'count' to the number
+ *  there are */
+mips_error mips_cpu_get_working_set(mips_cpu_h state,
+	mips_memprof_stream stream,
+	uint64_t* sizes,
+	size_t max,
+	size_t* count);
+
+/** Estimates the miss ratio of a fully associative LRU cache of
+ *  'lines' lines, interpolating within the histogram's buckets */
+double mips_reuse_miss_ratio(const mips_reuse_histogram* histogram, uint64_t lines);
+
+/** Writes miss ratios for a range of cache sizes, and a summary of
+ *  the working set, for both streams */
+mips_error mips_cpu_print_memprof(mips_cpu_h state, FILE* dest);
+
+#endif // mips_cpu_memprof_header
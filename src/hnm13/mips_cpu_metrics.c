@@ -0,0 +1,245 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Live counters in a shared memory segment
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_metrics.h"
+#include "mips_cpu_state.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** Slots must stay a whole number of cache lines */
+typedef char slot_size_check[sizeof(mips_metrics_slot) % 64 == 0 ? 1 : -1];
+
+/** The header is padded to a cache line too */
+#define HEADER_SIZE 64
+
+/** A segment being written */
+struct mips_metrics_impl
+{
+	/** Held while a slot is claimed or released */
+	pthread_mutex_t lock;
+	char* name;
+	mips_metrics_header* header;
+	size_t length;
+};
+
+/** Returns a slot of a segment */
+static mips_metrics_slot* slot_at(const mips_metrics_header* header, unsigned index)
+{
+	return (mips_metrics_slot*)((uint8_t*)header + header->header_size
+		+ (size_t)index * header->slot_size);
+}
+
+/** Reads a clock in nanoseconds */
+static uint64_t now(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Stores a counter, for a reader in another process */
+#define PUBLISH(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+/** Copies the CPU's counters to its slot; called from mips_cpu_step */
+void metrics_publish(mips_cpu_h state)
+{
+	mips_metrics_slot* slot = state->host.metrics;
+	const mips_cpu_stats* stats = &state->host.stats;
+	uint64_t errors[4] = {0, 0, 0, 0};
+	unsigned i, j;
+	state->host.metrics_countdown = state->host.metrics_period;
+	for(i = 1; i < 4; i++)
+		for(j = 0; j < 16; j++)
+			errors[i] += stats->errors[i][j];
+	PUBLISH(slot->pc, state->pc);
+	PUBLISH(slot->retired, stats->retired);
+	PUBLISH(slot->branches, stats->branches_taken + stats->branches_not_taken);
+	PUBLISH(slot->loads, stats->loads[0] + stats->loads[1] + stats->loads[2]);
+	PUBLISH(slot->stores, stats->stores[0] + stats->stores[1] + stats->stores[2]);
+	PUBLISH(slot->errors, errors[1]);
+	PUBLISH(slot->exceptions, errors[2]);
+	PUBLISH(slot->internal, errors[3]);
+	PUBLISH(slot->updated, now(CLOCK_MONOTONIC));
+}
+
+/** Creates a segment */
+mips_metrics_h mips_metrics_create(const char* name, unsigned slots)
+{
+	mips_metrics_h ret;
+	int fd;
+	if(name == NULL || slots == 0)
+		return NULL;
+	ret = calloc(1, sizeof(struct mips_metrics_impl));
+	if(ret == NULL)
+		return NULL;
+	ret->name = malloc(strlen(name) + 1);
+	ret->length = HEADER_SIZE + (size_t)slots * sizeof(mips_metrics_slot);
+	fd = ret->name == NULL ? -1 : shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd >= 0 && ftruncate(fd, ret->length) == 0)
+		ret->header = mmap(NULL, ret->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(fd >= 0)
+		close(fd);
+	if(ret->header == NULL || ret->header == MAP_FAILED)
+	{
+		if(fd >= 0)
+			shm_unlink(name);
+		free(ret->name);
+		free(ret);
+		return NULL;
+	}
+	strcpy(ret->name, name);
+	pthread_mutex_init(&ret->lock, NULL);
+	/** The object is new and zeroed, so every slot starts free */
+	ret->header->version = MIPS_METRICS_VERSION;
+	ret->header->header_size = HEADER_SIZE;
+	ret->header->slot_size = sizeof(mips_metrics_slot);
+	ret->header->num_slots = slots;
+	ret->header->pid = (uint32_t)getpid();
+	ret->header->created = now(CLOCK_REALTIME);
+	/** Written last, so a reader that sees it sees the rest */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(ret->header->magic, MIPS_METRICS_MAGIC, 8);
+	return ret;
+}
+
+/** Gives up a CPU's slot */
+static void detach(mips_cpu_h state)
+{
+	mips_metrics_h metrics = state->host.metrics_segment;
+	metrics_publish(state);
+	pthread_mutex_lock(&metrics->lock);
+	__atomic_store_n(&state->host.metrics->state, MIPS_METRICS_DETACHED, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&metrics->lock);
+	state->host.metrics = NULL;
+	state->host.metrics_segment = NULL;
+}
+
+/** Attaches or detaches a CPU */
+mips_error mips_cpu_set_metrics(mips_cpu_h state,
+	mips_metrics_h metrics,
+	unsigned period,
+	const char* label)
+{
+	mips_metrics_slot* slot = NULL;
+	unsigned i;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(metrics != NULL && period == 0)
+		return mips_ErrorInvalidArgument;
+	if(state->host.metrics != NULL)
+		detach(state);
+	if(metrics == NULL)
+		return mips_Success;
+	/** Take a free slot, or failing that, one left by a CPU that has
+	 *  finished */
+	pthread_mutex_lock(&metrics->lock);
+	for(i = 0; i < metrics->header->num_slots && slot == NULL; i++)
+		if(slot_at(metrics->header, i)->state == MIPS_METRICS_FREE)
+			slot = slot_at(metrics->header, i);
+	for(i = 0; i < metrics->header->num_slots && slot == NULL; i++)
+		if(slot_at(metrics->header, i)->state == MIPS_METRICS_DETACHED)
+			slot = slot_at(metrics->header, i);
+	if(slot != NULL)
+	{
+		/** Hide it from readers while the label changes */
+		__atomic_store_n(&slot->state, MIPS_METRICS_FREE, __ATOMIC_RELAXED);
+		memset(slot->label, 0, sizeof(slot->label));
+		if(label != NULL)
+			strncpy(slot->label, label, sizeof(slot->label) - 1);
+		PUBLISH(slot->cpu_id, state->cpu_id);
+		state->host.metrics = slot;
+		state->host.metrics_segment = metrics;
+		state->host.metrics_period = period;
+		metrics_publish(state);
+		__atomic_store_n(&slot->state, MIPS_METRICS_RUNNING, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&metrics->lock);
+	return slot != NULL ? mips_Success : mips_ErrorInvalidArgument;
+}
+
+/** Publishes now */
+mips_error mips_cpu_publish_metrics(mips_cpu_h state)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(state->host.metrics != NULL)
+		metrics_publish(state);
+	return mips_Success;
+}
+
+/** Removes a segment */
+void mips_metrics_free(mips_metrics_h metrics)
+{
+	if(metrics == NULL)
+		return;
+	munmap(metrics->header, metrics->length);
+	shm_unlink(metrics->name);
+	pthread_mutex_destroy(&metrics->lock);
+	free(metrics->name);
+	free(metrics);
+}
+
+/** Maps a segment for reading */
+const mips_metrics_header* mips_metrics_open(const char* name, size_t* length)
+{
+	mips_metrics_header* header;
+	struct stat st;
+	int fd;
+	if(name == NULL || length == NULL)
+		return NULL;
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) || (size_t)st.st_size < sizeof(mips_metrics_header))
+	{
+		close(fd);
+		return NULL;
+	}
+	*length = st.st_size;
+	header = mmap(NULL, *length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(header == MAP_FAILED)
+		return NULL;
+	/** Check the magic first; the rest is only valid once it is set */
+	if(memcmp(header->magic, MIPS_METRICS_MAGIC, 8) != 0)
+	{
+		munmap(header, *length);
+		return NULL;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(header->version != MIPS_METRICS_VERSION
+		|| header->header_size < sizeof(mips_metrics_header)
+		|| header->slot_size < sizeof(mips_metrics_slot)
+		|| header->header_size + (size_t)header->num_slots * header->slot_size > *length)
+	{
+		munmap(header, *length);
+		return NULL;
+	}
+	return header;
+}
+
+/** Returns a slot of a mapped segment */
+const mips_metrics_slot* mips_metrics_get_slot(const mips_metrics_header* header, unsigned index)
+{
+	if(header == NULL || index >= header->num_slots)
+		return NULL;
+	return slot_at(header, index);
+}
+
+/** Unmaps a segment */
+void mips_metrics_close(const mips_metrics_header* header, size_t length)
+{
+	if(header != NULL)
+		munmap((void*)header, length);
+}
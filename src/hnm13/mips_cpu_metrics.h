@@ -0,0 +1,104 @@
+#ifndef mips_cpu_metrics_header
+#define mips_cpu_metrics_header
+
+#include "mips_cpu.h"
+
+/** Live counters, published through shared memory
+ *
+ *  A metrics segment is a POSIX shared memory object (see shm_open)
+ *  holding a header and a fixed number of slots. Each CPU attached to
+ *  the segment claims a slot, and every so many instructions copies
+ *  its counters into it with relaxed atomic stores, so publishing
+ *  never waits for anything and a reader in another process never
+ *  sees a torn value. A reader may see one counter from a later
+ *  update than another, but each is correct as of some recent moment.
+ *
+ *  The layout is versioned. A reader should check the magic and
+ *  version, and step through the slots by 'slot_size' rather than
+ *  sizeof(mips_metrics_slot): later versions may add fields to the
+ *  end of the header or of a slot, but will not move existing ones. */
+
+/** The first 8 bytes of a segment */
+#define MIPS_METRICS_MAGIC "MIPSMETR"
+
+/** The layout described here */
+#define MIPS_METRICS_VERSION 1
+
+/** Slot states */
+#define MIPS_METRICS_FREE 0
+#define MIPS_METRICS_RUNNING 1
+#define MIPS_METRICS_DETACHED 2
+
+/** The start of a segment */
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t slot_size;
+	uint32_t num_slots;
+	/** The process that created the segment */
+	uint32_t pid;
+	uint32_t reserved;
+	/** When it was created, in nanoseconds since the epoch */
+	uint64_t created;
+} mips_metrics_header;
+
+/** One CPU's counters. Every field is written with a relaxed atomic
+ *  store, and should be read with a relaxed atomic load */
+typedef struct
+{
+	/** One of the MIPS_METRICS_ states */
+	uint32_t state;
+	/** The CPU's number (see mips_cpu_set_id) */
+	uint32_t cpu_id;
+	/** When the slot was last written, from CLOCK_MONOTONIC, in ns */
+	uint64_t updated;
+	/** The PC, and the counters of mips_cpu_stats */
+	uint64_t pc;
+	uint64_t retired;
+	uint64_t branches;
+	uint64_t loads, stores;
+	/** Instructions that failed: errors, exceptions and internal
+	 *  errors (see mips_error) */
+	uint64_t errors, exceptions, internal;
+	/** Set by the owner when the slot is claimed; not updated after */
+	char label[32];
+	/** Padding to a whole number of cache lines */
+	uint8_t reserved[16];
+} mips_metrics_slot;
+
+/** An opaque handle to a segment being written */
+struct mips_metrics_impl;
+typedef struct mips_metrics_impl *mips_metrics_h;
+
+/** Creates a segment of 'slots' slots, called 'name' (starting with
+ *  a '/', as for shm_open), replacing any there was */
+mips_metrics_h mips_metrics_create(const char* name, unsigned slots);
+
+/** Attaches a CPU to a slot of a segment, publishing every 'period'
+ *  instructions and whenever mips_cpu_run returns, or detaches it if
+ *  'metrics' is NULL. The label may be NULL. Fails with
+ *  mips_ErrorInvalidArgument if every slot is taken */
+mips_error mips_cpu_set_metrics(mips_cpu_h state,
+	mips_metrics_h metrics,
+	unsigned period,
+	const char* label);
+
+/** Writes the CPU's counters to its slot now */
+mips_error mips_cpu_publish_metrics(mips_cpu_h state);
+
+/** Removes a segment. Attached CPUs must be detached first */
+void mips_metrics_free(mips_metrics_h metrics);
+
+/** Maps a segment read-only, checking its magic and version, and
+ *  returns its header, or NULL. 'length' is set to the mapped size */
+const mips_metrics_header* mips_metrics_open(const char* name, size_t* length);
+
+/** Returns a slot of a mapped segment */
+const mips_metrics_slot* mips_metrics_get_slot(const mips_metrics_header* header, unsigned index);
+
+/** Unmaps a segment mapped by mips_metrics_open */
+void mips_metrics_close(const mips_metrics_header* header, size_t length);
+
+#endif // mips_cpu_metrics_header
@@ -0,0 +1,221 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * R3000-style system control coprocessor (COP0):
+ * kuseg/kseg0/kseg1/kseg2 segmentation and a software-managed TLB
+ *
+ * Translations are looked up in a direct-mapped host cache before
+ * the TLB itself is searched. Any instruction that writes the TLB
+ * flushes the cache.
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_state.h"
+#include "mips_cpu_extend.h"
+#include <string.h>
+
+/** COP0 register numbers */
+#define COP0_INDEX 0
+#define COP0_RANDOM 1
+#define COP0_ENTRYLO 2
+#define COP0_CONTEXT 4
+#define COP0_BADVADDR 8
+#define COP0_ENTRYHI 10
+#define COP0_STATUS 12
+#define COP0_CAUSE 13
+#define COP0_EPC 14
+#define COP0_PRID 15
+
+/** EntryHi fields */
+#define ENTRYHI_VPN 0xFFFFF000
+#define ENTRYHI_ASID 0x00000FC0
+/** EntryLo fields */
+#define ENTRYLO_PFN 0xFFFFF000
+#define ENTRYLO_N 0x800
+#define ENTRYLO_D 0x400
+#define ENTRYLO_V 0x200
+#define ENTRYLO_G 0x100
+/** Status fields */
+#define STATUS_KUC 0x2
+/** Index fields */
+#define INDEX_P 0x80000000
+
+/** Cause.ExcCode values for memory management exceptions */
+#define EXC_MOD 1
+#define EXC_TLBL 2
+#define EXC_TLBS 3
+#define EXC_ADEL 4
+#define EXC_ADES 5
+
+/** The lowest index TLBWR will write to */
+#define TLB_WIRED 8
+/** Processor revision: R3000A */
+#define PRID_R3000A 0x0230
+
+/** Bits of each register the guest can write with MTC0 */
+static const uint32_t write_mask[16] =
+{
+	0x00003F00, 0, 0xFFFFFF00, 0,
+	0xFFE00000, 0, 0, 0,
+	0, 0, 0xFFFFFFC0, 0,
+	0xF25FFF3F, 0x00000300, 0xFFFFFFFF, 0
+};
+
+/** Puts the MMU registers into their power-on state */
+void mmu_init(mips_mmu* mmu)
+{
+	memset(mmu, 0, sizeof(*mmu));
+	mmu->reg[COP0_RANDOM] = (TLB_SIZE - 1) << 8;
+	mmu->reg[COP0_PRID] = PRID_R3000A;
+}
+
+/** Records the faulting address and cause, and returns the error */
+static mips_error mmu_fault(mips_mmu* mmu, uint32_t address, unsigned code, mips_error error)
+{
+	uint32_t* reg = mmu->reg;
+	reg[COP0_BADVADDR] = address;
+	reg[COP0_CAUSE] = (reg[COP0_CAUSE] & ~0x7C) | (code << 2);
+	if(code <= EXC_TLBS)
+	{
+		reg[COP0_ENTRYHI] = (address & ENTRYHI_VPN) | (reg[COP0_ENTRYHI] & ENTRYHI_ASID);
+		reg[COP0_CONTEXT] = (reg[COP0_CONTEXT] & 0xFFE00000) | ((address >> 10) & 0x1FFFFC);
+	}
+	return error;
+}
+
+/** Searches the TLB for a matching entry
+ *  Returns the index, or -1 if none was found */
+static int tlb_find(mips_mmu* mmu, uint32_t vpn, uint32_t asid)
+{
+	int i;
+	tlb_entry* tlb = mmu->tlb;
+	for(i = 0; i < TLB_SIZE; i++)
+	{
+		if((tlb[i].hi & ENTRYHI_VPN) == vpn &&
+			((tlb[i].lo & ENTRYLO_G) || (tlb[i].hi & ENTRYHI_ASID) == asid))
+			return i;
+	}
+	return -1;
+}
+
+/** Translates a virtual address (cop_translate) */
+static mips_error mmu_translate(mips_cpu_h state, uint32_t address, mem_access access, uint32_t* physical)
+{
+	mips_mmu* mmu = &state->mmu;
+	uint32_t vpn, asid, lo;
+	tlb_entry* line;
+	int index;
+	bool store = (access == mem_store);
+	if(address & 0x80000000)
+	{
+		if(mmu->reg[COP0_STATUS] & STATUS_KUC)
+			return mmu_fault(mmu, address, store ? EXC_ADES : EXC_ADEL,
+				mips_ExceptionInvalidAddress);
+		/** kseg0 and kseg1 are unmapped windows onto the first 512MB */
+		if(address < 0xC0000000)
+		{
+			*physical = address & 0x1FFFFFFF;
+			return mips_Success;
+		}
+	}
+	vpn = address & ENTRYHI_VPN;
+	asid = mmu->reg[COP0_ENTRYHI] & ENTRYHI_ASID;
+	line = &mmu->cache[(address >> 12) & (TLB_CACHE_SIZE - 1)];
+	if(line->hi == (vpn | asid | 1))
+	{
+		lo = line->lo;
+	}
+	else
+	{
+		index = tlb_find(mmu, vpn, asid);
+		if(index < 0 || !(mmu->tlb[index].lo & ENTRYLO_V))
+			return mmu_fault(mmu, address, store ? EXC_TLBS : EXC_TLBL,
+				mips_ExceptionInvalidAddress);
+		lo = mmu->tlb[index].lo;
+		line->hi = vpn | asid | 1;
+		line->lo = lo;
+	}
+	if(store && !(lo & ENTRYLO_D))
+		return mmu_fault(mmu, address, EXC_MOD, mips_ExceptionAccessViolation);
+	*physical = (lo & ENTRYLO_PFN) | (address & ~ENTRYHI_VPN);
+	return mips_Success;
+}
+
+/** Writes EntryHi/EntryLo into the given TLB slot */
+static void tlb_write(mips_mmu* mmu, unsigned index)
+{
+	mmu->tlb[index].hi = mmu->reg[COP0_ENTRYHI];
+	mmu->tlb[index].lo = mmu->reg[COP0_ENTRYLO];
+	memset(mmu->cache, 0, sizeof(mmu->cache));
+}
+
+/** COP0 instructions: MFC0, MTC0, TLBR, TLBWI, TLBWR, TLBP, RFE (op) */
+static mips_error mmu_cop(mips_cpu_h state, uint32_t instruction)
+{
+	mips_mmu* mmu = &state->mmu;
+	uint32_t* reg = mmu->reg;
+	unsigned rs = (instruction >> 21) & 0x1F;
+	unsigned rt = (instruction >> 16) & 0x1F;
+	unsigned rd = (instruction >> 11) & 0x1F;
+	unsigned index;
+	int found;
+	if(rs & 0x10)
+	{
+		switch(instruction & 0x3F)
+		{
+		case 0x01: /** TLBR */
+			index = (reg[COP0_INDEX] >> 8) & (TLB_SIZE - 1);
+			reg[COP0_ENTRYHI] = mmu->tlb[index].hi;
+			reg[COP0_ENTRYLO] = mmu->tlb[index].lo;
+			break;
+		case 0x02: /** TLBWI */
+			tlb_write(mmu, (reg[COP0_INDEX] >> 8) & (TLB_SIZE - 1));
+			break;
+		case 0x06: /** TLBWR */
+			index = (reg[COP0_RANDOM] >> 8) & (TLB_SIZE - 1);
+			tlb_write(mmu, index);
+			index = (index <= TLB_WIRED) ? TLB_SIZE - 1 : index - 1;
+			reg[COP0_RANDOM] = index << 8;
+			break;
+		case 0x08: /** TLBP */
+			found = tlb_find(mmu, reg[COP0_ENTRYHI] & ENTRYHI_VPN,
+				reg[COP0_ENTRYHI] & ENTRYHI_ASID);
+			reg[COP0_INDEX] = (found < 0) ? INDEX_P : (unsigned)found << 8;
+			break;
+		case 0x10: /** RFE: pop the KU/IE stack */
+			reg[COP0_STATUS] = (reg[COP0_STATUS] & ~0xF) | ((reg[COP0_STATUS] >> 2) & 0xF);
+			break;
+		default:
+			return mips_ExceptionInvalidInstruction;
+		}
+		return mips_Success;
+	}
+	if(rd >= 16)
+		return mips_ExceptionInvalidInstruction;
+	switch(rs)
+	{
+	case 0: /** MFC0 */
+		set_reg(state, rt, reg[rd]);
+		break;
+	case 4: /** MTC0 */
+		reg[rd] = (reg[rd] & ~write_mask[rd]) | (state->reg[rt] & write_mask[rd]);
+		break;
+	default:
+		return mips_ExceptionInvalidInstruction;
+	}
+	return mips_Success;
+}
+
+/** Attaches the MMU as coprocessor 0 */
+mips_error mips_cpu_enable_mmu(mips_cpu_h state)
+{
+	coprocessor cp = {0};
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	cp.cop = &mmu_cop;
+	cp.translate = &mmu_translate;
+	mmu_init(&state->mmu);
+	return mips_cpu_set_coprocessor(state, 0, cp);
+}
@@ -0,0 +1,189 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Instrumentation plugins
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_plugin.h"
+#include "mips_cpu_state.h"
+#include <string.h>
+
+/** An added plugin */
+typedef struct
+{
+	mips_plugin callbacks;
+	void* user;
+	unsigned id;
+} plugin_entry;
+
+/** A CPU's plugins, in the order they were added */
+struct plugin_set
+{
+	plugin_entry* entries;
+	unsigned count;
+	unsigned next_id;
+	/** The PC that follows the last instruction reported, to find the
+	 *  start of each block; 'started' is cleared until there is one */
+	uint32_t next_pc;
+	bool started;
+};
+
+/** Whether a plugin hears of events at a PC */
+static bool in_range(const plugin_entry* entry, uint32_t pc)
+{
+	const mips_plugin* p = &entry->callbacks;
+	return (p->start == 0 && p->end == 0) || (pc >= p->start && pc < p->end);
+}
+
+/** Works out which kinds of event are wanted */
+static void update_mask(mips_cpu_h state)
+{
+	const plugin_set* set = state->host.plugins;
+	unsigned i, mask = 0;
+	for(i = 0; i < set->count; i++)
+	{
+		if(set->entries[i].callbacks.instruction != NULL)
+			mask |= plugin_kind_instruction;
+		if(set->entries[i].callbacks.block != NULL)
+			mask |= plugin_kind_block;
+		if(set->entries[i].callbacks.memory != NULL)
+			mask |= plugin_kind_memory;
+		if(set->entries[i].callbacks.branch != NULL)
+			mask |= plugin_kind_branch;
+		if(set->entries[i].callbacks.exception != NULL)
+			mask |= plugin_kind_exception;
+	}
+	state->host.plugin_mask = mask;
+}
+
+/** Reports an instruction, and the block it starts if any */
+void plugin_step(mips_cpu_h state, uint32_t instruction)
+{
+	plugin_set* set = state->host.plugins;
+	const plugin_entry* entry;
+	uint32_t pc = state->pc;
+	bool block = !set->started || pc != set->next_pc;
+	unsigned i;
+	set->started = true;
+	set->next_pc = pc + 4;
+	for(i = 0; i < set->count; i++)
+	{
+		entry = &set->entries[i];
+		if(!in_range(entry, pc))
+			continue;
+		if(block && entry->callbacks.block != NULL)
+			entry->callbacks.block(entry->user, state, pc);
+		if(entry->callbacks.instruction != NULL)
+			entry->callbacks.instruction(entry->user, state, pc, instruction);
+	}
+}
+
+/** Reports a load or store */
+void plugin_memory(mips_cpu_h state, uint32_t address, unsigned length, bool store)
+{
+	const plugin_set* set = state->host.plugins;
+	const plugin_entry* entry;
+	unsigned i;
+	for(i = 0; i < set->count; i++)
+	{
+		entry = &set->entries[i];
+		if(entry->callbacks.memory != NULL && in_range(entry, state->pc))
+			entry->callbacks.memory(entry->user, state, state->pc, address, length, store);
+	}
+}
+
+/** Reports a branch */
+void plugin_branch(mips_cpu_h state, uint32_t target, bool taken)
+{
+	const plugin_set* set = state->host.plugins;
+	const plugin_entry* entry;
+	unsigned i;
+	for(i = 0; i < set->count; i++)
+	{
+		entry = &set->entries[i];
+		if(entry->callbacks.branch != NULL && in_range(entry, state->pc))
+			entry->callbacks.branch(entry->user, state, state->pc, target, taken);
+	}
+}
+
+/** Reports a failed instruction */
+void plugin_exception(mips_cpu_h state, mips_error error)
+{
+	const plugin_set* set = state->host.plugins;
+	const plugin_entry* entry;
+	unsigned i;
+	for(i = 0; i < set->count; i++)
+	{
+		entry = &set->entries[i];
+		if(entry->callbacks.exception != NULL && in_range(entry, state->pc))
+			entry->callbacks.exception(entry->user, state, state->pc, error);
+	}
+}
+
+/** Adds a plugin */
+mips_error mips_cpu_add_plugin(mips_cpu_h state,
+	const mips_plugin* plugin,
+	void* user,
+	unsigned* id)
+{
+	plugin_set* set;
+	plugin_entry* entries;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(plugin == NULL || plugin->end < plugin->start)
+		return mips_ErrorInvalidArgument;
+	if(state->host.plugins == NULL)
+	{
+		state->host.plugins = calloc(1, sizeof(plugin_set));
+		if(state->host.plugins == NULL)
+			return mips_ErrorOutOfMemory;
+	}
+	set = state->host.plugins;
+	entries = realloc(set->entries, (set->count + 1) * sizeof(plugin_entry));
+	if(entries == NULL)
+		return mips_ErrorOutOfMemory;
+	set->entries = entries;
+	entries[set->count].callbacks = *plugin;
+	entries[set->count].user = user;
+	entries[set->count].id = set->next_id++;
+	if(id != NULL)
+		*id = entries[set->count].id;
+	set->count++;
+	/** The first instruction seen from now on starts a block */
+	set->started = false;
+	update_mask(state);
+	return mips_Success;
+}
+
+/** Removes a plugin */
+mips_error mips_cpu_remove_plugin(mips_cpu_h state, unsigned id)
+{
+	plugin_set* set;
+	unsigned i;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	set = state->host.plugins;
+	for(i = 0; set != NULL && i < set->count; i++)
+	{
+		if(set->entries[i].id == id)
+		{
+			memmove(&set->entries[i], &set->entries[i + 1],
+				(set->count - i - 1) * sizeof(plugin_entry));
+			set->count--;
+			update_mask(state);
+			return mips_Success;
+		}
+	}
+	return mips_ErrorInvalidArgument;
+}
+
+/** Frees a CPU's plugins */
+void plugin_free(plugin_set* set)
+{
+	if(set != NULL)
+		free(set->entries);
+	free(set);
+}
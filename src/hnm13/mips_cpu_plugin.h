@@ -0,0 +1,79 @@
+#ifndef mips_cpu_plugin_header
+#define mips_cpu_plugin_header
+
+#include "mips_cpu.h"
+#include <stdbool.h>
+
+/** Instrumentation plugins
+ *
+ *  A plugin is a set of callbacks, one for each kind of event, any of
+ *  which may be NULL. The CPU keeps a mask of the kinds some plugin
+ *  wants, and each place an event can come from tests its bit before
+ *  doing anything else, so a kind no plugin wants costs one test of a
+ *  word already in cache, and a CPU with no plugins runs as before.
+ *
+ *  A plugin may also give a range of PCs, and then only hears of
+ *  events from instructions in that range.
+ *
+ *  Callbacks run on the thread stepping the CPU, in the order the
+ *  plugins were added. They may read the CPU's state, but must not
+ *  step, reset or free it, nor add or remove plugins. */
+
+/** Before an instruction runs, with the word fetched */
+typedef void (*mips_plugin_instruction_fn)(void* user,
+	mips_cpu_h state,
+	uint32_t pc,
+	uint32_t instruction);
+
+/** Before the first instruction of a basic block runs: one not
+ *  reached by stepping on from the instruction before it */
+typedef void (*mips_plugin_block_fn)(void* user,
+	mips_cpu_h state,
+	uint32_t pc);
+
+/** After a load or store of 'length' bytes at a physical address */
+typedef void (*mips_plugin_memory_fn)(void* user,
+	mips_cpu_h state,
+	uint32_t pc,
+	uint32_t address,
+	unsigned length,
+	bool store);
+
+/** When a branch or jump is decided: 'target' is where it goes, or
+ *  would have gone, after its delay slot */
+typedef void (*mips_plugin_branch_fn)(void* user,
+	mips_cpu_h state,
+	uint32_t pc,
+	uint32_t target,
+	bool taken);
+
+/** When an instruction fails with an exception or error */
+typedef void (*mips_plugin_exception_fn)(void* user,
+	mips_cpu_h state,
+	uint32_t pc,
+	mips_error error);
+
+/** A plugin's callbacks */
+typedef struct
+{
+	mips_plugin_instruction_fn instruction;
+	mips_plugin_block_fn block;
+	mips_plugin_memory_fn memory;
+	mips_plugin_branch_fn branch;
+	mips_plugin_exception_fn exception;
+	/** Only events from PCs in [start, end) are reported, unless both
+	 *  are 0 */
+	uint32_t start, end;
+} mips_plugin;
+
+/** Adds a plugin, copying its callbacks, which will be passed 'user'.
+ *  The number to remove it by is written to 'id' if given */
+mips_error mips_cpu_add_plugin(mips_cpu_h state,
+	const mips_plugin* plugin,
+	void* user,
+	unsigned* id);
+
+/** Removes a plugin */
+mips_error mips_cpu_remove_plugin(mips_cpu_h state, unsigned id);
+
+#endif // mips_cpu_plugin_header
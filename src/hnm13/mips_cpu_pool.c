@@ -0,0 +1,161 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Arena allocation of CPU and RAM instances
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_pool.h"
+#include "mips_cpu_state.h"
+#include "mips_cpu_extend.h"
+#include <string.h>
+
+/** The size of a host cache line */
+#define CACHE_LINE 64
+
+/** Rounds a size up to a whole number of cache lines */
+#define LINE_ROUND(x) (((x) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1))
+
+/** One block of slots */
+typedef struct arena
+{
+	struct arena* next;
+	/** What malloc returned, and the first slot within it */
+	void* block;
+	uint8_t* base;
+} arena;
+
+/** Pool state */
+struct mips_pool_impl
+{
+	unsigned capacity;
+	uint32_t mem_size, block_size;
+	/** Bytes per slot: the CPU, then the RAM */
+	size_t slot_size, cpu_size;
+	arena* arenas;
+	/** The free slots, as a stack */
+	uint8_t** free;
+	unsigned free_count, total;
+};
+
+/** Allocates another arena, and puts all its slots on the free stack */
+static mips_error add_arena(mips_pool_h pool)
+{
+	arena* a = malloc(sizeof(arena));
+	uint8_t** stack = realloc(pool->free, (pool->total + pool->capacity) * sizeof(uint8_t*));
+	unsigned i;
+	if(stack != NULL)
+		pool->free = stack;
+	if(a == NULL || stack == NULL)
+	{
+		free(a);
+		return mips_ErrorOutOfMemory;
+	}
+	a->block = malloc(pool->slot_size * pool->capacity + CACHE_LINE - 1);
+	if(a->block == NULL)
+	{
+		free(a);
+		return mips_ErrorOutOfMemory;
+	}
+	a->base = (uint8_t*)LINE_ROUND((uintptr_t)a->block);
+	/** A slot whose CPU has no memory is free; see mips_pool_free */
+	for(i = pool->capacity; i-- > 0;)
+	{
+		((mips_cpu_h)(a->base + i * pool->slot_size))->mem = NULL;
+		pool->free[pool->free_count++] = a->base + i * pool->slot_size;
+	}
+	a->next = pool->arenas;
+	pool->arenas = a;
+	pool->total += pool->capacity;
+	return mips_Success;
+}
+
+/** Creates a pool */
+mips_pool_h mips_pool_create(unsigned capacity, uint32_t mem_size, uint32_t block_size)
+{
+	mips_pool_h ret;
+	if(capacity == 0 || mem_size == 0)
+		return NULL;
+	ret = calloc(1, sizeof(struct mips_pool_impl));
+	if(ret == NULL)
+		return NULL;
+	ret->capacity = capacity;
+	ret->mem_size = mem_size;
+	ret->block_size = block_size;
+	ret->cpu_size = LINE_ROUND(sizeof(struct mips_cpu_impl));
+	ret->slot_size = ret->cpu_size + LINE_ROUND(mips_mem_ram_footprint(mem_size));
+	if(add_arena(ret))
+	{
+		mips_pool_free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/** Takes an instance from the pool */
+mips_error mips_pool_acquire(mips_pool_h pool, mips_cpu_h* cpu, mips_mem_h* mem)
+{
+	uint8_t* slot;
+	mips_mem_h ram;
+	mips_error error;
+	if(pool == NULL)
+		return mips_ErrorInvalidHandle;
+	if(cpu == NULL)
+		return mips_ErrorInvalidArgument;
+	if(pool->free_count == 0 && (error = add_arena(pool)))
+		return error;
+	slot = pool->free[--pool->free_count];
+	ram = mips_mem_init_ram(slot + pool->cpu_size, pool->mem_size, pool->block_size);
+	*cpu = (mips_cpu_h)slot;
+	mips_cpu_init(*cpu, ram);
+	if(mem != NULL)
+		*mem = ram;
+	return mips_Success;
+}
+
+/** Returns an instance to the pool */
+void mips_pool_release(mips_pool_h pool, mips_cpu_h cpu)
+{
+	if(pool == NULL || cpu == NULL || cpu->mem == NULL)
+		return;
+	mips_cpu_destroy(cpu);
+	mips_mem_free(cpu->mem);
+	cpu->mem = NULL;
+	pool->free[pool->free_count++] = (uint8_t*)cpu;
+}
+
+/** Returns the number of free instances */
+unsigned mips_pool_available(mips_pool_h pool)
+{
+	return pool != NULL ? pool->free_count : 0;
+}
+
+/** Frees the pool */
+void mips_pool_free(mips_pool_h pool)
+{
+	arena* a;
+	mips_cpu_h cpu;
+	unsigned i;
+	if(pool == NULL)
+		return;
+	while(pool->arenas != NULL)
+	{
+		a = pool->arenas;
+		for(i = 0; i < pool->capacity; i++)
+		{
+			cpu = (mips_cpu_h)(a->base + i * pool->slot_size);
+			if(cpu->mem != NULL)
+			{
+				mips_cpu_destroy(cpu);
+				mips_mem_free(cpu->mem);
+			}
+		}
+		pool->arenas = a->next;
+		free(a->block);
+		free(a);
+	}
+	free(pool->free);
+	free(pool);
+}
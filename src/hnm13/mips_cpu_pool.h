@@ -0,0 +1,45 @@
+#ifndef mips_cpu_pool_header
+#define mips_cpu_pool_header
+
+#include "mips_cpu.h"
+
+/** A pool of CPU/RAM pairs, allocated in arenas and recycled
+ *
+ *  Each arena is one block holding 'capacity' slots, and each slot a
+ *  CPU state followed by a RAM (see mips_mem_init_ram), both on cache
+ *  line boundaries, so no two instances ever share a line. Free slots
+ *  sit on a stack, so taking and returning an instance is O(1) and
+ *  touches no allocator; a new arena is only added when every slot is
+ *  in use. Freeing the pool releases every arena at once, along with
+ *  anything instances still out hold.
+ *
+ *  A pool is not thread safe: give each thread its own. */
+struct mips_pool_impl;
+
+/** An opaque handle to a pool */
+typedef struct mips_pool_impl *mips_pool_h;
+
+/** Creates a pool of CPUs, each with mem_size bytes of RAM
+ *  capacity : The number of instances in each arena
+ *  Returns NULL if the first arena could not be allocated */
+mips_pool_h mips_pool_create(unsigned capacity, uint32_t mem_size, uint32_t block_size);
+
+/** Takes an instance from the pool
+ *  The CPU is freshly created, attached to its RAM; the RAM contents
+ *  are whatever the last user of the slot left there
+ *  cpu : Receives the CPU
+ *  mem : Receives its RAM, if given */
+mips_error mips_pool_acquire(mips_pool_h pool, mips_cpu_h* cpu, mips_mem_h* mem);
+
+/** Returns an instance to the pool; the CPU and its RAM must not be
+ *  used (or passed to mips_cpu_free or mips_mem_free) afterwards */
+void mips_pool_release(mips_pool_h pool, mips_cpu_h cpu);
+
+/** Returns the number of instances that can be taken before the pool
+ *  has to add an arena */
+unsigned mips_pool_available(mips_pool_h pool);
+
+/** Frees the pool, and every instance in it, taken or not */
+void mips_pool_free(mips_pool_h pool);
+
+#endif // mips_cpu_pool_header
@@ -0,0 +1,447 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Statistical profiling of guest code by stack sampling
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_profile.h"
+#include "mips_cpu_state.h"
+#include "mips_cpu_elf.h"
+#include <pthread.h>
+#include <string.h>
+
+/** The most frames recorded in one sample */
+#define PROFILE_MAX_DEPTH 64
+/** How far back to look for a function's prologue, in instructions */
+#define PROFILE_SCAN_LIMIT 1024
+
+/** The instructions the unwinder looks for */
+#define JR_RA 0x03E00008
+#define SW_RA_SP 0xAFBF0000
+#define ADDIU_SP_SP 0x27BD0000
+
+/** A stack seen in one or more samples: its PCs, innermost first */
+typedef struct profile_stack
+{
+	struct profile_stack* next;
+	uint64_t count;
+	uint32_t hash;
+	unsigned depth;
+	uint32_t pcs[];
+} profile_stack;
+
+/** A function name */
+typedef struct
+{
+	uint32_t address, size;
+	char* name;
+} profile_symbol;
+
+/** Profiler state */
+struct mips_profiler_impl
+{
+	pthread_mutex_t lock;
+	unsigned period;
+	uint64_t samples;
+	/** The distinct stacks, hashed on their PCs */
+	profile_stack** buckets;
+	size_t num_buckets, num_stacks;
+	/** Symbols, sorted by address when 'sorted' is set */
+	profile_symbol* symbols;
+	size_t num_symbols, max_symbols;
+	bool sorted;
+};
+
+/** Reads a word of guest memory, as the guest would see it, but
+ *  without leaving any trace: a TLB miss does not change the COP0
+ *  registers, and watchpoints are not hit */
+static bool read_word(mips_cpu_h state, uint32_t address, uint32_t* word)
+{
+	cop_translate translate = state->coprocessor[0].translate;
+	uint32_t cop0[16];
+	mips_error error = mips_Success;
+	if(address % 4)
+		return false;
+	if(translate != NULL)
+	{
+		memcpy(cop0, state->mmu.reg, sizeof(cop0));
+		error = translate(state, address, mem_load, &address);
+		memcpy(state->mmu.reg, cop0, sizeof(cop0));
+	}
+	if(error || mips_mem_peek(state->mem, address, 4, (uint8_t*)word) != mips_Success)
+		return false;
+	/** Stores the CPU is holding back are newer than memory */
+	if(state->stores != NULL)
+		store_buffer_load(state->stores, address, 4, (uint8_t*)word);
+	reverse_word(word);
+	return true;
+}
+
+/** Fills 'pcs' with the CPU's call stack, returning its depth */
+static unsigned unwind(mips_cpu_h state, uint32_t* pcs)
+{
+	uint32_t pc = state->pc, sp = state->reg[29], ra = state->reg[31];
+	uint32_t address, word, frame;
+	int ra_offset;
+	unsigned depth = 0, i;
+	while(depth < PROFILE_MAX_DEPTH)
+	{
+		pcs[depth++] = pc;
+		/** The instruction at 'pc' has not run yet, but everything
+		 *  from the prologue to just before it has */
+		frame = 0;
+		ra_offset = -1;
+		address = pc;
+		for(i = 0; i < PROFILE_SCAN_LIMIT && address >= 4; i++)
+		{
+			address -= 4;
+			if(!read_word(state, address, &word) || word == JR_RA)
+				break;
+			if((word & 0xFFFF0000) == SW_RA_SP && !(word & 0x8000))
+				ra_offset = word & 0xFFFF;
+			else if((word & 0xFFFF0000) == ADDIU_SP_SP && (word & 0x8000))
+			{
+				frame = -(int16_t)(word & 0xFFFF);
+				break;
+			}
+		}
+		/** Before $ra is saved, or in a leaf, it is still in the
+		 *  register; further out, it must have been saved */
+		if(ra_offset >= 0)
+		{
+			if(!read_word(state, sp + ra_offset, &ra))
+				break;
+		}
+		else if(depth > 1)
+			break;
+		sp += frame;
+		/** Count the caller as being at its jal */
+		if(ra < 8)
+			break;
+		pc = ra - 8;
+	}
+	return depth;
+}
+
+/** FNV-1a over a stack's PCs */
+static uint32_t hash_stack(const uint32_t* pcs, unsigned depth)
+{
+	uint32_t hash = 2166136261u;
+	unsigned i, j;
+	for(i = 0; i < depth; i++)
+		for(j = 0; j < 32; j += 8)
+			hash = (hash ^ ((pcs[i] >> j) & 0xFF)) * 16777619u;
+	return hash;
+}
+
+/** Doubles the hash table, once it is as full as it has buckets */
+static void grow_buckets(mips_profiler_h prof)
+{
+	size_t size = prof->num_buckets * 2, i;
+	profile_stack** buckets = calloc(size, sizeof(profile_stack*));
+	profile_stack *s, *next;
+	if(buckets == NULL)
+		return;
+	for(i = 0; i < prof->num_buckets; i++)
+		for(s = prof->buckets[i]; s != NULL; s = next)
+		{
+			next = s->next;
+			s->next = buckets[s->hash & (size - 1)];
+			buckets[s->hash & (size - 1)] = s;
+		}
+	free(prof->buckets);
+	prof->buckets = buckets;
+	prof->num_buckets = size;
+}
+
+/** Records where the CPU is; called from mips_cpu_step */
+void profile_sample(mips_cpu_h state)
+{
+	mips_profiler_h prof = state->host.profiler;
+	uint32_t pcs[PROFILE_MAX_DEPTH], cop0[16], hash;
+	unsigned depth;
+	profile_stack** bucket;
+	profile_stack* s;
+	state->host.profile_countdown = prof->period;
+	/** A failed translation sets COP0 registers; the guest mustn't
+	 *  see that */
+	memcpy(cop0, state->mmu.reg, sizeof(cop0));
+	depth = unwind(state, pcs);
+	memcpy(state->mmu.reg, cop0, sizeof(cop0));
+	hash = hash_stack(pcs, depth);
+
+	pthread_mutex_lock(&prof->lock);
+	prof->samples++;
+	bucket = &prof->buckets[hash & (prof->num_buckets - 1)];
+	for(s = *bucket; s != NULL; s = s->next)
+		if(s->hash == hash && s->depth == depth
+			&& !memcmp(s->pcs, pcs, depth * sizeof(uint32_t)))
+			break;
+	if(s == NULL)
+	{
+		s = malloc(sizeof(profile_stack) + depth * sizeof(uint32_t));
+		if(s != NULL)
+		{
+			s->hash = hash;
+			s->depth = depth;
+			s->count = 0;
+			memcpy(s->pcs, pcs, depth * sizeof(uint32_t));
+			s->next = *bucket;
+			*bucket = s;
+			if(++prof->num_stacks > prof->num_buckets)
+				grow_buckets(prof);
+		}
+	}
+	if(s != NULL)
+		s->count++;
+	pthread_mutex_unlock(&prof->lock);
+}
+
+/** Creates a profiler */
+mips_profiler_h mips_profiler_create(unsigned period)
+{
+	mips_profiler_h prof;
+	if(period == 0)
+		return NULL;
+	prof = calloc(1, sizeof(struct mips_profiler_impl));
+	if(prof == NULL)
+		return NULL;
+	prof->period = period;
+	prof->num_buckets = 256;
+	prof->buckets = calloc(prof->num_buckets, sizeof(profile_stack*));
+	if(prof->buckets == NULL)
+	{
+		free(prof);
+		return NULL;
+	}
+	pthread_mutex_init(&prof->lock, NULL);
+	return prof;
+}
+
+/** Attaches or detaches a CPU */
+mips_error mips_cpu_set_profiler(mips_cpu_h state, mips_profiler_h prof)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	state->host.profiler = prof;
+	if(prof != NULL)
+		state->host.profile_countdown = prof->period;
+	return mips_Success;
+}
+
+/** Adds a symbol */
+mips_error mips_profiler_add_symbol(mips_profiler_h prof,
+	const char* name,
+	uint32_t address,
+	uint32_t size)
+{
+	profile_symbol* symbols;
+	size_t length;
+	char* copy;
+	if(prof == NULL)
+		return mips_ErrorInvalidHandle;
+	if(name == NULL)
+		return mips_ErrorInvalidArgument;
+	length = strlen(name) + 1;
+	copy = malloc(length);
+	if(copy == NULL)
+		return mips_ErrorOutOfMemory;
+	memcpy(copy, name, length);
+	pthread_mutex_lock(&prof->lock);
+	if(prof->num_symbols == prof->max_symbols)
+	{
+		length = prof->max_symbols ? prof->max_symbols * 2 : 64;
+		symbols = realloc(prof->symbols, length * sizeof(profile_symbol));
+		if(symbols == NULL)
+		{
+			pthread_mutex_unlock(&prof->lock);
+			free(copy);
+			return mips_ErrorOutOfMemory;
+		}
+		prof->symbols = symbols;
+		prof->max_symbols = length;
+	}
+	prof->symbols[prof->num_symbols].address = address;
+	prof->symbols[prof->num_symbols].size = size;
+	prof->symbols[prof->num_symbols].name = copy;
+	prof->num_symbols++;
+	prof->sorted = false;
+	pthread_mutex_unlock(&prof->lock);
+	return mips_Success;
+}
+
+/** Adds the functions in one symbol table */
+static mips_error elf_symbols(mips_profiler_h prof, const elf_file* elf,
+	const elf_section* symtab, const elf_section* strtab)
+{
+	const uint8_t *syms = elf_contents(elf, symtab), *sym;
+	const char* strings = (const char*)elf_contents(elf, strtab);
+	uint32_t i, name_offset;
+	unsigned type, bind;
+	mips_error error;
+	if(syms == NULL || strings == NULL || strtab->size == 0
+		|| strings[strtab->size - 1] != 0)
+		return mips_ErrorInvalidArgument;
+	for(i = 0; i + 16 <= symtab->size; i += 16)
+	{
+		sym = syms + i;
+		name_offset = elf_word(sym);
+		type = sym[12] & 0xF;
+		bind = sym[12] >> 4;
+		/** Functions, and global labels in a section (from assembly) */
+		if(type != 2 && !(type == 0 && bind == 1 && elf_half(sym + 14) != 0))
+			continue;
+		if(name_offset == 0 || name_offset >= strtab->size)
+			continue;
+		error = mips_profiler_add_symbol(prof, strings + name_offset,
+			elf_word(sym + 4), elf_word(sym + 8));
+		if(error)
+			return error;
+	}
+	return mips_Success;
+}
+
+/** Loads the symbols of an ELF file */
+mips_error mips_profiler_load_elf(mips_profiler_h prof, const char* path)
+{
+	elf_file elf;
+	elf_section section, strtab;
+	unsigned i, found = 0;
+	mips_error error;
+	if(prof == NULL)
+		return mips_ErrorInvalidHandle;
+	error = elf_open(&elf, path);
+	for(i = 0; !error && i < elf.section_count; i++)
+	{
+		elf_section_header(&elf, i, &section);
+		/** SHT_SYMTAB, or SHT_DYNSYM for a stripped file */
+		if(section.type != ELF_SHT_SYMTAB && section.type != ELF_SHT_DYNSYM)
+			continue;
+		if(!elf_section_header(&elf, section.link, &strtab))
+			continue;
+		error = elf_symbols(prof, &elf, &section, &strtab);
+		found++;
+	}
+	if(!error && found == 0)
+		error = mips_ErrorInvalidArgument;
+	elf_close(&elf);
+	return error;
+}
+
+/** Orders symbols by address */
+static int compare_symbols(const void* a, const void* b)
+{
+	uint32_t x = ((const profile_symbol*)a)->address, y = ((const profile_symbol*)b)->address;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/** Finds the symbol an address is in; the symbols must be sorted */
+static const char* find_symbol(mips_profiler_h prof, uint32_t pc)
+{
+	size_t low = 0, high = prof->num_symbols, mid;
+	const profile_symbol* sym;
+	/** Find the last symbol at or before 'pc' */
+	while(low < high)
+	{
+		mid = (low + high) / 2;
+		if(prof->symbols[mid].address <= pc)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if(low == 0)
+		return NULL;
+	sym = &prof->symbols[low - 1];
+	return sym->size == 0 || pc - sym->address < sym->size ? sym->name : NULL;
+}
+
+/** Sorts the symbols, if any have been added since last time */
+static void sort_symbols(mips_profiler_h prof)
+{
+	if(!prof->sorted)
+	{
+		qsort(prof->symbols, prof->num_symbols, sizeof(profile_symbol), &compare_symbols);
+		prof->sorted = true;
+	}
+}
+
+/** Returns the name of the function an address is in */
+const char* mips_profiler_symbol(mips_profiler_h prof, uint32_t address)
+{
+	const char* ret;
+	if(prof == NULL)
+		return NULL;
+	pthread_mutex_lock(&prof->lock);
+	sort_symbols(prof);
+	ret = find_symbol(prof, address);
+	pthread_mutex_unlock(&prof->lock);
+	return ret;
+}
+
+/** Returns the number of samples */
+uint64_t mips_profiler_samples(mips_profiler_h prof)
+{
+	uint64_t ret;
+	if(prof == NULL)
+		return 0;
+	pthread_mutex_lock(&prof->lock);
+	ret = prof->samples;
+	pthread_mutex_unlock(&prof->lock);
+	return ret;
+}
+
+/** Writes the collapsed stacks */
+mips_error mips_profiler_write(mips_profiler_h prof, FILE* dest)
+{
+	const profile_stack* s;
+	const char* name;
+	size_t i;
+	unsigned j;
+	if(prof == NULL)
+		return mips_ErrorInvalidHandle;
+	if(dest == NULL)
+		return mips_ErrorInvalidArgument;
+	pthread_mutex_lock(&prof->lock);
+	sort_symbols(prof);
+	for(i = 0; i < prof->num_buckets; i++)
+		for(s = prof->buckets[i]; s != NULL; s = s->next)
+		{
+			for(j = s->depth; j-- > 0;)
+			{
+				name = find_symbol(prof, s->pcs[j]);
+				if(name != NULL)
+					fputs(name, dest);
+				else
+					fprintf(dest, "0x%08x", s->pcs[j]);
+				if(j > 0)
+					fputc(';', dest);
+			}
+			fprintf(dest, " %llu\n", (unsigned long long)s->count);
+		}
+	pthread_mutex_unlock(&prof->lock);
+	return ferror(dest) ? mips_ErrorFileWriteError : mips_Success;
+}
+
+/** Frees a profiler */
+void mips_profiler_free(mips_profiler_h prof)
+{
+	profile_stack *s, *next;
+	size_t i;
+	if(prof == NULL)
+		return;
+	for(i = 0; i < prof->num_buckets; i++)
+		for(s = prof->buckets[i]; s != NULL; s = next)
+		{
+			next = s->next;
+			free(s);
+		}
+	for(i = 0; i < prof->num_symbols; i++)
+		free(prof->symbols[i].name);
+	free(prof->symbols);
+	free(prof->buckets);
+	pthread_mutex_destroy(&prof->lock);
+	free(prof);
+}
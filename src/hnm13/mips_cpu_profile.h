@@ -0,0 +1,61 @@
+#ifndef mips_cpu_profile_header
+#define mips_cpu_profile_header
+
+#include "mips_cpu.h"
+#include <stdio.h>
+
+/** A statistical profiler of guest code
+ *
+ *  Every 'period' retired instructions, each CPU attached to the
+ *  profiler stops to record where it is, and the chain of calls that
+ *  led there. There is no frame pointer in MIPS code, so the stack is
+ *  unwound the way a debugger does without debug information: the
+ *  code before the PC is scanned back for the function's prologue,
+ *  an 'addiu $sp, $sp, -n' and an 'sw $ra, m($sp)', which give the
+ *  caller's $sp and where its return address was saved. A function
+ *  with no 'sw $ra' is a leaf, whose caller is still in $ra; that is
+ *  only possible for the innermost frame. The scan stops at a
+ *  'jr $ra', the end of the function before.
+ *
+ *  Identical stacks are counted together, and written out in the
+ *  collapsed format flame graph tools read: one line per stack, the
+ *  outermost function first, separated by semicolons, then the count.
+ *  Addresses are named from an ELF symbol table, or symbols added by
+ *  hand, and otherwise written in hex.
+ *
+ *  One profiler may be shared by CPUs on several threads. */
+struct mips_profiler_impl;
+
+/** An opaque handle to a profiler */
+typedef struct mips_profiler_impl *mips_profiler_h;
+
+/** Creates a profiler that samples every 'period' instructions */
+mips_profiler_h mips_profiler_create(unsigned period);
+
+/** Attaches a CPU to a profiler, or detaches it if 'prof' is NULL.
+ *  The profiler must outlive its attachment */
+mips_error mips_cpu_set_profiler(mips_cpu_h state, mips_profiler_h prof);
+
+/** Adds the function symbols of a 32-bit big endian MIPS ELF file */
+mips_error mips_profiler_load_elf(mips_profiler_h prof, const char* path);
+
+/** Adds one symbol; a size of 0 covers everything up to the next */
+mips_error mips_profiler_add_symbol(mips_profiler_h prof,
+	const char* name,
+	uint32_t address,
+	uint32_t size);
+
+/** Returns the name of the function an address is in, or NULL.
+ *  The name lasts as long as the profiler */
+const char* mips_profiler_symbol(mips_profiler_h prof, uint32_t address);
+
+/** Returns the number of samples taken */
+uint64_t mips_profiler_samples(mips_profiler_h prof);
+
+/** Writes the stacks sampled, in collapsed form */
+mips_error mips_profiler_write(mips_profiler_h prof, FILE* dest);
+
+/** Frees a profiler */
+void mips_profiler_free(mips_profiler_h prof);
+
+#endif // mips_cpu_profile_header
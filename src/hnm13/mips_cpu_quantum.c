@@ -0,0 +1,360 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Deterministic multi-core runs, in quanta separated by barriers
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_quantum.h"
+#include "mips_cpu_state.h"
+#include "mips_cpu_extend.h"
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+/** The number of entries a store buffer starts with (power of 2) */
+#define STORE_BUFFER_SIZE 64
+
+/** The buffered bytes of one word of memory */
+typedef struct
+{
+	/** Word aligned address */
+	uint32_t address;
+	/** The bytes, in memory order */
+	uint8_t data[4];
+	/** Which bytes of 'data' were stored; 0 for an empty slot */
+	uint8_t mask;
+} store_entry;
+
+/** An open addressed hash table of words, keyed by address */
+struct store_buffer
+{
+	store_entry* entries;
+	unsigned capacity, count;
+};
+
+/** Finds the slot for the given word, which may be empty */
+static store_entry* find_entry(const store_buffer* sb, uint32_t address)
+{
+	unsigned i = ((address >> 2) * 2654435761u) & (sb->capacity - 1);
+	while(sb->entries[i].mask && sb->entries[i].address != address)
+		i = (i + 1) & (sb->capacity - 1);
+	return &sb->entries[i];
+}
+
+/** Doubles the size of the table */
+static bool grow(store_buffer* sb)
+{
+	store_buffer old = *sb;
+	unsigned i;
+	sb->capacity = old.capacity ? old.capacity * 2 : STORE_BUFFER_SIZE;
+	sb->entries = calloc(sb->capacity, sizeof(store_entry));
+	if(sb->entries == NULL)
+	{
+		*sb = old;
+		return false;
+	}
+	for(i = 0; i < old.capacity; i++)
+		if(old.entries[i].mask)
+			*find_entry(sb, old.entries[i].address) = old.entries[i];
+	free(old.entries);
+	return true;
+}
+
+/** Adds a store of 'length' bytes, in memory order, to the buffer */
+mips_error store_buffer_store(store_buffer* sb, uint32_t address, unsigned length, const uint8_t* data)
+{
+	store_entry* e;
+	unsigned i, byte;
+	for(i = 0; i < length; i++)
+	{
+		if((sb->count + 1) * 2 > sb->capacity && !grow(sb))
+			return mips_ErrorOutOfMemory;
+		e = find_entry(sb, (address + i) & ~3u);
+		if(!e->mask)
+		{
+			e->address = (address + i) & ~3u;
+			sb->count++;
+		}
+		byte = (address + i) & 3;
+		e->data[byte] = data[i];
+		e->mask |= 1 << byte;
+	}
+	return mips_Success;
+}
+
+/** Replaces the bytes of a load that the buffer holds newer values for */
+void store_buffer_load(const store_buffer* sb, uint32_t address, unsigned length, uint8_t* data)
+{
+	const store_entry* e;
+	unsigned i, byte;
+	if(sb->count == 0)
+		return;
+	for(i = 0; i < length; i++)
+	{
+		e = find_entry(sb, (address + i) & ~3u);
+		byte = (address + i) & 3;
+		if(e->mask & (1 << byte))
+			data[i] = e->data[byte];
+	}
+}
+
+/** Writes the stored bytes of one word to memory */
+static mips_error commit_entry(const store_entry* e, mips_mem_h mem)
+{
+	mips_error error = mips_Success;
+	uint8_t word[4];
+	unsigned j;
+	if(e->mask == 0xF)
+		return mips_mem_write(mem, e->address, 4, e->data);
+	/** Only the bytes stored are written, where the memory allows it,
+	 *  so watchpoints on the rest of the word are not hit */
+	for(j = 0; j < 4 && !error; j++)
+		if(e->mask & (1 << j))
+			error = mips_mem_write(mem, e->address + j, 1, &e->data[j]);
+	if(error != mips_ExceptionInvalidAlignment)
+		return error;
+	/** Otherwise the rest of the word is read back around them, which
+	 *  is not the program reading it */
+	error = mips_mem_peek(mem, e->address, 4, word);
+	if(error)
+		return error;
+	for(j = 0; j < 4; j++)
+		if(e->mask & (1 << j))
+			word[j] = e->data[j];
+	return mips_mem_write(mem, e->address, 4, word);
+}
+
+/** Writes the buffer to memory and empties it */
+static mips_error store_buffer_commit(store_buffer* sb, mips_mem_h mem)
+{
+	mips_error error = mips_Success;
+	store_entry* e;
+	unsigned i;
+	for(i = 0; i < sb->capacity; i++)
+	{
+		e = &sb->entries[i];
+		if(!e->mask)
+			continue;
+		if(!error)
+			error = commit_entry(e, mem);
+		e->mask = 0;
+	}
+	sb->count = 0;
+	return error;
+}
+
+/** Scheduling state for one core */
+typedef struct
+{
+	mips_cpu_h cpu;
+	store_buffer stores;
+	/** Stopped for good */
+	bool done;
+	/** Waiting to run an SC on its own */
+	bool parked;
+	mips_error error;
+	uint64_t retired;
+} core_state;
+
+/** State shared by every thread in one mips_quantum_run call */
+typedef struct
+{
+	core_state* cores;
+	unsigned count, threads;
+	uint32_t quantum, stop_pc;
+	uint64_t budget;
+	pthread_barrier_t barrier;
+	/** Set between the barriers once every core is done */
+	bool finished;
+	/** Holds the threads back until we know how many started */
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	bool ready;
+} scheduler;
+
+/** Per-thread arguments */
+typedef struct
+{
+	scheduler* sched;
+	unsigned index;
+} worker_args;
+
+/** Marks the core as done if it has reached the end of its run */
+static void check_done(scheduler* s, core_state* c)
+{
+	uint32_t pc;
+	mips_cpu_get_pc(c->cpu, &pc);
+	if(c->error || pc == s->stop_pc || c->retired >= s->budget)
+		c->done = true;
+}
+
+/** Runs one core for a quantum, with its stores buffered */
+static void run_quantum(scheduler* s, core_state* c)
+{
+	uint64_t length = s->budget - c->retired, count = 0;
+	mips_error error;
+	if(c->done)
+		return;
+	if(length > s->quantum)
+		length = s->quantum;
+	c->cpu->stores = &c->stores;
+	error = mips_cpu_run(c->cpu, s->stop_pc, length, &count);
+	c->cpu->stores = NULL;
+	c->retired += count;
+	if(error == mips_ExceptionSerialise)
+		c->parked = true;
+	else
+		c->error = error;
+	check_done(s, c);
+}
+
+/** The serial part of a round: commits every buffer,
+ *  then runs the waiting SCs, all in core order */
+static void commit(scheduler* s)
+{
+	core_state* c;
+	mips_error error;
+	unsigned i;
+	for(i = 0; i < s->count; i++)
+	{
+		c = &s->cores[i];
+		error = store_buffer_commit(&c->stores, c->cpu->mem);
+		if(error && !c->error)
+		{
+			c->error = error;
+			c->done = true;
+		}
+	}
+	s->finished = true;
+	for(i = 0; i < s->count; i++)
+	{
+		c = &s->cores[i];
+		if(c->parked && !c->done)
+		{
+			c->error = mips_cpu_step(c->cpu);
+			if(!c->error)
+				c->retired++;
+			check_done(s, c);
+		}
+		c->parked = false;
+		if(!c->done)
+			s->finished = false;
+	}
+}
+
+/** Thread entry point: runs this thread's cores, round after round */
+static void* worker(void* arg)
+{
+	worker_args* args = arg;
+	scheduler* s = args->sched;
+	unsigned i;
+	pthread_mutex_lock(&s->lock);
+	while(!s->ready)
+		pthread_cond_wait(&s->start, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+	do
+	{
+		for(i = args->index; i < s->count; i += s->threads)
+			run_quantum(s, &s->cores[i]);
+		if(pthread_barrier_wait(&s->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+			commit(s);
+		pthread_barrier_wait(&s->barrier);
+	} while(!s->finished);
+	return NULL;
+}
+
+/** Runs several CPUs against one shared memory, reproducibly */
+mips_error mips_quantum_run(mips_cpu_h* cpus,
+	unsigned count,
+	unsigned threads,
+	uint32_t quantum,
+	uint32_t stop_pc,
+	uint64_t budget,
+	mips_error* errors,
+	uint64_t* retired)
+{
+	scheduler s;
+	pthread_t* handles;
+	worker_args* args;
+	unsigned i, started;
+	long cores;
+	if((cpus == NULL && count > 0) || quantum == 0)
+		return mips_ErrorInvalidArgument;
+	for(i = 0; i < count; i++)
+		if(cpus[i] == NULL || cpus[i]->mem == NULL)
+			return mips_ErrorInvalidHandle;
+	if(count == 0)
+		return mips_Success;
+	if(threads == 0)
+	{
+		cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? (unsigned)cores : 1;
+	}
+	if(threads > count)
+		threads = count;
+
+	s.cores = calloc(count, sizeof(core_state));
+	handles = malloc(threads * sizeof(pthread_t));
+	args = malloc(threads * sizeof(worker_args));
+	if(s.cores == NULL || handles == NULL || args == NULL)
+	{
+		free(s.cores);
+		free(handles);
+		free(args);
+		return mips_ErrorOutOfMemory;
+	}
+	s.count = count;
+	s.quantum = quantum;
+	s.stop_pc = stop_pc;
+	s.budget = budget;
+	s.finished = false;
+	for(i = 0; i < count; i++)
+	{
+		mips_cpu_set_id(cpus[i], i);
+		s.cores[i].cpu = cpus[i];
+		check_done(&s, &s.cores[i]);
+	}
+
+	/** Every thread must reach the barrier, so if we can't start them
+	 *  all, the ones we did start share the cores out between them */
+	s.ready = false;
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.start, NULL);
+	args[0].sched = &s;
+	args[0].index = 0;
+	for(started = 1; started < threads; started++)
+	{
+		args[started].sched = &s;
+		args[started].index = started;
+		if(pthread_create(&handles[started], NULL, &worker, &args[started]))
+			break;
+	}
+	s.threads = started;
+	pthread_barrier_init(&s.barrier, NULL, started);
+	pthread_mutex_lock(&s.lock);
+	s.ready = true;
+	pthread_cond_broadcast(&s.start);
+	pthread_mutex_unlock(&s.lock);
+	worker(&args[0]);
+	for(i = 1; i < started; i++)
+		pthread_join(handles[i], NULL);
+	pthread_barrier_destroy(&s.barrier);
+	pthread_cond_destroy(&s.start);
+	pthread_mutex_destroy(&s.lock);
+
+	for(i = 0; i < count; i++)
+	{
+		if(errors != NULL)
+			errors[i] = s.cores[i].error;
+		if(retired != NULL)
+			retired[i] = s.cores[i].retired;
+		free(s.cores[i].stores.entries);
+	}
+	free(s.cores);
+	free(handles);
+	free(args);
+	return mips_Success;
+}
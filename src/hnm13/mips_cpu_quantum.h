@@ -0,0 +1,37 @@
+#ifndef mips_cpu_quantum_header
+#define mips_cpu_quantum_header
+
+#include "mips_cpu.h"
+
+/** Runs several CPUs against one shared memory, reproducibly
+ *
+ *  Time is divided into quanta of 'quantum' instructions. In each
+ *  quantum every core runs in parallel, over up to 'threads' host
+ *  threads, but its stores are held in a private buffer: it sees its
+ *  own stores, and memory as it was when the quantum started. At the
+ *  end of the quantum all threads meet at a barrier, and the buffers
+ *  are written to memory in core order (so for any byte, the highest
+ *  numbered core's store wins).
+ *
+ *  SC ends its core's quantum early. Once the buffers are committed,
+ *  the waiting SCs are run one at a time, in core order.
+ *
+ *  The result depends only on the program, the number of cores and
+ *  the quantum; never on 'threads' or on host timing. A small quantum
+ *  lets the cores see each other's stores sooner, a large one spends
+ *  less time waiting at the barrier.
+ *
+ *  CPU i is given the number i, as with mips_smp_run. Each CPU stops
+ *  when it reaches stop_pc, fails, or retires 'budget' instructions;
+ *  errors[i] and retired[i] receive the results if given.
+ *  Passing threads == 0 uses one thread per online host core. */
+mips_error mips_quantum_run(mips_cpu_h* cpus,
+	unsigned count,
+	unsigned threads,
+	uint32_t quantum,
+	uint32_t stop_pc,
+	uint64_t budget,
+	mips_error* errors,
+	uint64_t* retired);
+
+#endif // mips_cpu_quantum_header
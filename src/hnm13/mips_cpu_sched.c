@@ -0,0 +1,309 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * M:N time-slicing of guests over worker threads, by stride scheduling
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_sched.h"
+#include "mips_cpu_extend.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+/** A guest's stride is this divided by its priority */
+#define STRIDE_SCALE (1u << 20)
+
+/** The number of guests there is room for before growing */
+#define INITIAL_GUESTS 64
+
+/** One scheduled CPU */
+typedef struct
+{
+	mips_cpu_h cpu;
+	uint32_t stop_pc;
+	uint64_t budget, retired;
+	/** Virtual time: advanced by 'stride' for every slice run */
+	uint64_t pass, stride;
+	mips_error error;
+	/** The id is taken, and the guest has finished running */
+	bool used, done;
+} guest;
+
+/** Scheduler state, all guarded by 'lock' */
+struct mips_sched_impl
+{
+	pthread_mutex_t lock;
+	/** Signalled when a guest is queued, or the workers should stop */
+	pthread_cond_t work;
+	/** Signalled when a guest finishes */
+	pthread_cond_t finished;
+	pthread_t* threads;
+	unsigned thread_count;
+	uint64_t slice;
+	/** Every guest, indexed by id */
+	guest* guests;
+	unsigned capacity;
+	/** Ids not in use, as a stack */
+	unsigned* free_ids;
+	unsigned free_count;
+	/** The run queue: a min-heap of ids, ordered by pass */
+	unsigned* heap;
+	unsigned heap_size;
+	/** Virtual time, the pass of the guest most recently started */
+	uint64_t pass;
+	bool stop;
+};
+
+/** True if guest a should run before guest b */
+static bool before(mips_sched_h s, unsigned a, unsigned b)
+{
+	if(s->guests[a].pass != s->guests[b].pass)
+		return s->guests[a].pass < s->guests[b].pass;
+	return a < b;
+}
+
+/** Adds a guest to the run queue */
+static void heap_push(mips_sched_h s, unsigned id)
+{
+	unsigned i = s->heap_size++, parent;
+	while(i > 0)
+	{
+		parent = (i - 1) / 2;
+		if(!before(s, id, s->heap[parent]))
+			break;
+		s->heap[i] = s->heap[parent];
+		i = parent;
+	}
+	s->heap[i] = id;
+}
+
+/** Takes the guest with the lowest pass from the run queue */
+static unsigned heap_pop(mips_sched_h s)
+{
+	unsigned ret = s->heap[0], last = s->heap[--s->heap_size];
+	unsigned i = 0, child;
+	while((child = i * 2 + 1) < s->heap_size)
+	{
+		if(child + 1 < s->heap_size && before(s, s->heap[child + 1], s->heap[child]))
+			child++;
+		if(!before(s, s->heap[child], last))
+			break;
+		s->heap[i] = s->heap[child];
+		i = child;
+	}
+	s->heap[i] = last;
+	return ret;
+}
+
+/** Makes room for twice as many guests */
+static bool grow(mips_sched_h s)
+{
+	unsigned capacity = s->capacity ? s->capacity * 2 : INITIAL_GUESTS, i;
+	guest* guests = realloc(s->guests, capacity * sizeof(guest));
+	unsigned *free_ids, *heap;
+	if(guests == NULL)
+		return false;
+	s->guests = guests;
+	free_ids = realloc(s->free_ids, capacity * sizeof(unsigned));
+	if(free_ids == NULL)
+		return false;
+	s->free_ids = free_ids;
+	heap = realloc(s->heap, capacity * sizeof(unsigned));
+	if(heap == NULL)
+		return false;
+	s->heap = heap;
+	/** Push the new ids highest first, so the lowest is used next */
+	for(i = capacity; i > s->capacity; i--)
+	{
+		s->guests[i - 1].used = false;
+		s->free_ids[s->free_count++] = i - 1;
+	}
+	s->capacity = capacity;
+	return true;
+}
+
+/** Marks a guest finished if it has reached the end of its run */
+static bool check_done(guest* g)
+{
+	uint32_t pc;
+	mips_cpu_get_pc(g->cpu, &pc);
+	g->done = g->error || pc == g->stop_pc || g->retired >= g->budget;
+	return g->done;
+}
+
+/** Thread entry point: runs slices until told to stop */
+static void* worker(void* arg)
+{
+	mips_sched_h s = arg;
+	mips_cpu_h cpu;
+	uint32_t stop_pc;
+	uint64_t length, count;
+	mips_error error;
+	unsigned id;
+	guest* g;
+	pthread_mutex_lock(&s->lock);
+	for(;;)
+	{
+		while(!s->stop && s->heap_size == 0)
+			pthread_cond_wait(&s->work, &s->lock);
+		if(s->stop)
+			break;
+		id = heap_pop(s);
+		g = &s->guests[id];
+		s->pass = g->pass;
+		cpu = g->cpu;
+		stop_pc = g->stop_pc;
+		length = g->budget - g->retired;
+		if(length > s->slice)
+			length = s->slice;
+
+		/** The guest is off the queue, so nobody else touches it */
+		pthread_mutex_unlock(&s->lock);
+		count = 0;
+		error = mips_cpu_run(cpu, stop_pc, length, &count);
+		pthread_mutex_lock(&s->lock);
+
+		/** The guest array may have moved while we were running */
+		g = &s->guests[id];
+		g->retired += count;
+		g->error = error;
+		g->pass += g->stride;
+		if(check_done(g))
+			pthread_cond_broadcast(&s->finished);
+		else
+			heap_push(s, id);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/** Creates a scheduler */
+mips_sched_h mips_sched_create(unsigned threads, uint64_t slice)
+{
+	mips_sched_h ret;
+	long cores;
+	if(slice == 0)
+		return NULL;
+	if(threads == 0)
+	{
+		cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? (unsigned)cores : 1;
+	}
+	ret = calloc(1, sizeof(struct mips_sched_impl));
+	if(ret == NULL)
+		return NULL;
+	ret->threads = malloc(threads * sizeof(pthread_t));
+	if(ret->threads == NULL)
+	{
+		free(ret);
+		return NULL;
+	}
+	ret->slice = slice;
+	pthread_mutex_init(&ret->lock, NULL);
+	pthread_cond_init(&ret->work, NULL);
+	pthread_cond_init(&ret->finished, NULL);
+	for(ret->thread_count = 0; ret->thread_count < threads; ret->thread_count++)
+		if(pthread_create(&ret->threads[ret->thread_count], NULL, &worker, ret))
+			break;
+	if(ret->thread_count == 0)
+	{
+		mips_sched_free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/** Queues a guest */
+mips_error mips_sched_add(mips_sched_h state,
+	mips_cpu_h cpu,
+	uint32_t stop_pc,
+	uint64_t budget,
+	unsigned priority,
+	unsigned* id)
+{
+	guest* g;
+	unsigned index;
+	if(state == NULL || cpu == NULL)
+		return mips_ErrorInvalidHandle;
+	if(priority == 0 || id == NULL)
+		return mips_ErrorInvalidArgument;
+	pthread_mutex_lock(&state->lock);
+	if(state->free_count == 0 && !grow(state))
+	{
+		pthread_mutex_unlock(&state->lock);
+		return mips_ErrorOutOfMemory;
+	}
+	index = state->free_ids[--state->free_count];
+	g = &state->guests[index];
+	g->cpu = cpu;
+	g->stop_pc = stop_pc;
+	g->budget = budget;
+	g->retired = 0;
+	g->error = mips_Success;
+	g->stride = STRIDE_SCALE / priority;
+	if(g->stride == 0)
+		g->stride = 1;
+	g->pass = state->pass + g->stride;
+	g->used = true;
+	if(!check_done(g))
+	{
+		heap_push(state, index);
+		pthread_cond_signal(&state->work);
+	}
+	*id = index;
+	pthread_mutex_unlock(&state->lock);
+	return mips_Success;
+}
+
+/** Waits for a guest to finish */
+mips_error mips_sched_wait(mips_sched_h state,
+	unsigned id,
+	mips_error* error,
+	uint64_t* retired)
+{
+	guest* g;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	pthread_mutex_lock(&state->lock);
+	if(id >= state->capacity || !state->guests[id].used)
+	{
+		pthread_mutex_unlock(&state->lock);
+		return mips_ErrorInvalidArgument;
+	}
+	while(!state->guests[id].done)
+		pthread_cond_wait(&state->finished, &state->lock);
+	g = &state->guests[id];
+	if(error != NULL)
+		*error = g->error;
+	if(retired != NULL)
+		*retired = g->retired;
+	g->used = false;
+	state->free_ids[state->free_count++] = id;
+	pthread_mutex_unlock(&state->lock);
+	return mips_Success;
+}
+
+/** Stops the workers and frees the scheduler */
+void mips_sched_free(mips_sched_h state)
+{
+	unsigned i;
+	if(state == NULL)
+		return;
+	pthread_mutex_lock(&state->lock);
+	state->stop = true;
+	pthread_cond_broadcast(&state->work);
+	pthread_mutex_unlock(&state->lock);
+	for(i = 0; i < state->thread_count; i++)
+		pthread_join(state->threads[i], NULL);
+	pthread_cond_destroy(&state->finished);
+	pthread_cond_destroy(&state->work);
+	pthread_mutex_destroy(&state->lock);
+	free(state->threads);
+	free(state->guests);
+	free(state->free_ids);
+	free(state->heap);
+	free(state);
+}
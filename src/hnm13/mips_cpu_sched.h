@@ -0,0 +1,54 @@
+#ifndef mips_cpu_sched_header
+#define mips_cpu_sched_header
+
+#include "mips_cpu.h"
+
+/** Time-slices many guests over a fixed pool of worker threads
+ *
+ *  Each guest is a CPU (with its own memory) that runs until its PC
+ *  reaches an exit address, it fails, or it uses up its budget. A
+ *  worker runs a guest for one slice of instructions with mips_cpu_run,
+ *  then puts it back in the queue; everything about the guest lives in
+ *  its struct mips_cpu_impl, so the next slice may run on any worker.
+ *
+ *  The next guest to run is chosen by stride scheduling: each guest
+ *  gets a share of the slices in proportion to its priority, and a
+ *  newly added guest starts level with the others rather than ahead
+ *  of or behind them. Short guests therefore finish quickly even when
+ *  long ones are queued, and no guest is ever starved.
+ *
+ *  A CPU must not be used by the caller between mips_sched_add and
+ *  the mips_sched_wait that reports it finished. */
+struct mips_sched_impl;
+
+/** An opaque handle to a scheduler */
+typedef struct mips_sched_impl *mips_sched_h;
+
+/** Creates a scheduler with 'threads' workers, each running 'slice'
+ *  instructions of a guest at a time
+ *  Passing threads == 0 uses one thread per online host core */
+mips_sched_h mips_sched_create(unsigned threads, uint64_t slice);
+
+/** Queues a guest to run from its current PC
+ *  priority : The relative share of time it gets, from 1 upwards
+ *  budget : The most instructions it may retire in total
+ *  id : Receives a number identifying the guest to mips_sched_wait */
+mips_error mips_sched_add(mips_sched_h state,
+	mips_cpu_h cpu,
+	uint32_t stop_pc,
+	uint64_t budget,
+	unsigned priority,
+	unsigned* id);
+
+/** Waits for a guest to finish, and reports how it stopped
+ *  Each guest may be waited for once; its id is then reused */
+mips_error mips_sched_wait(mips_sched_h state,
+	unsigned id,
+	mips_error* error,
+	uint64_t* retired);
+
+/** Stops the workers and frees the scheduler, abandoning any guests
+ *  that are still queued (their CPUs are left as they were) */
+void mips_sched_free(mips_sched_h state);
+
+#endif // mips_cpu_sched_header
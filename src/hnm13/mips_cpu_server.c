@@ -0,0 +1,568 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Job server over a Unix domain socket, with a warm pool of instances
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_server.h"
+#include "mips_cpu_extend.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/** A registered image, as a full copy of guest memory */
+typedef struct
+{
+	unsigned id;
+	uint8_t* snapshot;
+} image;
+
+/** A request read from a connection, waiting for a worker or running
+ *  on one */
+typedef struct job
+{
+	struct job* next;
+	mips_server_request req;
+	mips_server_response resp;
+	/** The input, and then the output */
+	uint8_t* buffer;
+	bool done;
+} job;
+
+/** A client connection, and the thread that reads its requests and
+ *  writes back the responses. It has one job at a time */
+typedef struct connection
+{
+	struct connection* next;
+	mips_server_h server;
+	int fd;
+	job job;
+	/** The bytes 'job.buffer' has room for */
+	uint32_t capacity;
+} connection;
+
+/** A warm CPU/RAM pair and the thread that runs jobs on it */
+typedef struct
+{
+	mips_server_h server;
+	mips_cpu_h cpu;
+	mips_mem_h mem;
+	/** The snapshot guest memory holds, but for the pages marked in
+	 *  'dirty'; NULL until the first job */
+	const uint8_t* loaded;
+	uint8_t* dirty;
+	pthread_t thread;
+	bool started;
+} worker;
+
+/** Server state */
+struct mips_server_impl
+{
+	struct sockaddr_un address;
+	int listener;
+	pthread_t acceptor;
+	bool accepting;
+	uint32_t mem_size, pages;
+	image* images;
+	unsigned image_count;
+	/** The snapshot for MIPS_SERVER_NO_IMAGE */
+	uint8_t* zero;
+	worker* workers;
+	unsigned pool;
+	/** Guards everything below */
+	pthread_mutex_t lock;
+	/** Jobs waiting for a worker, oldest first */
+	job *head, *tail;
+	/** Open connections */
+	connection* connections;
+	/** Signalled when a job is queued, and broadcast on stopping */
+	pthread_cond_t queued;
+	/** Broadcast when a job is done, and when a connection closes */
+	pthread_cond_t finished;
+	bool started, stop;
+};
+
+/** Returns the monotonic clock, in seconds */
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Reads exactly 'length' bytes, returning false on error or hang up */
+static bool read_full(int fd, void* data, size_t length)
+{
+	uint8_t* ptr = data;
+	ssize_t n;
+	while(length > 0)
+	{
+		n = read(fd, ptr, length);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		ptr += n;
+		length -= n;
+	}
+	return true;
+}
+
+/** Writes exactly 'length' bytes, returning false on error */
+static bool write_full(int fd, const void* data, size_t length)
+{
+	const uint8_t* ptr = data;
+	ssize_t n;
+	while(length > 0)
+	{
+		n = send(fd, ptr, length, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		ptr += n;
+		length -= n;
+	}
+	return true;
+}
+
+/** Finds the snapshot for an image id, or NULL */
+static const uint8_t* find_image(mips_server_h s, uint32_t id)
+{
+	unsigned i;
+	if(id == MIPS_SERVER_NO_IMAGE)
+		return s->zero;
+	for(i = 0; i < s->image_count; i++)
+		if(s->images[i].id == id)
+			return s->images[i].snapshot;
+	return NULL;
+}
+
+/** True if [address, address + length) lies inside guest memory */
+static bool in_memory(mips_server_h s, uint32_t address, uint32_t length)
+{
+	return address <= s->mem_size && length <= s->mem_size - address;
+}
+
+/** Puts guest memory back to a snapshot. If it already holds that
+ *  snapshot, only the pages the last job wrote are copied */
+static mips_error restore(worker* w, const uint8_t* snapshot)
+{
+	mips_server_h s = w->server;
+	uint32_t i, offset, length;
+	mips_error error = mips_Success;
+	if(w->loaded != snapshot)
+		memset(w->dirty, 1, s->pages);
+	else
+		error = mips_mem_take_dirty_pages(w->mem, w->dirty, s->pages);
+	for(i = 0; !error && i < s->pages; i++)
+	{
+		if(!w->dirty[i])
+			continue;
+		offset = i * MIPS_MEM_PAGE_SIZE;
+		length = s->mem_size - offset;
+		if(length > MIPS_MEM_PAGE_SIZE)
+			length = MIPS_MEM_PAGE_SIZE;
+		error = mips_mem_write(w->mem, offset, length, snapshot + offset);
+	}
+	/** Clears the flags those writes set */
+	if(!error)
+		error = mips_mem_take_dirty_pages(w->mem, w->dirty, s->pages);
+	w->loaded = error ? NULL : snapshot;
+	return error;
+}
+
+/** Runs one job on the worker's instance */
+static void run_job(worker* w, job* j)
+{
+	mips_server_h s = w->server;
+	const mips_server_request* req = &j->req;
+	mips_server_response* resp = &j->resp;
+	const uint8_t* snapshot = find_image(s, req->image);
+	double start = now();
+	mips_error error = mips_Success;
+	unsigned i;
+	memset(resp, 0, sizeof(mips_server_response));
+	if(snapshot == NULL || !in_memory(s, req->input_address, req->input_length)
+		|| !in_memory(s, req->output_address, req->output_length))
+		error = mips_ErrorInvalidArgument;
+	if(!error)
+	{
+		mips_cpu_reset(w->cpu);
+		error = restore(w, snapshot);
+	}
+	if(!error && req->input_length)
+		error = mips_mem_write(w->mem, req->input_address, req->input_length, j->buffer);
+	if(!error)
+	{
+		for(i = 1; i < 32; i++)
+			mips_cpu_set_register(w->cpu, i, req->regs[i]);
+		mips_cpu_set_pc(w->cpu, req->entry);
+		error = mips_cpu_run(w->cpu, req->exit, req->budget, &resp->retired);
+		for(i = 0; i < 32; i++)
+			mips_cpu_get_register(w->cpu, i, &resp->regs[i]);
+		mips_cpu_get_pc(w->cpu, &resp->pc);
+	}
+	if(!error && req->output_length)
+	{
+		error = mips_mem_read(w->mem, req->output_address, req->output_length, j->buffer);
+		if(!error)
+			resp->output_length = req->output_length;
+	}
+	resp->error = error;
+	resp->wall_time = now() - start;
+}
+
+/** Thread entry point for a worker: runs queued jobs until the
+ *  server stops */
+static void* worker_main(void* arg)
+{
+	worker* w = arg;
+	mips_server_h s = w->server;
+	job* j;
+	pthread_mutex_lock(&s->lock);
+	for(;;)
+	{
+		while(s->head == NULL && !s->stop)
+			pthread_cond_wait(&s->queued, &s->lock);
+		if(s->head == NULL)
+			break;
+		j = s->head;
+		s->head = j->next;
+		if(s->head == NULL)
+			s->tail = NULL;
+		pthread_mutex_unlock(&s->lock);
+		run_job(w, j);
+		pthread_mutex_lock(&s->lock);
+		j->done = true;
+		pthread_cond_broadcast(&s->finished);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/** Reads a request and its input into the connection's job
+ *  Returns false on hang up, or anything that isn't a request */
+static bool read_request(connection* c)
+{
+	job* j = &c->job;
+	uint32_t mem_size = c->server->mem_size, length;
+	uint8_t* buffer;
+	if(!read_full(c->fd, &j->req, sizeof(j->req)) || j->req.magic != MIPS_SERVER_MAGIC
+		|| j->req.input_length > mem_size || j->req.output_length > mem_size)
+		return false;
+	length = j->req.input_length > j->req.output_length
+		? j->req.input_length : j->req.output_length;
+	if(length > c->capacity)
+	{
+		buffer = realloc(j->buffer, length);
+		if(buffer == NULL)
+			return false;
+		j->buffer = buffer;
+		c->capacity = length;
+	}
+	return read_full(c->fd, j->buffer, j->req.input_length);
+}
+
+/** Thread entry point for a connection: queues each request for the
+ *  workers and writes back its response, until the client hangs up,
+ *  sends something that isn't a request, or the server stops */
+static void* serve(void* arg)
+{
+	connection* c = arg;
+	connection** link;
+	mips_server_h s = c->server;
+	job* j = &c->job;
+	while(read_request(c))
+	{
+		pthread_mutex_lock(&s->lock);
+		if(s->stop)
+		{
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		j->next = NULL;
+		j->done = false;
+		if(s->tail != NULL)
+			s->tail->next = j;
+		else
+			s->head = j;
+		s->tail = j;
+		pthread_cond_signal(&s->queued);
+		while(!j->done)
+			pthread_cond_wait(&s->finished, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+		if(!write_full(c->fd, &j->resp, sizeof(j->resp))
+			|| !write_full(c->fd, j->buffer, j->resp.output_length))
+			break;
+	}
+	pthread_mutex_lock(&s->lock);
+	for(link = &s->connections; *link != c; link = &(*link)->next)
+		;
+	*link = c->next;
+	pthread_cond_broadcast(&s->finished);
+	pthread_mutex_unlock(&s->lock);
+	close(c->fd);
+	free(j->buffer);
+	free(c);
+	return NULL;
+}
+
+/** Thread entry point: accepts connections, giving each a thread of
+ *  its own, until the server stops */
+static void* accept_main(void* arg)
+{
+	mips_server_h s = arg;
+	connection* c;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(;;)
+	{
+		fd = accept(s->listener, NULL, NULL);
+		if(fd < 0 && errno == EINTR)
+			continue;
+		if(fd < 0)
+			break;
+		c = calloc(1, sizeof(connection));
+		if(c == NULL)
+		{
+			close(fd);
+			continue;
+		}
+		pthread_mutex_lock(&s->lock);
+		if(s->stop)
+		{
+			pthread_mutex_unlock(&s->lock);
+			close(fd);
+			free(c);
+			break;
+		}
+		c->server = s;
+		c->fd = fd;
+		c->next = s->connections;
+		s->connections = c;
+		if(pthread_create(&thread, &attr, &serve, c))
+		{
+			s->connections = c->next;
+			close(fd);
+			free(c);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	pthread_attr_destroy(&attr);
+	return NULL;
+}
+
+/** Creates a server */
+mips_server_h mips_server_create(const char* path, unsigned pool, uint32_t mem_size)
+{
+	mips_server_h ret;
+	worker* w;
+	unsigned i;
+	if(path == NULL || strlen(path) >= sizeof(ret->address.sun_path)
+		|| pool == 0 || mem_size == 0)
+		return NULL;
+	ret = calloc(1, sizeof(struct mips_server_impl));
+	if(ret == NULL)
+		return NULL;
+	ret->listener = -1;
+	ret->mem_size = mem_size;
+	ret->pages = (mem_size + MIPS_MEM_PAGE_SIZE - 1) / MIPS_MEM_PAGE_SIZE;
+	ret->pool = pool;
+	ret->address.sun_family = AF_UNIX;
+	strcpy(ret->address.sun_path, path);
+	pthread_mutex_init(&ret->lock, NULL);
+	pthread_cond_init(&ret->queued, NULL);
+	pthread_cond_init(&ret->finished, NULL);
+	ret->zero = calloc(mem_size, 1);
+	ret->workers = calloc(pool, sizeof(worker));
+	if(ret->zero == NULL || ret->workers == NULL)
+	{
+		mips_server_free(ret);
+		return NULL;
+	}
+	for(i = 0; i < pool; i++)
+	{
+		w = &ret->workers[i];
+		w->server = ret;
+		w->mem = mips_mem_create_ram(mem_size, 1);
+		w->cpu = mips_cpu_create(w->mem);
+		w->dirty = malloc(ret->pages);
+		if(w->mem == NULL || w->cpu == NULL || w->dirty == NULL)
+		{
+			mips_server_free(ret);
+			return NULL;
+		}
+	}
+	return ret;
+}
+
+/** Registers an image */
+mips_error mips_server_add_image(mips_server_h state,
+	unsigned id,
+	const uint8_t* data,
+	uint32_t length,
+	uint32_t address)
+{
+	image* images;
+	uint8_t* snapshot;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(state->started || id == MIPS_SERVER_NO_IMAGE || find_image(state, id) != NULL
+		|| (data == NULL && length > 0) || !in_memory(state, address, length))
+		return mips_ErrorInvalidArgument;
+	snapshot = calloc(state->mem_size, 1);
+	images = realloc(state->images, (state->image_count + 1) * sizeof(image));
+	if(snapshot == NULL || images == NULL)
+	{
+		free(snapshot);
+		if(images != NULL)
+			state->images = images;
+		return mips_ErrorOutOfMemory;
+	}
+	memcpy(snapshot + address, data, length);
+	state->images = images;
+	images[state->image_count].id = id;
+	images[state->image_count].snapshot = snapshot;
+	state->image_count++;
+	return mips_Success;
+}
+
+/** Starts accepting connections */
+mips_error mips_server_start(mips_server_h state)
+{
+	unsigned i;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(state->started)
+		return mips_ErrorInvalidArgument;
+	state->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(state->listener < 0)
+		return mips_ErrorFileWriteError;
+	unlink(state->address.sun_path);
+	if(bind(state->listener, (struct sockaddr*)&state->address, sizeof(state->address))
+		|| listen(state->listener, SOMAXCONN))
+	{
+		close(state->listener);
+		state->listener = -1;
+		return mips_ErrorFileWriteError;
+	}
+	state->started = true;
+	for(i = 0; i < state->pool; i++)
+		state->workers[i].started = !pthread_create(&state->workers[i].thread,
+			NULL, &worker_main, &state->workers[i]);
+	state->accepting = !pthread_create(&state->acceptor, NULL, &accept_main, state);
+	return state->accepting ? mips_Success : mips_ErrorOutOfMemory;
+}
+
+/** Stops the server and frees everything */
+void mips_server_free(mips_server_h state)
+{
+	connection* c;
+	worker* w;
+	job* j;
+	unsigned i;
+	if(state == NULL)
+		return;
+	pthread_mutex_lock(&state->lock);
+	state->stop = true;
+	/** Jobs no worker has taken fail; those running are finished */
+	for(j = state->head; j != NULL; j = j->next)
+	{
+		memset(&j->resp, 0, sizeof(mips_server_response));
+		j->resp.error = mips_ErrorInvalidHandle;
+		j->done = true;
+	}
+	state->head = state->tail = NULL;
+	for(c = state->connections; c != NULL; c = c->next)
+		shutdown(c->fd, SHUT_RDWR);
+	pthread_cond_broadcast(&state->queued);
+	pthread_cond_broadcast(&state->finished);
+	pthread_mutex_unlock(&state->lock);
+	/** Wakes up the thread blocked in accept */
+	if(state->listener >= 0)
+		shutdown(state->listener, SHUT_RDWR);
+	if(state->accepting)
+		pthread_join(state->acceptor, NULL);
+	for(i = 0; state->workers != NULL && i < state->pool; i++)
+	{
+		w = &state->workers[i];
+		if(w->started)
+			pthread_join(w->thread, NULL);
+		mips_cpu_free(w->cpu);
+		mips_mem_free(w->mem);
+		free(w->dirty);
+	}
+	/** Each connection's thread frees it on the way out */
+	pthread_mutex_lock(&state->lock);
+	while(state->connections != NULL)
+		pthread_cond_wait(&state->finished, &state->lock);
+	pthread_mutex_unlock(&state->lock);
+	if(state->listener >= 0)
+	{
+		close(state->listener);
+		unlink(state->address.sun_path);
+	}
+	for(i = 0; i < state->image_count; i++)
+		free(state->images[i].snapshot);
+	pthread_cond_destroy(&state->queued);
+	pthread_cond_destroy(&state->finished);
+	pthread_mutex_destroy(&state->lock);
+	free(state->images);
+	free(state->workers);
+	free(state->zero);
+	free(state);
+}
+
+/** Connects to a server */
+int mips_client_connect(const char* path)
+{
+	struct sockaddr_un address;
+	int fd;
+	if(path == NULL || strlen(path) >= sizeof(address.sun_path))
+		return -1;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+		return -1;
+	if(connect(fd, (struct sockaddr*)&address, sizeof(address)))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/** Sends one job and waits for its result */
+mips_error mips_client_run(int fd,
+	const mips_server_request* request,
+	const uint8_t* input,
+	mips_server_response* response,
+	uint8_t* output)
+{
+	if(request == NULL || response == NULL
+		|| (input == NULL && request->input_length > 0)
+		|| (output == NULL && request->output_length > 0))
+		return mips_ErrorInvalidArgument;
+	if(!write_full(fd, request, sizeof(mips_server_request))
+		|| !write_full(fd, input, request->input_length))
+		return mips_ErrorFileWriteError;
+	if(!read_full(fd, response, sizeof(mips_server_response))
+		|| response->output_length > request->output_length
+		|| !read_full(fd, output, response->output_length))
+		return mips_ErrorFileReadError;
+	return mips_Success;
+}
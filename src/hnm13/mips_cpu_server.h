@@ -0,0 +1,92 @@
+#ifndef mips_cpu_server_header
+#define mips_cpu_server_header
+
+#include "mips_cpu.h"
+
+/** Marks the start of every request */
+#define MIPS_SERVER_MAGIC 0x4D495053
+/** Request image id for a job that starts from zeroed memory */
+#define MIPS_SERVER_NO_IMAGE 0xFFFFFFFF
+
+/** A job, as sent over the socket (in host byte order)
+ *  It is followed by input_length bytes, written to guest memory at
+ *  input_address after the image is loaded */
+typedef struct
+{
+	/** Always MIPS_SERVER_MAGIC */
+	uint32_t magic;
+	/** The id given to mips_server_add_image, or MIPS_SERVER_NO_IMAGE */
+	uint32_t image;
+	/** Initial register values ($0 is ignored) */
+	uint32_t regs[32];
+	/** Address of the first instruction, and where the job finishes */
+	uint32_t entry, exit;
+	/** The most instructions the job may retire */
+	uint64_t budget;
+	uint32_t input_address, input_length;
+	/** A block of guest memory to send back with the result */
+	uint32_t output_address, output_length;
+} mips_server_request;
+
+/** A result, as sent back over the socket
+ *  It is followed by output_length bytes of guest memory */
+typedef struct
+{
+	/** mips_Success if the job reached its exit or ran out of budget */
+	uint32_t error;
+	uint32_t pc;
+	uint64_t retired;
+	uint32_t regs[32];
+	/** Time spent on the job inside the server, in seconds */
+	double wall_time;
+	/** The number of output bytes following; 0 if the job failed */
+	uint32_t output_length;
+} mips_server_response;
+
+/** A job server listening on a Unix domain socket
+ *
+ *  The server keeps a warm pool of CPU/RAM pairs, created once, and
+ *  a snapshot of guest memory for each registered image. Each
+ *  connection has a thread that reads its requests into a shared
+ *  queue and writes back the responses; a worker thread owns each
+ *  pair, and takes jobs from the queue in turn, so any number of
+ *  clients share the pool. A worker puts back only the pages of the
+ *  snapshot that the last job wrote, so a job costs the run itself,
+ *  and a copy of the memory it touched, unless it uses a different
+ *  image to the one before it on that worker. */
+struct mips_server_impl;
+
+/** An opaque handle to a server */
+typedef struct mips_server_impl *mips_server_h;
+
+/** Creates a server that will listen at 'path' (replacing any old
+ *  socket there), with 'pool' instances of mem_size bytes of RAM */
+mips_server_h mips_server_create(const char* path, unsigned pool, uint32_t mem_size);
+
+/** Registers an image, in guest byte order, loaded at 'address' in
+ *  otherwise zeroed memory. Must be called before mips_server_start */
+mips_error mips_server_add_image(mips_server_h state,
+	unsigned id,
+	const uint8_t* image,
+	uint32_t length,
+	uint32_t address);
+
+/** Starts accepting connections */
+mips_error mips_server_start(mips_server_h state);
+
+/** Disconnects every client, stops the server and removes the socket */
+void mips_server_free(mips_server_h state);
+
+/** Connects to a server, returning the socket or -1 */
+int mips_client_connect(const char* path);
+
+/** Sends one job and waits for its result
+ *  input : request->input_length bytes to send with the job
+ *  output : Receives up to request->output_length bytes */
+mips_error mips_client_run(int fd,
+	const mips_server_request* request,
+	const uint8_t* input,
+	mips_server_response* response,
+	uint8_t* output);
+
+#endif // mips_cpu_server_header
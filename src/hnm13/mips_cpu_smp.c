@@ -0,0 +1,88 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Symmetric multi-core runs over host threads
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_smp.h"
+#include "mips_cpu_extend.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+/** Per-thread arguments and results */
+typedef struct
+{
+	mips_cpu_h cpu;
+	uint32_t stop_pc;
+	uint64_t budget;
+	mips_error error;
+	uint64_t retired;
+} core_args;
+
+/** Thread entry point: runs one core */
+static void* core(void* arg)
+{
+	core_args* args = arg;
+	args->error = mips_cpu_run(args->cpu, args->stop_pc,
+		args->budget, &args->retired);
+	return NULL;
+}
+
+/** Runs several CPUs against one shared memory, one host thread each */
+mips_error mips_smp_run(mips_cpu_h* cpus,
+	unsigned count,
+	uint32_t stop_pc,
+	uint64_t budget,
+	mips_error* errors,
+	uint64_t* retired)
+{
+	pthread_t* handles;
+	core_args* args;
+	bool* started;
+	unsigned i;
+	if(cpus == NULL && count > 0)
+		return mips_ErrorInvalidArgument;
+	for(i = 0; i < count; i++)
+		if(cpus[i] == NULL)
+			return mips_ErrorInvalidHandle;
+	handles = malloc(count * sizeof(pthread_t));
+	args = malloc(count * sizeof(core_args));
+	started = malloc(count * sizeof(bool));
+	if(count > 0 && (handles == NULL || args == NULL || started == NULL))
+	{
+		free(handles);
+		free(args);
+		free(started);
+		return mips_ErrorOutOfMemory;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		mips_cpu_set_id(cpus[i], i);
+		args[i].cpu = cpus[i];
+		args[i].stop_pc = stop_pc;
+		args[i].budget = budget;
+		args[i].retired = 0;
+		started[i] = !pthread_create(&handles[i], NULL, &core, &args[i]);
+		/** Rather than give up, run a core we couldn't start on this thread */
+		if(!started[i])
+			core(&args[i]);
+	}
+	for(i = 0; i < count; i++)
+	{
+		if(started[i])
+			pthread_join(handles[i], NULL);
+		if(errors != NULL)
+			errors[i] = args[i].error;
+		if(retired != NULL)
+			retired[i] = args[i].retired;
+	}
+
+	free(handles);
+	free(args);
+	free(started);
+	return mips_Success;
+}
@@ -0,0 +1,34 @@
+#ifndef mips_cpu_smp_header
+#define mips_cpu_smp_header
+
+#include "mips_cpu.h"
+
+/** Runs several CPUs against one shared memory, one host thread each
+ *
+ *  CPU i is given the number i, which the guest reads with RDHWR $0
+ *  (encoded as 0x7C00003B | rt << 16). Each CPU then runs as
+ *  mips_cpu_run would, until it reaches stop_pc, fails, or retires
+ *  'budget' instructions. If given, errors[i] and retired[i] receive
+ *  how CPU i stopped and how far it got.
+ *
+ *  Memory ordering, as seen by the guest:
+ *   - Loads and stores of a byte, half or word at an address aligned
+ *     to their size are single-copy atomic, and are seen by every CPU
+ *     in the order each CPU made them only for the same address.
+ *   - SYNC is a full fence. Everything before it is visible to all
+ *     CPUs before anything after it.
+ *   - LL/SC are implemented as a compare and swap of the word LL read,
+ *     which is sequentially consistent and also acts as a fence. SC
+ *     succeeds if the word holds the same value, even if it was
+ *     written in between (this is enough for locks and counters).
+ *
+ *  The memory's debug state (watch hits) is shared, so watchpoints are
+ *  best avoided while several CPUs are running. */
+mips_error mips_smp_run(mips_cpu_h* cpus,
+	unsigned count,
+	uint32_t stop_pc,
+	uint64_t budget,
+	mips_error* errors,
+	uint64_t* retired);
+
+#endif // mips_cpu_smp_header
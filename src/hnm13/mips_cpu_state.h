@@ -0,0 +1,290 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Private CPU state, shared between the mips_cpu_*.c files
+ **/
+
+#ifndef mips_cpu_state_header
+#define mips_cpu_state_header
+
+#include "mips_cpu.h"
+#include "mips_util.h"
+#include "mips_cpu_stats.h"
+#include "mips_cpu_latency.h"
+#include "mips_cpu_profile.h"
+#include "mips_cpu_metrics.h"
+#include "mips_cpu_coverage.h"
+#include <stdbool.h>
+
+/** The number of simulated register **/
+#define NUM_REGS 32
+/** The size of temp_buf **/
+#define BUF_SIZE 256
+
+/** Bits of undefined_hi_lo */
+#define UNDEFINED_HI 1
+#define UNDEFINED_LO 2
+
+/** The number of entries in the guest TLB */
+#define TLB_SIZE 64
+/** The number of entries in the host translation cache (power of 2) */
+#define TLB_CACHE_SIZE 256
+
+/** Two words next to each other, the high and low parts */
+typedef struct
+{
+	uint32_t lo, hi;
+} s_hi_lo;
+
+/** A double word register, accessible in full or in parts */
+typedef union
+{
+	uint64_t full;
+	s_hi_lo parts;
+} long_reg;
+
+/** A TLB entry, in the EntryHi/EntryLo register format */
+typedef struct
+{
+	uint32_t hi, lo;
+} tlb_entry;
+
+/** COP0 system control state (R3000 style) */
+typedef struct
+{
+	/** COP0 registers, indexed by register number */
+	uint32_t reg[16];
+	/** The guest-visible TLB */
+	tlb_entry tlb[TLB_SIZE];
+	/** Direct-mapped cache of TLB lookups, indexed by the low VPN bits.
+	 *  'hi' holds VPN | ASID | 1 when the line is valid */
+	tlb_entry cache[TLB_CACHE_SIZE];
+} mips_mmu;
+
+/** A CPU's stores held back from memory (see mips_cpu_quantum.c) */
+typedef struct store_buffer store_buffer;
+
+/** Kinds of debug message, as recorded in a trace ring */
+typedef enum
+{
+	trace_pc,
+	trace_pcN,
+	trace_op,
+	trace_reg,
+	trace_exception,
+	/** A read of an undefined register: 'index' is its number, or 32
+	 *  for $HI and 33 for $LO, and 'value' the PC */
+	trace_undefined,
+	/** Preformatted: 'length' bytes of text fill the records after it */
+	trace_text
+} trace_kind;
+
+/** One debug message, as the values it is made from */
+typedef struct
+{
+	uint8_t kind;
+	uint8_t index;
+	uint16_t length;
+	uint32_t value;
+	/** The instruction name, for trace_op */
+	const char* name;
+} trace_record;
+
+/** A CPU's asynchronous debug output (see mips_cpu_trace.c) */
+typedef struct trace_ring trace_ring;
+
+/** A CPU's binary trace file (see mips_cpu_btrace.c) */
+typedef struct btrace btrace;
+
+/** Latency sampling state (see mips_cpu_latency.c) */
+typedef struct
+{
+	/** One instruction in about this many is timed; 0 when off */
+	uint32_t period;
+	/** Instructions left until the next sample */
+	uint32_t countdown;
+	uint32_t seed;
+	mips_latency_profile profile;
+} latency_sampler;
+
+/** A CPU's shadow call stack and call counts (see mips_cpu_callgraph.c) */
+typedef struct callgraph callgraph;
+
+/** A CPU's reuse distance and working set profile (see mips_cpu_memprof.c) */
+typedef struct memprof memprof;
+
+/** A CPU's instrumentation plugins (see mips_cpu_plugin.c) */
+typedef struct plugin_set plugin_set;
+
+/** Bits of plugin_mask: the kinds of event some plugin wants */
+enum
+{
+	plugin_kind_instruction = 1,
+	plugin_kind_block = 2,
+	plugin_kind_memory = 4,
+	plugin_kind_branch = 8,
+	plugin_kind_exception = 16
+};
+
+/** What the host attaches to a CPU to watch it run, rather than
+ *  anything the guest can see. mips_cpu_reset and mips_cpu_copy_state
+ *  keep it as a unit */
+typedef struct
+{
+	/** If set, debug messages are written out by a background thread */
+	trace_ring* trace;
+	/** If set, a binary trace is written of every instruction */
+	btrace* btrace;
+	/** What has been executed */
+	mips_cpu_stats stats;
+	/** If set, instruction handlers may be timed */
+	latency_sampler* latency;
+	/** If set, the call stack is sampled every so many instructions */
+	mips_profiler_h profiler;
+	uint32_t profile_countdown;
+	/** If set, calls and returns are counted */
+	callgraph* callgraph;
+	/** If set, fetch and data addresses are profiled */
+	memprof* memprof;
+	/** If set, the slot counters are published to, every so often */
+	mips_metrics_slot* metrics;
+	mips_metrics_h metrics_segment;
+	uint32_t metrics_period, metrics_countdown;
+	/** If set, events are reported to plugins, of the kinds in the mask */
+	plugin_set* plugins;
+	unsigned plugin_mask;
+	/** If set, the instructions run are marked in this map, from where
+	 *  the current block started up to the next PC in sequence */
+	mips_coverage_h coverage;
+	uint32_t coverage_start, coverage_next;
+} cpu_attachments;
+
+/** CPU state structure */
+struct mips_cpu_impl
+{
+	/** Pointer to memory object */
+	mips_mem_h mem;
+	/** Debug level */
+	unsigned debug;
+	/** Output for debug messages */
+	FILE* output;
+	/** Debug handler method */
+	debug_handle debug_handle;
+	/** What the host has attached to watch it run */
+	cpu_attachments host;
+	/** Exception handler locations */
+	uint32_t exception[16];
+	/** Program counter */
+	uint32_t pc, pcN;
+	/** The $HI and $LO registers */
+	long_reg hi_lo;
+	/** Coprocessor settings */
+	coprocessor coprocessor[4];
+	/** General purpose registers */
+	uint32_t reg[NUM_REGS];
+	/** Bit n is set while $n is undefined: from a reset until it is
+	 *  first written */
+	uint32_t undefined;
+	/** UNDEFINED_HI and UNDEFINED_LO, while those are undefined: from
+	 *  a reset, or a division by zero, until they are next written */
+	unsigned undefined_hi_lo;
+	/** This core's number, read by the guest with RDHWR $0 */
+	unsigned cpu_id;
+	/** Set by LL and cleared by SC: the word LL read, and where from */
+	bool ll_bit;
+	uint32_t ll_addr, ll_value;
+	/** If set, stores are kept here rather than written to memory */
+	store_buffer* stores;
+	/** System control coprocessor state */
+	mips_mmu mmu;
+	/** A temporary buffer for processing debug output */
+	char temp_buf[BUF_SIZE];
+};
+
+/** Outputs the given string to the debug handler */
+void debug(mips_cpu_h state, const char* buf, size_t bufsize);
+
+/** Outputs a debug message of one of the trace_kind forms */
+void debug_event(mips_cpu_h state, unsigned kind, unsigned index, uint32_t value, const char* name);
+
+/** Formats a record (other than trace_text), returning the length */
+size_t trace_format(char* buf, const trace_record* rec);
+
+/** Adds a record, followed by rec->length bytes of text if given,
+ *  to the ring, or drops it if there is no room */
+void trace_push(trace_ring* ring, const trace_record* rec, const char* text);
+
+/** Sends what is left in the CPU's ring, then everything after, to
+ *  its current output and debug handler */
+void trace_set_output(mips_cpu_h state);
+
+/** Writes out everything in the CPU's ring, and frees it */
+void trace_stop(mips_cpu_h state);
+
+/** Add records to a binary trace: the start of an instruction,
+ *  a register write, a branch taken, a load or store, and an exception */
+void btrace_step(btrace* bt, uint32_t pc, uint32_t pcN);
+void btrace_reg(btrace* bt, unsigned index, uint32_t value);
+void btrace_branch(btrace* bt, uint32_t target);
+void btrace_mem(btrace* bt, bool load, unsigned reg, uint32_t address, unsigned length);
+void btrace_exception(btrace* bt, mips_error error);
+
+/** Runs an instruction's handler, adding the time it takes to the
+ *  CPU's latency histograms */
+mips_error latency_sample(mips_cpu_h state, op handler, uint32_t instruction);
+
+/** Adds the CPU's call stack to its profiler */
+void profile_sample(mips_cpu_h state);
+
+/** Tell the call graph of a call, a 'jr $ra', the PC being set, and
+ *  the retired count being reset */
+void callgraph_call(mips_cpu_h state, uint32_t target, uint32_t return_address);
+void callgraph_return(mips_cpu_h state, uint32_t target);
+void callgraph_restart(mips_cpu_h state);
+void callgraph_rebase(mips_cpu_h state);
+
+/** Frees a CPU's call graph */
+void callgraph_free(callgraph* cg);
+
+/** Adds an access to a memory profile stream (a mips_memprof_stream) */
+void memprof_access(mips_cpu_h state, unsigned stream, uint32_t address);
+
+/** Frees a CPU's memory profile */
+void memprof_free(memprof* mp);
+
+/** Copies the CPU's counters to its metrics slot */
+void metrics_publish(mips_cpu_h state);
+
+/** Report events to a CPU's plugins: an instruction about to run
+ *  (and the block it starts), a load or store, a branch decided, and
+ *  an instruction failing. Each is only called when its kind is in
+ *  the plugin mask */
+void plugin_step(mips_cpu_h state, uint32_t instruction);
+void plugin_memory(mips_cpu_h state, uint32_t address, unsigned length, bool store);
+void plugin_branch(mips_cpu_h state, uint32_t target, bool taken);
+void plugin_exception(mips_cpu_h state, mips_error error);
+
+/** Frees a CPU's plugins */
+void plugin_free(plugin_set* set);
+
+/** Tell the coverage map of a new block starting at the PC, and of an
+ *  edge of the conditional branch at the PC; and write the block being
+ *  run to the map */
+void coverage_block(mips_cpu_h state);
+void coverage_edge(mips_cpu_h state, bool taken);
+void coverage_flush(mips_cpu_h state);
+
+/** Sets a register, ensuring that $0 == 0 and outputting debug information */
+void set_reg(mips_cpu_h state, unsigned index, uint32_t value);
+
+/** Adds a store of 'length' bytes, in memory order, to the buffer */
+mips_error store_buffer_store(store_buffer* sb, uint32_t address, unsigned length, const uint8_t* data);
+
+/** Replaces the bytes of a load that the buffer holds newer values for */
+void store_buffer_load(const store_buffer* sb, uint32_t address, unsigned length, uint8_t* data);
+
+/** Puts the MMU registers into their power-on state */
+void mmu_init(mips_mmu* mmu);
+
+#endif // mips_cpu_state_header
@@ -0,0 +1,105 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Instruction mix counters
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_stats.h"
+#include "mips_cpu_state.h"
+#include "mips_cpu_extend.h"
+#include <string.h>
+
+/** Copies the counters */
+mips_error mips_cpu_get_stats(mips_cpu_h state, mips_cpu_stats* stats)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(stats == NULL)
+		return mips_ErrorInvalidArgument;
+	*stats = state->host.stats;
+	return mips_Success;
+}
+
+/** Zeroes the counters */
+mips_error mips_cpu_reset_stats(mips_cpu_h state)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	/** The call graph counts time by the retired count */
+	if(state->host.callgraph != NULL)
+		callgraph_rebase(state);
+	memset(&state->host.stats, 0, sizeof(mips_cpu_stats));
+	return mips_Success;
+}
+
+/** Adds one set of counters into another */
+void mips_cpu_add_stats(mips_cpu_stats* total, const mips_cpu_stats* stats)
+{
+	/** The struct is nothing but counters */
+	uint64_t* t = (uint64_t*)total;
+	const uint64_t* s = (const uint64_t*)stats;
+	size_t i;
+	for(i = 0; i < sizeof(mips_cpu_stats) / sizeof(uint64_t); i++)
+		t[i] += s[i];
+}
+
+/** One line of the instruction mix */
+typedef struct
+{
+	uint32_t instruction;
+	uint64_t count;
+} mix_entry;
+
+/** Orders mix entries by count, largest first */
+static int compare_mix(const void* a, const void* b)
+{
+	uint64_t x = ((const mix_entry*)a)->count, y = ((const mix_entry*)b)->count;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/** Writes the instruction mix */
+void mips_cpu_print_stats(const mips_cpu_stats* stats, FILE* dest)
+{
+	mix_entry mix[128];
+	unsigned i, j, n = 0;
+	double total = stats->retired ? (double)stats->retired : 1;
+	for(i = 0; i < 64; i++)
+	{
+		/** Opcode 0 is broken down by function below */
+		if(i > 0 && stats->opcode[i])
+		{
+			mix[n].instruction = i << 26;
+			mix[n++].count = stats->opcode[i];
+		}
+		if(stats->function[i])
+		{
+			mix[n].instruction = i;
+			mix[n++].count = stats->function[i];
+		}
+	}
+	qsort(mix, n, sizeof(mix_entry), &compare_mix);
+	fprintf(dest, "%-12s %14s %7s\n", "Instruction", "Retired", "Share");
+	for(i = 0; i < n; i++)
+		fprintf(dest, "%-12s %14llu %6.2f%%\n",
+			mips_cpu_instruction_name(mix[i].instruction),
+			(unsigned long long)mix[i].count, 100 * mix[i].count / total);
+	fprintf(dest, "%-12s %14llu\n", "Total", (unsigned long long)stats->retired);
+	fprintf(dest, "Branches: %llu taken, %llu not taken\n",
+		(unsigned long long)stats->branches_taken,
+		(unsigned long long)stats->branches_not_taken);
+	fprintf(dest, "Loads: %llu byte, %llu half, %llu word\n",
+		(unsigned long long)stats->loads[0], (unsigned long long)stats->loads[1],
+		(unsigned long long)stats->loads[2]);
+	fprintf(dest, "Stores: %llu byte, %llu half, %llu word\n",
+		(unsigned long long)stats->stores[0], (unsigned long long)stats->stores[1],
+		(unsigned long long)stats->stores[2]);
+	for(i = 1; i < 4; i++)
+		for(j = 0; j < 16; j++)
+			if(stats->errors[i][j])
+				fprintf(dest, "Exception: %s (0x%x): %llu\n",
+					mips_error_string((mips_error)((i << 12) | j)), (i << 12) | j,
+					(unsigned long long)stats->errors[i][j]);
+}
@@ -0,0 +1,42 @@
+#ifndef mips_cpu_stats_header
+#define mips_cpu_stats_header
+
+#include "mips_cpu.h"
+#include <stdio.h>
+
+/** What a CPU has executed since it was created, or the counters
+ *  were last reset. The counters are always kept: each is a plain
+ *  increment on a path that is already taken. They survive
+ *  mips_cpu_reset, so a CPU reused for many jobs profiles them all */
+typedef struct
+{
+	/** Instructions retired (that ran without an exception) */
+	uint64_t retired;
+	/** Retired instructions by opcode, and the R-type ones (opcode 0)
+	 *  by function field */
+	uint64_t opcode[64];
+	uint64_t function[64];
+	/** Conditional branches */
+	uint64_t branches_taken, branches_not_taken;
+	/** Loads and stores of 1, 2 and 4 bytes */
+	uint64_t loads[3], stores[3];
+	/** Instructions that failed, by mips_error: indexed by the top
+	 *  nibble of the code (1 for errors, 2 for exceptions, 3 for internal
+	 *  errors) and then by the low nibble */
+	uint64_t errors[4][16];
+} mips_cpu_stats;
+
+/** Copies the CPU's counters into 'stats' */
+mips_error mips_cpu_get_stats(mips_cpu_h state, mips_cpu_stats* stats);
+
+/** Sets all the CPU's counters to zero */
+mips_error mips_cpu_reset_stats(mips_cpu_h state);
+
+/** Adds one set of counters into another, for totals over many CPUs */
+void mips_cpu_add_stats(mips_cpu_stats* total, const mips_cpu_stats* stats);
+
+/** Writes the instruction mix as a table, busiest instructions first,
+ *  followed by the branch, memory and exception counts */
+void mips_cpu_print_stats(const mips_cpu_stats* stats, FILE* dest);
+
+#endif // mips_cpu_stats_header
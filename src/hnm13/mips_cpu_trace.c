@@ -0,0 +1,252 @@
+/**
+ * MIPS-I CPU Implementation
+ * (C) Hamish Milne 2014
+ *
+ * Asynchronous debug output, through a ring buffer per CPU
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_trace.h"
+#include "mips_cpu_state.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+/** How long the thread sleeps when the ring is empty, in nanoseconds */
+#define IDLE_SLEEP 200000
+
+/** Ring state. The CPU only writes 'head' and 'dropped', and the thread
+ *  only 'tail' and 'reported', each kept on its own cache line */
+struct trace_ring
+{
+	trace_record* records;
+	uint32_t mask;
+	mips_cpu_h state;
+	/** Where the CPU's output went when the ring was last empty, as the
+	 *  CPU may change its own copies while the thread is writing. Only
+	 *  changed once the thread has written out everything it was given,
+	 *  and only read by it for records pushed after that */
+	FILE* output;
+	debug_handle handle;
+	pthread_t thread;
+	bool stop;
+	char pad0[64];
+	uint64_t head, dropped;
+	char pad1[64];
+	uint64_t tail;
+	/** The drop count last written out */
+	uint64_t reported;
+	char pad2[64];
+};
+
+/** The number of records a message takes, with its text */
+static uint32_t record_count(size_t length)
+{
+	return 1 + (length + sizeof(trace_record) - 1) / sizeof(trace_record);
+}
+
+/** Formats a record as a debug message */
+size_t trace_format(char* buf, const trace_record* rec)
+{
+	switch(rec->kind)
+	{
+	case trace_pc:
+		return sprintf(buf, "PC: %d\n", rec->value);
+	case trace_pcN:
+		return sprintf(buf, "$pcN = 0x%x\n", rec->value);
+	case trace_op:
+		return sprintf(buf, "%s\n", rec->name);
+	case trace_reg:
+		return sprintf(buf, "$%d = %d (0x%x)\n", rec->index,
+			(int32_t)rec->value, rec->value);
+	case trace_exception:
+		return sprintf(buf, "Exception: %s\n",
+			mips_error_string((mips_error)rec->value));
+	case trace_undefined:
+		if(rec->index >= 32)
+			return sprintf(buf, "Undefined: $%s read at 0x%x\n",
+				rec->index == 32 ? "HI" : "LO", rec->value);
+		return sprintf(buf, "Undefined: $%d read at 0x%x\n", rec->index, rec->value);
+	default:
+		return 0;
+	}
+}
+
+/** Adds a record to the ring, or counts it as dropped */
+void trace_push(trace_ring* ring, const trace_record* rec, const char* text)
+{
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t count = record_count(text != NULL ? rec->length : 0);
+	uint32_t first, part;
+	if(count > ring->mask + 1 - (head - tail))
+	{
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ring->records[head & ring->mask] = *rec;
+	/** The text fills the following records, wrapping round the end */
+	if(text != NULL)
+	{
+		first = (head + 1) & ring->mask;
+		part = (ring->mask + 1 - first) * sizeof(trace_record);
+		if(part > rec->length)
+			part = rec->length;
+		memcpy(ring->records + first, text, part);
+		memcpy(ring->records, text + part, rec->length - part);
+	}
+	__atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+}
+
+/** Writes one message where the CPU's debug output goes */
+static void write_out(trace_ring* ring, const char* buf, size_t length)
+{
+	if(ring->handle != NULL)
+		ring->handle(ring->state, buf, length);
+	else
+		fwrite(buf, 1, length, ring->output != NULL ? ring->output : stdout);
+}
+
+/** Formats and writes out everything in the ring up to 'head' */
+static void drain(trace_ring* ring, uint64_t head)
+{
+	char buf[BUF_SIZE + 2 * sizeof(trace_record)];
+	const trace_record* rec;
+	uint64_t tail = ring->tail, dropped;
+	uint32_t first, part;
+	size_t length;
+	while(tail < head)
+	{
+		rec = &ring->records[tail & ring->mask];
+		if(rec->kind == trace_text)
+		{
+			length = rec->length;
+			first = (tail + 1) & ring->mask;
+			part = (ring->mask + 1 - first) * sizeof(trace_record);
+			if(part > length)
+				part = length;
+			memcpy(buf, ring->records + first, part);
+			memcpy(buf + part, ring->records, length - part);
+			tail += record_count(length);
+		}
+		else
+		{
+			length = trace_format(buf, rec);
+			tail++;
+		}
+		write_out(ring, buf, length);
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if(dropped != ring->reported)
+	{
+		write_out(ring, buf, sprintf(buf, "[%llu trace records dropped]\n",
+			(unsigned long long)(dropped - ring->reported)));
+		__atomic_store_n(&ring->reported, dropped, __ATOMIC_RELEASE);
+	}
+}
+
+/** Thread entry point: writes out records until told to stop */
+static void* trace_thread(void* arg)
+{
+	trace_ring* ring = arg;
+	struct timespec idle = {0, IDLE_SLEEP};
+	uint64_t head;
+	bool stop;
+	for(;;)
+	{
+		/** Read 'stop' first, so nothing pushed before it was set is missed */
+		stop = __atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if(head != ring->tail
+			|| __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) != ring->reported)
+			drain(ring, head);
+		else if(stop)
+			break;
+		else
+			nanosleep(&idle, NULL);
+	}
+	return NULL;
+}
+
+/** Writes out everything in the ring, and stops its thread */
+void trace_stop(mips_cpu_h state)
+{
+	trace_ring* ring = state->host.trace;
+	if(ring == NULL)
+		return;
+	__atomic_store_n(&ring->stop, true, __ATOMIC_RELEASE);
+	pthread_join(ring->thread, NULL);
+	state->host.trace = NULL;
+	free(ring->records);
+	free(ring);
+}
+
+/** Points the ring at the CPU's current output, once the thread has
+ *  finished with the old one: after the flush it has nothing to write
+ *  until the next push, which publishes the new output with 'head' */
+void trace_set_output(mips_cpu_h state)
+{
+	if(state->host.trace == NULL)
+		return;
+	mips_cpu_flush_trace(state);
+	state->host.trace->output = state->output;
+	state->host.trace->handle = state->debug_handle;
+}
+
+/** Turns asynchronous tracing on or off */
+mips_error mips_cpu_set_async_trace(mips_cpu_h state, unsigned capacity)
+{
+	trace_ring* ring;
+	uint32_t size = 1;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	trace_stop(state);
+	if(capacity == 0)
+		return mips_Success;
+	/** Room for at least one message of the largest size */
+	while(size < capacity || size < record_count(BUF_SIZE))
+		size <<= 1;
+	ring = calloc(1, sizeof(trace_ring));
+	if(ring == NULL)
+		return mips_ErrorOutOfMemory;
+	ring->records = malloc(size * sizeof(trace_record));
+	ring->mask = size - 1;
+	ring->state = state;
+	ring->output = state->output;
+	ring->handle = state->debug_handle;
+	if(ring->records == NULL || pthread_create(&ring->thread, NULL, &trace_thread, ring))
+	{
+		free(ring->records);
+		free(ring);
+		return mips_ErrorOutOfMemory;
+	}
+	state->host.trace = ring;
+	return mips_Success;
+}
+
+/** Waits until the ring is empty, and any drops have been reported */
+mips_error mips_cpu_flush_trace(mips_cpu_h state)
+{
+	struct timespec idle = {0, IDLE_SLEEP};
+	trace_ring* ring;
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	ring = state->host.trace;
+	while(ring != NULL && (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head
+		|| __atomic_load_n(&ring->reported, __ATOMIC_ACQUIRE) != ring->dropped))
+		nanosleep(&idle, NULL);
+	return mips_Success;
+}
+
+/** Gets the number of dropped records */
+mips_error mips_cpu_trace_dropped(mips_cpu_h state, uint64_t* dropped)
+{
+	if(state == NULL)
+		return mips_ErrorInvalidHandle;
+	if(dropped == NULL)
+		return mips_ErrorInvalidArgument;
+	*dropped = state->host.trace != NULL ? state->host.trace->dropped : 0;
+	return mips_Success;
+}
@@ -0,0 +1,36 @@
+#ifndef mips_cpu_trace_header
+#define mips_cpu_trace_header
+
+#include "mips_cpu.h"
+
+/** Asynchronous debug output
+ *
+ *  Normally each debug message is formatted and written, or passed to
+ *  the debug handler, by the CPU as it runs. With asynchronous tracing
+ *  the CPU instead puts a small binary record (the PC, the instruction,
+ *  a register and its new value, or an exception) into a ring buffer,
+ *  and a background thread formats the records and writes them to the
+ *  same place. The few messages that are not one of those kinds are
+ *  still formatted by the CPU, but go through the ring as text, so the
+ *  CPU never waits on I/O.
+ *
+ *  The ring has one writer (the CPU) and one reader (the thread), and
+ *  needs no locks. When it is full, records are dropped rather than
+ *  waited for; the output then says how many were lost, and
+ *  mips_cpu_trace_dropped counts them.
+ *
+ *  The debug handler, if any, is called on the background thread. */
+
+/** Turns asynchronous tracing on, with room for 'capacity' records
+ *  (rounded up to a power of 2), or off if capacity is 0. Turning it
+ *  off writes out everything still in the ring first */
+mips_error mips_cpu_set_async_trace(mips_cpu_h state, unsigned capacity);
+
+/** Waits until every record so far, and the count of any dropped,
+ *  has been written out */
+mips_error mips_cpu_flush_trace(mips_cpu_h state);
+
+/** Gets the number of records dropped because the ring was full */
+mips_error mips_cpu_trace_dropped(mips_cpu_h state, uint64_t* dropped);
+
+#endif // mips_cpu_trace_header
@@ -0,0 +1,107 @@
+/**
+ * MIPS-I Job server
+ * (C) Hamish Milne 2014
+ *
+ * Usage: mips_serve [-j threads] [-m bytes] socket [image.bin ...]
+ *
+ * Serves jobs (see mips_cpu_server.h) on the given Unix socket until
+ * interrupted. Each image is loaded at address 0, and given an id
+ * from 0 upwards in the order listed.
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_server.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Reads a whole file into a new buffer, or returns NULL */
+static uint8_t* read_file(const char* name, uint32_t* length)
+{
+	uint8_t* data;
+	long len;
+	FILE* fp = fopen(name, "rb");
+	if(fp == NULL)
+		return NULL;
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = len > 0 ? malloc(len) : NULL;
+	if(data != NULL && fread(data, 1, len, fp) != (size_t)len)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	*length = (uint32_t)len;
+	return data;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned threads = 0, i;
+	uint32_t mem_size = 0x100000, length;
+	mips_server_h server;
+	uint8_t* data;
+	sigset_t signals;
+	long cores;
+	int opt, sig;
+	while((opt = getopt(argc, argv, "j:m:")) != -1)
+	{
+		if(opt == 'j')
+			threads = strtoul(optarg, NULL, 0);
+		else if(opt == 'm')
+			mem_size = strtoul(optarg, NULL, 0);
+		else
+			break;
+	}
+	if(optind >= argc || opt == '?')
+	{
+		fprintf(stderr, "Usage: %s [-j threads] [-m bytes] socket [image.bin ...]\n", argv[0]);
+		return 1;
+	}
+	if(threads == 0)
+	{
+		cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? (unsigned)cores : 1;
+	}
+
+	server = mips_server_create(argv[optind], threads, mem_size);
+	if(server == NULL)
+	{
+		fprintf(stderr, "Could not create the server\n");
+		return 1;
+	}
+	for(i = optind + 1; i < (unsigned)argc; i++)
+	{
+		data = read_file(argv[i], &length);
+		if(data == NULL || mips_server_add_image(server, i - optind - 1, data, length, 0))
+		{
+			fprintf(stderr, "Could not load %s\n", argv[i]);
+			free(data);
+			mips_server_free(server);
+			return 1;
+		}
+		free(data);
+	}
+
+	/** Block the signals before any thread starts, so only sigwait sees them */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	if(mips_server_start(server))
+	{
+		fprintf(stderr, "Could not listen on %s\n", argv[optind]);
+		mips_server_free(server);
+		return 1;
+	}
+	fprintf(stderr, "Serving on %s with %u instances\n", argv[optind], threads);
+	sigwait(&signals, &sig);
+	mips_server_free(server);
+	return 0;
+}
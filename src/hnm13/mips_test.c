@@ -12,8 +12,36 @@
 #include "mips_test.h"
 #include "mips_cpu.h"
 #include "mips_util.h"
+#include "mips_cpu_extend.h"
+#include "mips_cpu_farm.h"
+#include "mips_cpu_lockstep.h"
+#include "mips_cpu_smp.h"
+#include "mips_cpu_quantum.h"
+#include "mips_cpu_sched.h"
+#include "mips_cpu_server.h"
+#include "mips_cpu_checkpoint.h"
+#include "mips_cpu_pool.h"
+#include "mips_cpu_trace.h"
+#include "mips_cpu_btrace.h"
+#include "mips_cpu_stats.h"
+#include "mips_cpu_latency.h"
+#include "mips_cpu_profile.h"
+#include "mips_cpu_callgraph.h"
+#include "mips_cpu_memprof.h"
+#include "mips_cpu_metrics.h"
+#include "mips_cpu_plugin.h"
+#include "mips_cpu_coverage.h"
 #include <limits.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 /**
  * Required signature for a general test operation
@@ -44,10 +72,8 @@ typedef bool (*rtype_test_op)(uint32_t a, uint32_t b, uint32_t out, bool imm, mi
  */
 typedef bool (*hilo_test_op)(uint32_t a, uint32_t b, uint64_t out, mips_error error);
 
-/** The size of temp_buf **/
+/** The size of the buffers used to build error messages **/
 #define BUF_SIZE 256
-/** A temporary character buffer used to build error messages **/
-static char temp_buf[BUF_SIZE];
 
 /** Test for ADD (rtype_test_op) */
 bool add_test(uint32_t a, uint32_t b, uint32_t out, bool imm, mips_error error)
@@ -263,6 +289,7 @@ static const uint32_t shift_test_values[NUM_VALUES] =
  **/
 void rtype_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned index)
 {
+	char temp_buf[BUF_SIZE];
 	int i, j;
 	uint32_t a, b, out;
 	int testID;
@@ -298,6 +325,7 @@ void rtype_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned ind
  **/
 void imm_test_base(const char* name, mips_cpu_h state, unsigned index, const uint32_t* values, const rtype_test_op* tests)
 {
+	char temp_buf[BUF_SIZE];
 	int i, j;
 	uint32_t v1, out;
 	mips_error error;
@@ -337,6 +365,7 @@ void shift_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned ind
 /** The test for MULT, DIV, and unsigned variants (test_op) */
 void hilo_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned index)
 {
+	char temp_buf[BUF_SIZE];
 	int i, j, testID;
 	uint32_t v1, v2, o1, o2;
 	uint64_t out;
@@ -375,6 +404,7 @@ void hilo_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned inde
  **/
 void lui_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned index)
 {
+	char temp_buf[BUF_SIZE];
 	int i, testID;
 	uint32_t v, out;
 	mips_error error;
@@ -405,6 +435,7 @@ void lui_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned index
  **/
 void load_base(const char* name, mips_cpu_h state, mips_mem_h mem, uint32_t offset, uint32_t value)
 {
+	char temp_buf[BUF_SIZE];
 	int testID = mips_test_begin_test(name);
 	bool pass;
 	uint32_t out = 0;
@@ -460,6 +491,7 @@ void lbu_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned index
  **/
 void store_base(const char* name, mips_cpu_h state, mips_mem_h mem, uint32_t offset, uint32_t store, uint32_t value)
 {
+	char temp_buf[BUF_SIZE];
 	int testID = mips_test_begin_test(name);
 	uint32_t out = 0;
 	bool pass;
@@ -534,6 +566,7 @@ void swr_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned index
  **/
 void branch_base(const char* name, const char* testName, mips_cpu_h state, uint32_t value, uint32_t test, unsigned index)
 {
+	char temp_buf[BUF_SIZE];
 	int i;
 	mips_error error = 0, last_error = 0;
 	uint32_t out, pcn;
@@ -654,6 +687,7 @@ void jr_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned index)
  **/
 void mf_base(const char* name, const char* reg, mips_cpu_h state, uint32_t test)
 {
+	char temp_buf[BUF_SIZE];
 	mips_error error;
 	bool pass;
 	uint32_t out;
@@ -682,6 +716,1677 @@ void mflo_test(const char* name, mips_cpu_h state, mips_mem_h mem, unsigned inde
 	mf_base(name, "LO", state, 0xECA8642);
 }
 
+/** A CPU on its own RAM, for the tests of things other than
+ *  single instructions */
+typedef struct
+{
+	mips_mem_h mem;
+	mips_cpu_h state;
+	int testID;
+} fixture;
+
+/** Begins the named test on a new CPU, with 'size' bytes of RAM
+ *  holding 'code' from 'address' */
+static void fixture_begin(fixture* f, const char* name, uint32_t size,
+	uint32_t address, const uint32_t* code, uint32_t length)
+{
+	f->testID = mips_test_begin_internal_test(name);
+	f->mem = mips_mem_create_ram(size, 4);
+	f->state = mips_cpu_create(f->mem);
+	mips_mem_write(f->mem, address, length, (const uint8_t*)code);
+}
+
+/** Frees the CPU and RAM, and ends the test with 'message' if it
+ *  failed */
+static void fixture_end(fixture* f, bool pass, const char* message)
+{
+	mips_cpu_free(f->state);
+	mips_mem_free(f->mem);
+	mips_test_end_test(f->testID, pass, pass ? NULL : message);
+}
+
+/**
+ * Test for the COP0 MMU
+ * Maps virtual page 0x00400000 to physical page 0x1000 with TLBWI,
+ * running from kseg0, then checks a store/load pair through the mapping
+ * and that an unmapped load misses the TLB. Then maps the next virtual
+ * page to physical page 0x3000, and checks that an LWL and an SWL
+ * across the two virtual pages reach both physical ones. Last, remaps
+ * the first page to physical page 0x2000, and checks that a load sees
+ * the new mapping, and that it misses once the ASID changes
+ **/
+void mmu_test()
+{
+	fixture f;
+	char temp_buf[BUF_SIZE];
+	static const uint32_t code[20] =
+	{
+		0x00508140, /** MTC0 $1, EntryHi */
+		0x00108240, /** MTC0 $2, EntryLo */
+		0x00008040, /** MTC0 $0, Index */
+		0x02000042, /** TLBWI */
+		0x100023AC, /** SW $3, 16($1) */
+		0x1000248C, /** LW $4, 16($1) */
+		0x0000C58C, /** LW $5, 0($6) */
+		0x00508B40, /** MTC0 $11, EntryHi */
+		0x00108C40, /** MTC0 $12, EntryLo */
+		0x00008D40, /** MTC0 $13, Index */
+		0x02000042, /** TLBWI */
+		0x0000EE89, /** LWL $14, 0($15) */
+		0x0000F0A9, /** SWL $16, 0($15) */
+		0x00508140, /** MTC0 $1, EntryHi */
+		0x00108740, /** MTC0 $7, EntryLo */
+		0x00008040, /** MTC0 $0, Index */
+		0x02000042, /** TLBWI */
+		0x1000288C, /** LW $8, 16($1) */
+		0x00508940, /** MTC0 $9, EntryHi */
+		0x10002A8C  /** LW $10, 16($1) */
+	};
+	int i;
+	mips_error error = mips_Success;
+	uint32_t out = 0, phys = 0;
+	uint8_t bytes[3];
+	bool pass;
+	fixture_begin(&f, "mmu", 0x4000, 0, code, sizeof(code));
+	mips_mem_write(f.mem, 0x1FFC, 4, (const uint8_t*)"\0\0\0\x11");
+	mips_mem_write(f.mem, 0x2000, 4, (const uint8_t*)"\xBB\0\0\0");
+	mips_mem_write(f.mem, 0x3000, 4, (const uint8_t*)"\xAA\0\0\0");
+	mips_mem_write(f.mem, 0x2010, 4, (const uint8_t*)"\xCA\xFE\xF0\x0D");
+	mips_cpu_enable_mmu(f.state);
+	mips_cpu_set_pc(f.state, 0x80000000);
+	mips_cpu_set_register(f.state, 1, 0x00400000);
+	mips_cpu_set_register(f.state, 2, 0x00001600);
+	mips_cpu_set_register(f.state, 3, 0x12345678);
+	mips_cpu_set_register(f.state, 6, 0x00500000);
+	mips_cpu_set_register(f.state, 7, 0x00002600);
+	mips_cpu_set_register(f.state, 9, 0x00400040);
+	mips_cpu_set_register(f.state, 11, 0x00401000);
+	mips_cpu_set_register(f.state, 12, 0x00003600);
+	mips_cpu_set_register(f.state, 13, 0x00000100);
+	mips_cpu_set_register(f.state, 15, 0x00400FFF);
+	mips_cpu_set_register(f.state, 16, 0x55660000);
+	for(i = 0; i < 6 && !error; i++)
+		error = mips_cpu_step(f.state);
+	mips_cpu_get_register(f.state, 4, &out);
+	mips_mem_read(f.mem, 0x1010, 4, (uint8_t*)&phys);
+	reverse_word(&phys);
+	pass = !error && out == 0x12345678 && phys == 0x12345678
+		&& mips_cpu_step(f.state) == mips_ExceptionInvalidAddress;
+	if(!pass)
+		sprintf(temp_buf, "MMU: 0x%x, 0x%x (%s)", out, phys, mips_error_string(error));
+	if(pass)
+	{
+		mips_cpu_set_pc(f.state, 0x8000001C);
+		for(i = 0; i < 5 && !error; i++)
+			error = mips_cpu_step(f.state);
+		mips_cpu_get_register(f.state, 14, &out);
+		pass = !error && out == 0x11AA0000;
+		/** The SWL must write to the same two bytes */
+		error = mips_cpu_step(f.state);
+		mips_mem_read(f.mem, 0x1FFC, 4, (uint8_t*)&phys);
+		bytes[0] = (uint8_t)(phys >> 24);
+		mips_mem_read(f.mem, 0x2000, 4, (uint8_t*)&phys);
+		bytes[1] = (uint8_t)phys;
+		mips_mem_read(f.mem, 0x3000, 4, (uint8_t*)&phys);
+		bytes[2] = (uint8_t)phys;
+		pass = pass && !error && bytes[0] == 0x55 && bytes[1] == 0xBB && bytes[2] == 0x66;
+		if(!pass)
+			sprintf(temp_buf, "Across pages: 0x%x, then 0x%x 0x%x 0x%x (%s)",
+				out, bytes[0], bytes[1], bytes[2], mips_error_string(error));
+	}
+	if(pass)
+	{
+		/** Neither load may be served from the old translation */
+		for(i = 0; i < 6 && !error; i++)
+			error = mips_cpu_step(f.state);
+		mips_cpu_get_register(f.state, 8, &out);
+		pass = !error && out == 0xCAFEF00D
+			&& mips_cpu_step(f.state) == mips_ExceptionInvalidAddress;
+		if(!pass)
+			sprintf(temp_buf, "Remapped: 0x%x (%s)", out, mips_error_string(error));
+	}
+	fixture_end(&f, pass, temp_buf);
+}
+
+/**
+ * Test for page permissions
+ * A store into a read/execute page and a fetch from a
+ * read/write page must both be refused
+ **/
+void protection_test()
+{
+	fixture f;
+	char temp_buf[BUF_SIZE];
+	static const uint32_t code[1] =
+	{
+		0x100003AC  /** SW $3, 16($0) */
+	};
+	mips_error e1, e2;
+	uint32_t before = 0, out = 0;
+	bool pass;
+	fixture_begin(&f, "protection", 0x2000, 0, code, sizeof(code));
+	mips_mem_read(f.mem, 16, 4, (uint8_t*)&before);
+	mips_mem_set_permissions(f.mem, 0, MIPS_MEM_PAGE_SIZE, mips_mem_PermRead | mips_mem_PermExecute);
+	mips_mem_set_permissions(f.mem, MIPS_MEM_PAGE_SIZE, MIPS_MEM_PAGE_SIZE, mips_mem_PermRead | mips_mem_PermWrite);
+	mips_cpu_set_register(f.state, 3, 0x12345678);
+	e1 = mips_cpu_step(f.state);
+	mips_mem_read(f.mem, 16, 4, (uint8_t*)&out);
+	mips_cpu_set_pc(f.state, MIPS_MEM_PAGE_SIZE);
+	e2 = mips_cpu_step(f.state);
+	pass = e1 == mips_ExceptionAccessViolation && out == before
+		&& e2 == mips_ExceptionAccessViolation;
+	if(!pass)
+		sprintf(temp_buf, "Protection: %s, %s", mips_error_string(e1), mips_error_string(e2));
+	fixture_end(&f, pass, temp_buf);
+}
+
+/**
+ * Test for watchpoints
+ * A store into a watched word must stop before the store happens,
+ * and go through once the watchpoint is removed
+ **/
+void watchpoint_test()
+{
+	fixture f;
+	char temp_buf[BUF_SIZE];
+	static const uint32_t code[1] =
+	{
+		0x100003AC  /** SW $3, 16($0) */
+	};
+	mips_error e1, e2;
+	uint32_t before = 0, out = 0, pc = 0, hit = 0;
+	bool pass;
+	fixture_begin(&f, "watchpoint", 0x2000, 0, code, sizeof(code));
+	mips_mem_read(f.mem, 16, 4, (uint8_t*)&before);
+	mips_mem_add_watchpoint(f.mem, 18, 1, mips_mem_WatchWrite);
+	mips_cpu_set_register(f.state, 3, 0x12345678);
+	e1 = mips_cpu_step(f.state);
+	mips_cpu_get_pc(f.state, &pc);
+	mips_mem_read(f.mem, 16, 4, (uint8_t*)&out);
+	mips_mem_get_watch_hit(f.mem, &hit, NULL, NULL);
+	pass = e1 == mips_ExceptionWatchpoint && out == before && pc == 0 && hit == 16;
+	mips_mem_remove_watchpoint(f.mem, 18, 1);
+	e2 = mips_cpu_step(f.state);
+	mips_mem_read(f.mem, 16, 4, (uint8_t*)&out);
+	reverse_word(&out);
+	pass = pass && !e2 && out == 0x12345678;
+	if(!pass)
+		sprintf(temp_buf, "Watchpoint: %s, %s", mips_error_string(e1), mips_error_string(e2));
+	fixture_end(&f, pass, temp_buf);
+}
+
+/** fragments/f_fibonacci-mips.bin, as stored in memory */
+static const uint32_t fibonacci_code[26] =
+{
+	0xE0FFBD27, 0x0200822C, 0x1800B2AF, 0x1C00BFAF, 0x1400B1AF, 0x1000B0AF,
+	0x11004014, 0x21908000, 0x21808000, 0x21880000, 0xFFFF0426, 0x0000000C,
+	0xFEFF1026, 0x0200032E, 0xFBFF6010, 0x21882202, 0x01005232, 0x1C00BF8F,
+	0x21103202, 0x1000B08F, 0x1800B28F, 0x1400B18F, 0x0800E003, 0x2000BD27,
+	0x11000008, 0x21880000
+};
+
+/** The return address given to f_fibonacci, where the run stops */
+#define FIBONACCI_EXIT 0xFFC
+
+/** Readies a CPU holding fibonacci_code to run f_fibonacci(n) */
+static void start_fibonacci(mips_cpu_h state, uint32_t n)
+{
+	mips_cpu_set_pc(state, 0);
+	mips_cpu_set_register(state, 4, n);
+	mips_cpu_set_register(state, 29, 0x1000);
+	mips_cpu_set_register(state, 31, FIBONACCI_EXIT);
+}
+
+/** Runs f_fibonacci(n) from a reset */
+static mips_error run_fibonacci(mips_cpu_h state, uint32_t n)
+{
+	mips_cpu_reset(state);
+	start_fibonacci(state, n);
+	return mips_cpu_run(state, FIBONACCI_EXIT, 1000000, NULL);
+}
+
+/** The value f_fibonacci(n) should return */
+static uint32_t fibonacci(uint32_t n)
+{
+	uint32_t a = 0, b = 1, t;
+	while(n-- > 0)
+	{
+		t = a + b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/** The number of instances taken by pool_test, from arenas of 4 */
+#define NUM_POOLED 6
+
+/**
+ * Test for pooled instances
+ * Takes enough CPUs to need a second arena, runs f_fibonacci on each,
+ * then checks they come back fresh after being recycled
+ **/
+void pool_test()
+{
+	mips_pool_h pool = mips_pool_create(4, 0x1000, 4);
+	mips_cpu_h cpus[NUM_POOLED];
+	mips_mem_h mem;
+	mips_error error = mips_Success;
+	uint32_t a, result, pc;
+	char temp_buf[BUF_SIZE];
+	int i, testID = mips_test_begin_internal_test("pool");
+	bool pass = pool != NULL;
+	if(!pass)
+		strcpy(temp_buf, "Could not create the pool");
+	for(i = 0; pass && i < NUM_POOLED; i++)
+	{
+		pass = !mips_pool_acquire(pool, &cpus[i], &mem)
+			&& ((uintptr_t)cpus[i] & 63) == 0 && ((uintptr_t)mem & 63) == 0;
+		if(!pass)
+		{
+			sprintf(temp_buf, "Instance %d not acquired, or misaligned", i);
+			break;
+		}
+		mips_mem_write(mem, 0, sizeof(fibonacci_code), (const uint8_t*)fibonacci_code);
+		start_fibonacci(cpus[i], i + 5);
+	}
+	for(i = 0; pass && i < NUM_POOLED; i++)
+	{
+		error = mips_cpu_run(cpus[i], FIBONACCI_EXIT, 1000000, NULL);
+		mips_cpu_get_register(cpus[i], 2, &result);
+		a = fibonacci(i + 5);
+		pass = !error && result == a;
+		if(!pass)
+			sprintf(temp_buf, "fib(%d) = %d [%d] (%s)", i + 5, result, a,
+				mips_error_string(error));
+	}
+	for(i = 0; pass && i < NUM_POOLED; i++)
+		mips_pool_release(pool, cpus[i]);
+	if(pass)
+	{
+		pass = mips_pool_available(pool) == 8
+			&& !mips_pool_acquire(pool, &cpus[0], NULL)
+			&& cpus[0] == cpus[NUM_POOLED - 1]
+			&& !mips_cpu_get_register(cpus[0], 2, &result) && result == 0
+			&& !mips_cpu_get_pc(cpus[0], &pc) && pc == 0;
+		if(!pass)
+			strcpy(temp_buf, "Recycled instance was not reset");
+	}
+	/** cpus[0] is still out, and goes with the pool */
+	mips_pool_free(pool);
+	mips_test_end_test(testID, pass, pass ? NULL : temp_buf);
+}
+
+/** Decodes a binary trace with 'filter' into a temporary file, then
+ *  reads the text back into 'text' */
+static mips_error btrace_text(const uint8_t* data, size_t length,
+	const mips_btrace_filter* filter, char* text, size_t size)
+{
+	FILE* out = tmpfile();
+	mips_error error = out == NULL ? mips_ErrorFileWriteError
+		: mips_btrace_decode(data, length, filter, out, NULL, NULL);
+	size_t read = 0;
+	if(!error)
+	{
+		rewind(out);
+		read = fread(text, 1, size - 1, out);
+	}
+	text[read] = 0;
+	if(out != NULL)
+		fclose(out);
+	return error;
+}
+
+/**
+ * Test for binary traces
+ * Records f_fibonacci(10), then decodes the trace, which must count
+ * every instruction and follow the register writes to the result.
+ * Then checks the decoder's filters: the writes of $2 alone must end
+ * with the result, the first instruction alone must be at PC 0, and
+ * only the 'jr $ra' may pass a filter on its PC
+ **/
+void btrace_test()
+{
+	fixture f;
+	mips_btrace_filter filter;
+	mips_error error;
+	static uint8_t data[0x10000];
+	static char text[0x10000];
+	uint64_t retired = 0, steps = 0;
+	uint32_t regs[32] = {0};
+	size_t length = 0;
+	const char* line;
+	FILE* fp;
+	char temp_buf[BUF_SIZE];
+	bool pass;
+	fixture_begin(&f, "btrace", 0x1000, 0, fibonacci_code, sizeof(fibonacci_code));
+	start_fibonacci(f.state, 10);
+	error = mips_btrace_open(f.state, "mips_test.btr", MIPS_BTRACE_ALL);
+	if(!error)
+		error = mips_cpu_run(f.state, FIBONACCI_EXIT, 1000000, &retired);
+	if(!error)
+		error = mips_btrace_close(f.state);
+	fp = fopen("mips_test.btr", "rb");
+	if(fp != NULL)
+	{
+		length = fread(data, 1, sizeof(data), fp);
+		fclose(fp);
+	}
+	remove("mips_test.btr");
+	mips_btrace_filter_init(&filter);
+	filter.level = 0;
+	if(!error && length < sizeof(data))
+		error = mips_btrace_decode(data, length, &filter, stdout, &steps, regs);
+	pass = !error && length < sizeof(data) && steps == retired && regs[2] == 55;
+	if(!pass)
+		sprintf(temp_buf, "%d bytes, %d of %d instructions, $2 = %d (%s)",
+			(int)length, (int)steps, (int)retired, regs[2], mips_error_string(error));
+	if(pass)
+	{
+		filter.level = 2;
+		filter.reg = 2;
+		error = btrace_text(data, length, &filter, text, sizeof(text));
+		line = strrchr(text, '$');
+		pass = !error && !strncmp(text, "$2 = ", 5) && line != NULL
+			&& !strcmp(line, "$2 = 55 (0x37)\n") && strstr(text, "$4") == NULL;
+		if(!pass)
+			strcpy(temp_buf, "Register filter");
+	}
+	if(pass)
+	{
+		mips_btrace_filter_init(&filter);
+		filter.count = 1;
+		error = btrace_text(data, length, &filter, text, sizeof(text));
+		line = strstr(text, "PC: ");
+		pass = !error && !strncmp(text, "PC: 0\n", 6)
+			&& line != NULL && strstr(line + 1, "PC: ") == NULL;
+		if(!pass)
+			strcpy(temp_buf, "Instruction count filter");
+	}
+	if(pass)
+	{
+		/** Instruction 22 of f_fibonacci is its only 'jr $ra' */
+		mips_btrace_filter_init(&filter);
+		filter.low = filter.high = 22 * 4;
+		error = btrace_text(data, length, &filter, text, sizeof(text));
+		for(line = text; pass && (line = strstr(line, "PC: ")) != NULL; line++)
+			pass = !strncmp(line, "PC: 88\n", 7);
+		pass = pass && !error && strstr(text, "PC: 88\n") != NULL;
+		if(!pass)
+			strcpy(temp_buf, "PC filter");
+	}
+	fixture_end(&f, pass, temp_buf);
+}
+
+/**
+ * Test for the instruction mix counters
+ * Runs f_fibonacci(10) and checks the counters add up, then checks
+ * an exception is counted and the counters can be zeroed
+ **/
+void stats_test()
+{
+	fixture f;
+	mips_cpu_stats stats;
+	mips_error error;
+	uint64_t retired = 0, opcodes = 0, functions = 0;
+	char temp_buf[BUF_SIZE];
+	int i;
+	bool pass;
+	fixture_begin(&f, "stats", 0x1000, 0, fibonacci_code, sizeof(fibonacci_code));
+	start_fibonacci(f.state, 10);
+	error = mips_cpu_run(f.state, FIBONACCI_EXIT, 1000000, &retired);
+	mips_cpu_get_stats(f.state, &stats);
+	for(i = 0; i < 64; i++)
+	{
+		opcodes += stats.opcode[i];
+		functions += stats.function[i];
+	}
+	/** Each call saves and restores four registers */
+	pass = !error && stats.retired == retired && opcodes == retired
+		&& functions == stats.opcode[0] && stats.branches_taken > 0
+		&& stats.branches_not_taken > 0 && stats.loads[2] > 0
+		&& stats.loads[2] == stats.stores[2];
+	if(!pass)
+		sprintf(temp_buf, "Retired %d, counted %d (%d R-type), %d loads, %d stores",
+			(int)retired, (int)stats.retired, (int)functions,
+			(int)stats.loads[2], (int)stats.stores[2]);
+	mips_cpu_set_pc(f.state, 2);
+	if(pass)
+	{
+		pass = mips_cpu_step(f.state) == mips_ExceptionInvalidAlignment
+			&& !mips_cpu_get_stats(f.state, &stats) && stats.retired == retired
+			&& stats.errors[2][mips_ExceptionInvalidAlignment & 0xF] == 1
+			&& !mips_cpu_reset_stats(f.state) && !mips_cpu_get_stats(f.state, &stats)
+			&& stats.retired == 0 && stats.errors[2][2] == 0;
+		if(!pass)
+			strcpy(temp_buf, "Exception not counted, or counters not reset");
+	}
+	fixture_end(&f, pass, temp_buf);
+}
+
+/**
+ * Test for latency sampling
+ * Times every instruction of f_fibonacci(10), then one in 16 of another
+ * run, and checks the samples add up
+ **/
+void latency_test()
+{
+	fixture f;
+	mips_latency_profile* profile = malloc(sizeof(mips_latency_profile));
+	mips_error error;
+	uint64_t retired = 0, samples = 0;
+	double p50 = 0, p99 = 0;
+	char temp_buf[BUF_SIZE];
+	int i, j;
+	bool pass;
+	fixture_begin(&f, "latency", 0x1000, 0, fibonacci_code, sizeof(fibonacci_code));
+	start_fibonacci(f.state, 10);
+	error = mips_cpu_set_latency_sampling(f.state, 1);
+	if(!error)
+		error = mips_cpu_run(f.state, FIBONACCI_EXIT, 1000000, &retired);
+	pass = profile != NULL && !error && !mips_cpu_get_latency(f.state, profile);
+	for(i = 0; pass && i < MIPS_LATENCY_OPS; i++)
+		for(j = 0; j < MIPS_LATENCY_BUCKETS; j++)
+			samples += profile->counts[i][j];
+	if(pass)
+	{
+		/** ADDU is the most common instruction */
+		p50 = mips_latency_percentile(profile->counts[64 + 0x21], 50);
+		p99 = mips_latency_percentile(profile->counts[64 + 0x21], 99);
+		pass = samples == retired && p50 <= p99;
+	}
+	if(!pass)
+		sprintf(temp_buf, "%d samples of %d instructions, p50 %f p99 %f (%s)",
+			(int)samples, (int)retired, p50, p99, mips_error_string(error));
+	if(pass)
+	{
+		mips_cpu_reset_latency(f.state);
+		mips_cpu_set_latency_sampling(f.state, 16);
+		mips_cpu_set_pc(f.state, 0);
+		mips_cpu_set_register(f.state, 31, FIBONACCI_EXIT);
+		error = mips_cpu_run(f.state, FIBONACCI_EXIT, 1000000, &retired);
+		mips_cpu_get_latency(f.state, profile);
+		for(samples = 0, i = 0; i < MIPS_LATENCY_OPS; i++)
+			for(j = 0; j < MIPS_LATENCY_BUCKETS; j++)
+				samples += profile->counts[i][j];
+		pass = !error && samples > retired / 32 && samples < retired / 8;
+		if(!pass)
+			sprintf(temp_buf, "%d samples of %d instructions at 1 in 16",
+				(int)samples, (int)retired);
+	}
+	free(profile);
+	fixture_end(&f, pass, temp_buf);
+}
+
+void profile_test()
+{
+	fixture f;
+	mips_profiler_h prof = mips_profiler_create(7);
+	FILE* out = tmpfile();
+	mips_error error;
+	uint64_t retired = 0, samples = 0, count;
+	unsigned frames, max_frames = 0;
+	char line[1024], *p, temp_buf[BUF_SIZE];
+	bool pass = prof != NULL && out != NULL;
+	fixture_begin(&f, "profile", 0x1000, 0, fibonacci_code, sizeof(fibonacci_code));
+	start_fibonacci(f.state, 10);
+	sprintf(temp_buf, "Couldn't create the profiler");
+	if(pass)
+	{
+		/** The caller's jal is counted 8 bytes before the return address */
+		mips_profiler_add_symbol(prof, "f_fibonacci", 0, sizeof(fibonacci_code));
+		mips_profiler_add_symbol(prof, "_start", FIBONACCI_EXIT - 8, 8);
+		mips_cpu_set_profiler(f.state, prof);
+		error = mips_cpu_run(f.state, FIBONACCI_EXIT, 1000000, &retired);
+		mips_cpu_set_profiler(f.state, NULL);
+		pass = !error && mips_profiler_samples(prof) == retired / 7
+			&& !mips_profiler_write(prof, out);
+		sprintf(temp_buf, "%d samples of %d instructions (%s)",
+			(int)mips_profiler_samples(prof), (int)retired, mips_error_string(error));
+	}
+	/** Every stack is f_fibonacci, called from _start, and recursion
+	 *  should be seen to about the depth of fib(10) */
+	if(pass)
+		rewind(out);
+	while(pass && fgets(line, sizeof(line), out) != NULL)
+	{
+		p = strrchr(line, ' ');
+		count = p == NULL ? 0 : strtoull(p + 1, NULL, 10);
+		samples += count;
+		frames = 0;
+		for(p = line; (p = strstr(p, "f_fibonacci")) != NULL; p++)
+			frames++;
+		if(frames > max_frames)
+			max_frames = frames;
+		pass = count > 0 && !strncmp(line, "_start;f_fibonacci", 18);
+		if(!pass)
+			sprintf(temp_buf, "Bad stack: %.200s", line);
+	}
+	if(pass && (samples != mips_profiler_samples(prof) || max_frames < 9))
+	{
+		pass = false;
+		sprintf(temp_buf, "%d samples written, deepest stack %u frames",
+			(int)samples, max_frames);
+	}
+	if(out != NULL)
+		fclose(out);
+	mips_profiler_free(prof);
+	fixture_end(&f, pass, temp_buf);
+}
+
+/** Where callgraph_test calls f_fibonacci from: 'jal 0' and a nop */
+#define CALLER_START 0x200
+#define CALLER_EXIT 0x208
+
+/**
+ * Test for the call graph
+ * Calls f_fibonacci from a stub, and checks that its recursion is
+ * collapsed, and that every instruction is counted once
+ **/
+void callgraph_test()
+{
+	fixture f;
+	static const uint32_t caller_code[2] = { 0x0000000C, 0 };
+	mips_profiler_h symbols = mips_profiler_create(1);
+	mips_callgraph_entry root, fib;
+	FILE* out = tmpfile();
+	mips_error error;
+	uint64_t retired = 0;
+	char line[256], temp_buf[BUF_SIZE];
+	bool pass, named = false;
+	fixture_begin(&f, "callgraph", 0x1000, 0, fibonacci_code, sizeof(fibonacci_code));
+	mips_mem_write(f.mem, CALLER_START, sizeof(caller_code), (const uint8_t*)caller_code);
+	mips_cpu_set_register(f.state, 4, 10);
+	mips_cpu_set_register(f.state, 29, 0x1000);
+	mips_cpu_set_pc(f.state, CALLER_START);
+	error = mips_cpu_set_callgraph(f.state, true);
+	if(!error)
+		error = mips_cpu_run(f.state, CALLER_EXIT, 1000000, &retired);
+	mips_cpu_get_callgraph(f.state, CALLER_START, &root);
+	mips_cpu_get_callgraph(f.state, 0, &fib);
+	pass = !error && root.calls == 1 && root.inclusive == retired
+		&& fib.calls == 1 && fib.recursive > 0 && fib.self == fib.inclusive
+		&& root.self + fib.self == retired;
+	if(!pass)
+		sprintf(temp_buf, "Root %d/%d/%d, f_fibonacci %d+%d calls, %d/%d of %d instructions (%s)",
+			(int)root.calls, (int)root.self, (int)root.inclusive,
+			(int)fib.calls, (int)fib.recursive, (int)fib.self, (int)fib.inclusive,
+			(int)retired, mips_error_string(error));
+	if(pass && out != NULL && symbols != NULL)
+	{
+		mips_profiler_add_symbol(symbols, "f_fibonacci", 0, sizeof(fibonacci_code));
+		mips_cpu_print_callgraph(f.state, symbols, out);
+		rewind(out);
+		while(fgets(line, sizeof(line), out) != NULL)
+			if(strstr(line, "f_fibonacci [") != NULL)
+				named = true;
+		pass = named;
+		if(!pass)
+			sprintf(temp_buf, "f_fibonacci not in the report");
+	}
+	if(out != NULL)
+		fclose(out);
+	mips_profiler_free(symbols);
+	fixture_end(&f, pass, temp_buf);
+}
+
+/** Where memprof_test's sweep starts and ends */
+#define SWEEP_START 0x200
+#define SWEEP_EXIT 0x210
+/** The data it sweeps over: 6144 words, in 1536 lines of 16 bytes */
+#define SWEEP_FROM 0x1000
+#define SWEEP_TO 0x7000
+
+/** Runs memprof_test's sweep twice, returning the instructions retired */
+static uint64_t sweep_twice(mips_cpu_h state)
+{
+	uint64_t retired, total = 0;
+	int i;
+	for(i = 0; i < 2; i++)
+	{
+		mips_cpu_set_pc(state, SWEEP_START);
+		mips_cpu_set_register(state, 4, SWEEP_FROM);
+		mips_cpu_set_register(state, 5, SWEEP_TO);
+		retired = 0;
+		if(mips_cpu_run(state, SWEEP_EXIT, 100000, &retired))
+			return 0;
+		total += retired;
+	}
+	return total;
+}
+
+/**
+ * Test for the memory profile
+ * Sweeps over some memory twice, so every line is reused at the same
+ * distance, first following every line, then a sample of them
+ **/
+void memprof_test()
+{
+	fixture f;
+	/** lw $8, 0($4); addiu $4, $4, 4; bne $4, $5, -3; nop */
+	static const uint32_t sweep_code[4] = { 0x0000888C, 0x04008424, 0xFDFF8514, 0 };
+	mips_memprof_config config = { 16, 0, 1000 };
+	mips_reuse_histogram fetch, data;
+	uint64_t sets[64], retired;
+	size_t count = 0, i;
+	char temp_buf[BUF_SIZE];
+	bool pass;
+	fixture_begin(&f, "memprof", 0x8000, SWEEP_START, sweep_code, sizeof(sweep_code));
+	mips_cpu_set_memprof(f.state, &config);
+	retired = sweep_twice(f.state);
+	mips_cpu_get_reuse(f.state, mips_MemprofFetch, &fetch);
+	mips_cpu_get_reuse(f.state, mips_MemprofData, &data);
+	mips_cpu_get_working_set(f.state, mips_MemprofFetch, sets, 64, &count);
+	/** The code is one line. Each data line is read four times a
+	 *  sweep: the first read of the first sweep is cold, the first of
+	 *  the second misses in a cache smaller than the data, and the rest
+	 *  always hit */
+	pass = retired > 0 && fetch.accesses == retired && fetch.cold == 1
+		&& data.accesses == 12288 && data.cold == 1536
+		&& mips_reuse_miss_ratio(&data, 1024) == 0.25
+		&& mips_reuse_miss_ratio(&data, 2048) == 0.125
+		&& count == retired / 1000 && count <= 64;
+	for(i = 0; pass && i < count; i++)
+		pass = sets[i] == 16;
+	if(!pass)
+		sprintf(temp_buf, "Exact: %d fetches, %d cold; %d accesses, %d cold, "
+			"miss ratios %f %f; %d windows",
+			(int)fetch.accesses, (int)fetch.cold, (int)data.accesses, (int)data.cold,
+			mips_reuse_miss_ratio(&data, 1024), mips_reuse_miss_ratio(&data, 2048), (int)count);
+	if(pass)
+	{
+		config.sample_shift = 3;
+		config.window = 0;
+		mips_cpu_set_memprof(f.state, &config);
+		retired = sweep_twice(f.state);
+		mips_cpu_get_reuse(f.state, mips_MemprofData, &data);
+		pass = retired > 0 && data.sampled > 0 && data.sampled < data.accesses / 4
+			&& mips_reuse_miss_ratio(&data, 1024) == 0.25
+			&& mips_reuse_miss_ratio(&data, 2048) == 0.125;
+		if(!pass)
+			sprintf(temp_buf, "Sampled: %d of %d accesses, miss ratios %f %f",
+				(int)data.sampled, (int)data.accesses,
+				mips_reuse_miss_ratio(&data, 1024), mips_reuse_miss_ratio(&data, 2048));
+	}
+	fixture_end(&f, pass, temp_buf);
+}
+
+/** What plugin_test's plugins have been told */
+typedef struct
+{
+	uint64_t instructions, blocks, loads, stores, taken, not_taken;
+	uint32_t last_block;
+} plugin_counts;
+
+static void count_instruction(void* user, mips_cpu_h state, uint32_t pc, uint32_t instruction)
+{
+	(void)state; (void)pc; (void)instruction;
+	((plugin_counts*)user)->instructions++;
+}
+
+static void count_block(void* user, mips_cpu_h state, uint32_t pc)
+{
+	(void)state;
+	((plugin_counts*)user)->blocks++;
+	((plugin_counts*)user)->last_block = pc;
+}
+
+static void count_memory(void* user, mips_cpu_h state, uint32_t pc,
+	uint32_t address, unsigned length, bool store)
+{
+	(void)state; (void)pc; (void)address; (void)length;
+	if(store)
+		((plugin_counts*)user)->stores++;
+	else
+		((plugin_counts*)user)->loads++;
+}
+
+static void count_branch(void* user, mips_cpu_h state, uint32_t pc, uint32_t target, bool taken)
+{
+	(void)state; (void)pc; (void)target;
+	if(taken)
+		((plugin_counts*)user)->taken++;
+	else
+		((plugin_counts*)user)->not_taken++;
+}
+
+/**
+ * Test for instrumentation plugins
+ * Sweeps over some memory twice with one plugin seeing everything and
+ * another seeing only the loop's branch, then with neither
+ **/
+void plugin_test()
+{
+	fixture f;
+	static const uint32_t sweep_code[4] = { 0x0000888C, 0x04008424, 0xFDFF8514, 0 };
+	mips_plugin plugin = { count_instruction, count_block, count_memory, count_branch, NULL, 0, 0 };
+	plugin_counts all, branch;
+	unsigned all_id = 0, branch_id = 0;
+	uint64_t retired;
+	char temp_buf[BUF_SIZE];
+	bool pass;
+	memset(&all, 0, sizeof(all));
+	memset(&branch, 0, sizeof(branch));
+	fixture_begin(&f, "plugin", 0x8000, SWEEP_START, sweep_code, sizeof(sweep_code));
+	mips_cpu_add_plugin(f.state, &plugin, &all, &all_id);
+	plugin.start = SWEEP_START + 8;
+	plugin.end = SWEEP_START + 12;
+	mips_cpu_add_plugin(f.state, &plugin, &branch, &branch_id);
+	retired = sweep_twice(f.state);
+	/** Each sweep is 6144 times round the loop, every time but the
+	 *  last branching back to start a new block */
+	pass = retired == 49152 && all.instructions == retired && all.blocks == 12288
+		&& all.last_block == SWEEP_START && all.loads == 12288 && all.stores == 0
+		&& all.taken == 12286 && all.not_taken == 2
+		&& branch.instructions == 12288 && branch.blocks == 0 && branch.loads == 0
+		&& branch.taken == 12286 && branch.not_taken == 2;
+	if(!pass)
+		sprintf(temp_buf, "Counted %d instructions, %d blocks, %d loads, %d/%d branches;"
+			" in range %d instructions, %d blocks, %d branches",
+			(int)all.instructions, (int)all.blocks, (int)all.loads, (int)all.taken,
+			(int)all.not_taken, (int)branch.instructions, (int)branch.blocks,
+			(int)(branch.taken + branch.not_taken));
+	if(pass)
+	{
+		pass = !mips_cpu_remove_plugin(f.state, all_id)
+			&& !mips_cpu_remove_plugin(f.state, branch_id)
+			&& mips_cpu_remove_plugin(f.state, branch_id) == mips_ErrorInvalidArgument
+			&& sweep_twice(f.state) == retired && all.instructions == retired
+			&& branch.instructions == 12288;
+		if(!pass)
+			sprintf(temp_buf, "Removed plugins still called");
+	}
+	fixture_end(&f, pass, temp_buf);
+}
+
+/** Marks the word run in coverage_test's reference map */
+static void mark_instruction(void* user, mips_cpu_h state, uint32_t pc, uint32_t instruction)
+{
+	(void)state; (void)instruction;
+	if(pc < 0x100)
+		((bool*)user)[pc / 4] = true;
+}
+
+/**
+ * Test for coverage maps
+ * Runs f_fibonacci twice into two maps, checking the first against
+ * the instructions a plugin saw, then merges the two through files
+ * and reports on an ELF file holding the code, naming its function
+ * from the file's own symbol table
+ **/
+void coverage_test()
+{
+	fixture f;
+	mips_coverage_h full = mips_coverage_create(0, 0x100), small = mips_coverage_create(0, 0x100);
+	mips_coverage_h other = mips_coverage_create(0, 0x200), merged = NULL;
+	mips_plugin plugin = { mark_instruction, NULL, NULL, NULL, NULL, 0, 0 };
+	mips_coverage_summary summary;
+	mips_profiler_h symbols = mips_profiler_create(1);
+	bool ran[64];
+	uint8_t elf[364];
+	unsigned covered = 0, small_covered = 0, edges, i;
+	char map_path[64], elf_path[64], line[256], temp_buf[BUF_SIZE];
+	const char* name = NULL;
+	FILE* file;
+	bool pass;
+	memset(ran, 0, sizeof(ran));
+	memset(&summary, 0, sizeof(summary));
+	fixture_begin(&f, "coverage", 0x1000, 0, fibonacci_code, sizeof(fibonacci_code));
+	mips_cpu_add_plugin(f.state, &plugin, ran, NULL);
+	mips_cpu_set_coverage(f.state, full);
+	pass = !run_fibonacci(f.state, 10);
+	mips_cpu_set_coverage(f.state, small);
+	pass = pass && !run_fibonacci(f.state, 1);
+	mips_cpu_set_coverage(f.state, NULL);
+	/** Both ways of the two conditional branches (BNE at 0x18, BEQ at
+	 *  0x38) are taken for n = 10, which runs all of it, and n = 1
+	 *  runs less */
+	for(i = 0; pass && i < 64; i++)
+	{
+		edges = mips_coverage_edges(full, i * 4);
+		pass = mips_coverage_pc(full, i * 4) == ran[i]
+			&& edges == (i == 6 || i == 14 ? MIPS_COVERAGE_TAKEN | MIPS_COVERAGE_NOT_TAKEN : 0)
+			&& (!mips_coverage_pc(small, i * 4) || ran[i]);
+		covered += ran[i];
+		small_covered += mips_coverage_pc(small, i * 4);
+	}
+	pass = pass && covered == 26 && small_covered > 0 && small_covered < covered;
+	if(!pass)
+		sprintf(temp_buf, "Map differs from the instructions run at 0x%x", (i - 1) * 4);
+	if(pass)
+	{
+		sprintf(map_path, "/tmp/mips_test_%d.cov", (int)getpid());
+		pass = !mips_coverage_save(small, map_path)
+			&& (merged = mips_coverage_load(map_path)) != NULL
+			&& !mips_coverage_merge(merged, full)
+			&& mips_coverage_merge(merged, other) == mips_ErrorInvalidArgument;
+		for(i = 0; pass && i < 64; i++)
+			pass = mips_coverage_pc(merged, i * 4) == ran[i]
+				&& mips_coverage_edges(merged, i * 4) == mips_coverage_edges(full, i * 4);
+		remove(map_path);
+		if(!pass)
+			sprintf(temp_buf, "Merged map not the union of the runs");
+	}
+	/** A minimal ELF file: a header, the code, then a null section, an
+	 *  executable one for the code, a symbol table naming f_fibonacci
+	 *  and its strings */
+	if(pass)
+	{
+		memset(elf, 0, sizeof(elf));
+		memcpy(elf, "\177ELF\1\2\1", 7);
+		elf[17] = 2;
+		elf[19] = 8;
+		elf[23] = 1;
+		elf[34] = 156 >> 8;
+		elf[35] = 156 & 0xFF;
+		elf[41] = 52;
+		elf[47] = 40;
+		elf[49] = 4;
+		memcpy(elf + 52, fibonacci_code, sizeof(fibonacci_code));
+		elf[196 + 7] = 1;
+		elf[196 + 11] = 6;
+		elf[196 + 19] = 52;
+		elf[196 + 23] = sizeof(fibonacci_code);
+		elf[236 + 7] = 2;
+		elf[236 + 18] = 316 >> 8;
+		elf[236 + 19] = 316 & 0xFF;
+		elf[236 + 23] = 32;
+		elf[236 + 27] = 3;
+		elf[236 + 39] = 16;
+		elf[276 + 7] = 3;
+		elf[276 + 18] = 348 >> 8;
+		elf[276 + 19] = 348 & 0xFF;
+		elf[276 + 23] = 13;
+		elf[332 + 3] = 1;
+		elf[332 + 11] = sizeof(fibonacci_code);
+		elf[332 + 12] = 0x12;
+		elf[332 + 15] = 1;
+		memcpy(elf + 348, "\0f_fibonacci", 13);
+		sprintf(elf_path, "/tmp/mips_test_%d.elf", (int)getpid());
+		file = fopen(elf_path, "wb");
+		if(file != NULL)
+		{
+			fwrite(elf, sizeof(elf), 1, file);
+			fclose(file);
+		}
+		pass = !mips_coverage_report(merged, elf_path, NULL, NULL, &summary)
+			&& summary.instructions == 26 && summary.covered == covered
+			&& summary.edges == 4 && summary.edges_covered == 4;
+		if(!pass)
+			sprintf(temp_buf, "Report of %d/%d instructions, %d/%d edges",
+				(int)summary.covered, (int)summary.instructions,
+				(int)summary.edges_covered, (int)summary.edges);
+	}
+	/** The report's only function line must be for f_fibonacci */
+	if(pass)
+	{
+		pass = !mips_profiler_load_elf(symbols, elf_path)
+			&& (name = mips_profiler_symbol(symbols, 0x10)) != NULL
+			&& !strcmp(name, "f_fibonacci");
+		file = pass ? tmpfile() : NULL;
+		pass = file != NULL && !mips_coverage_report(merged, elf_path, symbols, file, NULL);
+		if(pass)
+		{
+			rewind(file);
+			pass = fgets(line, sizeof(line), file) && fgets(line, sizeof(line), file)
+				&& strstr(line, " f_fibonacci\n") != NULL
+				&& fgets(line, sizeof(line), file) && strstr(line, " total\n") != NULL;
+		}
+		if(file != NULL)
+			fclose(file);
+		if(!pass)
+			sprintf(temp_buf, "Symbols: %s", name != NULL ? name : "none");
+	}
+	remove(elf_path);
+	mips_profiler_free(symbols);
+	mips_coverage_free(full);
+	mips_coverage_free(small);
+	mips_coverage_free(other);
+	mips_coverage_free(merged);
+	fixture_end(&f, pass, temp_buf);
+}
+
+/**
+ * Test for undefined register reports
+ * Reads a register never written, and $HI after a division by zero,
+ * then runs the same code again with everything it reads defined
+ **/
+void undefined_test()
+{
+	fixture f;
+	/** addu $2, $8, $0; div $4, $5; mfhi $3; mult $4, $4; mflo $6 */
+	static const uint32_t code[5] = { 0x21100001, 0x1A008500, 0x10180000, 0x18008400, 0x12300000 };
+	static const char expected[] = "Undefined: $8 read at 0x0\nUndefined: $HI read at 0x8\n";
+	FILE* output = tmpfile();
+	char text[128], temp_buf[BUF_SIZE];
+	size_t length = 0;
+	mips_error error;
+	bool pass;
+	fixture_begin(&f, "undefined", 0x1000, 0, code, sizeof(code));
+	mips_cpu_set_debug_level(f.state, 1, output);
+	mips_cpu_set_register(f.state, 4, 7);
+	mips_cpu_set_register(f.state, 5, 0);
+	error = mips_cpu_run(f.state, sizeof(code), 100, NULL);
+	if(output != NULL)
+	{
+		fflush(output);
+		rewind(output);
+		length = fread(text, 1, sizeof(text) - 1, output);
+	}
+	text[length] = 0;
+	pass = !error && !strcmp(text, expected);
+	if(!pass)
+		sprintf(temp_buf, "Reported \"%s\"", text);
+	/** Setting the registers and dividing by non-zero define them all */
+	if(pass)
+	{
+		mips_cpu_set_register(f.state, 8, 1);
+		mips_cpu_set_register(f.state, 5, 2);
+		mips_cpu_set_pc(f.state, 0);
+		error = mips_cpu_run(f.state, sizeof(code), 100, NULL);
+		fflush(output);
+		pass = !error && ftell(output) == (long)length;
+		if(!pass)
+			sprintf(temp_buf, "Defined registers reported");
+	}
+	/** A reset makes them undefined again */
+	if(pass)
+	{
+		mips_cpu_reset(f.state);
+		mips_cpu_set_register(f.state, 4, 7);
+		mips_cpu_set_register(f.state, 5, 0);
+		error = mips_cpu_run(f.state, sizeof(code), 100, NULL);
+		fflush(output);
+		pass = !error && ftell(output) == (long)(2 * length);
+		if(!pass)
+			sprintf(temp_buf, "Registers still defined after a reset");
+	}
+	fixture_end(&f, pass, temp_buf);
+}
+
+#ifndef _WIN32
+/** The number of CPUs run at once by threads_test */
+#define NUM_THREADS 4
+
+/** One f_fibonacci call for fibonacci_thread */
+typedef struct
+{
+	uint32_t n, result;
+	mips_error error;
+} fibonacci_job;
+
+/** Runs one fibonacci_job on its own CPU and RAM, with full tracing */
+void* fibonacci_thread(void* arg)
+{
+	fibonacci_job* job = arg;
+	mips_mem_h mem = mips_mem_create_ram(0x1000, 4);
+	mips_cpu_h state = mips_cpu_create(mem);
+	mips_error error = mips_Success;
+	uint32_t pc = 0;
+	FILE* trace = tmpfile();
+	mips_mem_write(mem, 0, sizeof(fibonacci_code), (const uint8_t*)fibonacci_code);
+	if(trace != NULL)
+		mips_cpu_set_debug_level(state, 3, trace);
+	start_fibonacci(state, job->n);
+	while(!error && pc != FIBONACCI_EXIT)
+	{
+		error = mips_cpu_step(state);
+		mips_cpu_get_pc(state, &pc);
+	}
+	mips_cpu_get_register(state, 2, &job->result);
+	job->error = error;
+	mips_cpu_free(state);
+	mips_mem_free(mem);
+	return NULL;
+}
+
+/**
+ * Test for reentrancy
+ * Runs f_fibonacci on several CPUs in parallel threads, all tracing,
+ * and checks every result
+ **/
+void threads_test()
+{
+	pthread_t threads[NUM_THREADS];
+	fibonacci_job jobs[NUM_THREADS];
+	uint32_t a;
+	char temp_buf[BUF_SIZE];
+	int i, testID = mips_test_begin_internal_test("threads");
+	bool pass = true;
+	for(i = 0; i < NUM_THREADS; i++)
+	{
+		jobs[i].n = 10 + i;
+		jobs[i].result = 0;
+		pthread_create(&threads[i], NULL, &fibonacci_thread, &jobs[i]);
+	}
+	for(i = 0; i < NUM_THREADS; i++)
+	{
+		pthread_join(threads[i], NULL);
+		a = fibonacci((int)jobs[i].n);
+		if(jobs[i].error || jobs[i].result != a)
+		{
+			pass = false;
+			sprintf(temp_buf, "fib(%d) = %d [%d] (%s)", jobs[i].n,
+				jobs[i].result, a, mips_error_string(jobs[i].error));
+		}
+	}
+	mips_test_end_test(testID, pass, pass ? NULL : temp_buf);
+}
+
+/** The number of jobs run by farm_test */
+#define NUM_FARM_JOBS 24
+
+/**
+ * Test for the job farm
+ * Runs a batch of f_fibonacci calls of varying length over a thread pool.
+ * Each starts from a stub that loads the word at 0x800 into $10, which
+ * only the even jobs write to, so the odd ones must find it wiped
+ **/
+void farm_test()
+{
+	static const uint32_t stub[3] =
+	{
+		0x00080A8C, /** LW $10, 0x800($0) */
+		0x00000008, /** J 0 */
+		0x00000000  /** NOP */
+	};
+	static const uint8_t marker[4] = { 0xC0, 0xDE, 0xF0, 0x0D };
+	mips_farm_input inputs[2];
+	mips_farm_job jobs[NUM_FARM_JOBS];
+	mips_farm_result results[NUM_FARM_JOBS];
+	uint32_t a, loaded;
+	char temp_buf[BUF_SIZE];
+	int i, testID = mips_test_begin_internal_test("farm");
+	bool pass;
+	inputs[0].address = 0x900;
+	inputs[0].data = (const uint8_t*)stub;
+	inputs[0].length = sizeof(stub);
+	inputs[1].address = 0x800;
+	inputs[1].data = marker;
+	inputs[1].length = sizeof(marker);
+	memset(jobs, 0, sizeof(jobs));
+	for(i = 0; i < NUM_FARM_JOBS; i++)
+	{
+		jobs[i].image = (const uint8_t*)fibonacci_code;
+		jobs[i].image_length = sizeof(fibonacci_code);
+		jobs[i].inputs = inputs;
+		jobs[i].input_count = (i % 2) ? 1 : 2;
+		jobs[i].regs[4] = i % 16;
+		jobs[i].regs[29] = 0x1000;
+		jobs[i].regs[31] = FIBONACCI_EXIT;
+		jobs[i].entry = 0x900;
+		jobs[i].exit = FIBONACCI_EXIT;
+		jobs[i].budget = 1000000;
+	}
+	pass = mips_farm_run(jobs, results, NUM_FARM_JOBS, NUM_THREADS, 0x1000) == mips_Success;
+	for(i = 0; pass && i < NUM_FARM_JOBS; i++)
+	{
+		a = fibonacci(i % 16);
+		loaded = (i % 2) ? 0 : 0xC0DEF00D;
+		pass = !results[i].error && results[i].pc == FIBONACCI_EXIT
+			&& results[i].regs[2] == a && results[i].retired > 0
+			&& results[i].regs[10] == loaded;
+		if(!pass)
+			sprintf(temp_buf, "Job %d: fib(%d) = %d [%d], $10 = 0x%x [0x%x] (%s)",
+				i, i % 16, results[i].regs[2], a, results[i].regs[10], loaded,
+				mips_error_string(results[i].error));
+	}
+	mips_test_end_test(testID, pass, pass ? NULL : temp_buf);
+}
+
+/** The number of guests run by sched_test */
+#define NUM_SCHED_GUESTS 64
+
+/**
+ * Test for the time-slicing scheduler
+ * Runs many f_fibonacci guests, of mixed length and priority,
+ * a few instructions at a time over a small pool of threads
+ **/
+void sched_test()
+{
+	mips_sched_h sched = mips_sched_create(NUM_THREADS, 50);
+	mips_mem_h mems[NUM_SCHED_GUESTS];
+	mips_cpu_h cpus[NUM_SCHED_GUESTS];
+	unsigned ids[NUM_SCHED_GUESTS];
+	mips_error error;
+	uint32_t a, result;
+	char temp_buf[BUF_SIZE];
+	int i, created, testID = mips_test_begin_internal_test("sched");
+	bool pass = sched != NULL;
+	for(created = 0; pass && created < NUM_SCHED_GUESTS; created++)
+	{
+		i = created;
+		mems[i] = mips_mem_create_ram(0x1000, 4);
+		cpus[i] = mips_cpu_create(mems[i]);
+		mips_mem_write(mems[i], 0, sizeof(fibonacci_code), (const uint8_t*)fibonacci_code);
+		start_fibonacci(cpus[i], i % 16);
+		pass = mips_sched_add(sched, cpus[i], FIBONACCI_EXIT, 1000000,
+			1 + i % 3, &ids[i]) == mips_Success;
+	}
+	for(i = 0; pass && i < NUM_SCHED_GUESTS; i++)
+	{
+		mips_sched_wait(sched, ids[i], &error, NULL);
+		mips_cpu_get_register(cpus[i], 2, &result);
+		a = fibonacci(i % 16);
+		pass = !error && result == a;
+		if(!pass)
+			sprintf(temp_buf, "Guest %d: fib(%d) = %d [%d] (%s)", i, i % 16,
+				result, a, mips_error_string(error));
+	}
+	mips_sched_free(sched);
+	for(i = 0; i < created; i++)
+	{
+		mips_cpu_free(cpus[i]);
+		mips_mem_free(mems[i]);
+	}
+	mips_test_end_test(testID, pass, pass ? NULL : temp_buf);
+}
+
+/** The number of jobs sent by server_test, and the connections they
+ *  are spread over: more than the server has workers */
+#define NUM_SERVER_JOBS 16
+#define NUM_SERVER_CONNECTIONS 3
+
+/**
+ * Test for the job server
+ * Sends a stream of f_fibonacci jobs down more connections than the
+ * server has workers, all held open. Every other job sends a word of
+ * input that must come back as output; the rest send none, and must
+ * read back the image's memory, not what an earlier job wrote
+ **/
+void server_test()
+{
+	mips_server_h server = mips_server_create("mips_test.sock", 2, 0x1000);
+	mips_server_request req;
+	mips_server_response resp;
+	uint32_t a, in, out;
+	char temp_buf[BUF_SIZE];
+	int fds[NUM_SERVER_CONNECTIONS];
+	int i, testID = mips_test_begin_internal_test("server");
+	bool pass = server != NULL
+		&& !mips_server_add_image(server, 7, (const uint8_t*)fibonacci_code,
+			sizeof(fibonacci_code), 0)
+		&& !mips_server_start(server);
+	for(i = 0; i < NUM_SERVER_CONNECTIONS; i++)
+	{
+		fds[i] = pass ? mips_client_connect("mips_test.sock") : -1;
+		pass = pass && fds[i] >= 0;
+	}
+	if(!pass)
+		strcpy(temp_buf, "Could not start the server");
+	memset(&req, 0, sizeof(req));
+	req.magic = MIPS_SERVER_MAGIC;
+	req.image = 7;
+	req.regs[29] = 0x1000;
+	req.regs[31] = FIBONACCI_EXIT;
+	req.exit = FIBONACCI_EXIT;
+	req.budget = 1000000;
+	req.input_address = req.output_address = 0x800;
+	req.output_length = 4;
+	for(i = 0; pass && i < NUM_SERVER_JOBS; i++)
+	{
+		req.regs[4] = i;
+		req.input_length = (i % 2) ? 0 : 4;
+		in = (i % 2) ? 0 : 0xC0DE0000 | i;
+		out = 0xFFFFFFFF;
+		pass = !mips_client_run(fds[i % NUM_SERVER_CONNECTIONS], &req,
+			(uint8_t*)&in, &resp, (uint8_t*)&out);
+		a = fibonacci(i);
+		pass = pass && !resp.error && resp.regs[2] == a && out == in;
+		if(!pass)
+			sprintf(temp_buf, "Job %d: fib(%d) = %d [%d], output 0x%x (%s)", i, i,
+				resp.regs[2], a, out, mips_error_string(resp.error));
+	}
+	for(i = 0; i < NUM_SERVER_CONNECTIONS; i++)
+		if(fds[i] >= 0)
+			close(fds[i]);
+	mips_server_free(server);
+	mips_test_end_test(testID, pass, pass ? NULL : temp_buf);
+}
+
+/** Counts the instructions replayed in one interval */
+static void count_step(void* stats, mips_cpu_h state)
+{
+	(void)state;
+	(*(uint64_t*)stats)++;
+}
+
+/** Adds one interval's count into the total */
+static void count_merge(void* total, const void* stats)
+{
+	*(uint64_t*)total += *(const uint64_t*)stats;
+}
+
+/** Records f_fibonacci(15) from a reset, with the stack at 'sp', then
+ *  replays it on one thread, returning what the replay did and putting
+ *  what the recorded run stopped with in 'stopped' */
+static mips_error record_fibonacci(mips_cpu_h state, uint32_t sp, mips_error* stopped)
+{
+	mips_recording_h rec;
+	mips_error replayed;
+	mips_cpu_reset(state);
+	start_fibonacci(state, 15);
+	mips_cpu_set_register(state, 29, sp);
+	rec = mips_record(state, 0x2000, 4, FIBONACCI_EXIT, 1000000, 100, stopped);
+	replayed = rec != NULL ? mips_replay(rec, 1, NULL, NULL, NULL, 0) : mips_ErrorInvalidHandle;
+	mips_recording_free(rec);
+	return replayed;
+}
+
+/**
+ * Test for checkpointed replay
+ * Records f_fibonacci(15) with a checkpoint every 100 instructions,
+ * with the page above the code execute only, then replays the
+ * intervals in parallel, counting the instructions. Then records runs
+ * that stop on an access violation, with the stack in that page, and
+ * on a watchpoint, which must replay the same way, and checks that
+ * the recorder was not taken for a read of the watched range
+ **/
+void checkpoint_test()
+{
+	fixture f;
+	mips_recording_h rec;
+	mips_error error = mips_Success, replayed;
+	uint64_t total = 0;
+	uint32_t result = 0, address, length;
+	unsigned kind = 0;
+	char temp_buf[BUF_SIZE];
+	bool pass;
+	fixture_begin(&f, "checkpoint", 0x2000, 0, fibonacci_code, sizeof(fibonacci_code));
+	mips_mem_set_permissions(f.mem, 0x1000, 0x1000, mips_mem_PermExecute);
+	start_fibonacci(f.state, 15);
+	rec = mips_record(f.state, 0x2000, 4, FIBONACCI_EXIT, 1000000, 100, &error);
+	mips_cpu_get_register(f.state, 2, &result);
+	replayed = mips_replay(rec, NUM_THREADS, &count_step, &count_merge,
+		&total, sizeof(uint64_t));
+	pass = rec != NULL && !error && result == 610 && !replayed
+		&& mips_recording_intervals(rec) > NUM_THREADS
+		&& total == mips_recording_retired(rec);
+	if(!pass)
+		sprintf(temp_buf, "fib(15) = %d, %d intervals, replayed %d of %d (%s)",
+			result, mips_recording_intervals(rec), (int)total,
+			(int)mips_recording_retired(rec), mips_error_string(replayed));
+	mips_recording_free(rec);
+	if(pass)
+	{
+		replayed = record_fibonacci(f.state, 0x2000, &error);
+		pass = error == mips_ExceptionAccessViolation && !replayed;
+		if(!pass)
+			sprintf(temp_buf, "Protected stack: recorded %s, replayed %s",
+				mips_error_string(error), mips_error_string(replayed));
+	}
+	if(pass)
+	{
+		mips_mem_add_watchpoint(f.mem, 0xF00, 0x100, mips_mem_WatchAccess);
+		replayed = record_fibonacci(f.state, 0x1000, &error);
+		pass = error == mips_ExceptionWatchpoint && !replayed
+			&& !mips_mem_get_watch_hit(f.mem, &address, &length, &kind)
+			&& kind == mips_mem_WatchWrite && length == 4;
+		if(!pass)
+			sprintf(temp_buf, "Watched stack: recorded %s, replayed %s, hit kind %d",
+				mips_error_string(error), mips_error_string(replayed), kind);
+	}
+	fixture_end(&f, pass, temp_buf);
+}
+
+/** Runs f_fibonacci(n) at full debug level, tracing to 'trace',
+ *  asynchronously if capacity is not 0. The output is taken away
+ *  before the trace thread is stopped, so everything, the count of
+ *  any records dropped included, must reach 'trace' before that */
+static mips_error traced_fibonacci(uint32_t n, FILE* trace, unsigned capacity, uint64_t* dropped)
+{
+	mips_mem_h mem = mips_mem_create_ram(0x1000, 4);
+	mips_cpu_h state = mips_cpu_create(mem);
+	mips_error error;
+	mips_mem_write(mem, 0, sizeof(fibonacci_code), (const uint8_t*)fibonacci_code);
+	mips_cpu_set_debug_level(state, 3, trace);
+	error = mips_cpu_set_async_trace(state, capacity);
+	start_fibonacci(state, n);
+	if(!error)
+		error = mips_cpu_run(state, FIBONACCI_EXIT, 1000000, NULL);
+	mips_cpu_trace_dropped(state, dropped);
+	mips_cpu_set_debug_level(state, 0, NULL);
+	/** Stops the trace thread, but leaves 'trace' open */
+	mips_cpu_set_async_trace(state, 0);
+	mips_cpu_free(state);
+	mips_mem_free(mem);
+	return error;
+}
+
+/**
+ * Test for asynchronous tracing
+ * The trace written by the background thread, given room for all of
+ * it, must be byte for byte the trace written synchronously. Given
+ * too little room, the drops the trace reports must add up to the
+ * number dropped
+ **/
+void async_trace_test()
+{
+	FILE* sync = tmpfile();
+	FILE* async = tmpfile();
+	FILE* small = tmpfile();
+	uint64_t dropped = 0;
+	unsigned long long reported = 0, count;
+	long length = 0;
+	int a = 0, b = 0;
+	char temp_buf[BUF_SIZE], line[64];
+	int testID = mips_test_begin_internal_test("async_trace");
+	bool pass = sync != NULL && async != NULL
+		&& !traced_fibonacci(8, sync, 0, &dropped)
+		&& !traced_fibonacci(8, async, 1 << 16, &dropped)
+		&& dropped == 0;
+	if(pass)
+	{
+		length = ftell(sync);
+		pass = length > 0 && length == ftell(async);
+		rewind(sync);
+		rewind(async);
+		while(pass && a != EOF)
+		{
+			a = fgetc(sync);
+			b = fgetc(async);
+			pass = a == b;
+		}
+	}
+	if(!pass)
+		sprintf(temp_buf, "Traces differ (%ld bytes, %d dropped)", length, (int)dropped);
+	if(pass)
+	{
+		pass = small != NULL && !traced_fibonacci(8, small, 1, &dropped) && dropped > 0;
+		if(pass)
+			rewind(small);
+		while(pass && fgets(line, sizeof(line), small) != NULL)
+			if(sscanf(line, "[%llu trace records dropped]", &count) == 1)
+				reported += count;
+		pass = pass && reported == dropped;
+		if(!pass)
+			sprintf(temp_buf, "Small ring: %d dropped, %d reported", (int)dropped, (int)reported);
+	}
+	if(sync != NULL)
+		fclose(sync);
+	if(async != NULL)
+		fclose(async);
+	if(small != NULL)
+		fclose(small);
+	mips_test_end_test(testID, pass, pass ? NULL : temp_buf);
+}
+
+/**
+ * Test for published metrics
+ * Runs f_fibonacci with a CPU attached to a one-slot segment, and reads
+ * its counters back through a separate read-only mapping
+ **/
+void metrics_test()
+{
+	fixture f;
+	mips_cpu_h other;
+	mips_metrics_h metrics;
+	const mips_metrics_header* header = NULL;
+	const mips_metrics_slot* slot = NULL;
+	mips_cpu_stats stats;
+	mips_error error;
+	size_t length = 0;
+	char name[64], temp_buf[BUF_SIZE];
+	bool pass;
+	sprintf(name, "/mips_test_metrics_%d", (int)getpid());
+	metrics = mips_metrics_create(name, 1);
+	fixture_begin(&f, "metrics", 0x1000, 0, fibonacci_code, sizeof(fibonacci_code));
+	other = mips_cpu_create(f.mem);
+	start_fibonacci(f.state, 10);
+	error = mips_cpu_set_metrics(f.state, metrics, 100, "fibonacci");
+	if(!error)
+		error = mips_cpu_run(f.state, FIBONACCI_EXIT, 1000000, NULL);
+	mips_cpu_get_stats(f.state, &stats);
+	header = mips_metrics_open(name, &length);
+	slot = mips_metrics_get_slot(header, 0);
+	pass = !error && slot != NULL && header->num_slots == 1
+		&& __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == MIPS_METRICS_RUNNING
+		&& !strcmp(slot->label, "fibonacci")
+		&& __atomic_load_n(&slot->retired, __ATOMIC_RELAXED) == stats.retired
+		&& __atomic_load_n(&slot->pc, __ATOMIC_RELAXED) == FIBONACCI_EXIT;
+	if(!pass)
+		sprintf(temp_buf, "Slot not as published (%s)", mips_error_string(error));
+	/** The only slot is taken until the first CPU lets it go */
+	if(pass)
+	{
+		pass = mips_cpu_set_metrics(other, metrics, 100, NULL) != mips_Success
+			&& !mips_cpu_set_metrics(f.state, NULL, 0, NULL)
+			&& __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == MIPS_METRICS_DETACHED
+			&& !mips_cpu_set_metrics(other, metrics, 100, NULL)
+			&& __atomic_load_n(&slot->retired, __ATOMIC_RELAXED) == 0
+			&& slot->label[0] == 0;
+		if(!pass)
+			sprintf(temp_buf, "Slot not handed over");
+	}
+	mips_cpu_free(other);
+	mips_metrics_close(header, length);
+	mips_metrics_free(metrics);
+	fixture_end(&f, pass, temp_buf);
+}
+
+/** Each core adds SMP_COUNT to the word at 0x100 one at a time, with
+ *  LL/SC, then stores its CPU number * 4 at 0x200 + CPU number * 4:
+ *
+ *      rdhwr $8, $0
+ *      addiu $9, $0, SMP_COUNT
+ *  1:  ll    $10, 0x100($0)
+ *      addiu $10, $10, 1
+ *      sc    $10, 0x100($0)
+ *      beq   $10, $0, 1b
+ *      nop
+ *      addiu $9, $9, -1
+ *      bne   $9, $0, 1b
+ *      nop
+ *      sync
+ *      sll   $8, $8, 2
+ *      sw    $8, 0x200($8)
+ */
+static const uint32_t smp_code[13] =
+{
+	0x3B00087C, 0xE8030924, 0x00010AC0, 0x01004A25,
+	0x00010AE0, 0xFCFF4011, 0x00000000, 0xFFFF2925,
+	0xF9FF2015, 0x00000000, 0x0F000000, 0x80400800,
+	0x000208AD
+};
+
+/** The number of increments made by each core in smp_test */
+#define SMP_COUNT 1000
+/** Where smp_code finishes */
+#define SMP_EXIT 0x34
+
+/**
+ * Test for shared memory multi-core runs
+ * Several cores race to increment one counter, which must not lose any
+ **/
+void smp_test()
+{
+	mips_mem_h mem = mips_mem_create_ram(0x1000, 4);
+	mips_cpu_h cpus[NUM_THREADS];
+	mips_error errors[NUM_THREADS];
+	uint32_t word;
+	char temp_buf[BUF_SIZE];
+	int i, testID = mips_test_begin_internal_test("smp");
+	bool pass = true;
+	mips_mem_write(mem, 0, sizeof(smp_code), (const uint8_t*)smp_code);
+	word = 0;
+	mips_mem_write(mem, 0x100, 4, (uint8_t*)&word);
+	for(i = 0; i < NUM_THREADS; i++)
+		cpus[i] = mips_cpu_create(mem);
+	mips_smp_run(cpus, NUM_THREADS, SMP_EXIT, 1000000, errors, NULL);
+	for(i = 0; i < NUM_THREADS; i++)
+	{
+		mips_mem_read(mem, 0x200 + i * 4, 4, (uint8_t*)&word);
+		reverse_word(&word);
+		if(errors[i] || word != (uint32_t)i * 4)
+		{
+			pass = false;
+			sprintf(temp_buf, "CPU %d: %d (%s)", i, word, mips_error_string(errors[i]));
+		}
+		mips_cpu_free(cpus[i]);
+	}
+	mips_mem_read(mem, 0x100, 4, (uint8_t*)&word);
+	reverse_word(&word);
+	if(pass && word != NUM_THREADS * SMP_COUNT)
+	{
+		pass = false;
+		sprintf(temp_buf, "Counter = %d [%d]", word, NUM_THREADS * SMP_COUNT);
+	}
+	mips_test_end_test(testID, pass, pass ? NULL : temp_buf);
+	mips_mem_free(mem);
+}
+
+/** Each core adds 1000 to the word at 0x100 with an unguarded
+ *  load, add and store, so increments are lost when cores race:
+ *
+ *      addiu $9, $0, 1000
+ *  1:  lw    $10, 0x100($0)
+ *      addiu $10, $10, 1
+ *      sw    $10, 0x100($0)
+ *      addiu $9, $9, -1
+ *      bne   $9, $0, 1b
+ *      nop
+ */
+static const uint32_t race_code[7] =
+{
+	0xE8030924, 0x00010A8C, 0x01004A25, 0x00010AAC,
+	0xFFFF2925, 0xFBFF2015, 0x00000000
+};
+
+/** Where race_code finishes */
+#define RACE_EXIT 0x1C
+
+/**
+ * Runs 'code' on NUM_THREADS cores under the quantum scheduler, adding
+ * their counters into 'stats', and the number of instructions plugins
+ * were told of into 'steps', if given
+ * Returns the final value of the word at 0x100
+ **/
+uint32_t quantum_run_code(const uint32_t* code, uint32_t size, uint32_t exit,
+	unsigned threads, uint32_t quantum, mips_error* errors, mips_cpu_stats* stats,
+	uint64_t* steps)
+{
+	mips_mem_h mem = mips_mem_create_ram(0x1000, 4);
+	mips_cpu_h cpus[NUM_THREADS];
+	mips_cpu_stats cpu_stats;
+	mips_plugin plugin;
+	plugin_counts counts[NUM_THREADS];
+	uint32_t word = 0;
+	int i;
+	memset(&plugin, 0, sizeof(plugin));
+	memset(counts, 0, sizeof(counts));
+	plugin.instruction = &count_instruction;
+	mips_mem_write(mem, 0, size, (const uint8_t*)code);
+	mips_mem_write(mem, 0x100, 4, (uint8_t*)&word);
+	for(i = 0; i < NUM_THREADS; i++)
+	{
+		cpus[i] = mips_cpu_create(mem);
+		if(steps != NULL)
+			mips_cpu_add_plugin(cpus[i], &plugin, &counts[i], NULL);
+	}
+	mips_quantum_run(cpus, NUM_THREADS, threads, quantum, exit, 1000000, errors, NULL);
+	for(i = 0; i < NUM_THREADS; i++)
+	{
+		if(stats != NULL && !mips_cpu_get_stats(cpus[i], &cpu_stats))
+			mips_cpu_add_stats(stats, &cpu_stats);
+		if(steps != NULL)
+			*steps += counts[i].instructions;
+		mips_cpu_free(cpus[i]);
+	}
+	mips_mem_read(mem, 0x100, 4, (uint8_t*)&word);
+	reverse_word(&word);
+	mips_mem_free(mem);
+	return word;
+}
+
+/**
+ * Test for the deterministic scheduler
+ * LL/SC must still count correctly, without the SCs that wait for the
+ * buffers counting as errors or being reported to plugins twice, and
+ * a racy count must come out the same
+ * however many host threads are used. A buffered store to a read-only
+ * page must fail on the instruction that made it
+ **/
+void quantum_test()
+{
+	mips_mem_h mem;
+	mips_cpu_h cpus[2];
+	mips_cpu_stats stats;
+	mips_error errors[NUM_THREADS];
+	uint64_t retired[2], steps = 0;
+	uint32_t counter, serial;
+	char temp_buf[BUF_SIZE];
+	int i, j, testID = mips_test_begin_internal_test("quantum");
+	bool pass;
+	memset(&stats, 0, sizeof(stats));
+	counter = quantum_run_code(smp_code, sizeof(smp_code), SMP_EXIT, NUM_THREADS, 64,
+		errors, &stats, &steps);
+	pass = counter == NUM_THREADS * SMP_COUNT && steps == stats.retired;
+	for(i = 0; i < NUM_THREADS; i++)
+		pass = pass && !errors[i];
+	for(i = 0; i < 4; i++)
+		for(j = 0; j < 16; j++)
+			pass = pass && stats.errors[i][j] == 0;
+	if(!pass)
+		sprintf(temp_buf, "LL/SC counter = %d [%d], %d steps for %d instructions",
+			counter, NUM_THREADS * SMP_COUNT, (int)steps, (int)stats.retired);
+	if(pass)
+	{
+		serial = quantum_run_code(race_code, sizeof(race_code), RACE_EXIT, 1, 7, errors, NULL, NULL);
+		counter = quantum_run_code(race_code, sizeof(race_code), RACE_EXIT, NUM_THREADS, 7,
+			errors, NULL, NULL);
+		pass = counter == serial && counter > 0;
+		if(!pass)
+			sprintf(temp_buf, "Racy counter = %d with 1 thread, %d with %d",
+				serial, counter, NUM_THREADS);
+	}
+	if(pass)
+	{
+		/** The first SW of race_code is its fourth instruction */
+		mem = mips_mem_create_ram(0x1000, 4);
+		mips_mem_write(mem, 0, sizeof(race_code), (const uint8_t*)race_code);
+		mips_mem_set_permissions(mem, 0, 0x1000, mips_mem_PermRead | mips_mem_PermExecute);
+		for(i = 0; i < 2; i++)
+			cpus[i] = mips_cpu_create(mem);
+		mips_quantum_run(cpus, 2, 2, 64, RACE_EXIT, 1000000, errors, retired);
+		for(i = 0; i < 2; i++)
+		{
+			pass = pass && errors[i] == mips_ExceptionAccessViolation && retired[i] == 3;
+			mips_cpu_free(cpus[i]);
+		}
+		mips_mem_free(mem);
+		if(!pass)
+			sprintf(temp_buf, "Read-only store: %s after %d instructions",
+				mips_error_string(errors[0]), (int)retired[0]);
+	}
+	mips_test_end_test(testID, pass, pass ? NULL : temp_buf);
+}
+#endif
+
+#ifdef __linux__
+/**
+ * Test for shared RAM
+ * A read-only mapping of the memfd must see a write made through the API
+ **/
+void shared_ram_test()
+{
+	static const uint8_t data[4] = { 0x12, 0x34, 0x56, 0x78 };
+	mips_mem_h mem = mips_mem_create_shared_ram(0x2000, 4, "mips_test");
+	int testID = mips_test_begin_internal_test("shared_ram");
+	const uint8_t* view = MAP_FAILED;
+	bool pass;
+	if(mem != NULL)
+	{
+		view = mmap(NULL, 0x2000, PROT_READ, MAP_SHARED, mips_mem_get_fd(mem), 0);
+		mips_mem_write(mem, 0x1004, 4, data);
+	}
+	pass = view != MAP_FAILED && memcmp(view + 0x1004, data, 4) == 0;
+	mips_test_end_test(testID, pass, pass ? NULL : "Shared RAM not visible");
+	if(view != MAP_FAILED)
+		munmap((void*)view, 0x2000);
+	mips_mem_free(mem);
+}
+#endif
+
 /** Information about a single instruction test **/
 typedef struct
 {
@@ -780,6 +2485,48 @@ void do_test(mips_cpu_h state, mips_mem_h mem, unsigned index)
 		info.test(info.name, state, mem, info.index);
 }
 
+/**
+ * Test for the lockstep engine
+ * Runs every enabled R-type test as one batch of lanes,
+ * one lane per pair of test values
+ **/
+void lockstep_test(mips_mem_h mem)
+{
+	mips_lockstep_h ls = mips_lockstep_create(mem, NUM_VALUES * NUM_VALUES);
+	char temp_buf[BUF_SIZE];
+	int testID = mips_test_begin_internal_test("lockstep");
+	unsigned i, lane;
+	uint32_t a, b, out;
+	mips_error error;
+	bool pass = ls != NULL;
+	for(i = 0; pass && i < 52; i++)
+	{
+		if(tests[i].test != &rtype_test)
+			continue;
+		mips_mem_write(mem, 0, sizeof(tests[i].data), (const uint8_t*)tests[i].data);
+		for(lane = 0; lane < NUM_VALUES * NUM_VALUES; lane++)
+		{
+			mips_lockstep_set_register(ls, lane, 1, test_values[lane / NUM_VALUES]);
+			mips_lockstep_set_register(ls, lane, 2, test_values[lane % NUM_VALUES]);
+		}
+		mips_lockstep_set_pc(ls, 0);
+		mips_lockstep_step(ls);
+		for(lane = 0; pass && lane < NUM_VALUES * NUM_VALUES; lane++)
+		{
+			a = test_values[lane / NUM_VALUES];
+			b = test_values[lane % NUM_VALUES];
+			mips_lockstep_get_register(ls, lane, 3, &out);
+			mips_lockstep_get_error(ls, lane, &error);
+			pass = rtype_tests[tests[i].index](a, b, out, false, error);
+			if(!pass)
+				sprintf(temp_buf, "%s: %d, %d = %d (%s)", tests[i].name,
+					a, b, out, mips_error_string(error));
+		}
+	}
+	mips_test_end_test(testID, pass, pass ? NULL : temp_buf);
+	mips_lockstep_free(ls);
+}
+
 int main()
 {
 	mips_mem_h mem = mips_mem_create_ram(64, 4);
@@ -788,6 +2535,34 @@ int main()
 	mips_test_begin_suite();
 	for(i = 0; i < 52; i++)
 		do_test(cpu, mem, i);
+	mmu_test();
+	protection_test();
+	watchpoint_test();
+	lockstep_test(mem);
+	pool_test();
+	btrace_test();
+	stats_test();
+	latency_test();
+	profile_test();
+	callgraph_test();
+	memprof_test();
+	plugin_test();
+	coverage_test();
+	undefined_test();
+#ifndef _WIN32
+	threads_test();
+	farm_test();
+	smp_test();
+	quantum_test();
+	sched_test();
+	server_test();
+	checkpoint_test();
+	async_trace_test();
+	metrics_test();
+#endif
+#ifdef __linux__
+	shared_ram_test();
+#endif
 	mips_test_end_suite();
 	mips_cpu_free(cpu);
 	mips_mem_free(mem);
@@ -0,0 +1,134 @@
+/**
+ * MIPS-I Live metrics viewer
+ * (C) Hamish Milne 2014
+ *
+ * Usage: mips_top [-i interval] [-n count] /segment
+ *
+ * Shows the counters CPUs publish to a metrics segment (see
+ * mips_cpu_metrics.h), as a table redrawn every 'interval' seconds
+ * (1 by default), 'count' times (forever by default). The instruction
+ * rate is worked out from the change in each slot since the last
+ * table. Reading takes no locks, so the simulation is never held up.
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_metrics.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Loads a counter, as published */
+#define READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/** What was last seen of a slot */
+typedef struct
+{
+	uint64_t retired, updated;
+} slot_history;
+
+/** Names of the slot states */
+static const char* const state_names[] = { "free", "running", "detached" };
+
+/** Reads the monotonic clock, in nanoseconds */
+static uint64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Writes one table */
+static void show(const mips_metrics_header* header, slot_history* history)
+{
+	const mips_metrics_slot* slot;
+	uint64_t retired, updated, faults, errors, time = now();
+	double rate;
+	uint32_t state;
+	unsigned i;
+	char label[sizeof(slot->label) + 1];
+	printf("%4s %4s %-8s %-16s %10s %16s %14s %10s %8s %9s\n", "Slot", "CPU", "State",
+		"Label", "PC", "Retired", "Instr/s", "Exceptions", "Errors", "Age (ms)");
+	for(i = 0; i < header->num_slots; i++)
+	{
+		slot = mips_metrics_get_slot(header, i);
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if(state == MIPS_METRICS_FREE)
+			continue;
+		retired = READ(slot->retired);
+		updated = READ(slot->updated);
+		faults = READ(slot->exceptions);
+		errors = READ(slot->errors) + READ(slot->internal);
+		rate = 0;
+		if(history[i].updated && updated > history[i].updated && retired >= history[i].retired)
+			rate = (retired - history[i].retired) * 1e9 / (updated - history[i].updated);
+		history[i].retired = retired;
+		history[i].updated = updated;
+		memcpy(label, slot->label, sizeof(slot->label));
+		label[sizeof(slot->label)] = 0;
+		printf("%4u %4u %-8s %-16.16s 0x%08x %16llu %14.0f %10llu %8llu %9.0f\n",
+			i, READ(slot->cpu_id), state < 3 ? state_names[state] : "?", label,
+			(uint32_t)READ(slot->pc), (unsigned long long)retired, rate,
+			(unsigned long long)faults, (unsigned long long)errors,
+			time > updated ? (time - updated) / 1e6 : 0.0);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	const mips_metrics_header* header;
+	slot_history* history;
+	struct timespec wait;
+	size_t length;
+	double interval = 1;
+	long count = -1;
+	int opt;
+	while((opt = getopt(argc, argv, "i:n:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'i':
+			interval = atof(optarg);
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		default:
+			optind = argc;
+		}
+	}
+	if(optind != argc - 1 || interval <= 0)
+	{
+		fprintf(stderr, "Usage: %s [-i interval] [-n count] /segment\n", argv[0]);
+		return 1;
+	}
+	header = mips_metrics_open(argv[optind], &length);
+	if(header == NULL)
+	{
+		fprintf(stderr, "Could not open metrics segment %s\n", argv[optind]);
+		return 1;
+	}
+	wait.tv_sec = (time_t)interval;
+	wait.tv_nsec = (long)((interval - wait.tv_sec) * 1e9);
+	history = calloc(header->num_slots, sizeof(slot_history));
+	if(history == NULL)
+		return 1;
+	while(count != 0)
+	{
+		show(header, history);
+		if(count > 0)
+			count--;
+		if(count != 0)
+		{
+			nanosleep(&wait, NULL);
+			putchar('\n');
+		}
+	}
+	free(history);
+	mips_metrics_close(header, length);
+	return 0;
+}
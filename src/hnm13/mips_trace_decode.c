@@ -0,0 +1,116 @@
+/**
+ * MIPS-I Binary trace decoder
+ * (C) Hamish Milne 2014
+ *
+ * Usage: mips_trace_decode [-l level] [-i image.bin] [-p low:high]
+ *                          [-s first] [-c count] [-r reg] trace.bin
+ *
+ * Writes a binary trace (see mips_cpu_btrace.h) to stdout as the text
+ * mips_cpu_step would have written at the given debug level (3 by
+ * default). Instruction names come from the program image, loaded at
+ * address 0, if one is given. The output can be limited to the
+ * instructions at PCs from low to high, to 'count' instructions from
+ * number 'first' (counting from 0), and to the writes of one register.
+ * The decoding itself is mips_btrace_decode's.
+ *
+ * ISO C90 compatible
+ **/
+
+#include "mips_cpu_btrace.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** Maps a whole file read-only, or returns NULL */
+static const uint8_t* map_file(const char* name, size_t* length)
+{
+	struct stat st;
+	void* data;
+	int fd = open(name, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	*length = st.st_size;
+	return data == MAP_FAILED ? NULL : data;
+}
+
+int main(int argc, char** argv)
+{
+	mips_btrace_filter filter;
+	const uint8_t* data;
+	const char* image = NULL;
+	size_t length = 0, image_length = 0;
+	uint64_t instructions = 0;
+	mips_error error;
+	char* sep;
+	int opt;
+	mips_btrace_filter_init(&filter);
+	while((opt = getopt(argc, argv, "l:i:p:s:c:r:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'l':
+			filter.level = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 'p':
+			filter.low = strtoul(optarg, &sep, 0);
+			if(*sep == ':')
+				filter.high = strtoul(sep + 1, NULL, 0);
+			break;
+		case 's':
+			filter.first = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			filter.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			filter.reg = atoi(optarg);
+			break;
+		default:
+			optind = argc;
+		}
+	}
+	if(optind != argc - 1)
+	{
+		fprintf(stderr, "Usage: %s [-l level] [-i image.bin] [-p low:high]"
+			" [-s first] [-c count] [-r reg] trace.bin\n", argv[0]);
+		return 1;
+	}
+	if(image != NULL)
+	{
+		filter.image = map_file(image, &image_length);
+		filter.image_length = (uint32_t)image_length;
+		if(filter.image == NULL)
+		{
+			fprintf(stderr, "Could not read %s\n", image);
+			return 1;
+		}
+	}
+	data = map_file(argv[optind], &length);
+	error = data == NULL ? mips_ErrorInvalidArgument
+		: mips_btrace_decode(data, length, &filter, stdout, &instructions, NULL);
+	if(error == mips_ErrorInvalidArgument)
+	{
+		fprintf(stderr, "%s is not a binary trace\n", argv[optind]);
+		return 1;
+	}
+	if(error)
+	{
+		fprintf(stderr, "The trace is cut short after %llu instructions\n",
+			(unsigned long long)instructions);
+		return 1;
+	}
+	return 0;
+}
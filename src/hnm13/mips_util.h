@@ -14,44 +14,64 @@ typedef mips_error (*cop_load_store)(mips_cpu_h state, unsigned reg, uint32_t* d
 
 typedef void (*debug_handle)(mips_cpu_h state, const char* message, size_t len);
 
+/** The kind of memory access being made by the CPU */
+typedef enum
+{
+	mem_load,
+	mem_store,
+	mem_fetch
+} mem_access;
+
+/** Signature for an address translation
+ *  Converts a virtual address to a physical one for the given access
+ *  'state' can be assumed valid */
+typedef mips_error (*cop_translate)(mips_cpu_h state, uint32_t address, mem_access access, uint32_t* physical);
+
 /** Struct for a set of coprocessor functions  */
 typedef struct
 {
 	op cop;
 	cop_load_store lwc, swc;
+	/** Optional MMU hook, only used on coprocessor 0 */
+	cop_translate translate;
 } coprocessor;
 
 static const mips_error mips_ExceptionCoprocessorUnusable = mips_InternalError + 1;
 static const mips_error mips_ExceptionSystemCall = mips_InternalError + 2;
+/** Returned by mips_cpu_step for an SC while the CPU's stores are
+ *  being buffered, before anything is told of the SC, to have the
+ *  scheduler run it on its own once the buffers are committed */
+static const mips_error mips_ExceptionSerialise = mips_InternalError + 3;
+/** Returned by mips_replay when an interval ends somewhere other than
+ *  where the recorded run did */
+static const mips_error mips_ErrorReplayDiverged = mips_InternalError + 4;
 
-static const char* errors[16] =
-{
-	"Not implemented",
-	"Invalid argument",
-	"Invalid handle",
-	"File read error",
-	"File write error",
-	0,0,0,
-	0,0,0,0,
-	0,0,0,0
-};
-
-static const char* exceptions[16] =
-{
-	"Break",
-	"Invalid address",
-	"Invalid alignment",
-	"Access violation",
-	"Invalid instruction",
-	"Arithmetic overflow",
-	"Coprocessor unusable",
-	"System call",
-	0,0,0,0,
-	0,0,0,0
-};
-
-static const char* mips_error_string(mips_error error)
+/** Describes an error or exception */
+static inline const char* mips_error_string(mips_error error)
 {
+	static const char* errors[16] =
+	{
+		"Not implemented",
+		"Invalid argument",
+		"Invalid handle",
+		"File read error",
+		"File write error",
+		"Out of memory",0,0,
+		0,0,0,0,
+		0,0,0,0
+	};
+	static const char* exceptions[16] =
+	{
+		"Break",
+		"Invalid address",
+		"Invalid alignment",
+		"Access violation",
+		"Invalid instruction",
+		"Arithmetic overflow",
+		"Watchpoint",0,
+		0,0,0,0,
+		0,0,0,0
+	};
 	unsigned code = error >> 16;
 	const char* ret = NULL;
 	if(code == 1)
@@ -64,7 +84,7 @@ static const char* mips_error_string(mips_error error)
 }
 
 /** Reverses the byte order of the given input */
-static void reverse_word(uint32_t* word)
+static inline void reverse_word(uint32_t* word)
 {
 	uint32_t ret;
 	uint8_t *iptr = (uint8_t*)word + 4;
@@ -75,7 +95,8 @@ static void reverse_word(uint32_t* word)
 	*word = ret;
 }
 
-static mips_error mips_load_file(mips_mem_h mem, const char* file)
+/** Loads a file into memory from address 0 */
+static inline mips_error mips_load_file(mips_mem_h mem, const char* file)
 {
 	unsigned len;
 	mips_error error;
@@ -8,14 +8,77 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define PAGE_SHIFT 12
+// Set in a page's permission byte when a watchpoint overlaps the page
+#define PAGE_WATCHED 0x80
+// Set in a page's permission byte when the page is written
+#define PAGE_DIRTY 0x40
+
+struct watchpoint
+{
+	uint32_t address;
+	uint32_t length;
+	unsigned kind;
+};
 
 struct mips_mem_provider
 {
 	uint32_t length;
 	uint32_t blockSize;
 	uint8_t *data;
+	uint8_t *pages;	// One byte of mips_mem_perm bits per page
+	int fd;	// Shared memory file behind data, or -1 if data is on the heap
+	bool inPlace;	// Built by mips_mem_init_ram: the storage belongs to the caller
+	
+	struct watchpoint *watches;
+	unsigned watchCount;
+	struct watchpoint lastHit;	// kind is 0 until something is hit
 };
 
+static uint32_t page_count(uint32_t cbMem)
+{
+	return (cbMem>>PAGE_SHIFT) + ((cbMem&(MIPS_MEM_PAGE_SIZE-1)) ? 1 : 0);
+}
+
+/* Wraps already allocated storage in a new provider */
+static mips_mem_h create_provider(
+	uint32_t cbMem,
+	uint32_t blockSize,
+	uint8_t *data,
+	int fd
+){
+	uint8_t *pages=(uint8_t*)malloc(page_count(cbMem));
+	if(pages==0)
+		return 0;
+	memset(pages, mips_mem_PermAll, page_count(cbMem));
+	
+	struct mips_mem_provider *mem=(struct mips_mem_provider*)malloc(sizeof(struct mips_mem_provider));
+	if(mem==0){
+		free(pages);
+		return 0;
+	}
+	
+	mem->length=cbMem;
+	mem->blockSize=blockSize;
+	mem->data=data;
+	mem->pages=pages;
+	mem->fd=fd;
+	mem->inPlace=false;
+	mem->watches=0;
+	mem->watchCount=0;
+	mem->lastHit.kind=0;
+	
+	return mem;
+}
+
 extern "C" mips_mem_h mips_mem_create_ram(
 	uint32_t cbMem,	//!< Total number of bytes of ram
 	uint32_t blockSize	//!< Granularity in bytes
@@ -24,27 +87,155 @@ extern "C" mips_mem_h mips_mem_create_ram(
 	if(data==0)
 		return 0;
 	
-	struct mips_mem_provider *mem=(struct mips_mem_provider*)malloc(sizeof(struct mips_mem_provider));
-	if(mem==0){
+	mips_mem_h mem=create_provider(cbMem, blockSize, data, -1);
+	if(mem==0)
 		free(data);
+	return mem;
+}
+
+// The provider, then its page table, then the data on a cache line boundary
+static size_t data_offset(uint32_t cbMem)
+{
+	return (sizeof(struct mips_mem_provider)+page_count(cbMem)+63) & ~(size_t)63;
+}
+
+extern "C" size_t mips_mem_ram_footprint(
+	uint32_t cbMem	//!< Total number of bytes of ram
+){
+	return data_offset(cbMem)+cbMem;
+}
+
+extern "C" mips_mem_h mips_mem_init_ram(
+	void *storage,	//!< mips_mem_ram_footprint(cbMem) bytes, 64 byte aligned
+	uint32_t cbMem,	//!< Total number of bytes of ram
+	uint32_t blockSize	//!< Granularity in bytes
+){
+	if(storage==0 || ((uintptr_t)storage & 63))
 		return 0;
-	}
 	
+	struct mips_mem_provider *mem=(struct mips_mem_provider*)storage;
 	mem->length=cbMem;
 	mem->blockSize=blockSize;
-	mem->data=data;
+	mem->pages=(uint8_t*)storage+sizeof(struct mips_mem_provider);
+	mem->data=(uint8_t*)storage+data_offset(cbMem);
+	mem->fd=-1;
+	mem->inPlace=true;
+	mem->watches=0;
+	mem->watchCount=0;
+	mem->lastHit.kind=0;
+	memset(mem->pages, mips_mem_PermAll, page_count(cbMem));
 	
 	return mem;
 }
 
-static mips_error mips_mem_read_write(
-	bool write,
+extern "C" mips_mem_h mips_mem_create_shared_ram(
+	uint32_t cbMem,	//!< Total number of bytes of ram
+	uint32_t blockSize,	//!< Granularity in bytes
+	const char *name	//!< Name of the memfd
+){
+#ifdef __linux__
+	if(cbMem==0)
+		return 0;
+	
+	int fd=memfd_create(name ? name : "mips_ram", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fd<0)
+		return 0;
+	// Seal the size, so a reader's mapping can never be truncated under it
+	if(ftruncate(fd, cbMem)!=0
+		|| fcntl(fd, F_ADD_SEALS, F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL)!=0){
+		close(fd);
+		return 0;
+	}
+	
+	void *data=mmap(0, cbMem, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(data==MAP_FAILED){
+		close(fd);
+		return 0;
+	}
+	
+	mips_mem_h mem=create_provider(cbMem, blockSize, (uint8_t*)data, fd);
+	if(mem==0){
+		munmap(data, cbMem);
+		close(fd);
+	}
+	return mem;
+#else
+	(void)cbMem; (void)blockSize; (void)name;
+	return 0;
+#endif
+}
+
+extern "C" int mips_mem_get_fd(mips_mem_h mem)
+{
+	return mem ? mem->fd : -1;
+}
+
+/* The slow path for a transaction that touched a watched page */
+static mips_error check_watchpoints(
+	mips_mem_h mem,
+	unsigned access,
+	uint32_t address,
+	uint32_t length
+)
+{
+	for(unsigned i=0; i<mem->watchCount; i++){
+		const struct watchpoint *w=&mem->watches[i];
+		if((w->kind & access) && address < w->address+w->length && w->address < address+length){
+			mem->lastHit.address=address;
+			mem->lastHit.length=length;
+			mem->lastHit.kind=access;
+			return mips_ExceptionWatchpoint;
+		}
+	}
+	return mips_Success;
+}
+
+/* Flags a page as written. CPUs on other threads may be writing
+   the same page, so the flag is set atomically, but only once */
+static void mark_dirty(mips_mem_h mem, uint32_t page)
+{
+	if(!(__atomic_load_n(&mem->pages[page], __ATOMIC_RELAXED) & PAGE_DIRTY))
+		__atomic_fetch_or(&mem->pages[page], (uint8_t)PAGE_DIRTY, __ATOMIC_RELAXED);
+}
+
+/* Moves a naturally aligned byte, half or word in a single access,
+   so CPUs sharing the RAM from other threads never see it half written */
+static void transfer_atomic(uint8_t *p, uint8_t *buf, uint32_t length, bool write)
+{
+	uint32_t word;
+	uint16_t half;
+	if(length==4){
+		if(write){
+			memcpy(&word, buf, 4);
+			__atomic_store_n((uint32_t*)p, word, __ATOMIC_RELAXED);
+		}else{
+			word=__atomic_load_n((uint32_t*)p, __ATOMIC_RELAXED);
+			memcpy(buf, &word, 4);
+		}
+	}else if(length==2){
+		if(write){
+			memcpy(&half, buf, 2);
+			__atomic_store_n((uint16_t*)p, half, __ATOMIC_RELAXED);
+		}else{
+			half=__atomic_load_n((uint16_t*)p, __ATOMIC_RELAXED);
+			memcpy(buf, &half, 2);
+		}
+	}else{
+		if(write)
+			__atomic_store_n(p, *buf, __ATOMIC_RELAXED);
+		else
+			*buf=__atomic_load_n(p, __ATOMIC_RELAXED);
+	}
+}
+
+/* Checks that a transaction may be made, without making it */
+static mips_error check_access(
+	unsigned access,	// The mips_mem_perm bit needed
     mips_mem_h mem,
     uint32_t address,
-    uint32_t length,
-    uint8_t *dataOut
+    uint32_t length
 )
-{	
+{
 	if(mem==0)
 		return mips_ErrorInvalidHandle;
 	
@@ -54,11 +245,56 @@ static mips_error mips_mem_read_write(
 	if(0 != ((address+length)%mem->blockSize)){
 		return mips_ExceptionInvalidAlignment;
 	}
-	if((address+length) > mem->length){	// A subtle bug here, maybe?
+	// Written this way round so that address+length can't wrap
+	if(address > mem->length || length > mem->length-address){
 		return mips_ExceptionInvalidAddress;
 	}
+	if(length==0){
+		return mips_Success;
+	}
+	
+	// Nearly every transaction is within one page, so this is one test
+	uint32_t page=address>>PAGE_SHIFT;
+	uint32_t last=(address+length-1)>>PAGE_SHIFT;
+	bool watched=false;
+	do{
+		uint8_t flags=__atomic_load_n(&mem->pages[page], __ATOMIC_RELAXED);
+		if((flags & (access|PAGE_WATCHED)) != access){
+			if(!(flags & access)){
+				return mips_ExceptionAccessViolation;
+			}
+			watched=true;
+		}
+	}while(++page<=last);
+	if(watched){
+		return check_watchpoints(mem, access, address, length);
+	}
+	return mips_Success;
+}
+
+static mips_error mips_mem_read_write(
+	unsigned access,	// The mips_mem_perm bit needed
+    mips_mem_h mem,
+    uint32_t address,
+    uint32_t length,
+    uint8_t *dataOut
+)
+{	
+	mips_error err=check_access(access, mem, address, length);
+	if(err || length==0)
+		return err;
 	
+	uint32_t page=address>>PAGE_SHIFT;
+	uint32_t last=(address+length-1)>>PAGE_SHIFT;
+	bool write=(access==mips_mem_PermWrite);
 	if(write){
+		do{
+			mark_dirty(mem, page);
+		}while(++page<=last);
+	}
+	if(length<=4 && (length&(length-1))==0 && (address&(length-1))==0){
+		transfer_atomic(mem->data+address, dataOut, length, write);
+	}else if(write){
 		for(unsigned i=0; i<length; i++){
 			mem->data[address+i]=dataOut[i];
 		}
@@ -78,7 +314,7 @@ mips_error mips_mem_read(
 )
 {	
 	return mips_mem_read_write(
-		false,	// we want to read
+		mips_mem_PermRead,	// we want to read
 		mem,
 		address,
 		length,
@@ -94,7 +330,7 @@ mips_error mips_mem_write(
 )
 {
 	return mips_mem_read_write(
-		true,	// we want to write
+		mips_mem_PermWrite,	// we want to write
 		mem,
 		address,
 		length,
@@ -102,11 +338,310 @@ mips_error mips_mem_write(
 	);
 }
 
+mips_error mips_mem_fetch(
+    mips_mem_h mem,		//!< Handle to target memory
+    uint32_t address,	//!< Byte address to start transaction at
+    uint32_t length,	//!< Number of bytes to transfer
+    uint8_t *dataOut	//!< Receives the target bytes
+)
+{
+	return mips_mem_read_write(
+		mips_mem_PermExecute,	// we want to execute
+		mem,
+		address,
+		length,
+		dataOut
+	);
+}
+
+mips_error mips_mem_probe_write(
+    mips_mem_h mem,
+    uint32_t address,
+    uint32_t length
+)
+{
+	return check_access(mips_mem_PermWrite, mem, address, length);
+}
+
+mips_error mips_mem_peek(
+    mips_mem_h mem,
+    uint32_t address,
+    uint32_t length,
+    uint8_t *dataOut
+)
+{
+	if(mem==0)
+		return mips_ErrorInvalidHandle;
+	if(address > mem->length || length > mem->length-address){
+		return mips_ExceptionInvalidAddress;
+	}
+	if(length<=4 && (length&(length-1))==0 && (address&(length-1))==0){
+		transfer_atomic(mem->data+address, dataOut, length, false);
+	}else{
+		for(unsigned i=0; i<length; i++){
+			dataOut[i]=mem->data[address+i];
+		}
+	}
+	return mips_Success;
+}
+
+mips_error mips_mem_poke(
+    mips_mem_h mem,
+    uint32_t address,
+    uint32_t length,
+    const uint8_t *dataIn
+)
+{
+	if(mem==0)
+		return mips_ErrorInvalidHandle;
+	if(address > mem->length || length > mem->length-address){
+		return mips_ExceptionInvalidAddress;
+	}
+	if(length==0)
+		return mips_Success;
+	
+	uint32_t page=address>>PAGE_SHIFT;
+	uint32_t last=(address+length-1)>>PAGE_SHIFT;
+	do{
+		mark_dirty(mem, page);
+	}while(++page<=last);
+	if(length<=4 && (length&(length-1))==0 && (address&(length-1))==0){
+		transfer_atomic(mem->data+address, (uint8_t*)dataIn, length, true);
+	}else{
+		for(unsigned i=0; i<length; i++){
+			mem->data[address+i]=dataIn[i];
+		}
+	}
+	return mips_Success;
+}
+
+mips_error mips_mem_compare_swap(
+    mips_mem_h mem,
+    uint32_t address,
+    uint8_t *expected,
+    const uint8_t *desired,
+    int *swapped
+)
+{
+	if(mem==0)
+		return mips_ErrorInvalidHandle;
+	if(expected==0 || desired==0)
+		return mips_ErrorInvalidArgument;
+	if((address%4) || (4%mem->blockSize)){
+		return mips_ExceptionInvalidAlignment;
+	}
+	if(address > mem->length || 4 > mem->length-address){
+		return mips_ExceptionInvalidAddress;
+	}
+	
+	const unsigned access=mips_mem_PermRead|mips_mem_PermWrite;
+	uint8_t flags=__atomic_load_n(&mem->pages[address>>PAGE_SHIFT], __ATOMIC_RELAXED);
+	if((flags & access) != access){
+		return mips_ExceptionAccessViolation;
+	}
+	if(flags & PAGE_WATCHED){
+		mips_error err=check_watchpoints(mem, mips_mem_PermWrite, address, 4);
+		if(err)
+			return err;
+	}
+	
+	mark_dirty(mem, address>>PAGE_SHIFT);
+	uint32_t oldWord, newWord;
+	memcpy(&oldWord, expected, 4);
+	memcpy(&newWord, desired, 4);
+	bool ok=__atomic_compare_exchange_n((uint32_t*)(mem->data+address), &oldWord, newWord,
+		false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	memcpy(expected, &oldWord, 4);
+	if(swapped)
+		*swapped=ok ? 1 : 0;
+	return mips_Success;
+}
+
+mips_error mips_mem_set_permissions(
+    mips_mem_h mem,
+    uint32_t address,
+    uint32_t length,
+    unsigned perms
+)
+{
+	if(mem==0)
+		return mips_ErrorInvalidHandle;
+	if(length==0 || address >= mem->length || length > mem->length-address)
+		return mips_ErrorInvalidArgument;
+	
+	// Writers set the dirty flag in the same bytes from other threads,
+	// so swap in the new permissions without disturbing the other flags
+	uint32_t page=address>>PAGE_SHIFT;
+	uint32_t last=(address+length-1)>>PAGE_SHIFT;
+	do{
+		uint8_t flags=__atomic_load_n(&mem->pages[page], __ATOMIC_RELAXED);
+		uint8_t updated;
+		do{
+			updated=(uint8_t)((flags & ~mips_mem_PermAll) | (perms & mips_mem_PermAll));
+		}while(!__atomic_compare_exchange_n(&mem->pages[page], &flags, updated,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}while(++page<=last);
+	return mips_Success;
+}
+
+mips_error mips_mem_get_permissions(
+    mips_mem_h mem,
+    uint8_t *perms,
+    uint32_t count
+)
+{
+	if(mem==0)
+		return mips_ErrorInvalidHandle;
+	uint32_t pages=page_count(mem->length);
+	if(perms==0 || count<pages)
+		return mips_ErrorInvalidArgument;
+	for(uint32_t i=0; i<pages; i++){
+		perms[i]=__atomic_load_n(&mem->pages[i], __ATOMIC_RELAXED) & mips_mem_PermAll;
+	}
+	return mips_Success;
+}
+
+mips_error mips_mem_take_dirty_pages(
+    mips_mem_h mem,
+    uint8_t *dirty,
+    uint32_t count
+)
+{
+	if(mem==0)
+		return mips_ErrorInvalidHandle;
+	uint32_t pages=page_count(mem->length);
+	if(dirty==0 || count<pages)
+		return mips_ErrorInvalidArgument;
+	for(uint32_t i=0; i<pages; i++){
+		uint8_t flags=__atomic_fetch_and(&mem->pages[i], (uint8_t)~PAGE_DIRTY, __ATOMIC_RELAXED);
+		dirty[i]=(flags & PAGE_DIRTY) ? 1 : 0;
+	}
+	return mips_Success;
+}
+
+/* Sets or clears the watched flag on every page overlapping the range,
+   atomically, as the dirty flag may be being set from other threads */
+static void mark_watched(mips_mem_h mem, uint32_t address, uint32_t length, bool watched)
+{
+	uint32_t page=address>>PAGE_SHIFT;
+	uint32_t last=(address+length-1)>>PAGE_SHIFT;
+	do{
+		if(watched)
+			__atomic_fetch_or(&mem->pages[page], (uint8_t)PAGE_WATCHED, __ATOMIC_RELAXED);
+		else
+			__atomic_fetch_and(&mem->pages[page], (uint8_t)~PAGE_WATCHED, __ATOMIC_RELAXED);
+	}while(++page<=last);
+}
+
+mips_error mips_mem_add_watchpoint(
+    mips_mem_h mem,
+    uint32_t address,
+    uint32_t length,
+    unsigned kind
+)
+{
+	if(mem==0)
+		return mips_ErrorInvalidHandle;
+	kind&=mips_mem_WatchAccess;
+	if(kind==0 || length==0 || address >= mem->length || length > mem->length-address)
+		return mips_ErrorInvalidArgument;
+	
+	struct watchpoint *watches=(struct watchpoint*)realloc(mem->watches, (mem->watchCount+1)*sizeof(struct watchpoint));
+	if(watches==0)
+		return mips_ErrorOutOfMemory;
+	mem->watches=watches;
+	watches[mem->watchCount].address=address;
+	watches[mem->watchCount].length=length;
+	watches[mem->watchCount].kind=kind;
+	mem->watchCount++;
+	
+	mark_watched(mem, address, length, true);
+	return mips_Success;
+}
+
+mips_error mips_mem_remove_watchpoint(
+    mips_mem_h mem,
+    uint32_t address,
+    uint32_t length
+)
+{
+	if(mem==0)
+		return mips_ErrorInvalidHandle;
+	for(unsigned i=0; i<mem->watchCount; i++){
+		if(mem->watches[i].address==address && mem->watches[i].length==length){
+			mem->watches[i]=mem->watches[--mem->watchCount];
+			// Other watchpoints may share the pages, so re-mark them all
+			mark_watched(mem, address, length, false);
+			for(unsigned j=0; j<mem->watchCount; j++){
+				mark_watched(mem, mem->watches[j].address, mem->watches[j].length, true);
+			}
+			return mips_Success;
+		}
+	}
+	return mips_ErrorInvalidArgument;
+}
+
+mips_error mips_mem_get_watchpoint(
+    mips_mem_h mem,
+    unsigned index,
+    uint32_t *address,
+    uint32_t *length,
+    unsigned *kind
+)
+{
+	if(mem==0)
+		return mips_ErrorInvalidHandle;
+	if(index>=mem->watchCount)
+		return mips_ErrorInvalidArgument;
+	if(address)
+		*address=mem->watches[index].address;
+	if(length)
+		*length=mem->watches[index].length;
+	if(kind)
+		*kind=mem->watches[index].kind;
+	return mips_Success;
+}
+
+mips_error mips_mem_get_watch_hit(
+    mips_mem_h mem,
+    uint32_t *address,
+    uint32_t *length,
+    unsigned *kind
+)
+{
+	if(mem==0)
+		return mips_ErrorInvalidHandle;
+	if(mem->lastHit.kind==0)
+		return mips_ErrorInvalidArgument;
+	if(address)
+		*address=mem->lastHit.address;
+	if(length)
+		*length=mem->lastHit.length;
+	if(kind)
+		*kind=mem->lastHit.kind;
+	return mips_Success;
+}
+
 void mips_mem_free(mips_mem_h mem)
 {
 	if(mem){
+		if(mem->inPlace){
+			free(mem->watches);
+			mem->watches=0;
+			return;
+		}
+#ifdef __linux__
+		if(mem->fd>=0){
+			munmap(mem->data, mem->length);
+			close(mem->fd);
+		}else
+#endif
 		free(mem->data);
 		mem->data=0;
+		free(mem->pages);
+		mem->pages=0;
+		free(mem->watches);
+		mem->watches=0;
 		free(mem);
 	}
 }
@@ -19,6 +19,7 @@ struct test_info_t
 {
     int testId;
     std::string instruction;
+    bool internal;  // Not of an instruction: 'instruction' is the test's name
     int status;
     std::string message;
 };
@@ -94,15 +95,18 @@ extern "C" void mips_test_begin_suite()
         exit(1);
     }
 
-    // Build up a list of known instruction names
+    // Build up a list of known instruction names, in upper case as
+    // they are looked up
     for(unsigned i=0; i<sg_instructionsCount; i++){
-        sg_knownInstructions.insert(std::string(sg_instructionsArray[i].instruction));
+        std::string name(sg_instructionsArray[i].instruction);
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+        sg_knownInstructions.insert(name);
     }
 
     sg_started=true;
 }
 
-extern "C" int mips_test_begin_test(const char *instruction)
+static int begin_test(const char *instruction, bool internal)
 {
     if(!sg_started){
         fprintf(stderr, "Error:mips_test_begin_test - Test suite has not been started with mips_test_begin_suite.\n");
@@ -120,12 +124,18 @@ extern "C" int mips_test_begin_test(const char *instruction)
 
     test_info_t info;
     info.testId=testId;
+    info.internal=internal;
 
-    info.instruction=instruction; // We want the string in upper case (shouting!)
-    std::transform(info.instruction.begin(), info.instruction.end(), info.instruction.begin(), ::toupper);
+    info.instruction=instruction;
+    if(!internal){
+        // We want the string in upper case (shouting!)
+        std::transform(info.instruction.begin(), info.instruction.end(), info.instruction.begin(), ::toupper);
 
-    if(sg_knownInstructions.find(info.instruction)==sg_knownInstructions.end()){
-        fprintf(stderr, "Warning:mips_test_begin_test - Unknown instruction '%s', might want to check the spelling.\n", instruction);
+        if(info.instruction=="<INTERNAL>"){
+            info.internal=true;
+        }else if(sg_knownInstructions.find(info.instruction)==sg_knownInstructions.end()){
+            fprintf(stderr, "Warning:mips_test_begin_test - Unknown instruction '%s', might want to check the spelling.\n", instruction);
+        }
     }
 
     info.status=-1;
@@ -134,6 +144,16 @@ extern "C" int mips_test_begin_test(const char *instruction)
     return testId;
 }
 
+extern "C" int mips_test_begin_test(const char *instruction)
+{
+    return begin_test(instruction, false);
+}
+
+extern "C" int mips_test_begin_internal_test(const char *name)
+{
+    return begin_test(name, true);
+}
+
 extern "C" void mips_test_end_test(int testId, int passed, const char *msg)
 {
     if(!sg_started){
@@ -184,6 +204,9 @@ extern "C" void mips_test_end_suite()
 
     for(unsigned i=0; i<sg_tests.size(); i++){
         test_info_t info=sg_tests[i];
+        if(info.internal){
+            continue;
+        }
 
         statistics[info.instruction].first++;   // count all tests
         if(info.status==1){
@@ -231,4 +254,33 @@ extern "C" void mips_test_end_suite()
     fprintf(stderr, "Fully working :            %3u (%5.1f%%)\n", totalFullyWorking, 100.0*totalFullyWorking/(double)totalTested);
     fprintf(stderr, "Partially working :        %3u (%5.1f%%)\n", totalPartiallyWorking, 100.0*totalPartiallyWorking/(double)totalTested);
     fprintf(stderr, "Not working at all :       %3u (%5.1f%%)\n", totalNotWorking, 100.0*totalNotWorking/(double)totalTested);
+
+    // Then the tests of other things, each by name
+    int totalInternal=0;
+    int totalInternalFailed=0;
+    for(unsigned i=0; i<sg_tests.size(); i++){
+        const test_info_t &info=sg_tests[i];
+        if(!info.internal){
+            continue;
+        }
+        if(totalInternal==0){
+            fprintf(stderr, "\n");
+            fprintf(stderr, "|        Internal test | result |\n");
+            fprintf(stderr, "+----------------------+--------+\n");
+        }
+        totalInternal++;
+        if(info.status!=1){
+            totalInternalFailed++;
+        }
+        fprintf(stderr, "|%21s | %6s |\n", info.instruction.c_str(), info.status==1 ? "passed" : "FAILED");
+        if(info.status!=1 && info.message.size()>0){
+            fprintf(stderr, "+ %s\n", info.message.c_str());
+        }
+    }
+    if(totalInternal>0){
+        fprintf(stderr, "+----------------------+--------+\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Internal tests run :       %3u\n", totalInternal);
+        fprintf(stderr, "Internal tests failed :    %3u\n", totalInternalFailed);
+    }
 }